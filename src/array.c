@@ -17,6 +17,7 @@
    */
 
 #include "array.h"
+#include "fsearch_memory.h"
 #include <assert.h>
 #include <string.h>
 #include <sys/param.h>
@@ -63,7 +64,7 @@ darray_new(size_t num_items) {
     new->max_items = num_items;
     new->num_items = 0;
 
-    new->data = calloc(num_items, sizeof(void *));
+    new->data = fsearch_memory_calloc(num_items, sizeof(void *));
     assert(new->data != NULL);
 
     return new;
@@ -81,7 +82,7 @@ darray_expand(DynamicArray *array, size_t min) {
     void *new_data = realloc(array->data, array->max_items * sizeof(void *));
     assert(new_data != NULL);
     array->data = new_data;
-    memset(array->data + old_max_items, 0, expand_rate + 1);
+    memset(array->data + old_max_items, 0, expand_rate * sizeof(void *));
 }
 
 void
@@ -93,10 +94,14 @@ darray_set_item(DynamicArray *array, void *data, uint32_t idx) {
         darray_expand(array, idx + 1);
     }
 
-    array->data[idx] = data;
-    if (data != NULL) {
+    // replacing an item doesn't change the count
+    if (data != NULL && array->data[idx] == NULL) {
         array->num_items++;
     }
+    else if (data == NULL && array->data[idx] != NULL) {
+        array->num_items--;
+    }
+    array->data[idx] = data;
 }
 
 void
@@ -104,7 +109,7 @@ darray_remove_item(DynamicArray *array, uint32_t idx) {
     assert(array != NULL);
     assert(array->data != NULL);
 
-    if (idx >= array->max_items) {
+    if (idx >= array->max_items || array->data[idx] == NULL) {
         return;
     }
 
@@ -18,11 +18,16 @@
 
 #define _GNU_SOURCE
 #include "btree.h"
+#include "fsearch_memory.h"
 #include "string_utils.h"
 #include <assert.h>
+#include <glib.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 BTreeNode *
 btree_node_new(const char *name, time_t mtime, off_t size, uint32_t pos, bool is_dir) {
@@ -39,6 +44,221 @@ btree_node_new(const char *name, time_t mtime, off_t size, uint32_t pos, bool is
     new->size = size;
     new->pos = pos;
     new->is_dir = is_dir;
+    new->has_metadata = true;
+
+    return new;
+}
+
+typedef struct _BTreeNodeArenaBlock BTreeNodeArenaBlock;
+
+struct _BTreeNodeArenaBlock {
+    BTreeNodeArenaBlock *next;
+    size_t size;
+    size_t used;
+};
+
+typedef struct _BTreeNodeArenaMapping BTreeNodeArenaMapping;
+
+struct _BTreeNodeArenaMapping {
+    BTreeNodeArenaMapping *next;
+    void *addr;
+    size_t len;
+};
+
+struct _BTreeNodeArena {
+    // separate blocks for nodes and names, so nodes are packed densely
+    BTreeNodeArenaBlock *node_blocks;
+    BTreeNodeArenaBlock *name_blocks;
+    // foreign mappings names point into, e.g. database files
+    BTreeNodeArenaMapping *mappings;
+    size_t next_block_size;
+    size_t size;
+    volatile gint ref_count;
+};
+
+#define ARENA_BLOCK_SIZE_MIN (64 * 1024)
+#define ARENA_BLOCK_SIZE_MAX (16 * 1024 * 1024)
+
+static BTreeNodeArenaBlock *
+btree_node_arena_block_new(BTreeNodeArena *arena, size_t min_size) {
+    size_t size = arena->next_block_size;
+    while (size < min_size + sizeof(BTreeNodeArenaBlock)) {
+        size *= 2;
+    }
+    if (arena->next_block_size < ARENA_BLOCK_SIZE_MAX) {
+        arena->next_block_size *= 2;
+    }
+
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(mem != MAP_FAILED);
+    fsearch_memory_advise(mem, size);
+
+    BTreeNodeArenaBlock *block = mem;
+    block->next = NULL;
+    block->size = size;
+    block->used = sizeof(BTreeNodeArenaBlock);
+    arena->size += size;
+    return block;
+}
+
+static void
+btree_node_arena_blocks_free(BTreeNodeArenaBlock *block) {
+    while (block) {
+        BTreeNodeArenaBlock *next = block->next;
+        munmap(block, block->size);
+        block = next;
+    }
+}
+
+static void *
+btree_node_arena_block_alloc(BTreeNodeArena *arena, BTreeNodeArenaBlock **blocks, size_t size, size_t align) {
+    BTreeNodeArenaBlock *block = *blocks;
+    size_t offset = block ? (block->used + align - 1) & ~(align - 1) : 0;
+    if (!block || offset + size > block->size) {
+        block = btree_node_arena_block_new(arena, size + align);
+        block->next = *blocks;
+        *blocks = block;
+        offset = (block->used + align - 1) & ~(align - 1);
+    }
+    block->used = offset + size;
+    return (char *)block + offset;
+}
+
+BTreeNodeArena *
+btree_node_arena_new(void) {
+    BTreeNodeArena *arena = calloc(1, sizeof(BTreeNodeArena));
+    assert(arena);
+    arena->next_block_size = ARENA_BLOCK_SIZE_MIN;
+    arena->ref_count = 1;
+    return arena;
+}
+
+BTreeNodeArena *
+btree_node_arena_ref(BTreeNodeArena *arena) {
+    assert(arena);
+    g_atomic_int_inc(&arena->ref_count);
+    return arena;
+}
+
+void
+btree_node_arena_free(BTreeNodeArena *arena) {
+    if (!arena) {
+        return;
+    }
+    if (!g_atomic_int_dec_and_test(&arena->ref_count)) {
+        return;
+    }
+    btree_node_arena_blocks_free(arena->node_blocks);
+    btree_node_arena_blocks_free(arena->name_blocks);
+    BTreeNodeArenaMapping *mapping = arena->mappings;
+    while (mapping) {
+        BTreeNodeArenaMapping *next = mapping->next;
+        munmap(mapping->addr, mapping->len);
+        free(mapping);
+        mapping = next;
+    }
+    free(arena);
+    arena = NULL;
+}
+
+static void
+btree_node_arena_blocks_merge(BTreeNodeArenaBlock **blocks, BTreeNodeArenaBlock *other) {
+    if (!other) {
+        return;
+    }
+    // keep the current block of the receiving arena in front, so allocation continues there
+    BTreeNodeArenaBlock *last = other;
+    while (last->next) {
+        last = last->next;
+    }
+    if (*blocks) {
+        last->next = (*blocks)->next;
+        (*blocks)->next = other;
+    }
+    else {
+        *blocks = other;
+    }
+}
+
+void
+btree_node_arena_merge(BTreeNodeArena *arena, BTreeNodeArena *other) {
+    assert(arena);
+    assert(other);
+
+    btree_node_arena_blocks_merge(&arena->node_blocks, other->node_blocks);
+    btree_node_arena_blocks_merge(&arena->name_blocks, other->name_blocks);
+    arena->size += other->size;
+
+    if (other->mappings) {
+        BTreeNodeArenaMapping *last = other->mappings;
+        while (last->next) {
+            last = last->next;
+        }
+        last->next = arena->mappings;
+        arena->mappings = other->mappings;
+    }
+
+    other->node_blocks = NULL;
+    other->name_blocks = NULL;
+    other->mappings = NULL;
+    other->size = 0;
+}
+
+void
+btree_node_arena_add_mapping(BTreeNodeArena *arena, void *addr, size_t len) {
+    assert(arena);
+    assert(addr);
+
+    BTreeNodeArenaMapping *mapping = calloc(1, sizeof(BTreeNodeArenaMapping));
+    assert(mapping);
+    mapping->addr = addr;
+    mapping->len = len;
+    mapping->next = arena->mappings;
+    arena->mappings = mapping;
+}
+
+size_t
+btree_node_arena_get_size(BTreeNodeArena *arena) {
+    assert(arena);
+    return arena->size;
+}
+
+BTreeNode *
+btree_node_arena_alloc(BTreeNodeArena *arena, const char *name, time_t mtime, off_t size, uint32_t pos, bool is_dir) {
+    assert(arena);
+    assert(name);
+
+    const size_t name_len = strlen(name) + 1;
+    char *new_name = btree_node_arena_block_alloc(arena, &arena->name_blocks, name_len, 1);
+    memcpy(new_name, name, name_len);
+
+    return btree_node_arena_alloc_with_name(arena, new_name, mtime, size, pos, is_dir);
+}
+
+BTreeNode *
+btree_node_arena_alloc_with_name(BTreeNodeArena *arena,
+                                 const char *name,
+                                 time_t mtime,
+                                 off_t size,
+                                 uint32_t pos,
+                                 bool is_dir) {
+    assert(arena);
+    assert(name);
+
+    BTreeNode *new =
+        btree_node_arena_block_alloc(arena, &arena->node_blocks, sizeof(BTreeNode), _Alignof(BTreeNode));
+
+    // names are never modified, so they can live in read-only mappings too
+    new->name = (char *)name;
+    new->parent = NULL;
+    new->children = NULL;
+    new->next = NULL;
+    new->mtime = mtime;
+    new->size = size;
+    new->pos = pos;
+    new->is_dir = is_dir;
+    new->has_metadata = true;
+    new->split = false;
 
     return new;
 }
@@ -297,3 +517,143 @@ btree_node_get_path_full(BTreeNode *node, char *path, size_t path_len) {
     }
     return btree_node_build_path(node, path, path_len);
 }
+
+// batches smaller than this per thread aren't worth to be split up
+#define BTREE_NODE_PATHS_MIN_NODES_PER_THREAD 10000
+
+typedef struct {
+    size_t offset;
+    size_t len;
+} BTreeNodePathsFolder;
+
+typedef struct {
+    BTreeNode **nodes;
+    uint32_t num_nodes;
+    GString *paths;
+    size_t *offsets;
+
+    // the paths of the folders seen so far, without a trailing slash, in folder_paths
+    GHashTable *folder_ids;
+    GArray *folders;
+    GString *folder_paths;
+} BTreeNodePathsChunk;
+
+static BTreeNodePathsFolder
+btree_node_paths_get_folder(BTreeNodePathsChunk *chunk, BTreeNode *folder) {
+    gpointer id = NULL;
+    if (g_hash_table_lookup_extended(chunk->folder_ids, folder, NULL, &id)) {
+        return g_array_index(chunk->folders, BTreeNodePathsFolder, GPOINTER_TO_UINT(id));
+    }
+
+    BTreeNodePathsFolder entry = {0};
+    if (btree_node_is_root(folder)) {
+        // the root of "/" has an empty name, its children are separated by the slash alone
+        entry.offset = chunk->folder_paths->len;
+        entry.len = strlen(folder->name);
+        g_string_append_len(chunk->folder_paths, folder->name, entry.len);
+    }
+    else {
+        const BTreeNodePathsFolder parent = btree_node_paths_get_folder(chunk, folder->parent);
+        entry.offset = chunk->folder_paths->len;
+        // the parent's path is in folder_paths itself, so it's grown first and the copy is taken afterwards
+        g_string_set_size(chunk->folder_paths, entry.offset + parent.len);
+        memcpy(chunk->folder_paths->str + entry.offset, chunk->folder_paths->str + parent.offset, parent.len);
+        g_string_append_c(chunk->folder_paths, '/');
+        g_string_append(chunk->folder_paths, folder->name);
+        entry.len = chunk->folder_paths->len - entry.offset;
+    }
+    g_hash_table_insert(chunk->folder_ids, folder, GUINT_TO_POINTER(chunk->folders->len));
+    g_array_append_val(chunk->folders, entry);
+    return entry;
+}
+
+static void
+btree_node_paths_build_chunk(BTreeNodePathsChunk *chunk) {
+    chunk->folder_ids = g_hash_table_new(NULL, NULL);
+    chunk->folders = g_array_new(FALSE, FALSE, sizeof(BTreeNodePathsFolder));
+    chunk->folder_paths = g_string_new(NULL);
+
+    for (uint32_t i = 0; i < chunk->num_nodes; i++) {
+        BTreeNode *node = chunk->nodes[i];
+        chunk->offsets[i] = chunk->paths->len;
+        if (btree_node_is_root(node)) {
+            g_string_append(chunk->paths, node->name[0] != '\0' ? node->name : "/");
+        }
+        else {
+            const BTreeNodePathsFolder parent = btree_node_paths_get_folder(chunk, node->parent);
+            g_string_append_len(chunk->paths, chunk->folder_paths->str + parent.offset, parent.len);
+            g_string_append_c(chunk->paths, '/');
+            g_string_append(chunk->paths, node->name);
+        }
+        g_string_append_c(chunk->paths, '\0');
+    }
+
+    g_hash_table_destroy(chunk->folder_ids);
+    g_array_free(chunk->folders, TRUE);
+    g_string_free(chunk->folder_paths, TRUE);
+}
+
+static void
+btree_node_paths_build_chunks(uint32_t start, uint32_t end, gpointer data) {
+    BTreeNodePathsChunk *chunks = data;
+    for (uint32_t i = start; i < end; i++) {
+        btree_node_paths_build_chunk(&chunks[i]);
+    }
+}
+
+BTreeNodePaths *
+btree_node_paths_new(BTreeNode **nodes, uint32_t num_nodes, FsearchThreadPool *pool) {
+    assert(nodes != NULL || num_nodes == 0);
+
+    BTreeNodePaths *paths = calloc(1, sizeof(BTreeNodePaths));
+    assert(paths != NULL);
+    paths->num_paths = num_nodes;
+    paths->offsets = malloc(MAX(num_nodes, 1) * sizeof(size_t));
+    assert(paths->offsets != NULL);
+
+    uint32_t num_chunks = pool ? fsearch_thread_pool_get_num_threads(pool) : 1;
+    num_chunks = MAX(1, MIN(num_chunks, num_nodes / BTREE_NODE_PATHS_MIN_NODES_PER_THREAD));
+    BTreeNodePathsChunk chunks[num_chunks];
+    const uint32_t chunk_size = num_nodes / num_chunks;
+    for (uint32_t i = 0; i < num_chunks; i++) {
+        const uint32_t start = i * chunk_size;
+        chunks[i] = (BTreeNodePathsChunk){
+            .nodes = nodes + start,
+            .num_nodes = i == num_chunks - 1 ? num_nodes - start : chunk_size,
+            .offsets = paths->offsets + start,
+            // somewhat more than the names alone, to start with
+            .paths = g_string_sized_new(64 * (size_t)chunk_size + 1),
+        };
+    }
+    fsearch_thread_pool_parallel_for(pool, num_chunks, 1, btree_node_paths_build_chunks, chunks);
+
+    // one chunk after the other, the offsets of the later ones move by the size of the earlier ones
+    size_t len = 0;
+    for (uint32_t i = 0; i < num_chunks; i++) {
+        len += chunks[i].paths->len;
+    }
+    paths->paths = malloc(MAX(len, 1));
+    assert(paths->paths != NULL);
+    size_t base = 0;
+    for (uint32_t i = 0; i < num_chunks; i++) {
+        BTreeNodePathsChunk *chunk = &chunks[i];
+        memcpy(paths->paths + base, chunk->paths->str, chunk->paths->len);
+        for (uint32_t j = 0; j < chunk->num_nodes; j++) {
+            chunk->offsets[j] += base;
+        }
+        base += chunk->paths->len;
+        g_string_free(chunk->paths, TRUE);
+    }
+    return paths;
+}
+
+void
+btree_node_paths_free(BTreeNodePaths *paths) {
+    if (!paths) {
+        return;
+    }
+    free(paths->paths);
+    free(paths->offsets);
+    free(paths);
+    paths = NULL;
+}
@@ -22,8 +22,14 @@
 #include <stdint.h>
 #include <sys/types.h>
 
+#include "fsearch_thread_pool.h"
+
 typedef struct _BTreeNode BTreeNode;
 
+// Bump allocator for nodes and their names. Nodes allocated from an arena
+// must not be freed individually, they're released all at once with the arena.
+typedef struct _BTreeNodeArena BTreeNodeArena;
+
 struct _BTreeNode {
     BTreeNode *next;
     BTreeNode *parent;
@@ -36,6 +42,10 @@ struct _BTreeNode {
     off_t size;
     uint32_t pos;
     bool is_dir;
+    // false if size and mtime weren't indexed yet
+    bool has_metadata;
+    // its children were moved to a tree of their own, whose root is named after its path
+    bool split;
 };
 
 BTreeNode *
@@ -44,6 +54,39 @@ btree_node_new(const char *name, time_t mtime, off_t size, uint32_t pos, bool is
 void
 btree_node_free(BTreeNode *node);
 
+BTreeNodeArena *
+btree_node_arena_new(void);
+
+// Another reference to arena, for nodes which are moved to another tree. btree_node_arena_free
+// drops one, the arena is freed together with the last one.
+BTreeNodeArena *
+btree_node_arena_ref(BTreeNodeArena *arena);
+
+void
+btree_node_arena_free(BTreeNodeArena *arena);
+
+void
+btree_node_arena_merge(BTreeNodeArena *arena, BTreeNodeArena *other);
+
+// Hands a mapping over to the arena, it's unmapped when the arena is freed
+void
+btree_node_arena_add_mapping(BTreeNodeArena *arena, void *addr, size_t len);
+
+size_t
+btree_node_arena_get_size(BTreeNodeArena *arena);
+
+BTreeNode *
+btree_node_arena_alloc(BTreeNodeArena *arena, const char *name, time_t mtime, off_t size, uint32_t pos, bool is_dir);
+
+// Like btree_node_arena_alloc, but the name isn't copied and must stay valid as long as the arena
+BTreeNode *
+btree_node_arena_alloc_with_name(BTreeNodeArena *arena,
+                                 const char *name,
+                                 time_t mtime,
+                                 off_t size,
+                                 uint32_t pos,
+                                 bool is_dir);
+
 void
 btree_node_unlink(BTreeNode *node);
 
@@ -85,3 +128,25 @@ btree_node_get_path(BTreeNode *node, char *path, size_t path_len);
 
 bool
 btree_node_get_path_full(BTreeNode *node, char *path, size_t path_len);
+
+// The full paths of many nodes at once, see btree_node_paths_new
+typedef struct {
+    // all paths one after another, each one NUL terminated
+    char *paths;
+    // where the path of each node starts in paths
+    size_t *offsets;
+    uint32_t num_paths;
+} BTreeNodePaths;
+
+// Same as btree_node_get_path_full for every node, but the path of each folder is only built once
+// and copied for all nodes in it, and with a pool large batches are split up between its threads
+BTreeNodePaths *
+btree_node_paths_new(BTreeNode **nodes, uint32_t num_nodes, FsearchThreadPool *pool);
+
+void
+btree_node_paths_free(BTreeNodePaths *paths);
+
+static inline const char *
+btree_node_paths_get(BTreeNodePaths *paths, uint32_t idx) {
+    return paths->paths + paths->offsets[idx];
+}
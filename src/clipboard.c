@@ -22,7 +22,7 @@
 #include <string.h>
 
 static GdkDragAction clipboard_action = GDK_ACTION_DEFAULT;
-static GList *clipboard_file_list = NULL;
+static BTreeNodePaths *clipboard_paths = NULL;
 
 enum { URI_LIST = 1, NAUTILUS_WORKAROUND, GNOME_COPIED_FILES, N_CLIPBOARD_TARGETS };
 
@@ -33,17 +33,16 @@ static GtkTargetEntry targets[] = {{"text/uri-list", 0, URI_LIST},
 static void
 clipboard_clean_data(GtkClipboard *clipboard, gpointer user_data) {
     /* g_debug("clean clipboard!\n"); */
-    if (clipboard_file_list) {
-        g_list_foreach(clipboard_file_list, (GFunc)g_free, NULL);
-        g_list_free(clipboard_file_list);
-        clipboard_file_list = NULL;
+    if (clipboard_paths) {
+        btree_node_paths_free(clipboard_paths);
+        clipboard_paths = NULL;
     }
     clipboard_action = GDK_ACTION_DEFAULT;
 }
 
 static void
 clipboard_get_data(GtkClipboard *clipboard, GtkSelectionData *selection_data, guint info, gpointer user_data) {
-    if (!clipboard_file_list) {
+    if (!clipboard_paths) {
         return;
     }
 
@@ -68,19 +67,19 @@ clipboard_get_data(GtkClipboard *clipboard, GtkSelectionData *selection_data, gu
         goto out;
     }
 
-    GList *l = NULL;
-    for (l = clipboard_file_list; l; l = l->next) {
+    for (uint32_t i = 0; i < clipboard_paths->num_paths; i++) {
+        const char *path = btree_node_paths_get(clipboard_paths, i);
         gchar *file_name = NULL;
         if (use_uri) {
-            file_name = g_filename_to_uri((char *)l->data, NULL, NULL);
+            file_name = g_filename_to_uri(path, NULL, NULL);
         }
         else {
-            file_name = g_filename_display_name((char *)l->data);
+            file_name = g_filename_display_name(path);
         }
         g_string_append(list, file_name);
         g_free(file_name);
 
-        if (l->next != NULL) {
+        if (i + 1 < clipboard_paths->num_paths) {
             if (info == GNOME_COPIED_FILES) {
                 g_string_append_c(list, '\n');
             }
@@ -107,33 +106,29 @@ out:
 }
 
 void
-clipboard_copy_file_list(GList *file_list, bool copy) {
+clipboard_copy_file_list(BTreeNodePaths *paths, bool copy) {
     GtkClipboard *clip = gtk_clipboard_get(GDK_SELECTION_CLIPBOARD);
     gtk_clipboard_set_with_data(clip, targets, G_N_ELEMENTS(targets), clipboard_get_data, clipboard_clean_data, NULL);
 
-    clipboard_file_list = file_list;
+    clipboard_paths = paths;
     clipboard_action = copy ? GDK_ACTION_COPY : GDK_ACTION_MOVE;
 }
 
 void
-clipboard_copy_filepath_list(GList *file_list) {
+clipboard_copy_filepath_list(BTreeNodePaths *paths) {
     GtkClipboard *clip = gtk_clipboard_get(GDK_SELECTION_CLIPBOARD);
     GString *filepathlist = NULL;
-    if (g_list_length(file_list) == 1) {
-        gchar *file_name = NULL;
-        file_name = (char *)(g_list_first(file_list))->data;
-        filepathlist = g_string_new(file_name);
+    if (paths->num_paths == 1) {
+        filepathlist = g_string_new(btree_node_paths_get(paths, 0));
     }
     else {
         filepathlist = g_string_sized_new(8192);
-        for (GList *file = file_list; file != NULL; file = file->next) {
-            gchar *file_name = NULL;
-            file_name = (char *)file->data;
-
-            g_string_append(filepathlist, file_name);
+        for (uint32_t i = 0; i < paths->num_paths; i++) {
+            g_string_append(filepathlist, btree_node_paths_get(paths, i));
             g_string_append(filepathlist, "\n");
         }
     }
     gtk_clipboard_set_text(clip, filepathlist->str, filepathlist->len);
     g_string_free(filepathlist, TRUE);
+    btree_node_paths_free(paths);
 }
@@ -21,8 +21,11 @@ along with this program; if not, see <http://www.gnu.org/licenses/>.
 #include <glib.h>
 #include <stdbool.h>
 
+#include "btree.h"
+
+// Both take ownership of paths
 void
-clipboard_copy_file_list(GList *file_list, bool copy);
+clipboard_copy_file_list(BTreeNodePaths *paths, bool copy);
 
 void
-clipboard_copy_filepath_list(GList *file_list);
+clipboard_copy_filepath_list(BTreeNodePaths *paths);
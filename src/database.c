@@ -23,7 +23,8 @@
 #include <dirent.h>
 #include <err.h>
 #include <errno.h>
-#include <fnmatch.h>
+#include <fcntl.h>
+#include <gio/gio.h>
 #include <glib/gi18n.h>
 #include <glib/gstdio.h>
 #include <malloc.h>
@@ -31,16 +32,26 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "database.h"
+#include "database_mount_table.h"
+#include "database_shard.h"
 #include "debug.h"
 #include "fsearch.h"
+#include "fsearch_exclude_matcher.h"
 #include "fsearch_exclude_path.h"
+#include "fsearch_file_type.h"
 #include "fsearch_include_path.h"
+#include "fsearch_sort.h"
+#include "fsearch_stats.h"
+#include "fsearch_thread_pool.h"
+#include "fsearch_timer.h"
 
 struct _FsearchDatabase {
     GList *locations;
@@ -48,10 +59,34 @@ struct _FsearchDatabase {
     GList *includes;
     GList *excludes;
     char **exclude_files;
+    // both of them compiled, for the scans
+    FsearchExcludeMatcher *exclude_matcher;
+    // the mounts when the database was created, to skip pseudo file systems and tell devices apart
+    DatabaseMountTable *mounts;
     DynamicArray *entries;
     uint32_t num_entries;
-
-    bool exclude_hidden;
+    // one per location, in the order of the locations
+    DatabaseShard **shards;
+    // index in entries of every entry of each shard
+    uint32_t **shard_global_indices;
+    uint32_t num_shards;
+    // for the shard of every part the one with the folder it was split off from and that folder,
+    // UINT32_MAX and NULL for the shards of the locations themselves
+    uint32_t *part_parents;
+    BTreeNode **part_folders;
+    // FsearchDatabaseFolderStats of the folders with parts below them, of those parts. The entry
+    // tables only know the entries of their own shard.
+    GHashTable *part_folder_stats;
+    // rank of each entry per sort order, built with the entries list
+    uint32_t *sort_ranks[NUM_DATABASE_SORT_TYPES];
+    // DatabaseEntryMetadata of the entries indexed without it by their index, looked up once they're
+    // asked for. The nodes might be shared with other databases, so it's not written into them.
+    GHashTable *entry_metadata;
+    GMutex entry_metadata_mutex;
+    // changes whenever the entries list is rebuilt, unique across all databases
+    uint32_t generation;
+
+    FsearchDatabaseScanFlags flags;
     time_t timestamp;
 
     int32_t ref_count;
@@ -61,7 +96,46 @@ struct _FsearchDatabase {
 struct _FsearchDatabaseNode {
     // B+ tree of entry nodes
     BTreeNode *entries;
+    // memory of all nodes and names of this location
+    BTreeNodeArena *arena;
+    // number of entries, without the root
     uint32_t num_items;
+    // whether the order of the pos fields of the entries matches their sort order,
+    // e.g. because it was saved with the location
+    bool sorted;
+    // searchable copy of the entries, dropped whenever the location changes
+    DatabaseShard *shard;
+    // databases share the locations which didn't change. A shared location isn't modified anymore,
+    // changes are made to a copy of it.
+    volatile gint ref_count;
+    // when the last scan of the location started, folders which changed after that might have
+    // been read before their last change, even though their mtime is still the same
+    time_t scan_started;
+    // the folders outside of the location which were entered through symbolic links, as
+    // DatabaseInode. None of them is entered twice, that ends cycles too.
+    GHashTable *link_targets;
+    // the root with all links resolved, links to folders in there aren't followed
+    char *real_path;
+    GMutex link_targets_mutex;
+
+    // Large locations are split into parts, locations of their own with the subtree of one of
+    // their folders, whose root is named after the path of the folder. The folder keeps no
+    // children and is marked as split. Changes only copy and rebuild the parts they're in.
+    // The root name of the location a part was split off from, NULL for the location itself.
+    char *location_name;
+    // how far below the root of its location the children of the root are
+    uint32_t root_depth;
+    // the arena of the location a part was split off from, with the nodes which were moved
+    BTreeNodeArena *shared_arena;
+};
+
+// The pos of a node is its index in the shard of its location. Nodes added by db_update_folders
+// have this one until the shard is built again.
+#define DATABASE_NODE_POS_NEW UINT32_MAX
+
+enum {
+    DATABASE_NODE_FLAG_DIR = 1 << 0,
+    DATABASE_NODE_FLAG_NO_METADATA = 1 << 1,
 };
 
 enum {
@@ -80,13 +154,23 @@ static FsearchDatabaseNode *
 db_location_get_for_path(FsearchDatabase *db, const char *path);
 
 static FsearchDatabaseNode *
-db_location_build_tree(FsearchDatabase *db, const char *dname, bool *cancel, void (*callback)(const char *));
+db_location_build_tree(FsearchDatabase *db,
+                       const char *dname,
+                       FsearchThreadPool *pool,
+                       bool *cancel,
+                       void (*callback)(const char *));
 
 static FsearchDatabaseNode *
 db_location_new(void);
 
 static void
-db_list_add_location(FsearchDatabase *db, FsearchDatabaseNode *location);
+db_location_free(FsearchDatabaseNode *location);
+
+static int
+sort_by_name(const void *a, const void *b);
+
+static void
+db_build_sort_ranks(FsearchDatabase *db, FsearchThreadPool *pool);
 
 // Implemenation
 
@@ -115,45 +199,56 @@ db_update_timestamp(FsearchDatabase *db) {
     db->timestamp = time(NULL);
 }
 
+// Database files since version 1.0 are mapped and used in place: a header, fixed-size records in
+// depth-first pre-order (so parents always come before their children) and a blob of NUL terminated
+// names the records point into.
+typedef struct {
+    char magic[4];
+    uint8_t majorver;
+    uint8_t minorver;
+    uint16_t reserved;
+    uint32_t num_records;
+    // scan_started of the location, 0 in older files
+    uint32_t scan_started;
+    uint64_t names_size;
+} DatabaseFileHeader;
+
+typedef struct {
+    int64_t size;
+    int64_t mtime;
+    uint32_t name_offset;
+    // index of the parent record, DATABASE_FILE_NO_PARENT for the root
+    uint32_t parent;
+    // precomputed sort position
+    uint32_t pos;
+    uint8_t flags;
+    uint8_t reserved[3];
+} DatabaseFileRecord;
+
+_Static_assert(sizeof(DatabaseFileHeader) == 24, "unexpected database file header size");
+_Static_assert(sizeof(DatabaseFileRecord) == 32, "unexpected database file record size");
+
+#define DATABASE_FILE_MAJOR_VERSION 1
+#define DATABASE_FILE_MINOR_VERSION 0
+#define DATABASE_FILE_NO_PARENT UINT32_MAX
+
 static FsearchDatabaseNode *
-db_location_load_from_file(const char *fname) {
+db_location_load_from_legacy_file(FILE *fp, const char *fname) {
+    assert(fp != NULL);
     assert(fname != NULL);
 
-    FILE *fp = fopen(fname, "rb");
-    if (!fp) {
-        return NULL;
-    }
-
     BTreeNode *root = NULL;
-
-    char magic[4];
-    if (fread(magic, 1, 4, fp) != 4) {
-        trace("[database_read_file] failed to read magic\n");
-        goto load_fail;
-    }
-    if (strncmp(magic, "FSDB", 4)) {
-        trace("[database_read_file] bad signature\n");
-        goto load_fail;
-    }
-
-    uint8_t majorver = 0;
-    if (fread(&majorver, 1, 1, fp) != 1) {
-        goto load_fail;
-    }
-    if (majorver != 0) {
-        trace("[database_read_file] bad majorver=%d\n", majorver);
-        goto load_fail;
-    }
+    FsearchDatabaseNode *location = db_location_new();
 
     uint8_t minorver = 0;
     if (fread(&minorver, 1, 1, fp) != 1) {
         goto load_fail;
     }
-    if (minorver != 1) {
+    if (minorver != 1 && minorver != 2) {
         trace("[database_read_file] bad minorver=%d\n", minorver);
         goto load_fail;
     }
-    trace("[database_read_file] database version=%d.%d\n", majorver, minorver);
+    trace("[database_read_file] database version=0.%d\n", minorver);
 
     uint32_t num_items = 0;
     if (fread(&num_items, 1, 4, fp) != 4) {
@@ -191,12 +286,13 @@ db_location_load_from_file(const char *fname) {
         }
         name[name_len] = '\0';
 
-        // read is_dir
-        uint8_t is_dir = 0;
-        if (fread(&is_dir, 1, 1, fp) != 1) {
+        // read is_dir, since version 0.2 it also tells whether the entry was indexed without metadata
+        uint8_t node_flags = 0;
+        if (fread(&node_flags, 1, 1, fp) != 1) {
             trace("[database_read_file] failed to read is_dir\n");
             goto load_fail;
         }
+        const bool is_dir = minorver == 1 ? node_flags : node_flags & DATABASE_NODE_FLAG_DIR;
 
         // read size
         uint64_t size = 0;
@@ -220,7 +316,10 @@ db_location_load_from_file(const char *fname) {
         }
 
         int is_root = !strcmp(name, "/");
-        BTreeNode *new = btree_node_new(is_root ? "" : name, mtime, size, pos, is_dir);
+        BTreeNode *new = btree_node_arena_alloc(location->arena, is_root ? "" : name, mtime, size, pos, is_dir);
+        if (minorver > 1 && node_flags & DATABASE_NODE_FLAG_NO_METADATA) {
+            new->has_metadata = false;
+        }
         if (!prev) {
             num_items_read++;
             prev = new;
@@ -231,10 +330,11 @@ db_location_load_from_file(const char *fname) {
         num_items_read++;
     }
     trace("[database_load] finished with %d of %d items successfully read\n", num_items_read, num_items);
+    trace("[database_load] %zu bytes allocated for nodes\n", btree_node_arena_get_size(location->arena));
 
-    FsearchDatabaseNode *location = db_location_new();
-    location->num_items = num_items_read;
+    location->num_items = num_items_read - 1;
     location->entries = root;
+    location->sorted = true;
 
     fclose(fp);
 
@@ -242,705 +342,3590 @@ db_location_load_from_file(const char *fname) {
 
 load_fail:
     fprintf(stderr, "database load fail (%s)!\n", fname);
-    if (fp) {
-        fclose(fp);
-    }
-    if (root) {
-        btree_node_free(root);
-    }
+    fclose(fp);
+    db_location_free(location);
     return NULL;
 }
 
-static bool
-db_location_write_to_file(FsearchDatabaseNode *location, const char *path) {
-    assert(path != NULL);
-    assert(location != NULL);
+static FsearchDatabaseNode *
+db_location_load_from_mapped_file(int fd, const char *fname) {
+    assert(fd >= 0);
+    assert(fname != NULL);
 
-    if (!location->entries) {
-        return false;
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(DatabaseFileHeader)) {
+        close(fd);
+        goto map_fail;
     }
-    g_mkdir_with_parents(path, 0700);
-
-    GString *db_path = g_string_new(path);
-    g_string_append(db_path, "/database.db");
-
-    FILE *fp = fopen(db_path->str, "w+b");
-    if (!fp) {
-        return false;
+    const size_t map_size = st.st_size;
+    void *map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping stays valid after closing the file
+    close(fd);
+    if (map == MAP_FAILED) {
+        trace("[database_read_file] failed to map file\n");
+        goto map_fail;
     }
 
-    const char magic[] = "FSDB";
-    if (fwrite(magic, 1, 4, fp) != 4) {
-        goto save_fail;
-    }
+    // from here on the mapping is owned by the arena, the nodes' names point into it
+    FsearchDatabaseNode *location = db_location_new();
+    btree_node_arena_add_mapping(location->arena, map, map_size);
 
-    const uint8_t majorver = 0;
-    if (fwrite(&majorver, 1, 1, fp) != 1) {
-        goto save_fail;
+    const DatabaseFileHeader *header = map;
+    if (header->minorver != DATABASE_FILE_MINOR_VERSION) {
+        trace("[database_read_file] bad minorver=%d\n", header->minorver);
+        goto load_fail;
     }
+    trace("[database_read_file] database version=%d.%d\n", header->majorver, header->minorver);
 
-    const uint8_t minorver = 1;
-    if (fwrite(&minorver, 1, 1, fp) != 1) {
-        goto save_fail;
+    const uint64_t records_size = (uint64_t)header->num_records * sizeof(DatabaseFileRecord);
+    if (header->num_records == 0 || header->names_size == 0
+        || header->names_size > map_size - sizeof(DatabaseFileHeader)
+        || records_size != map_size - sizeof(DatabaseFileHeader) - header->names_size) {
+        trace("[database_read_file] bad file size\n");
+        goto load_fail;
     }
 
-    uint32_t num_items = btree_node_n_nodes(location->entries);
-    if (fwrite(&num_items, 1, 4, fp) != 4) {
-        goto save_fail;
+    const DatabaseFileRecord *records = (const DatabaseFileRecord *)((const char *)map + sizeof(DatabaseFileHeader));
+    const char *names = (const char *)map + sizeof(DatabaseFileHeader) + records_size;
+    if (names[header->names_size - 1] != '\0') {
+        trace("[database_read_file] names aren't terminated\n");
+        goto load_fail;
     }
 
-    const uint16_t del = 0;
-
-    BTreeNode *root = location->entries;
-    BTreeNode *node = root;
-    uint32_t is_root = !strcmp(root->name, "");
-
-    while (node) {
-        const char *name = is_root ? "/" : node->name;
-        is_root = 0;
-        uint16_t len = strlen(name);
-        if (len) {
-            // write length of node name
-            if (fwrite(&len, 1, 2, fp) != 2) {
-                goto save_fail;
-            }
-            // write node name
-            if (fwrite(name, 1, len, fp) != len) {
-                goto save_fail;
-            }
-            // write node name
-            uint8_t is_dir = node->is_dir;
-            if (fwrite(&is_dir, 1, 1, fp) != 1) {
-                goto save_fail;
-            }
-
-            // write node name
-            uint64_t size = node->size;
-            if (fwrite(&size, 1, 8, fp) != 8) {
-                goto save_fail;
-            }
-
-            // write node name
-            uint64_t mtime = node->mtime;
-            if (fwrite(&mtime, 1, 8, fp) != 8) {
-                goto save_fail;
-            }
-
-            // write node name
-            uint32_t pos = node->pos;
-            if (fwrite(&pos, 1, 4, fp) != 4) {
-                goto save_fail;
-            }
-
-            BTreeNode *temp = node->children;
-            if (!temp) {
-                // reached end of children, write delimiter
-                if (fwrite(&del, 1, 2, fp) != 2) {
-                    goto save_fail;
-                }
-                BTreeNode *current = node;
-                while (true) {
-                    temp = current->next;
-                    if (temp) {
-                        // found next, sibling add that
-                        node = temp;
-                        break;
-                    }
-
-                    if (fwrite(&del, 1, 2, fp) != 2) {
-                        goto save_fail;
-                    }
-                    temp = current->parent;
-                    if (!temp) {
-                        // reached last node, abort
-                        node = NULL;
-                        break;
-                    }
-                    else {
-                        current = temp;
-                    }
-                }
-            }
-            else {
-                node = temp;
-            }
+    const uint32_t num_records = header->num_records;
+    BTreeNode **nodes = calloc(num_records, sizeof(BTreeNode *));
+    assert(nodes != NULL);
+
+    for (uint32_t i = 0; i < num_records; i++) {
+        const DatabaseFileRecord *record = &records[i];
+        const bool is_root = i == 0;
+        if (record->name_offset >= header->names_size
+            || (is_root ? record->parent != DATABASE_FILE_NO_PARENT : record->parent >= i)) {
+            trace("[database_read_file] bad record %d\n", i);
+            free(nodes);
+            goto load_fail;
         }
-        else {
-            goto save_fail;
+        BTreeNode *node = btree_node_arena_alloc_with_name(location->arena,
+                                                           names + record->name_offset,
+                                                           record->mtime,
+                                                           record->size,
+                                                           record->pos,
+                                                           record->flags & DATABASE_NODE_FLAG_DIR);
+        if (record->flags & DATABASE_NODE_FLAG_NO_METADATA) {
+            node->has_metadata = false;
         }
+        if (!is_root) {
+            btree_node_prepend(nodes[record->parent], node);
+        }
+        nodes[i] = node;
     }
+    location->entries = nodes[0];
+    location->num_items = num_records - 1;
+    location->sorted = true;
+    location->scan_started = header->scan_started;
+    free(nodes);
+
+    trace("[database_load] finished with %d items successfully read\n", num_records);
+    trace("[database_load] %zu bytes allocated for nodes\n", btree_node_arena_get_size(location->arena));
+    return location;
 
-    fclose(fp);
+load_fail:
+    db_location_free(location);
+map_fail:
+    fprintf(stderr, "database load fail (%s)!\n", fname);
+    return NULL;
+}
 
-    trace("[database_save] saved %s\n", path);
-    return true;
+// Compact database files (version 2.0) are smaller, but have to be decoded. Their records come in
+// the same order as those of mapped files, split into blocks of DATABASE_COMPACT_BLOCK_RECORDS which
+// are coded on their own and can be decoded in parallel. Siblings are written in name order and
+// share their prefix with the previous one of the same block, numbers are varints, sort positions
+// and modification times are coded as the difference to the previous record of the block.
+// Every record is:
+//   flags (1 byte), DATABASE_NODE_FLAG_* and DATABASE_COMPACT_FLAG_*
+//   distance to the parent record, unless it's the parent of the previous record
+//   distance to the sibling whose name it shares a prefix with, and the length of that prefix
+//   length of the rest of the name, then the rest of the name
+//   pos, size and mtime
+// The offsets of the blocks (8 bytes each) end the file.
+typedef struct {
+    char magic[4];
+    uint8_t majorver;
+    uint8_t minorver;
+    uint16_t reserved;
+    uint32_t num_records;
+    uint32_t scan_started;
+    uint32_t num_blocks;
+    uint32_t reserved2;
+    uint64_t index_offset;
+} DatabaseCompactFileHeader;
+
+_Static_assert(sizeof(DatabaseCompactFileHeader) == 32, "unexpected compact database file header size");
+
+#define DATABASE_COMPACT_FILE_MAJOR_VERSION 2
+#define DATABASE_COMPACT_FILE_MINOR_VERSION 0
+#define DATABASE_COMPACT_BLOCK_RECORDS 4096
 
-save_fail:
+enum {
+    // the parent is the same as the one of the previous record of the block
+    DATABASE_COMPACT_FLAG_SAME_PARENT = 1 << 2,
+    // the name starts with part of a sibling's name
+    DATABASE_COMPACT_FLAG_PREFIX = 1 << 3,
+};
+// blocks decoded by one thread at least, small files aren't worth splitting up
+#define DATABASE_COMPACT_MIN_BLOCKS_PER_THREAD 8
 
-    fclose(fp);
-    unlink(db_path->str);
-    g_string_free(db_path, TRUE);
-    return false;
+static inline uint64_t
+db_compact_zigzag(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
 }
 
-static bool
-file_is_excluded(const char *name, char **exclude_files) {
-    if (exclude_files) {
-        for (int i = 0; exclude_files[i]; ++i) {
-            if (!fnmatch(exclude_files[i], name, 0)) {
-                return true;
-            }
-        }
-    }
-    return false;
+static inline int64_t
+db_compact_unzigzag(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
 }
 
-static bool
-directory_is_excluded(const char *name, GList *excludes) {
-    while (excludes) {
-        FsearchExcludePath *fs_path = excludes->data;
-        if (!strcmp(name, fs_path->path)) {
-            if (fs_path->enabled) {
-                return true;
-            }
-            return false;
+static inline bool
+db_compact_get_varint(const uint8_t **p, const uint8_t *end, uint64_t *value) {
+    uint64_t result = 0;
+    for (uint32_t shift = 0; shift < 64 && *p < end; shift += 7) {
+        const uint8_t byte = *(*p)++;
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return true;
         }
-        excludes = excludes->next;
     }
     return false;
 }
 
-typedef struct DatabaseWalkContext {
-    FsearchDatabase *db;
-    FsearchDatabaseNode *db_node;
-    GString *path;
-    GTimer *timer;
-    bool *cancel;
-    void (*callback)(const char *);
-    bool exclude_hidden;
-} DatabaseWalkContext;
-
-static int
-db_location_walk_tree_recursive(DatabaseWalkContext *walk_context, BTreeNode *parent) {
-
-    if (*walk_context->cancel == true) {
-        return WALK_CANCEL;
+static void
+db_compact_put_varint(GByteArray *buf, uint64_t value) {
+    uint8_t bytes[10];
+    uint32_t len = 0;
+    while (value >= 0x80) {
+        bytes[len++] = (uint8_t)value | 0x80;
+        value >>= 7;
     }
+    bytes[len++] = (uint8_t)value;
+    g_byte_array_append(buf, bytes, len);
+}
 
-    GString *path = walk_context->path;
-    g_string_append_c(path, '/');
-
-    // remember end of parent path
-    gsize path_len = path->len;
-
-    DIR *dir = NULL;
-    if (!(dir = opendir(path->str))) {
-        return WALK_BADIO;
-    }
+typedef struct {
+    const uint8_t *map;
+    // num_blocks + 1 of them, the last one is where the index starts
+    uint64_t *block_offsets;
+    uint32_t num_records;
+    BTreeNode **nodes;
+    uint32_t *parents;
+    // of each thread, at the index of the first block it decoded
+    BTreeNodeArena **arenas;
+    volatile gint failed;
+} DatabaseCompactLoadContext;
 
-    double elapsed_seconds = g_timer_elapsed(walk_context->timer, NULL);
-    if (elapsed_seconds > 0.1) {
-        if (walk_context->callback) {
-            walk_context->callback(path->str);
+static bool
+db_location_decode_compact_block(DatabaseCompactLoadContext *ctx, BTreeNodeArena *arena, uint32_t block) {
+    const uint8_t *p = ctx->map + ctx->block_offsets[block];
+    const uint8_t *end = ctx->map + ctx->block_offsets[block + 1];
+    const uint32_t start = block * DATABASE_COMPACT_BLOCK_RECORDS;
+    const uint32_t stop = MIN(start + DATABASE_COMPACT_BLOCK_RECORDS, ctx->num_records);
+
+    char name[PATH_MAX];
+    int64_t pos = 0;
+    int64_t mtime = 0;
+    for (uint32_t i = start; i < stop; i++) {
+        uint64_t prefix_len = 0;
+        uint64_t suffix_len = 0;
+        if (p >= end) {
+            return false;
         }
-        g_timer_start(walk_context->timer);
-    }
-
-    struct dirent *dent = NULL;
-    while ((dent = readdir(dir))) {
-        if (*walk_context->cancel == true) {
-            if (dir) {
-                closedir(dir);
+        const uint8_t flags = *p++;
+        if (flags & DATABASE_COMPACT_FLAG_SAME_PARENT) {
+            if (i == start) {
+                return false;
             }
-            return WALK_CANCEL;
+            ctx->parents[i] = ctx->parents[i - 1];
         }
-        if (walk_context->exclude_hidden && dent->d_name[0] == '.') {
-            // file is dotfile, skip
-            continue;
+        else if (i == 0) {
+            ctx->parents[i] = DATABASE_FILE_NO_PARENT;
         }
-        if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, "..")) {
-            continue;
+        else {
+            uint64_t parent_distance = 0;
+            if (!db_compact_get_varint(&p, end, &parent_distance) || parent_distance == 0 || parent_distance > i) {
+                return false;
+            }
+            ctx->parents[i] = i - (uint32_t)parent_distance;
         }
-        if (file_is_excluded(dent->d_name, walk_context->db->exclude_files)) {
-            continue;
+        if (flags & DATABASE_COMPACT_FLAG_PREFIX) {
+            uint64_t sibling_distance = 0;
+            if (!db_compact_get_varint(&p, end, &sibling_distance) || sibling_distance == 0
+                || sibling_distance > i - start) {
+                return false;
+            }
+            const char *sibling_name = ctx->nodes[i - sibling_distance]->name;
+            if (!db_compact_get_varint(&p, end, &prefix_len) || prefix_len > strlen(sibling_name)) {
+                return false;
+            }
+            memcpy(name, sibling_name, prefix_len);
         }
-
-        // create full path of file/folder
-        g_string_truncate(path, path_len);
-        g_string_append(path, dent->d_name);
-
-        struct stat st;
-        if (lstat(path->str, &st) == -1) {
-            // warn("Can't stat %s", fn);
-            continue;
+        if (!db_compact_get_varint(&p, end, &suffix_len) || suffix_len > (uint64_t)(end - p)
+            || prefix_len + suffix_len >= sizeof(name)) {
+            return false;
         }
+        memcpy(name + prefix_len, p, suffix_len);
+        name[prefix_len + suffix_len] = '\0';
+        p += suffix_len;
 
-        const bool is_dir = S_ISDIR(st.st_mode);
-        if (is_dir && directory_is_excluded(path->str, walk_context->db->excludes)) {
-            trace("[database_scan] excluded directory: %s\n", path->str);
-            continue;
+        uint64_t pos_delta = 0;
+        uint64_t size = 0;
+        uint64_t mtime_delta = 0;
+        if (!db_compact_get_varint(&p, end, &pos_delta) || !db_compact_get_varint(&p, end, &size)
+            || !db_compact_get_varint(&p, end, &mtime_delta)) {
+            return false;
         }
-
-        BTreeNode *node = btree_node_new(dent->d_name, st.st_mtime, st.st_size, 0, is_dir);
-        btree_node_prepend(parent, node);
-        walk_context->db_node->num_items++;
-        if (is_dir) {
-            db_location_walk_tree_recursive(walk_context, node);
+        pos += db_compact_unzigzag(pos_delta);
+        mtime += db_compact_unzigzag(mtime_delta);
+
+        BTreeNode *node = btree_node_arena_alloc(arena,
+                                                 name,
+                                                 (time_t)mtime,
+                                                 (off_t)size,
+                                                 (uint32_t)pos,
+                                                 flags & DATABASE_NODE_FLAG_DIR);
+        if (flags & DATABASE_NODE_FLAG_NO_METADATA) {
+            node->has_metadata = false;
         }
+        ctx->nodes[i] = node;
     }
-
-    if (dir) {
-        closedir(dir);
-    }
-    return WALK_OK;
+    return p == end;
 }
 
 static void
-db_location_free(FsearchDatabaseNode *location) {
-    assert(location != NULL);
-
-    if (location->entries) {
-        btree_node_free(location->entries);
-        location->entries = NULL;
+db_location_decode_compact_blocks(uint32_t start, uint32_t end, gpointer data) {
+    DatabaseCompactLoadContext *ctx = data;
+    BTreeNodeArena *arena = btree_node_arena_new();
+    ctx->arenas[start] = arena;
+    for (uint32_t block = start; block < end && !g_atomic_int_get(&ctx->failed); block++) {
+        if (!db_location_decode_compact_block(ctx, arena, block)) {
+            trace("[database_read_file] bad block %d\n", block);
+            g_atomic_int_set(&ctx->failed, 1);
+        }
     }
-    g_free(location);
-    location = NULL;
 }
 
 static FsearchDatabaseNode *
-db_location_build_tree(FsearchDatabase *db, const char *dname, bool *cancel, void (*callback)(const char *)) {
-    const char *root_name = NULL;
-    if (!strcmp(dname, "/")) {
-        root_name = "";
+db_location_load_from_compact_file(int fd, const char *fname, FsearchThreadPool *pool) {
+    assert(fd >= 0);
+    assert(fname != NULL);
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(DatabaseCompactFileHeader)) {
+        close(fd);
+        goto map_fail;
     }
-    else {
-        root_name = dname;
+    const size_t map_size = st.st_size;
+    void *map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        trace("[database_read_file] failed to map file\n");
+        goto map_fail;
     }
-    BTreeNode *root = btree_node_new(root_name, 0, 0, 0, true);
-    FsearchDatabaseNode *location = db_location_new();
-    location->entries = root;
+    madvise(map, map_size, MADV_SEQUENTIAL);
 
-    GTimer *timer = g_timer_new();
-    GString *path = NULL;
-    if (!strcmp(dname, "/")) {
-        path = g_string_new(NULL);
+    const DatabaseCompactFileHeader *header = map;
+    if (header->minorver != DATABASE_COMPACT_FILE_MINOR_VERSION) {
+        trace("[database_read_file] bad minorver=%d\n", header->minorver);
+        munmap(map, map_size);
+        goto map_fail;
     }
-    else {
-        path = g_string_new(dname);
+    trace("[database_read_file] database version=%d.%d\n", header->majorver, header->minorver);
+
+    const uint32_t num_records = header->num_records;
+    const uint32_t num_blocks = header->num_blocks;
+    const time_t scan_started = header->scan_started;
+    if (num_records == 0
+        || num_blocks != (num_records + DATABASE_COMPACT_BLOCK_RECORDS - 1) / DATABASE_COMPACT_BLOCK_RECORDS
+        || header->index_offset < sizeof(DatabaseCompactFileHeader)
+        || header->index_offset + (uint64_t)num_blocks * sizeof(uint64_t) != map_size) {
+        trace("[database_read_file] bad file size\n");
+        munmap(map, map_size);
+        goto map_fail;
     }
 
-    g_timer_start(timer);
-    DatabaseWalkContext walk_context = {
-        .db = db,
-        .db_node = location,
-        .path = path,
-        .timer = timer,
-        .cancel = cancel,
-        .callback = callback,
-        .exclude_hidden = db->exclude_hidden,
-    };
-
-    uint32_t res = db_location_walk_tree_recursive(&walk_context, root);
+    DatabaseCompactLoadContext ctx = {0};
+    ctx.map = map;
+    ctx.num_records = num_records;
+    ctx.block_offsets = malloc((num_blocks + 1) * sizeof(uint64_t));
+    assert(ctx.block_offsets != NULL);
+    memcpy(ctx.block_offsets, (const char *)map + header->index_offset, num_blocks * sizeof(uint64_t));
+    ctx.block_offsets[num_blocks] = header->index_offset;
+    for (uint32_t i = 0; i < num_blocks; i++) {
+        if (ctx.block_offsets[i] < sizeof(DatabaseCompactFileHeader)
+            || ctx.block_offsets[i] > ctx.block_offsets[i + 1]) {
+            trace("[database_read_file] bad block offset %d\n", i);
+            ctx.failed = 1;
+        }
+    }
+    ctx.nodes = calloc(num_records, sizeof(BTreeNode *));
+    ctx.parents = malloc(num_records * sizeof(uint32_t));
+    ctx.arenas = calloc(num_blocks, sizeof(BTreeNodeArena *));
+    assert(ctx.nodes != NULL);
+    assert(ctx.parents != NULL);
+    assert(ctx.arenas != NULL);
+
+    if (!ctx.failed) {
+        fsearch_thread_pool_parallel_for(pool,
+                                         num_blocks,
+                                         DATABASE_COMPACT_MIN_BLOCKS_PER_THREAD,
+                                         db_location_decode_compact_blocks,
+                                         &ctx);
+    }
+    // the names were copied into the arenas
+    munmap(map, map_size);
 
-    g_string_free(path, TRUE);
-    g_timer_destroy(timer);
-    if (res == WALK_OK) {
-        return location;
+    FsearchDatabaseNode *location = db_location_new();
+    for (uint32_t i = 0; i < num_blocks; i++) {
+        if (ctx.arenas[i]) {
+            btree_node_arena_merge(location->arena, ctx.arenas[i]);
+            btree_node_arena_free(ctx.arenas[i]);
+        }
+    }
+    if (!ctx.failed) {
+        // in file order, so the children end up in the same order as with mapped files
+        for (uint32_t i = 1; i < num_records; i++) {
+            btree_node_prepend(ctx.nodes[ctx.parents[i]], ctx.nodes[i]);
+        }
+        location->entries = ctx.nodes[0];
+        location->num_items = num_records - 1;
+        location->sorted = true;
+        location->scan_started = scan_started;
+    }
+    free(ctx.arenas);
+    free(ctx.parents);
+    free(ctx.nodes);
+    free(ctx.block_offsets);
+    if (ctx.failed) {
+        db_location_free(location);
+        goto map_fail;
     }
 
-    trace("[database_scan] walk error: %d\n", res);
-    db_location_free(location);
+    trace("[database_load] finished with %d items successfully read\n", num_records);
+    trace("[database_load] %zu bytes allocated for nodes\n", btree_node_arena_get_size(location->arena));
+    return location;
+
+map_fail:
+    fprintf(stderr, "database load fail (%s)!\n", fname);
     return NULL;
 }
 
 static FsearchDatabaseNode *
-db_location_new(void) {
-    FsearchDatabaseNode *location = g_new0(FsearchDatabaseNode, 1);
-    return location;
-}
+db_location_load_from_file(const char *fname, FsearchThreadPool *pool) {
+    assert(fname != NULL);
 
-static bool
-db_list_insert_node(BTreeNode *node, void *data) {
-    FsearchDatabase *db = data;
-    darray_set_item(db->entries, node, node->pos);
-    db->num_entries++;
-    return true;
-}
+    int fd = open(fname, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
 
-static void
-db_traverse_tree_insert(BTreeNode *node, void *data) {
-    btree_node_traverse(node, db_list_insert_node, data);
-}
+    char magic[5];
+    if (read(fd, magic, sizeof(magic)) != sizeof(magic)) {
+        trace("[database_read_file] failed to read magic\n");
+        goto load_fail;
+    }
+    if (strncmp(magic, "FSDB", 4)) {
+        trace("[database_read_file] bad signature\n");
+        goto load_fail;
+    }
 
-static uint32_t temp_index = 0;
+    const uint8_t majorver = magic[4];
+    if (majorver == DATABASE_FILE_MAJOR_VERSION) {
+        return db_location_load_from_mapped_file(fd, fname);
+    }
+    else if (majorver == DATABASE_COMPACT_FILE_MAJOR_VERSION) {
+        return db_location_load_from_compact_file(fd, fname, pool);
+    }
+    else if (majorver == 0) {
+        // files written before version 1.0 have to be parsed
+        FILE *fp = fdopen(fd, "rb");
+        if (!fp) {
+            goto load_fail;
+        }
+        return db_location_load_from_legacy_file(fp, fname);
+    }
+    trace("[database_read_file] bad majorver=%d\n", majorver);
 
-static bool
-db_list_add_node(BTreeNode *node, void *data) {
-    FsearchDatabase *db = data;
-    darray_set_item(db->entries, node, temp_index++);
-    db->num_entries++;
-    return true;
+load_fail:
+    fprintf(stderr, "database load fail (%s)!\n", fname);
+    close(fd);
+    return NULL;
 }
 
-static void
-db_traverse_tree_add(BTreeNode *node, void *data) {
-    btree_node_traverse(node, db_list_add_node, data);
-}
+// A location of a database together with its parts, which are saved and scanned again as one tree
+typedef struct {
+    FsearchDatabase *db;
+    // every location of db by its shard
+    FsearchDatabaseNode **locations;
+    // the shard of the location, and those of the parts by their split folder as GUINT_TO_POINTER(shard + 1)
+    uint32_t shard;
+    GHashTable *part_shards;
+    // rank of the entries of all of them in name order, by their index in the entries list
+    uint32_t *ranks;
+} DatabaseJoinContext;
 
 static void
-db_list_insert_location(FsearchDatabase *db, FsearchDatabaseNode *location) {
-    assert(db != NULL);
-    assert(location != NULL);
-    assert(location->entries != NULL);
-
-    btree_node_children_foreach(location->entries, db_traverse_tree_insert, db);
+db_join_context_clear(DatabaseJoinContext *ctx) {
+    free(ctx->locations);
+    ctx->locations = NULL;
+    if (ctx->part_shards) {
+        g_hash_table_destroy(ctx->part_shards);
+        ctx->part_shards = NULL;
+    }
+    free(ctx->ranks);
+    ctx->ranks = NULL;
 }
 
-static void
-db_list_add_location(FsearchDatabase *db, FsearchDatabaseNode *location) {
-    assert(db != NULL);
-    assert(location != NULL);
-    assert(location->entries != NULL);
+// False if location has no parts in db, its pos fields are all it needs then
+static bool
+db_join_context_init(DatabaseJoinContext *ctx, FsearchDatabase *db, FsearchDatabaseNode *location) {
+    *ctx = (DatabaseJoinContext){.db = db, .shard = UINT32_MAX};
+    if (!db->part_folders) {
+        return false;
+    }
+    ctx->locations = malloc(db->num_shards * sizeof(FsearchDatabaseNode *));
+    assert(ctx->locations != NULL);
+    ctx->part_shards = g_hash_table_new(NULL, NULL);
+    uint32_t s = 0;
+    for (GList *l = db->locations; l != NULL; l = l->next, s++) {
+        ctx->locations[s] = l->data;
+    }
+    assert(s == db->num_shards);
+
+    const char *name = location->entries->name;
+    for (s = 0; s < db->num_shards; s++) {
+        if (ctx->locations[s] == location) {
+            ctx->shard = s;
+        }
+        else if (db->part_folders[s] && !strcmp(ctx->locations[s]->location_name, name)) {
+            g_hash_table_insert(ctx->part_shards, db->part_folders[s], GUINT_TO_POINTER(s + 1));
+        }
+    }
+    if (ctx->shard == UINT32_MAX || g_hash_table_size(ctx->part_shards) == 0) {
+        db_join_context_clear(ctx);
+        return false;
+    }
+
+    // the entries of all of them are marked first, then counted in the order of the entries list
+    ctx->ranks = malloc(MAX(db->num_entries, 1) * sizeof(uint32_t));
+    assert(ctx->ranks != NULL);
+    memset(ctx->ranks, 0xff, db->num_entries * sizeof(uint32_t));
+    for (s = 0; s < db->num_shards; s++) {
+        if (s == ctx->shard || (db->part_folders[s] && !strcmp(ctx->locations[s]->location_name, name))) {
+            for (uint32_t i = 0; i < db->shards[s]->num_entries; i++) {
+                ctx->ranks[db->shard_global_indices[s][i]] = 0;
+            }
+        }
+    }
+    uint32_t rank = 0;
+    for (uint32_t i = 0; i < db->num_entries; i++) {
+        if (ctx->ranks[i] != UINT32_MAX) {
+            ctx->ranks[i] = rank++;
+        }
+    }
+    return true;
+}
+
+// pos of node of the given shard among the entries of the location and all of its parts
+static uint32_t
+db_join_get_pos(DatabaseJoinContext *ctx, BTreeNode *node, uint32_t shard) {
+    if (!ctx || !node->parent || node->pos == DATABASE_NODE_POS_NEW) {
+        return node->pos;
+    }
+    return ctx->ranks[ctx->db->shard_global_indices[shard][node->pos]];
+}
+
+// The children of node, those of the root of its part for a split folder. shard is set to the one
+// they're in.
+static BTreeNode *
+db_join_get_children(DatabaseJoinContext *ctx, BTreeNode *node, uint32_t *shard) {
+    if (ctx && node->split) {
+        const uint32_t part = GPOINTER_TO_UINT(g_hash_table_lookup(ctx->part_shards, node));
+        if (part) {
+            *shard = part - 1;
+            return ctx->locations[part - 1]->entries->children;
+        }
+    }
+    return node->children;
+}
+
+typedef struct {
+    FILE *fp;
+    GString *names;
+    uint32_t num_records;
+    DatabaseJoinContext *join;
+} DatabaseFileWriteContext;
+
+static bool
+db_location_write_node(DatabaseFileWriteContext *ctx, BTreeNode *node, uint32_t parent, uint32_t shard) {
+    const size_t name_len = strlen(node->name) + 1;
+    if (ctx->names->len + name_len > UINT32_MAX) {
+        trace("[database_save] names don't fit into the file format\n");
+        return false;
+    }
+
+    DatabaseFileRecord record = {0};
+    record.size = node->size;
+    record.mtime = node->mtime;
+    record.name_offset = ctx->names->len;
+    record.parent = parent;
+    record.pos = db_join_get_pos(ctx->join, node, shard);
+    record.flags = node->is_dir ? DATABASE_NODE_FLAG_DIR : 0;
+    if (!node->has_metadata) {
+        record.flags |= DATABASE_NODE_FLAG_NO_METADATA;
+    }
+    if (fwrite(&record, sizeof(record), 1, ctx->fp) != 1) {
+        return false;
+    }
+    g_string_append_len(ctx->names, node->name, name_len);
+
+    const uint32_t index = ctx->num_records++;
+    BTreeNode *children = db_join_get_children(ctx->join, node, &shard);
+    for (BTreeNode *child = children; child; child = child->next) {
+        if (!db_location_write_node(ctx, child, index, shard)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool
+db_location_write_mapped_file(FsearchDatabaseNode *location, DatabaseJoinContext *join, FILE *fp) {
+    DatabaseFileWriteContext ctx = {0};
+    ctx.fp = fp;
+    ctx.names = g_string_sized_new(4096);
+    ctx.join = join;
+
+    // reserve room for the header, it's written once the records are known
+    DatabaseFileHeader header = {0};
+    bool res = fwrite(&header, sizeof(header), 1, fp) == 1
+            && db_location_write_node(&ctx, location->entries, DATABASE_FILE_NO_PARENT, join ? join->shard : 0)
+            && fwrite(ctx.names->str, 1, ctx.names->len, fp) == ctx.names->len;
+    if (res) {
+        memcpy(header.magic, "FSDB", 4);
+        header.majorver = DATABASE_FILE_MAJOR_VERSION;
+        header.minorver = DATABASE_FILE_MINOR_VERSION;
+        header.num_records = ctx.num_records;
+        header.scan_started = (uint32_t)location->scan_started;
+        header.names_size = ctx.names->len;
+        res = !fseek(fp, 0, SEEK_SET) && fwrite(&header, sizeof(header), 1, fp) == 1;
+    }
+    g_string_free(ctx.names, TRUE);
+    return res;
+}
+
+typedef struct {
+    FILE *fp;
+    // the records of the current block, and where it starts in the file
+    GByteArray *block;
+    uint64_t block_offset;
+    GArray *block_offsets;
+    uint32_t num_records;
+    uint32_t prev_parent;
+    int64_t prev_pos;
+    int64_t prev_mtime;
+    DatabaseJoinContext *join;
+} DatabaseCompactWriteContext;
+
+static bool
+db_location_flush_compact_block(DatabaseCompactWriteContext *ctx) {
+    if (ctx->block->len == 0) {
+        return true;
+    }
+    g_array_append_val(ctx->block_offsets, ctx->block_offset);
+    if (fwrite(ctx->block->data, 1, ctx->block->len, ctx->fp) != ctx->block->len) {
+        return false;
+    }
+    ctx->block_offset += ctx->block->len;
+    g_byte_array_set_size(ctx->block, 0);
+    return true;
+}
+
+static bool
+db_location_write_compact_node(DatabaseCompactWriteContext *ctx,
+                               BTreeNode *node,
+                               uint32_t shard,
+                               uint32_t parent,
+                               BTreeNode *sibling,
+                               uint32_t sibling_index) {
+    const uint32_t index = ctx->num_records++;
+    const uint32_t block_start = index - index % DATABASE_COMPACT_BLOCK_RECORDS;
+    const bool is_block_start = index == block_start;
+    if (is_block_start) {
+        if (!db_location_flush_compact_block(ctx)) {
+            return false;
+        }
+        ctx->prev_pos = 0;
+        ctx->prev_mtime = 0;
+    }
+
+    // the previous sibling is only known to the decoder if it's in the same block
+    size_t prefix_len = 0;
+    if (sibling && sibling_index >= block_start) {
+        while (sibling->name[prefix_len] && sibling->name[prefix_len] == node->name[prefix_len]) {
+            prefix_len++;
+        }
+    }
+
+    uint8_t flags = node->is_dir ? DATABASE_NODE_FLAG_DIR : 0;
+    if (!node->has_metadata) {
+        flags |= DATABASE_NODE_FLAG_NO_METADATA;
+    }
+    const bool same_parent = !is_block_start && parent == ctx->prev_parent;
+    if (same_parent) {
+        flags |= DATABASE_COMPACT_FLAG_SAME_PARENT;
+    }
+    if (prefix_len) {
+        flags |= DATABASE_COMPACT_FLAG_PREFIX;
+    }
+    g_byte_array_append(ctx->block, &flags, 1);
+    if (!same_parent && parent != DATABASE_FILE_NO_PARENT) {
+        db_compact_put_varint(ctx->block, index - parent);
+    }
+    ctx->prev_parent = parent;
+    if (prefix_len) {
+        db_compact_put_varint(ctx->block, index - sibling_index);
+        db_compact_put_varint(ctx->block, prefix_len);
+    }
+    const size_t name_len = strlen(node->name);
+    db_compact_put_varint(ctx->block, name_len - prefix_len);
+    g_byte_array_append(ctx->block, (const uint8_t *)node->name + prefix_len, name_len - prefix_len);
+
+    const uint32_t pos = db_join_get_pos(ctx->join, node, shard);
+    db_compact_put_varint(ctx->block, db_compact_zigzag((int64_t)pos - ctx->prev_pos));
+    db_compact_put_varint(ctx->block, (uint64_t)node->size);
+    db_compact_put_varint(ctx->block, db_compact_zigzag((int64_t)node->mtime - ctx->prev_mtime));
+    ctx->prev_pos = pos;
+    ctx->prev_mtime = node->mtime;
+
+    BTreeNode *first_child = db_join_get_children(ctx->join, node, &shard);
+    if (!first_child) {
+        return true;
+    }
+    // in name order, neighbours share the longest prefixes
+    GPtrArray *children = g_ptr_array_new();
+    for (BTreeNode *child = first_child; child; child = child->next) {
+        g_ptr_array_add(children, child);
+    }
+    g_ptr_array_sort(children, sort_by_name);
+
+    bool res = true;
+    BTreeNode *prev_child = NULL;
+    uint32_t prev_child_index = 0;
+    for (guint i = 0; res && i < children->len; i++) {
+        BTreeNode *child = g_ptr_array_index(children, i);
+        const uint32_t child_index = ctx->num_records;
+        res = db_location_write_compact_node(ctx, child, shard, index, prev_child, prev_child_index);
+        prev_child = child;
+        prev_child_index = child_index;
+    }
+    g_ptr_array_free(children, TRUE);
+    return res;
+}
+
+static bool
+db_location_write_compact_file(FsearchDatabaseNode *location, DatabaseJoinContext *join, FILE *fp) {
+    DatabaseCompactWriteContext ctx = {0};
+    ctx.fp = fp;
+    ctx.join = join;
+    ctx.block = g_byte_array_sized_new(64 * 1024);
+    ctx.block_offset = sizeof(DatabaseCompactFileHeader);
+    ctx.block_offsets = g_array_new(FALSE, FALSE, sizeof(uint64_t));
+
+    DatabaseCompactFileHeader header = {0};
+    bool res = fwrite(&header, sizeof(header), 1, fp) == 1
+            && db_location_write_compact_node(
+                   &ctx, location->entries, join ? join->shard : 0, DATABASE_FILE_NO_PARENT, NULL, 0)
+            && db_location_flush_compact_block(&ctx)
+            && fwrite(ctx.block_offsets->data, sizeof(uint64_t), ctx.block_offsets->len, fp) == ctx.block_offsets->len;
+    if (res) {
+        memcpy(header.magic, "FSDB", 4);
+        header.majorver = DATABASE_COMPACT_FILE_MAJOR_VERSION;
+        header.minorver = DATABASE_COMPACT_FILE_MINOR_VERSION;
+        header.num_records = ctx.num_records;
+        header.scan_started = (uint32_t)location->scan_started;
+        header.num_blocks = ctx.block_offsets->len;
+        header.index_offset = ctx.block_offset;
+        res = !fseek(fp, 0, SEEK_SET) && fwrite(&header, sizeof(header), 1, fp) == 1;
+    }
+    g_byte_array_free(ctx.block, TRUE);
+    g_array_free(ctx.block_offsets, TRUE);
+    return res;
+}
+
+// stdio buffer of the database files, so the many small writes of the records turn into few large ones
+#define DATABASE_SAVE_BUFFER_SIZE (1024 * 1024)
+
+// With join the parts of location are written into its file too
+static bool
+db_location_write_to_file(FsearchDatabaseNode *location, DatabaseJoinContext *join, const char *path, bool compact) {
+    assert(path != NULL);
+    assert(location != NULL);
+
+    if (!location->entries) {
+        return false;
+    }
+    g_mkdir_with_parents(path, 0700);
+
+    GString *db_path = g_string_new(path);
+    g_string_append(db_path, "/database.db");
+    // the old file stays in place until the new one is complete
+    GString *tmp_path = g_string_new(db_path->str);
+    g_string_append(tmp_path, ".tmp");
+
+    FILE *fp = fopen(tmp_path->str, "w+b");
+    if (!fp) {
+        g_string_free(tmp_path, TRUE);
+        g_string_free(db_path, TRUE);
+        return false;
+    }
+    setvbuf(fp, NULL, _IOFBF, DATABASE_SAVE_BUFFER_SIZE);
+
+    bool written = compact ? db_location_write_compact_file(location, join, fp)
+                           : db_location_write_mapped_file(location, join, fp);
+    written = written && !fflush(fp) && !fsync(fileno(fp));
+    if (fclose(fp) || !written || rename(tmp_path->str, db_path->str)) {
+        unlink(tmp_path->str);
+        g_string_free(tmp_path, TRUE);
+        g_string_free(db_path, TRUE);
+        return false;
+    }
+
+    trace("[database_save] saved %s\n", path);
+    g_string_free(tmp_path, TRUE);
+    g_string_free(db_path, TRUE);
+    return true;
+}
+
+// Folders are read with getdents64 into a buffer this large, readdir only reads 32 KiB
+// at a time, so huge folders and network file systems take fewer round trips
+#define DATABASE_SCAN_DENTS_BUFFER_SIZE (256 * 1024)
+
+// the layout of the records which getdents64 returns
+typedef struct DatabaseDirent {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} DatabaseDirent;
+
+typedef struct DatabaseDirReader {
+    int fd;
+    // DATABASE_SCAN_DENTS_BUFFER_SIZE bytes, owned by the caller
+    char *buffer;
+    size_t len;
+    size_t pos;
+} DatabaseDirReader;
+
+static bool
+db_dir_reader_open(DatabaseDirReader *reader, const char *path, char *buffer) {
+    reader->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    reader->buffer = buffer;
+    reader->len = 0;
+    reader->pos = 0;
+    return reader->fd >= 0;
+}
+
+static DatabaseDirent *
+db_dir_reader_next(DatabaseDirReader *reader) {
+    if (reader->pos >= reader->len) {
+        const long len = syscall(SYS_getdents64, reader->fd, reader->buffer, DATABASE_SCAN_DENTS_BUFFER_SIZE);
+        if (len <= 0) {
+            return NULL;
+        }
+        reader->len = len;
+        reader->pos = 0;
+    }
+    DatabaseDirent *dent = (DatabaseDirent *)(reader->buffer + reader->pos);
+    reader->pos += dent->d_reclen;
+    return dent;
+}
+
+static void
+db_dir_reader_close(DatabaseDirReader *reader) {
+    if (reader->fd >= 0) {
+        close(reader->fd);
+        reader->fd = -1;
+    }
+}
+
+typedef struct DatabaseEntryInfo {
+    time_t mtime;
+    off_t size;
+    bool is_dir;
+    bool has_metadata;
+    // a symbolic link to a folder, which is entered like one. The rest is about the folder.
+    bool is_link;
+    dev_t device;
+    ino_t inode;
+} DatabaseEntryInfo;
+
+typedef struct DatabaseInode {
+    dev_t device;
+    ino_t inode;
+} DatabaseInode;
+
+static guint
+db_inode_hash(gconstpointer key) {
+    const DatabaseInode *inode = key;
+    return g_int64_hash(&(gint64){(gint64)inode->inode}) ^ g_int64_hash(&(gint64){(gint64)inode->device});
+}
+
+static gboolean
+db_inode_equal(gconstpointer a, gconstpointer b) {
+    const DatabaseInode *inode_a = a;
+    const DatabaseInode *inode_b = b;
+    return inode_a->inode == inode_b->inode && inode_a->device == inode_b->device;
+}
+
+// Whether the folder behind the link at path should be entered, it's claimed for the link then.
+// Folders inside the location are indexed through their own path anyway, and none outside of
+// it is entered through more than one link.
+static bool
+db_location_claim_link_target(FsearchDatabaseNode *location, const char *path, dev_t device, ino_t inode) {
+    char *target = realpath(path, NULL);
+    if (!target) {
+        return false;
+    }
+    DatabaseInode key = {.device = device, .inode = inode};
+
+    g_mutex_lock(&location->link_targets_mutex);
+    if (!location->real_path) {
+        const char *root = location->entries->name[0] ? location->entries->name : "/";
+        location->real_path = realpath(root, NULL);
+        if (!location->real_path) {
+            location->real_path = strdup(root);
+        }
+    }
+    const size_t root_len = strlen(location->real_path);
+    const bool inside = !strncmp(target, location->real_path, root_len)
+                     && (root_len == 1 || target[root_len] == '\0' || target[root_len] == '/');
+    const bool claimed = !inside && !g_hash_table_contains(location->link_targets, &key);
+    if (claimed) {
+        DatabaseInode *link_target = g_new(DatabaseInode, 1);
+        *link_target = key;
+        g_hash_table_add(location->link_targets, link_target);
+    }
+    g_mutex_unlock(&location->link_targets_mutex);
+
+    free(target);
+    return claimed;
+}
+
+#ifdef STATX_TYPE
+static bool statx_unsupported = false;
+#endif
+
+// In names only mode files whose type the file system told us with d_type aren't stat'ed.
+// Folders always are, incremental scans compare their mtimes, and there are few of them.
+static inline bool
+db_scan_entry_needs_stat(unsigned char d_type, bool names_only, bool follow_symlinks) {
+    return !names_only || d_type == DT_UNKNOWN || d_type == DT_DIR || (follow_symlinks && d_type == DT_LNK);
+}
+
+// Queries the type, size and mtime of a directory entry relative to the fd of
+// its parent directory, so no absolute path needs to be built for that.
+// In names only mode most stat calls are skipped, see db_scan_entry_needs_stat.
+// With follow_symlinks a link to a folder is reported as that folder, with is_link set.
+static bool
+db_scan_entry_get_info(int dir_fd,
+                       const char *name,
+                       unsigned char d_type,
+                       bool names_only,
+                       bool follow_symlinks,
+                       DatabaseEntryInfo *info) {
+    if (!db_scan_entry_needs_stat(d_type, names_only, follow_symlinks)) {
+        info->is_dir = d_type == DT_DIR;
+        info->has_metadata = false;
+        return true;
+    }
+
+    bool is_link = false;
+#ifdef STATX_TYPE
+    if (!statx_unsupported) {
+        struct statx stx;
+        // AT_STATX_DONT_SYNC: attributes cached by network file systems are good enough for the index
+        if (!statx(dir_fd,
+                   name,
+                   AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                   STATX_TYPE | STATX_SIZE | STATX_MTIME,
+                   &stx)) {
+            info->is_dir = S_ISDIR(stx.stx_mode);
+            info->size = stx.stx_size;
+            info->mtime = stx.stx_mtime.tv_sec;
+            info->has_metadata = true;
+            is_link = S_ISLNK(stx.stx_mode);
+            if (!is_link || !follow_symlinks) {
+                return true;
+            }
+        }
+        else if (errno != ENOSYS) {
+            return false;
+        }
+        else {
+            statx_unsupported = true;
+        }
+    }
+#endif
+
+    struct stat st;
+    if (!is_link) {
+        if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            return false;
+        }
+        info->is_dir = S_ISDIR(st.st_mode);
+        info->size = st.st_size;
+        info->mtime = st.st_mtime;
+        info->has_metadata = true;
+        is_link = S_ISLNK(st.st_mode);
+        if (!is_link || !follow_symlinks) {
+            return true;
+        }
+    }
+
+    // links to anything but a folder, and broken ones, are indexed as they are
+    if (!fstatat(dir_fd, name, &st, 0) && S_ISDIR(st.st_mode)) {
+        info->is_dir = true;
+        info->size = st.st_size;
+        info->mtime = st.st_mtime;
+        info->is_link = true;
+        info->device = st.st_dev;
+        info->inode = st.st_ino;
+    }
+    return true;
+}
+
+// Links to folders which aren't entered, see db_location_claim_link_target, or which lie on
+// a pseudo file system, become plain entries. The others are entered just like folders.
+static void
+db_scan_entry_claim_link(FsearchDatabase *db,
+                         FsearchDatabaseNode *location,
+                         const char *path,
+                         DatabaseEntryInfo *info) {
+    if (!info->is_link) {
+        return;
+    }
+    const DatabaseMount *mount = db_mount_table_lookup_device(db->mounts, info->device);
+    if ((db->flags.exclude_virtual_fs && mount && mount->is_virtual)
+        || !db_location_claim_link_target(location, path, info->device, info->inode)) {
+        info->is_dir = false;
+        info->is_link = false;
+    }
+}
+
+// Whether the folder at path is the mount point of a pseudo file system which shouldn't be
+// entered. The folder itself stays in the index.
+static bool
+db_scan_folder_is_virtual(FsearchDatabase *db, const char *path) {
+    if (!db->flags.exclude_virtual_fs) {
+        return false;
+    }
+    const DatabaseMount *mount = db_mount_table_lookup(db->mounts, path);
+    return mount && mount->is_virtual;
+}
+
+static BTreeNode *
+db_scan_entry_new_node(BTreeNodeArena *arena, const char *name, DatabaseEntryInfo *info) {
+    BTreeNode *node = btree_node_arena_alloc(arena, name, info->mtime, info->size, 0, info->is_dir);
+    node->has_metadata = info->has_metadata;
+    return node;
+}
+
+typedef struct DatabaseWalkContext {
+    FsearchDatabase *db;
+    FsearchDatabaseNode *db_node;
+    GString *path;
+    GTimer *timer;
+    bool *cancel;
+    void (*callback)(const char *);
+    // DATABASE_SCAN_DENTS_BUFFER_SIZE bytes
+    char *dents;
+    bool exclude_hidden;
+    bool names_only;
+    bool follow_symlinks;
+} DatabaseWalkContext;
+
+static int
+db_location_walk_tree_recursive(DatabaseWalkContext *walk_context, BTreeNode *parent) {
+
+    if (*walk_context->cancel == true) {
+        return WALK_CANCEL;
+    }
+
+    GString *path = walk_context->path;
+    g_string_append_c(path, '/');
+
+    // remember end of parent path
+    gsize path_len = path->len;
+
+    DatabaseDirReader dir;
+    if (!db_dir_reader_open(&dir, path->str, walk_context->dents)) {
+        return WALK_BADIO;
+    }
+
+    double elapsed_seconds = g_timer_elapsed(walk_context->timer, NULL);
+    if (elapsed_seconds > 0.1) {
+        if (walk_context->callback) {
+            walk_context->callback(path->str);
+        }
+        g_timer_start(walk_context->timer);
+    }
+
+    uint32_t num_entries = 0;
+    uint32_t num_stat_calls = 0;
+    DatabaseDirent *dent = NULL;
+    while ((dent = db_dir_reader_next(&dir))) {
+        if (*walk_context->cancel == true) {
+            db_dir_reader_close(&dir);
+            return WALK_CANCEL;
+        }
+        if (walk_context->exclude_hidden && dent->d_name[0] == '.') {
+            // file is dotfile, skip
+            continue;
+        }
+        if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, "..")) {
+            continue;
+        }
+        if (fsearch_exclude_matcher_file_is_excluded(walk_context->db->exclude_matcher, dent->d_name)) {
+            continue;
+        }
+
+        DatabaseEntryInfo info = {0};
+        const bool found = db_scan_entry_get_info(dir.fd,
+                                                  dent->d_name,
+                                                  dent->d_type,
+                                                  walk_context->names_only,
+                                                  walk_context->follow_symlinks,
+                                                  &info);
+        num_stat_calls += db_scan_entry_needs_stat(dent->d_type,
+                                                   walk_context->names_only,
+                                                   walk_context->follow_symlinks);
+        if (!found) {
+            continue;
+        }
+
+        if (info.is_dir) {
+            // the full path is only needed to check for excludes and to descend
+            g_string_truncate(path, path_len);
+            g_string_append(path, dent->d_name);
+            db_scan_entry_claim_link(walk_context->db, walk_context->db_node, path->str, &info);
+            if (info.is_dir
+                && fsearch_exclude_matcher_directory_is_excluded(walk_context->db->exclude_matcher, path->str)) {
+                trace("[database_scan] excluded directory: %s\n", path->str);
+                continue;
+            }
+        }
+
+        BTreeNode *node = db_scan_entry_new_node(walk_context->db_node->arena, dent->d_name, &info);
+        btree_node_prepend(parent, node);
+        walk_context->db_node->num_items++;
+        num_entries++;
+    }
+
+    db_dir_reader_close(&dir);
+    fsearch_stats_add(FSEARCH_STATS_SCAN_ENTRIES, num_entries);
+    fsearch_stats_add(FSEARCH_STATS_SCAN_FOLDERS, 1);
+    fsearch_stats_add(FSEARCH_STATS_SCAN_STAT_CALLS, num_stat_calls);
+
+    // the folders are only entered once this one is closed,
+    // that way all of them share one buffer and only one is open at a time
+    for (BTreeNode *child = parent->children; child != NULL; child = child->next) {
+        if (child->is_dir) {
+            g_string_truncate(path, path_len);
+            g_string_append(path, child->name);
+            if (!db_scan_folder_is_virtual(walk_context->db, path->str)) {
+                db_location_walk_tree_recursive(walk_context, child);
+            }
+        }
+    }
+    return WALK_OK;
+}
+
+typedef struct DatabaseParallelWalkContext DatabaseParallelWalkContext;
+
+// Network file systems only get a part of the workers, so while they wait for the server
+// the others keep reading the local disks
+#define DATABASE_SCAN_REMOTE_DEVICE_SHARE 2
+
+// The folders of a device are read by at most max_running workers at a time,
+// the others wait in its queue
+typedef struct DatabaseWalkDevice {
+    GQueue pending;
+    uint32_t num_running;
+    uint32_t max_running;
+} DatabaseWalkDevice;
+
+typedef struct DatabaseWalkTask {
+    DatabaseParallelWalkContext *ctx;
+    // directory node whose children still need to be scanned
+    BTreeNode *node;
+    char *path;
+    // the device the folder is on, NULL if it may use all workers
+    DatabaseWalkDevice *device;
+} DatabaseWalkTask;
+
+typedef struct DatabaseWalkWorker {
+    GString *path;
+    // DATABASE_SCAN_DENTS_BUFFER_SIZE bytes
+    char *dents;
+    // nodes are allocated from a per worker arena, it's merged into the location's arena at the end
+    BTreeNodeArena *arena;
+    uint32_t num_items;
+} DatabaseWalkWorker;
+
+struct DatabaseParallelWalkContext {
+    FsearchDatabase *db;
+    FsearchDatabaseNode *db_node;
+    FsearchThreadPool *pool;
+    FsearchTaskGroup *group;
+    // one per thread of the pool, indexed by fsearch_thread_pool_get_thread_index
+    DatabaseWalkWorker *workers;
+    uint32_t num_workers;
+    // one per device of the mount table
+    DatabaseWalkDevice *devices;
+    uint32_t num_devices;
+    GMutex devices_mutex;
+
+    BTreeNode *root;
+    bool root_failed;
+
+    GMutex timer_mutex;
+    GTimer *timer;
+    bool *cancel;
+    void (*callback)(const char *);
+    bool exclude_hidden;
+    bool names_only;
+    bool follow_symlinks;
+};
+
+static DatabaseWalkTask *
+db_walk_task_new(DatabaseParallelWalkContext *ctx, BTreeNode *node, const char *path, DatabaseWalkDevice *device) {
+    DatabaseWalkTask *task = g_new0(DatabaseWalkTask, 1);
+    task->ctx = ctx;
+    task->node = node;
+    task->path = g_strdup(path);
+    task->device = device;
+    return task;
+}
+
+static void
+db_walk_task_free(DatabaseWalkTask *task) {
+    if (!task) {
+        return;
+    }
+    g_free(task->path);
+    task->path = NULL;
+    g_free(task);
+}
+
+static void
+db_walk_task_run(gpointer data);
+
+static DatabaseWalkDevice *
+db_walk_get_device(DatabaseParallelWalkContext *ctx, const DatabaseMount *mount) {
+    DatabaseWalkDevice *device = &ctx->devices[mount->device_idx];
+    return device->max_running > 0 ? device : NULL;
+}
+
+// The device of the folder at path, the one of its parent unless a device is mounted there
+// or it's behind a link
+static DatabaseWalkDevice *
+db_walk_get_folder_device(DatabaseParallelWalkContext *ctx,
+                          DatabaseWalkDevice *parent_device,
+                          const char *path,
+                          DatabaseEntryInfo *info) {
+    const DatabaseMount *mount = info->is_link ? db_mount_table_lookup_device(ctx->db->mounts, info->device)
+                                               : db_mount_table_lookup(ctx->db->mounts, path);
+    return mount ? db_walk_get_device(ctx, mount) : parent_device;
+}
+
+static void
+db_walk_push_task(DatabaseParallelWalkContext *ctx, DatabaseWalkTask *task) {
+    DatabaseWalkDevice *device = task->device;
+    if (device) {
+        g_mutex_lock(&ctx->devices_mutex);
+        if (device->num_running >= device->max_running) {
+            g_queue_push_tail(&device->pending, task);
+            g_mutex_unlock(&ctx->devices_mutex);
+            return;
+        }
+        device->num_running++;
+        g_mutex_unlock(&ctx->devices_mutex);
+    }
+    fsearch_task_group_push(ctx->group, db_walk_task_run, task);
+}
+
+// Hands the slot of a finished task of device on to the next one which waits for it
+static void
+db_walk_device_task_done(DatabaseParallelWalkContext *ctx, DatabaseWalkDevice *device) {
+    g_mutex_lock(&ctx->devices_mutex);
+    // the newest first, so the device is walked depth first like the others
+    DatabaseWalkTask *next = g_queue_pop_tail(&device->pending);
+    if (!next) {
+        device->num_running--;
+    }
+    g_mutex_unlock(&ctx->devices_mutex);
+    if (next) {
+        fsearch_task_group_push(ctx->group, db_walk_task_run, next);
+    }
+}
+
+static void
+db_walk_worker_scan_dir(DatabaseWalkWorker *worker, DatabaseWalkTask *task) {
+    DatabaseParallelWalkContext *ctx = task->ctx;
+    if (*ctx->cancel == true) {
+        return;
+    }
+
+    GString *path = worker->path;
+    g_string_assign(path, task->path);
+    g_string_append_c(path, '/');
+
+    // remember end of parent path
+    gsize path_len = path->len;
+
+    DatabaseDirReader dir;
+    if (!db_dir_reader_open(&dir, path->str, worker->dents)) {
+        if (task->node == ctx->root) {
+            ctx->root_failed = true;
+        }
+        return;
+    }
+
+    if (ctx->callback && g_mutex_trylock(&ctx->timer_mutex)) {
+        double elapsed_seconds = g_timer_elapsed(ctx->timer, NULL);
+        if (elapsed_seconds > 0.1) {
+            ctx->callback(path->str);
+            g_timer_start(ctx->timer);
+        }
+        g_mutex_unlock(&ctx->timer_mutex);
+    }
+
+    uint32_t num_entries = 0;
+    uint32_t num_stat_calls = 0;
+    DatabaseDirent *dent = NULL;
+    while ((dent = db_dir_reader_next(&dir))) {
+        if (*ctx->cancel == true) {
+            break;
+        }
+        if (ctx->exclude_hidden && dent->d_name[0] == '.') {
+            // file is dotfile, skip
+            continue;
+        }
+        if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, "..")) {
+            continue;
+        }
+        if (fsearch_exclude_matcher_file_is_excluded(ctx->db->exclude_matcher, dent->d_name)) {
+            continue;
+        }
+
+        DatabaseEntryInfo info = {0};
+        const bool found = db_scan_entry_get_info(dir.fd,
+                                                  dent->d_name,
+                                                  dent->d_type,
+                                                  ctx->names_only,
+                                                  ctx->follow_symlinks,
+                                                  &info);
+        num_stat_calls += db_scan_entry_needs_stat(dent->d_type, ctx->names_only, ctx->follow_symlinks);
+        if (!found) {
+            continue;
+        }
+
+        if (info.is_dir) {
+            g_string_truncate(path, path_len);
+            g_string_append(path, dent->d_name);
+            db_scan_entry_claim_link(ctx->db, ctx->db_node, path->str, &info);
+            if (info.is_dir && fsearch_exclude_matcher_directory_is_excluded(ctx->db->exclude_matcher, path->str)) {
+                trace("[database_scan] excluded directory: %s\n", path->str);
+                continue;
+            }
+        }
+
+        // only this worker modifies the children of task->node, so no locking is required here
+        BTreeNode *node = db_scan_entry_new_node(worker->arena, dent->d_name, &info);
+        btree_node_prepend(task->node, node);
+        worker->num_items++;
+        num_entries++;
+        if (info.is_dir && !db_scan_folder_is_virtual(ctx->db, path->str)) {
+            // the pool runs the newest tasks of a worker first, so every worker walks its part depth first
+            DatabaseWalkDevice *device = db_walk_get_folder_device(ctx, task->device, path->str, &info);
+            db_walk_push_task(ctx, db_walk_task_new(ctx, node, path->str, device));
+        }
+    }
+
+    db_dir_reader_close(&dir);
+    fsearch_stats_add(FSEARCH_STATS_SCAN_ENTRIES, num_entries);
+    fsearch_stats_add(FSEARCH_STATS_SCAN_FOLDERS, 1);
+    fsearch_stats_add(FSEARCH_STATS_SCAN_STAT_CALLS, num_stat_calls);
+}
+
+static void
+db_walk_task_run(gpointer data) {
+    DatabaseWalkTask *task = data;
+    DatabaseParallelWalkContext *ctx = task->ctx;
+    DatabaseWalkWorker *worker = &ctx->workers[fsearch_thread_pool_get_thread_index(ctx->pool)];
+    db_walk_worker_scan_dir(worker, task);
+    if (task->device) {
+        db_walk_device_task_done(ctx, task->device);
+    }
+    db_walk_task_free(task);
+}
+
+static int
+db_location_walk_tree_parallel(DatabaseParallelWalkContext *ctx, FsearchThreadPool *pool, const char *path) {
+    // tasks only run on the workers, the last slot is there for completeness
+    const uint32_t num_workers = fsearch_thread_pool_get_num_threads(pool) + 1;
+
+    ctx->pool = pool;
+    ctx->num_workers = num_workers;
+    ctx->workers = g_new0(DatabaseWalkWorker, num_workers);
+    g_mutex_init(&ctx->timer_mutex);
+
+    for (uint32_t i = 0; i < num_workers; i++) {
+        DatabaseWalkWorker *worker = &ctx->workers[i];
+        worker->path = g_string_new(NULL);
+        worker->dents = malloc(DATABASE_SCAN_DENTS_BUFFER_SIZE);
+        assert(worker->dents != NULL);
+        worker->arena = btree_node_arena_new();
+    }
+
+    ctx->num_devices = db_mount_table_get_num_devices(ctx->db->mounts);
+    ctx->devices = g_new0(DatabaseWalkDevice, MAX(ctx->num_devices, 1));
+    g_mutex_init(&ctx->devices_mutex);
+    for (uint32_t i = 0; i < db_mount_table_get_num_mounts(ctx->db->mounts); i++) {
+        const DatabaseMount *mount = db_mount_table_get_mount(ctx->db->mounts, i);
+        if (mount->is_remote) {
+            ctx->devices[mount->device_idx].max_running = MAX(1, (num_workers - 1) / DATABASE_SCAN_REMOTE_DEVICE_SHARE);
+        }
+    }
+    const DatabaseMount *root_mount = db_mount_table_find(ctx->db->mounts, path);
+    DatabaseWalkDevice *root_device = root_mount ? db_walk_get_device(ctx, root_mount) : NULL;
+
+    // every directory is a task, it's done once all of them are
+    ctx->group = fsearch_task_group_new(pool);
+    db_walk_push_task(ctx, db_walk_task_new(ctx, ctx->root, path, root_device));
+    fsearch_task_group_free(ctx->group);
+    ctx->group = NULL;
+
+    uint32_t num_items = 0;
+    for (uint32_t i = 0; i < num_workers; i++) {
+        DatabaseWalkWorker *worker = &ctx->workers[i];
+        num_items += worker->num_items;
+        g_string_free(worker->path, TRUE);
+        free(worker->dents);
+        btree_node_arena_merge(ctx->db_node->arena, worker->arena);
+        btree_node_arena_free(worker->arena);
+    }
+    g_free(ctx->workers);
+    ctx->workers = NULL;
+    g_free(ctx->devices);
+    ctx->devices = NULL;
+    g_mutex_clear(&ctx->devices_mutex);
+
+    g_mutex_clear(&ctx->timer_mutex);
+
+    trace("[database_scan] %d workers found %d entries\n", num_workers - 1, num_items);
+    ctx->db_node->num_items += num_items;
+
+    if (*ctx->cancel == true) {
+        return WALK_CANCEL;
+    }
+    if (ctx->root_failed) {
+        return WALK_BADIO;
+    }
+    return WALK_OK;
+}
+
+static void
+db_location_free(FsearchDatabaseNode *location) {
+    assert(location != NULL);
+    if (!g_atomic_int_dec_and_test(&location->ref_count)) {
+        return;
+    }
+
+    db_shard_unref(location->shard);
+    location->shard = NULL;
+    g_hash_table_destroy(location->link_targets);
+    location->link_targets = NULL;
+    free(location->real_path);
+    location->real_path = NULL;
+    g_mutex_clear(&location->link_targets_mutex);
+    // all nodes live in the arena, no need to walk the tree
+    location->entries = NULL;
+    if (location->arena) {
+        btree_node_arena_free(location->arena);
+        location->arena = NULL;
+    }
+    if (location->shared_arena) {
+        btree_node_arena_free(location->shared_arena);
+        location->shared_arena = NULL;
+    }
+    g_free(location->location_name);
+    location->location_name = NULL;
+    g_free(location);
+    location = NULL;
+}
+
+static FsearchDatabaseNode *
+db_location_build_tree(FsearchDatabase *db,
+                       const char *dname,
+                       FsearchThreadPool *pool,
+                       bool *cancel,
+                       void (*callback)(const char *)) {
+    const char *root_name = NULL;
+    if (!strcmp(dname, "/")) {
+        root_name = "";
+    }
+    else {
+        root_name = dname;
+    }
+    FsearchDatabaseNode *location = db_location_new();
+    BTreeNode *root = btree_node_arena_alloc(location->arena, root_name, 0, 0, 0, true);
+    location->entries = root;
+    location->scan_started = time(NULL);
+
+    GTimer *timer = g_timer_new();
+    GString *path = NULL;
+    if (!strcmp(dname, "/")) {
+        path = g_string_new(NULL);
+    }
+    else {
+        path = g_string_new(dname);
+    }
+
+    g_timer_start(timer);
+    uint32_t res = WALK_OK;
+    if (pool && fsearch_thread_pool_get_num_threads(pool) > 1) {
+        DatabaseParallelWalkContext walk_context = {
+            .db = db,
+            .db_node = location,
+            .root = root,
+            .timer = timer,
+            .cancel = cancel,
+            .callback = callback,
+            .exclude_hidden = db->flags.exclude_hidden,
+            .names_only = db->flags.names_only,
+            .follow_symlinks = db->flags.follow_symlinks,
+        };
+        res = db_location_walk_tree_parallel(&walk_context, pool, path->str);
+    }
+    else {
+        DatabaseWalkContext walk_context = {
+            .db = db,
+            .db_node = location,
+            .path = path,
+            .timer = timer,
+            .cancel = cancel,
+            .callback = callback,
+            .dents = malloc(DATABASE_SCAN_DENTS_BUFFER_SIZE),
+            .exclude_hidden = db->flags.exclude_hidden,
+            .names_only = db->flags.names_only,
+            .follow_symlinks = db->flags.follow_symlinks,
+        };
+        assert(walk_context.dents != NULL);
+        res = db_location_walk_tree_recursive(&walk_context, root);
+        free(walk_context.dents);
+    }
+
+    g_string_free(path, TRUE);
+    g_timer_destroy(timer);
+    if (res == WALK_OK) {
+        return location;
+    }
+
+    trace("[database_scan] walk error: %d\n", res);
+    db_location_free(location);
+    return NULL;
+}
+
+static FsearchDatabaseNode *
+db_location_new(void) {
+    FsearchDatabaseNode *location = g_new0(FsearchDatabaseNode, 1);
+    location->arena = btree_node_arena_new();
+    location->link_targets = g_hash_table_new_full(db_inode_hash, db_inode_equal, g_free, NULL);
+    g_mutex_init(&location->link_targets_mutex);
+    location->ref_count = 1;
+    return location;
+}
+
+static BTreeNode *
+db_location_copy_node(BTreeNodeArena *arena, BTreeNode *node) {
+    BTreeNode *copy = btree_node_arena_alloc(arena, node->name, node->mtime, node->size, node->pos, node->is_dir);
+    copy->has_metadata = node->has_metadata;
+    copy->split = node->split;
+    // the children keep their order, so the saved order of the location stays valid
+    BTreeNode **link = &copy->children;
+    for (BTreeNode *child = node->children; child; child = child->next) {
+        BTreeNode *child_copy = db_location_copy_node(arena, child);
+        child_copy->parent = copy;
+        *link = child_copy;
+        link = &child_copy->next;
+    }
+    return copy;
+}
+
+static void
+db_location_copy_link_targets(FsearchDatabaseNode *location, FsearchDatabaseNode *other) {
+    GHashTableIter iter;
+    gpointer key = NULL;
+    g_hash_table_iter_init(&iter, other->link_targets);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        DatabaseInode *link_target = g_new(DatabaseInode, 1);
+        *link_target = *(DatabaseInode *)key;
+        g_hash_table_add(location->link_targets, link_target);
+    }
+}
+
+// A private copy of a location which other databases still use, so it can be changed.
+// The shard isn't copied, it has to be built again for the changed entries anyway.
+static FsearchDatabaseNode *
+db_location_copy(FsearchDatabaseNode *location) {
+    assert(location != NULL);
+    assert(location->entries != NULL);
+
+    FsearchDatabaseNode *copy = db_location_new();
+    copy->entries = db_location_copy_node(copy->arena, location->entries);
+    copy->num_items = location->num_items;
+    copy->sorted = location->sorted;
+    copy->scan_started = location->scan_started;
+    copy->real_path = location->real_path ? strdup(location->real_path) : NULL;
+    copy->location_name = g_strdup(location->location_name);
+    copy->root_depth = location->root_depth;
+    db_location_copy_link_targets(copy, location);
+    return copy;
+}
+
+// The node of location at path, NULL if it isn't in there. Split folders are only found at the end
+// of the path, what's below them is in their part.
+static BTreeNode *
+db_location_find_node(FsearchDatabaseNode *location, const char *path) {
+    BTreeNode *folder = location->entries;
+    // the root of "/" has an empty name, the path of its children starts with the separator all the same
+    const size_t root_len = strlen(folder->name);
+    if (strncmp(path, folder->name, root_len) != 0) {
+        return NULL;
+    }
+    const char *name = path + root_len;
+    while (*name) {
+        if (*name != '/') {
+            return NULL;
+        }
+        name++;
+        const size_t name_len = strcspn(name, "/");
+        if (name_len == 0) {
+            continue;
+        }
+        if (folder->split) {
+            return NULL;
+        }
+        BTreeNode *child = folder->children;
+        while (child && !(child->is_dir && !strncmp(child->name, name, name_len) && child->name[name_len] == '\0')) {
+            child = child->next;
+        }
+        if (!child) {
+            return NULL;
+        }
+        folder = child;
+        name += name_len;
+    }
+    return folder;
+}
+
+// The folder of location at path, NULL if it isn't in there or in a part
+static BTreeNode *
+db_location_find_folder(FsearchDatabaseNode *location, const char *path) {
+    BTreeNode *folder = db_location_find_node(location, path);
+    return folder && !folder->split ? folder : NULL;
+}
+
+// the root name of the location which location is a part of, or of location itself
+static const char *
+db_location_get_name(FsearchDatabaseNode *location) {
+    return location->location_name ? location->location_name : location->entries->name;
+}
+
+// The split folder part was split off from, NULL if it's gone. It's in the location of part or in
+// the one of its other parts whose root is the longest prefix of its path, among the first
+// num_locations of locations. parent is set to the index of the one it's in.
+static BTreeNode *
+db_part_find_folder(FsearchDatabaseNode **locations,
+                    uint32_t num_locations,
+                    FsearchDatabaseNode *part,
+                    uint32_t *parent) {
+    const char *path = part->entries->name;
+    uint32_t found = UINT32_MAX;
+    size_t found_len = 0;
+    for (uint32_t i = 0; i < num_locations; i++) {
+        FsearchDatabaseNode *location = locations[i];
+        if (strcmp(db_location_get_name(location), part->location_name) != 0) {
+            continue;
+        }
+        const char *root_name = location->entries->name;
+        const size_t len = strlen(root_name);
+        if (!location->location_name) {
+            if (found == UINT32_MAX) {
+                found = i;
+            }
+        }
+        else if (len > found_len && !strncmp(path, root_name, len) && path[len] == '/') {
+            found = i;
+            found_len = len;
+        }
+    }
+    if (found == UINT32_MAX) {
+        return NULL;
+    }
+    BTreeNode *folder = db_location_find_node(locations[found], path);
+    if (!folder || !folder->split) {
+        return NULL;
+    }
+    *parent = found;
+    return folder;
+}
+
+// Locations with more entries than that are split into parts, see FsearchDatabaseNode. The largest
+// folders with at least the minimum of entries below them are split off until the rest fits.
+#define DATABASE_PART_MAX_ENTRIES (1 << 17)
+#define DATABASE_PART_MIN_ENTRIES (1 << 14)
+
+typedef struct {
+    BTreeNode *folder;
+    uint32_t num_entries;
+} DatabaseSplitFolder;
+
+typedef struct {
+    FsearchDatabaseNode *location;
+    // the subfolders of the folders on the way down, with the entries which are still below them
+    GArray *folders;
+    GList *parts;
+} DatabaseSplitContext;
+
+static int
+db_split_folder_compare(const void *a, const void *b) {
+    const uint32_t num_a = ((const DatabaseSplitFolder *)a)->num_entries;
+    const uint32_t num_b = ((const DatabaseSplitFolder *)b)->num_entries;
+    return num_a > num_b ? -1 : num_a < num_b;
+}
+
+static gint
+db_part_compare_path_len(gconstpointer a, gconstpointer b) {
+    const size_t len_a = strlen(((FsearchDatabaseNode *)a)->entries->name);
+    const size_t len_b = strlen(((FsearchDatabaseNode *)b)->entries->name);
+    return len_a < len_b ? -1 : len_a > len_b;
+}
+
+// Moves the entries below folder to a new part, root_depth is the one of its children
+static bool
+db_location_split_off(DatabaseSplitContext *ctx, BTreeNode *folder, uint32_t num_entries, uint32_t root_depth) {
+    char path[PATH_MAX] = "";
+    if (!btree_node_get_path_full(folder, path, sizeof(path))) {
+        return false;
+    }
+    FsearchDatabaseNode *location = ctx->location;
+    FsearchDatabaseNode *part = db_location_new();
+    BTreeNode *root = btree_node_arena_alloc(part->arena, path, folder->mtime, folder->size, 0, true);
+    root->has_metadata = folder->has_metadata;
+    root->children = folder->children;
+    for (BTreeNode *child = root->children; child; child = child->next) {
+        child->parent = root;
+    }
+    folder->children = NULL;
+    folder->split = true;
+
+    part->entries = root;
+    part->num_items = num_entries;
+    part->sorted = location->sorted;
+    part->scan_started = location->scan_started;
+    part->real_path = location->real_path ? strdup(location->real_path) : NULL;
+    part->location_name = g_strdup(db_location_get_name(location));
+    part->root_depth = root_depth;
+    // the nodes which were moved stay where they are
+    part->shared_arena = btree_node_arena_ref(location->arena);
+    db_location_copy_link_targets(part, location);
+    location->num_items -= num_entries;
+    ctx->parts = g_list_prepend(ctx->parts, part);
+    return true;
+}
+
+// Returns the number of entries which stay below folder, depth is the one of its children
+static uint32_t
+db_location_split_folder(DatabaseSplitContext *ctx, BTreeNode *folder, uint32_t depth) {
+    const guint first = ctx->folders->len;
+    uint32_t num_entries = 0;
+    for (BTreeNode *child = folder->children; child; child = child->next) {
+        num_entries++;
+        if (child->is_dir && child->children) {
+            DatabaseSplitFolder subfolder = {child, db_location_split_folder(ctx, child, depth + 1)};
+            num_entries += subfolder.num_entries;
+            g_array_append_val(ctx->folders, subfolder);
+        }
+    }
+    if (num_entries > DATABASE_PART_MAX_ENTRIES) {
+        DatabaseSplitFolder *subfolders = &g_array_index(ctx->folders, DatabaseSplitFolder, first);
+        const guint num_subfolders = ctx->folders->len - first;
+        qsort(subfolders, num_subfolders, sizeof(DatabaseSplitFolder), db_split_folder_compare);
+        for (guint i = 0; i < num_subfolders && num_entries > DATABASE_PART_MAX_ENTRIES; i++) {
+            if (subfolders[i].num_entries < DATABASE_PART_MIN_ENTRIES) {
+                break;
+            }
+            if (db_location_split_off(ctx, subfolders[i].folder, subfolders[i].num_entries, depth + 1)) {
+                num_entries -= subfolders[i].num_entries;
+            }
+        }
+    }
+    g_array_set_size(ctx->folders, first);
+    return num_entries;
+}
+
+// Splits location into parts if it's too large and returns them, every part comes after the one
+// it was split off from. Parts aren't split again, their nodes are in two arenas.
+static GList *
+db_location_split(FsearchDatabaseNode *location) {
+    if (location->num_items <= DATABASE_PART_MAX_ENTRIES || location->shard || location->shared_arena) {
+        return NULL;
+    }
+    assert(g_atomic_int_get(&location->ref_count) == 1);
+
+    DatabaseSplitContext ctx = {
+        .location = location,
+        .folders = g_array_new(FALSE, FALSE, sizeof(DatabaseSplitFolder)),
+    };
+    db_location_split_folder(&ctx, location->entries, location->root_depth);
+    g_array_free(ctx.folders, TRUE);
+    ctx.parts = g_list_sort(ctx.parts, db_part_compare_path_len);
+    trace("[database] split %s into %u parts\n", location->entries->name, g_list_length(ctx.parts));
+    return ctx.parts;
+}
+
+typedef struct {
+    BTreeNode **nodes;
+    uint32_t num_nodes;
+    uint32_t max_nodes;
+} DatabaseNodeCollector;
+
+static bool
+db_location_collect_node(BTreeNode *node, void *data) {
+    DatabaseNodeCollector *collector = data;
+    assert(collector->num_nodes < collector->max_nodes);
+    collector->nodes[collector->num_nodes++] = node;
+    return true;
+}
+
+static void
+db_location_collect_subtree(BTreeNode *node, void *data) {
+    btree_node_traverse(node, db_location_collect_node, data);
+}
+
+static int
+db_sort_compare_nodes(void *a, void *b, void *user_data) {
+    return sort_by_name(&a, &b);
+}
+
+static inline int
+db_sort_compare_items(FsearchSortItem *a, FsearchSortItem *b) {
+    if (a->key != b->key) {
+        return a->key < b->key ? -1 : 1;
+    }
+    return db_sort_compare_nodes(a->data, b->data, NULL);
+}
+
+// merges the sorted runs items[0, mid) and items[mid, num_items)
+static void
+db_sort_merge_items(FsearchSortItem *items, uint32_t mid, uint32_t num_items) {
+    FsearchSortItem *left = malloc(MAX(mid, 1) * sizeof(FsearchSortItem));
+    assert(left != NULL);
+    memcpy(left, items, mid * sizeof(FsearchSortItem));
+
+    uint32_t i = 0;
+    uint32_t j = mid;
+    uint32_t k = 0;
+    while (i < mid && j < num_items) {
+        if (db_sort_compare_items(&items[j], &left[i]) < 0) {
+            items[k++] = items[j++];
+        }
+        else {
+            items[k++] = left[i++];
+        }
+    }
+    while (i < mid) {
+        items[k++] = left[i++];
+    }
+    free(left);
+}
+
+static uint32_t
+db_location_get_sorted_entries(FsearchDatabaseNode *location, FsearchSortItem *items, FsearchThreadPool *pool) {
+    assert(location != NULL);
+    assert(location->entries != NULL);
+
+    DatabaseNodeCollector collector = {0};
+    collector.max_nodes = location->num_items;
+    collector.nodes = malloc(MAX(collector.max_nodes, 1) * sizeof(BTreeNode *));
+    assert(collector.nodes != NULL);
+    btree_node_children_foreach(location->entries, db_location_collect_subtree, &collector);
+
+    const uint32_t num_entries = collector.num_nodes;
+    for (uint32_t i = 0; i < num_entries; i++) {
+        BTreeNode *node = collector.nodes[i];
+        items[i].key = location->sorted ? node->pos : fsearch_sort_get_name_key(node->name, node->is_dir);
+        items[i].data = node;
+    }
+    free(collector.nodes);
+
+    if (location->sorted) {
+        // the positions were saved with the location, restoring the order is linear
+        fsearch_sort_by_rank(items, num_entries);
+        for (uint32_t i = 0; i < num_entries; i++) {
+            BTreeNode *node = items[i].data;
+            items[i].key = fsearch_sort_get_name_key(node->name, node->is_dir);
+        }
+        // nodes added by db_new_with_changed_folders have no position yet and end up behind
+        // all the others, only they need to be sorted
+        uint32_t num_sorted = num_entries;
+        while (num_sorted > 0 && ((BTreeNode *)items[num_sorted - 1].data)->pos == DATABASE_NODE_POS_NEW) {
+            num_sorted--;
+        }
+        if (num_sorted < num_entries) {
+            fsearch_sort(items + num_sorted, num_entries - num_sorted, db_sort_compare_nodes, NULL, pool);
+            db_sort_merge_items(items, num_sorted, num_entries);
+        }
+    }
+    else {
+        fsearch_sort(items, num_entries, db_sort_compare_nodes, NULL, pool);
+    }
+
+    // the shard is built from this order, the entry table links the entries to their parents through pos
+    for (uint32_t i = 0; i < num_entries; i++) {
+        BTreeNode *node = items[i].data;
+        node->pos = i;
+    }
+    location->sorted = true;
+    return num_entries;
+}
+
+static FsearchDatabaseNode *
+db_location_get_for_path(FsearchDatabase *db, const char *path) {
+    assert(db != NULL);
+    assert(path != NULL);
+
+    GList *locations = db->locations;
+    for (GList *l = locations; l != NULL; l = l->next) {
+        FsearchDatabaseNode *location = (FsearchDatabaseNode *)l->data;
+        if (location->location_name) {
+            continue;
+        }
+        BTreeNode *root = btree_node_get_root(location->entries);
+        const char *location_path = root->name;
+        if (!strcmp(location_path, path)) {
+            return location;
+        }
+    }
+    return NULL;
+}
+
+// static bool
+// db_location_remove(FsearchDatabase *db, const char *path) {
+//    assert(db != NULL);
+//    assert(path != NULL);
+//
+//    FsearchDatabaseNode *location = db_location_get_for_path(db, path);
+//    if (location) {
+//        db->locations = g_list_remove(db->locations, location);
+//        db_location_free(location);
+//        db_sort(db);
+//    }
+//
+//    return true;
+//}
+
+static void
+location_build_path(char *path, size_t path_len, const char *location_name) {
+    assert(path != NULL);
+    assert(location_name != NULL);
+
+    const char *location = !strcmp(location_name, "") ? "/" : location_name;
+
+    gchar *path_checksum = g_compute_checksum_for_string(G_CHECKSUM_SHA256, location, -1);
+
+    assert(path_checksum != NULL);
+
+    gchar data_dir[PATH_MAX] = "";
+    db_build_data_dir(data_dir, sizeof(data_dir));
+
+    assert(0 <= snprintf(path, path_len, "%s/database/%s", data_dir, path_checksum));
+    g_free(path_checksum);
+    return;
+}
+
+// static void
+// db_location_delete(FsearchDatabaseNode *location, const char *location_name) {
+//    assert(location != NULL);
+//    assert(location_name != NULL);
+//
+//    gchar database_path[PATH_MAX] = "";
+//    location_build_path(database_path, sizeof(database_path), location_name);
+//
+//    gchar database_file_path[PATH_MAX] = "";
+//    assert(0 <= snprintf(database_file_path, sizeof(database_file_path), "%s/%s", database_path, "database.db"));
+//
+//    g_remove(database_file_path);
+//    g_remove(database_path);
+//}
+
+static bool
+db_save_location(FsearchDatabase *db, const char *location_name) {
+    assert(db != NULL);
+
+    gchar database_path[PATH_MAX] = "";
+    location_build_path(database_path, sizeof(database_path), location_name);
+    trace("[database_save] saving %s to %s\n", location_name, database_path);
+
+    gchar database_fname[PATH_MAX] = "";
+    assert(0 <= snprintf(database_fname, sizeof(database_fname), "%s/database.db", database_path));
+    FsearchDatabaseNode *location = db_location_get_for_path(db, location_name);
+    if (location) {
+        DatabaseJoinContext join;
+        const bool has_parts = db_join_context_init(&join, db, location);
+        db_location_write_to_file(location, has_parts ? &join : NULL, database_path, db->flags.compact_database);
+        db_join_context_clear(&join);
+    }
+
+    return true;
+}
+
+bool
+db_save_locations(FsearchDatabase *db) {
+    assert(db != NULL);
+
+    // db_update_sort_index (db);
+    GList *locations = db->locations;
+    for (GList *l = locations; l != NULL; l = l->next) {
+        FsearchDatabaseNode *location = (FsearchDatabaseNode *)l->data;
+        if (location->location_name) {
+            // parts are saved with their location
+            continue;
+        }
+        BTreeNode *root = btree_node_get_root(location->entries);
+        const char *location_path = root->name;
+        db_save_location(db, location_path);
+    }
+    return true;
+}
+
+// saves run one after the other on a thread of their own
+static GMutex db_save_mutex;
+static GCond db_save_cond;
+static GThreadPool *db_save_pool = NULL;
+static uint32_t db_save_num_pending = 0;
+
+static void
+db_save_thread(gpointer data, gpointer user_data) {
+    FsearchDatabase *db = data;
+    db_save_locations(db);
+    db_unref(db);
+
+    g_mutex_lock(&db_save_mutex);
+    db_save_num_pending--;
+    g_cond_broadcast(&db_save_cond);
+    g_mutex_unlock(&db_save_mutex);
+}
+
+void
+db_save_locations_async(FsearchDatabase *db) {
+    assert(db != NULL);
+
+    db_ref(db);
+    g_mutex_lock(&db_save_mutex);
+    if (!db_save_pool) {
+        db_save_pool = g_thread_pool_new(db_save_thread, NULL, 1, FALSE, NULL);
+    }
+    db_save_num_pending++;
+    g_thread_pool_push(db_save_pool, db, NULL);
+    g_mutex_unlock(&db_save_mutex);
+}
+
+void
+db_save_wait(void) {
+    g_mutex_lock(&db_save_mutex);
+    while (db_save_num_pending > 0) {
+        g_cond_wait(&db_save_cond, &db_save_mutex);
+    }
+    g_mutex_unlock(&db_save_mutex);
+}
+
+static gchar *
+db_location_get_path(const char *location_name) {
+    gchar database_path[PATH_MAX] = "";
+    location_build_path(database_path, sizeof(database_path), location_name);
+
+    gchar database_fname[PATH_MAX] = "";
+    assert(0 <= snprintf(database_fname, sizeof(database_fname), "%s/database.db", database_path));
+
+    return g_strdup(database_fname);
+}
+
+static bool
+db_location_load(FsearchDatabase *db, const char *location_name) {
+    gchar *load_path = db_location_get_path(location_name);
+    if (!load_path) {
+        return false;
+    }
+    FsearchDatabaseNode *location =
+        db_location_load_from_file(load_path, db->flags.parallel ? fsearch_thread_pool_get_default() : NULL);
+    g_free(load_path);
+    load_path = NULL;
+
+    if (location) {
+        db->locations = g_list_append(db->locations, location);
+        db->num_entries += location->num_items;
+        db_update_timestamp(db);
+        return true;
+    }
+    db_update_timestamp(db);
+    return false;
+}
+
+static bool
+db_location_add(FsearchDatabase *db,
+                const char *location_name,
+                FsearchThreadPool *pool,
+                bool *cancel,
+                void (*callback)(const char *)) {
+    assert(db != NULL);
+    trace("[database_scan] scan location: %s\n", location_name);
+
+    FsearchDatabaseNode *location = db_location_build_tree(db, location_name, pool, cancel, callback);
+
+    if (location) {
+        trace("[database_scan] %s scanned with %d entries\n", location_name, location->num_items);
+        db->locations = g_list_append(db->locations, location);
+        db->num_entries += location->num_items;
+        db_update_timestamp(db);
+        return true;
+    }
+
+    db_update_timestamp(db);
+    return false;
+}
+
+static DatabaseShard *
+db_location_build_shard(FsearchDatabaseNode *location,
+                        bool with_trigram_index,
+                        size_t *memory_left,
+                        FsearchThreadPool *pool) {
+    // the pos fields of the nodes are written, no other database may use the location
+    assert(g_atomic_int_get(&location->ref_count) == 1);
+    FsearchSortItem *items = malloc(MAX(location->num_items, 1) * sizeof(FsearchSortItem));
+    assert(items != NULL);
+    const uint32_t num_entries = db_location_get_sorted_entries(location, items, pool);
+    DynamicArray *entries = darray_new(num_entries);
+    for (uint32_t i = 0; i < num_entries; i++) {
+        darray_set_item(entries, items[i].data, i);
+    }
+    free(items);
+    DatabaseShard *shard = db_shard_new(entries, num_entries, with_trigram_index, memory_left);
+    shard->root_depth = location->root_depth;
+    return shard;
+}
+
+static volatile gint db_generation_counter = 0;
+
+// the memory of the nodes of all locations, parts share the arena of their location with it
+static size_t
+db_get_node_bytes(FsearchDatabase *db) {
+    GHashTable *arenas = g_hash_table_new(NULL, NULL);
+    size_t node_bytes = 0;
+    for (GList *l = db->locations; l != NULL; l = l->next) {
+        FsearchDatabaseNode *location = l->data;
+        BTreeNodeArena *location_arenas[] = {location->arena, location->shared_arena};
+        for (uint32_t i = 0; i < G_N_ELEMENTS(location_arenas); i++) {
+            if (location_arenas[i] && !g_hash_table_contains(arenas, location_arenas[i])) {
+                g_hash_table_add(arenas, location_arenas[i]);
+                node_bytes += btree_node_arena_get_size(location_arenas[i]);
+            }
+        }
+    }
+    g_hash_table_destroy(arenas);
+    return node_bytes;
+}
+
+static int
+db_sort_compare_flat_nodes(void *a, void *b, void *user_data) {
+    BTreeNode **nodes = user_data;
+    return sort_by_name(&nodes[GPOINTER_TO_UINT(a)], &nodes[GPOINTER_TO_UINT(b)]);
+}
+
+// Merges the given shards of db, which are sorted runs on their own, into nodes, with the shard of
+// every node in node_shards
+static void
+db_merge_shards(FsearchDatabase *db,
+                const uint32_t *shards,
+                uint32_t num_shards,
+                BTreeNode **nodes,
+                uint32_t *node_shards,
+                FsearchThreadPool *pool) {
+    uint32_t num_items = 0;
+    for (uint32_t s = 0; s < num_shards; s++) {
+        num_items += db->shards[shards[s]]->num_entries;
+    }
+    // the items refer to the nodes by their index in flat_nodes, which tells the shard they're from too
+    BTreeNode **flat_nodes = malloc(MAX(num_items, 1) * sizeof(BTreeNode *));
+    assert(flat_nodes != NULL);
+    FsearchSortItem *items = malloc(MAX(num_items, 1) * sizeof(FsearchSortItem));
+    assert(items != NULL);
+    uint32_t *run_starts = malloc((num_shards + 1) * sizeof(uint32_t));
+    assert(run_starts != NULL);
+
+    uint32_t offset = 0;
+    for (uint32_t s = 0; s < num_shards; s++) {
+        DatabaseShard *shard = db->shards[shards[s]];
+        run_starts[s] = offset;
+        for (uint32_t i = 0; i < shard->num_entries; i++) {
+            BTreeNode *node = darray_get_item(shard->entries, i);
+            flat_nodes[offset] = node;
+            items[offset].key = fsearch_sort_get_name_key(node->name, node->is_dir);
+            items[offset].data = GUINT_TO_POINTER(offset);
+            offset++;
+        }
+    }
+    run_starts[num_shards] = offset;
+    fsearch_sort_merge_runs(items, num_items, run_starts, num_shards, db_sort_compare_flat_nodes, flat_nodes, pool);
+
+    for (uint32_t i = 0; i < num_items; i++) {
+        const uint32_t idx = GPOINTER_TO_UINT(items[i].data);
+        // the last run which starts at or before idx, empty ones start where the next one does
+        uint32_t lo = 0;
+        uint32_t hi = num_shards;
+        while (hi - lo > 1) {
+            const uint32_t mid = lo + (hi - lo) / 2;
+            if (run_starts[mid] <= idx) {
+                lo = mid;
+            }
+            else {
+                hi = mid;
+            }
+        }
+        nodes[i] = flat_nodes[idx];
+        node_shards[i] = shards[lo];
+    }
+    free(run_starts);
+    free(items);
+    free(flat_nodes);
+}
+
+static int
+db_sort_compare_entries(BTreeNode *a, BTreeNode *b) {
+    const uint64_t key_a = fsearch_sort_get_name_key(a->name, a->is_dir);
+    const uint64_t key_b = fsearch_sort_get_name_key(b->name, b->is_dir);
+    if (key_a != key_b) {
+        return key_a < key_b ? -1 : 1;
+    }
+    return sort_by_name(&a, &b);
+}
+
+// The entries list of db is that of previous with the entries of shards previous doesn't have merged
+// into it, if those are at most this share of all entries. Every other list is merged from all shards.
+#define DATABASE_ENTRIES_MERGE_MAX_NEW_SHARE 4
+
+// False if db has too few shards in common with previous
+static bool
+db_merge_shards_into_previous(FsearchDatabase *db,
+                              FsearchDatabase *previous,
+                              uint32_t num_entries,
+                              BTreeNode **nodes,
+                              uint32_t *node_shards,
+                              FsearchThreadPool *pool) {
+    if (!previous || !previous->entries || previous->num_shards == 0) {
+        return false;
+    }
+    // the shard of db which is the same as each one of previous
+    GHashTable *previous_shards = g_hash_table_new(NULL, NULL);
+    for (uint32_t p = 0; p < previous->num_shards; p++) {
+        g_hash_table_insert(previous_shards, previous->shards[p], GUINT_TO_POINTER(p + 1));
+    }
+    uint32_t *kept_shards = malloc(previous->num_shards * sizeof(uint32_t));
+    assert(kept_shards != NULL);
+    memset(kept_shards, 0xff, previous->num_shards * sizeof(uint32_t));
+    uint32_t *new_shards = malloc(MAX(db->num_shards, 1) * sizeof(uint32_t));
+    assert(new_shards != NULL);
+    uint32_t num_new_shards = 0;
+    uint32_t num_new_entries = 0;
+    for (uint32_t s = 0; s < db->num_shards; s++) {
+        const uint32_t p = GPOINTER_TO_UINT(g_hash_table_lookup(previous_shards, db->shards[s]));
+        if (p) {
+            kept_shards[p - 1] = s;
+        }
+        else {
+            new_shards[num_new_shards++] = s;
+            num_new_entries += db->shards[s]->num_entries;
+        }
+    }
+    g_hash_table_destroy(previous_shards);
+    if (num_new_entries > num_entries / DATABASE_ENTRIES_MERGE_MAX_NEW_SHARE) {
+        free(new_shards);
+        free(kept_shards);
+        return false;
+    }
+
+    // the entries of the shards db keeps, in the order of previous
+    const uint32_t num_kept = num_entries - num_new_entries;
+    uint32_t *shard_of_previous = malloc(MAX(previous->num_entries, 1) * sizeof(uint32_t));
+    assert(shard_of_previous != NULL);
+    memset(shard_of_previous, 0xff, previous->num_entries * sizeof(uint32_t));
+    for (uint32_t p = 0; p < previous->num_shards; p++) {
+        if (kept_shards[p] == UINT32_MAX) {
+            continue;
+        }
+        for (uint32_t i = 0; i < previous->shards[p]->num_entries; i++) {
+            shard_of_previous[previous->shard_global_indices[p][i]] = kept_shards[p];
+        }
+    }
+    BTreeNode **kept_nodes = malloc(MAX(num_kept, 1) * sizeof(BTreeNode *));
+    uint32_t *kept_node_shards = malloc(MAX(num_kept, 1) * sizeof(uint32_t));
+    assert(kept_nodes != NULL && kept_node_shards != NULL);
+    uint32_t k = 0;
+    for (uint32_t i = 0; i < previous->num_entries; i++) {
+        if (shard_of_previous[i] != UINT32_MAX) {
+            kept_nodes[k] = darray_get_item(previous->entries, i);
+            kept_node_shards[k] = shard_of_previous[i];
+            k++;
+        }
+    }
+    assert(k == num_kept);
+    free(shard_of_previous);
+
+    BTreeNode **new_nodes = malloc(MAX(num_new_entries, 1) * sizeof(BTreeNode *));
+    uint32_t *new_node_shards = malloc(MAX(num_new_entries, 1) * sizeof(uint32_t));
+    assert(new_nodes != NULL && new_node_shards != NULL);
+    db_merge_shards(db, new_shards, num_new_shards, new_nodes, new_node_shards, pool);
+
+    // every new entry goes behind the kept ones which aren't greater, those in between are copied as they are
+    uint32_t a = 0;
+    uint32_t i = 0;
+    for (uint32_t b = 0; b < num_new_entries; b++) {
+        uint32_t lo = a;
+        uint32_t hi = num_kept;
+        while (lo < hi) {
+            const uint32_t mid = lo + (hi - lo) / 2;
+            if (db_sort_compare_entries(kept_nodes[mid], new_nodes[b]) <= 0) {
+                lo = mid + 1;
+            }
+            else {
+                hi = mid;
+            }
+        }
+        memcpy(nodes + i, kept_nodes + a, (lo - a) * sizeof(BTreeNode *));
+        memcpy(node_shards + i, kept_node_shards + a, (lo - a) * sizeof(uint32_t));
+        i += lo - a;
+        a = lo;
+        nodes[i] = new_nodes[b];
+        node_shards[i] = new_node_shards[b];
+        i++;
+    }
+    memcpy(nodes + i, kept_nodes + a, (num_kept - a) * sizeof(BTreeNode *));
+    memcpy(node_shards + i, kept_node_shards + a, (num_kept - a) * sizeof(uint32_t));
+
+    free(new_node_shards);
+    free(new_nodes);
+    free(kept_node_shards);
+    free(kept_nodes);
+    free(new_shards);
+    free(kept_shards);
+    trace("[database_build_list] merged %u new entries into %u\n", num_new_entries, num_kept);
+    return true;
+}
+
+static void
+db_part_folder_stats_add(FsearchDatabase *db, BTreeNode *folder, const FsearchDatabaseFolderStats *stats) {
+    FsearchDatabaseFolderStats *sum = g_hash_table_lookup(db->part_folder_stats, folder);
+    if (!sum) {
+        sum = g_new0(FsearchDatabaseFolderStats, 1);
+        g_hash_table_insert(db->part_folder_stats, folder, sum);
+    }
+    sum->num_children += stats->num_children;
+    sum->num_files += stats->num_files;
+    sum->total_size += stats->total_size;
+}
+
+static void
+db_shard_get_folder_stats(FsearchDatabase *db, uint32_t shard_idx, uint32_t idx, FsearchDatabaseFolderStats *stats);
+
+// Links the shards of the parts to the split folders they belong to, and adds up what's below
+// those folders
+static void
+db_build_part_info(FsearchDatabase *db, FsearchDatabaseNode **locations) {
+    bool has_parts = false;
+    for (uint32_t s = 0; s < db->num_shards && !has_parts; s++) {
+        has_parts = locations[s]->location_name != NULL;
+    }
+    if (!has_parts) {
+        return;
+    }
+    db->part_parents = malloc(db->num_shards * sizeof(uint32_t));
+    assert(db->part_parents != NULL);
+    db->part_folders = calloc(db->num_shards, sizeof(BTreeNode *));
+    assert(db->part_folders != NULL);
+    db->part_folder_stats = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+    for (uint32_t s = 0; s < db->num_shards; s++) {
+        db->part_parents[s] = UINT32_MAX;
+        if (locations[s]->location_name) {
+            db->part_folders[s] = db_part_find_folder(locations, s, locations[s], &db->part_parents[s]);
+            assert(db->part_folders[s] != NULL);
+        }
+    }
+
+    // parts come after the ones they were split off from, so those below a part are added up before it
+    for (uint32_t s = db->num_shards; s > 0; s--) {
+        const uint32_t part = s - 1;
+        BTreeNode *folder = db->part_folders[part];
+        if (!folder) {
+            continue;
+        }
+        FsearchDatabaseFolderStats total = {0};
+        for (BTreeNode *child = locations[part]->entries->children; child; child = child->next) {
+            total.num_children++;
+            if (child->is_dir) {
+                FsearchDatabaseFolderStats stats = {0};
+                db_shard_get_folder_stats(db, part, child->pos, &stats);
+                total.num_files += stats.num_files;
+                total.total_size += stats.total_size;
+            }
+            else {
+                total.num_files++;
+                total.total_size += MAX(child->size, 0);
+            }
+        }
+        // the folders above it within its shard only get the files below it
+        db_part_folder_stats_add(db, folder, &total);
+        total.num_children = 0;
+        for (BTreeNode *parent = folder->parent; parent && parent->parent; parent = parent->parent) {
+            db_part_folder_stats_add(db, parent, &total);
+        }
+    }
+}
+
+// Builds the entries list of db from the shards of its locations. previous is a database which
+// shares most of them, if there is one.
+static void
+db_build_entries_list(FsearchDatabase *db, FsearchDatabase *previous, FsearchThreadPool *pool) {
+    assert(db != NULL);
+    assert(db->num_entries >= 0);
+
+    db_entries_clear(db);
+    db->generation = (uint32_t)g_atomic_int_add(&db_generation_counter, 1) + 1;
+
+    for (GList *l = db->locations; l != NULL; l = l->next) {
+        FsearchDatabaseNode *location = l->data;
+        if (location->shard && location->shard->with_trigram_index != db->flags.trigram_index) {
+            if (g_atomic_int_get(&location->ref_count) > 1) {
+                // the others keep the location and its shard as they are
+                l->data = db_location_copy(location);
+                db_location_free(location);
+                location = l->data;
+            }
+            else {
+                db_shard_unref(location->shard);
+                location->shard = NULL;
+            }
+        }
+        // the parts go right behind the location, they're small enough already
+        GList *parts = db_location_split(location);
+        for (GList *p = g_list_last(parts); p != NULL; p = p->prev) {
+            db->locations = g_list_insert_before(db->locations, l->next, p->data);
+        }
+        g_list_free(parts);
+    }
+
+    // only the shards of locations which changed since they were built are built again
+    const uint32_t num_runs = g_list_length(db->locations);
+    db->num_shards = num_runs;
+    db->shards = calloc(MAX(num_runs, 1), sizeof(DatabaseShard *));
+    assert(db->shards != NULL);
+    db->shard_global_indices = calloc(MAX(num_runs, 1), sizeof(uint32_t *));
+    assert(db->shard_global_indices != NULL);
+    FsearchDatabaseNode **locations = calloc(MAX(num_runs, 1), sizeof(FsearchDatabaseNode *));
+    assert(locations != NULL);
+
+    // with a budget the nodes come first, the shards get what's left of it in the order of the locations
+    size_t memory_left = db->flags.memory_budget;
+    if (db->flags.memory_budget) {
+        memory_left -= MIN(db_get_node_bytes(db), memory_left);
+    }
+
+    uint32_t num_entries = 0;
+    uint32_t num_shards_built = 0;
+    uint32_t run = 0;
+    for (GList *l = db->locations; l != NULL; l = l->next, run++) {
+        FsearchDatabaseNode *location = l->data;
+        if (!location->shard) {
+            location->shard = db_location_build_shard(location,
+                                                      db->flags.trigram_index,
+                                                      db->flags.memory_budget ? &memory_left : NULL,
+                                                      pool);
+            num_shards_built++;
+        }
+        else if (db->flags.memory_budget) {
+            memory_left -= MIN(location->shard->size, memory_left);
+        }
+        DatabaseShard *shard = db_shard_ref(location->shard);
+        db->shards[run] = shard;
+        db->shard_global_indices[run] = malloc(MAX(shard->num_entries, 1) * sizeof(uint32_t));
+        assert(db->shard_global_indices[run] != NULL);
+        locations[run] = location;
+        num_entries += shard->num_entries;
+    }
+    trace("[database_build_list] create list for %d entries, %u of %u shards built\n",
+          num_entries,
+          num_shards_built,
+          num_runs);
+    db->entries = darray_new(num_entries);
+
+    BTreeNode **nodes = malloc(MAX(num_entries, 1) * sizeof(BTreeNode *));
+    assert(nodes != NULL);
+    uint32_t *node_shards = malloc(MAX(num_entries, 1) * sizeof(uint32_t));
+    assert(node_shards != NULL);
+    if (!db_merge_shards_into_previous(db, previous, num_entries, nodes, node_shards, pool)) {
+        // every shard is a sorted run on its own, merge them
+        uint32_t *shards = malloc(MAX(num_runs, 1) * sizeof(uint32_t));
+        assert(shards != NULL);
+        for (run = 0; run < num_runs; run++) {
+            shards[run] = run;
+        }
+        db_merge_shards(db, shards, num_runs, nodes, node_shards, pool);
+        free(shards);
+    }
+
+    // The shards keep their order in the merged list, so every entry is the next one of its shard.
+    // Shards are shared with other databases, so the global indices are kept with db.
+    uint32_t *next_in_run = calloc(MAX(num_runs, 1), sizeof(uint32_t));
+    assert(next_in_run != NULL);
+    for (uint32_t i = 0; i < num_entries; i++) {
+        darray_set_item(db->entries, nodes[i], i);
+        run = node_shards[i];
+        db->shard_global_indices[run][next_in_run[run]++] = i;
+    }
+    db->num_entries = num_entries;
+    free(next_in_run);
+    free(node_shards);
+    free(nodes);
+
+    db_build_part_info(db, locations);
+    free(locations);
+    db_build_sort_ranks(db, pool);
+    if (fsearch_stats_is_enabled()) {
+        fsearch_stats_set(FSEARCH_STATS_DB_ENTRIES, db->num_entries);
+        fsearch_stats_set(FSEARCH_STATS_DB_NODE_BYTES, db_get_node_bytes(db));
+    }
+    trace("[database_build_list] list created\n");
+}
+
+// static BTreeNode *
+// db_location_get_entries(FsearchDatabaseNode *location) {
+//    assert(location != NULL);
+//    return location->entries;
+//}
+
+FsearchDatabase *
+db_new(GList *includes, GList *excludes, char **exclude_files, FsearchDatabaseScanFlags flags) {
+    FsearchDatabase *db = g_new0(FsearchDatabase, 1);
+    g_mutex_init(&db->mutex);
+    g_mutex_init(&db->entry_metadata_mutex);
+    if (includes) {
+        db->includes = g_list_copy_deep(includes, (GCopyFunc)fsearch_include_path_copy, NULL);
+    }
+    if (excludes) {
+        db->excludes = g_list_copy_deep(excludes, (GCopyFunc)fsearch_exclude_path_copy, NULL);
+    }
+    if (exclude_files) {
+        db->exclude_files = g_strdupv(exclude_files);
+    }
+    db->exclude_matcher = fsearch_exclude_matcher_new(db->excludes, db->exclude_files);
+    db->mounts = db_mount_table_new();
+    db->flags = flags;
+    db->ref_count = 1;
+    return db;
+}
+
+typedef struct {
+    FsearchDatabase *db;
+    FsearchDatabaseNode *location;
+    // the database with the parts of location, whose folders are gone with their split folder
+    FsearchDatabase *previous;
+    // folders removed so far, their descendants don't need to be updated anymore
+    GHashTable *removed_folders;
+    FsearchDatabaseFolderFunc folder_added;
+    FsearchDatabaseFolderFunc folder_removed;
+    void *user_data;
+} DatabaseFolderUpdateContext;
+
+static bool
+db_folder_update_add_node(BTreeNode *node, void *data) {
+    DatabaseFolderUpdateContext *ctx = data;
+    node->pos = DATABASE_NODE_POS_NEW;
+    if (node->is_dir && ctx->folder_added) {
+        ctx->folder_added(node, ctx->user_data);
+    }
+    return true;
+}
+
+static void
+db_folder_update_remove_part(DatabaseFolderUpdateContext *ctx, BTreeNode *folder);
+
+static void
+db_folder_update_remove_part_folders(DatabaseFolderUpdateContext *ctx, BTreeNode *folder) {
+    for (BTreeNode *child = folder->children; child; child = child->next) {
+        if (!child->is_dir) {
+            continue;
+        }
+        ctx->folder_removed(child, ctx->user_data);
+        if (child->split) {
+            db_folder_update_remove_part(ctx, child);
+        }
+        else {
+            db_folder_update_remove_part_folders(ctx, child);
+        }
+    }
+}
+
+// The folders of the part of a removed split folder are gone too, the part is dropped once the
+// database is built
+static void
+db_folder_update_remove_part(DatabaseFolderUpdateContext *ctx, BTreeNode *folder) {
+    char path[PATH_MAX] = "";
+    if (!ctx->previous || !btree_node_get_path_full(folder, path, sizeof(path))) {
+        return;
+    }
+    const char *location_name = db_location_get_name(ctx->location);
+    for (GList *l = ctx->previous->locations; l != NULL; l = l->next) {
+        FsearchDatabaseNode *part = l->data;
+        if (part->location_name && !strcmp(part->location_name, location_name) && !strcmp(part->entries->name, path)) {
+            db_folder_update_remove_part_folders(ctx, part->entries);
+            return;
+        }
+    }
+}
+
+static bool
+db_folder_update_remove_node(BTreeNode *node, void *data) {
+    DatabaseFolderUpdateContext *ctx = data;
+    ctx->location->num_items--;
+    if (node->is_dir) {
+        g_hash_table_add(ctx->removed_folders, node);
+        if (ctx->folder_removed) {
+            ctx->folder_removed(node, ctx->user_data);
+            if (node->split) {
+                db_folder_update_remove_part(ctx, node);
+            }
+        }
+    }
+    return true;
+}
+
+static bool
+db_folder_update_is_removed(DatabaseFolderUpdateContext *ctx, BTreeNode *folder) {
+    for (BTreeNode *node = folder; node; node = node->parent) {
+        if (g_hash_table_contains(ctx->removed_folders, node)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Brings the children of folder in line with what's on disk. Removed nodes stay in the arena
+// until the location is freed.
+static void
+db_folder_update(DatabaseFolderUpdateContext *ctx, BTreeNode *folder) {
+    char path[PATH_MAX] = "";
+    if (!btree_node_get_path_full(folder, path, sizeof(path))) {
+        return;
+    }
+    if (!btree_node_is_root(folder) && db_scan_folder_is_virtual(ctx->db, path)) {
+        return;
+    }
+    char *dents = malloc(DATABASE_SCAN_DENTS_BUFFER_SIZE);
+    assert(dents != NULL);
+    DatabaseDirReader dir;
+    if (!db_dir_reader_open(&dir, path, dents)) {
+        free(dents);
+        // it's gone too, that's up to the update of its parent
+        trace("[database_update] failed to open folder: %s\n", path);
+        return;
+    }
+
+    const bool exclude_hidden = ctx->db->flags.exclude_hidden;
+    const bool names_only = ctx->db->flags.names_only;
+    const bool follow_symlinks = ctx->db->flags.follow_symlinks;
+    struct stat st;
+    if (!fstat(dir.fd, &st)) {
+        // changes of the children change the folder too, and incremental scans
+        // need its mtime even without metadata of the other entries
+        folder->size = st.st_size;
+        folder->mtime = st.st_mtime;
+        folder->has_metadata = true;
+    }
+
+    // the children which aren't found on disk remain in here
+    GHashTable *old_children = g_hash_table_new(g_str_hash, g_str_equal);
+    for (BTreeNode *child = folder->children; child; child = child->next) {
+        g_hash_table_insert(old_children, child->name, child);
+    }
+    GPtrArray *new_children = g_ptr_array_new();
+
+    // the walker appends the name of every folder it enters to the path
+    GString *child_path = g_string_new(btree_node_is_root(folder) && !strcmp(path, "/") ? "" : path);
+    const gsize child_path_len = child_path->len;
+
+    DatabaseDirent *dent = NULL;
+    while ((dent = db_dir_reader_next(&dir))) {
+        if (exclude_hidden && dent->d_name[0] == '.') {
+            continue;
+        }
+        if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, "..")) {
+            continue;
+        }
+        if (fsearch_exclude_matcher_file_is_excluded(ctx->db->exclude_matcher, dent->d_name)) {
+            continue;
+        }
+
+        DatabaseEntryInfo info = {0};
+        if (!db_scan_entry_get_info(dir.fd, dent->d_name, dent->d_type, names_only, follow_symlinks, &info)) {
+            continue;
+        }
+        BTreeNode *child = g_hash_table_lookup(old_children, dent->d_name);
+        if (info.is_dir) {
+            g_string_truncate(child_path, child_path_len);
+            g_string_append_c(child_path, '/');
+            g_string_append(child_path, dent->d_name);
+            if (!(child && child->is_dir)) {
+                // a link which was entered before still has its folder claimed
+                db_scan_entry_claim_link(ctx->db, ctx->location, child_path->str, &info);
+            }
+            if (info.is_dir
+                && fsearch_exclude_matcher_directory_is_excluded(ctx->db->exclude_matcher, child_path->str)) {
+                continue;
+            }
+        }
+
+        if (child && child->is_dir == info.is_dir) {
+            if (info.has_metadata) {
+                child->size = info.size;
+                child->mtime = info.mtime;
+                child->has_metadata = true;
+            }
+            g_hash_table_remove(old_children, dent->d_name);
+            continue;
+        }
+
+        BTreeNode *node = db_scan_entry_new_node(ctx->location->arena, dent->d_name, &info);
+        ctx->location->num_items++;
+        g_ptr_array_add(new_children, node);
+    }
+    db_dir_reader_close(&dir);
+
+    // the new folders are walked once this one is closed, so they can use the same buffer
+    GTimer *timer = g_timer_new();
+    bool cancel = false;
+    for (uint32_t i = 0; i < new_children->len; i++) {
+        BTreeNode *node = g_ptr_array_index(new_children, i);
+        if (!node->is_dir) {
+            continue;
+        }
+        g_string_truncate(child_path, child_path_len);
+        g_string_append_c(child_path, '/');
+        g_string_append(child_path, node->name);
+        DatabaseWalkContext walk_context = {
+            .db = ctx->db,
+            .db_node = ctx->location,
+            .path = child_path,
+            .timer = timer,
+            .cancel = &cancel,
+            .callback = NULL,
+            .dents = dents,
+            .exclude_hidden = exclude_hidden,
+            .names_only = names_only,
+            .follow_symlinks = follow_symlinks,
+        };
+        if (!db_scan_folder_is_virtual(ctx->db, child_path->str)) {
+            db_location_walk_tree_recursive(&walk_context, node);
+        }
+    }
+    g_string_free(child_path, TRUE);
+    g_timer_destroy(timer);
+    free(dents);
+
+    // The old children go first: a folder replaced by a new one of the same name has the same path,
+    // so folder_removed has to see the old node before folder_added sees the new one. The order of
+    // the remaining children is kept.
+    BTreeNode **link = &folder->children;
+    BTreeNode *child = folder->children;
+    while (child) {
+        BTreeNode *next = child->next;
+        if (g_hash_table_lookup(old_children, child->name) == child) {
+            btree_node_traverse(child, db_folder_update_remove_node, ctx);
+        }
+        else {
+            *link = child;
+            link = &child->next;
+        }
+        child = next;
+    }
+    *link = NULL;
+    g_hash_table_destroy(old_children);
+
+    for (uint32_t i = 0; i < new_children->len; i++) {
+        BTreeNode *node = g_ptr_array_index(new_children, i);
+        btree_node_prepend(folder, node);
+        btree_node_traverse(node, db_folder_update_add_node, ctx);
+    }
+    g_ptr_array_free(new_children, TRUE);
+}
+
+static gint
+db_folder_compare_depth(gconstpointer a, gconstpointer b) {
+    const uint32_t depth_a = btree_node_depth(*(BTreeNode **)a);
+    const uint32_t depth_b = btree_node_depth(*(BTreeNode **)b);
+    return depth_a < depth_b ? -1 : depth_a > depth_b;
+}
+
+// Updates the given folders of location, which must be a location of db which no other database uses.
+// previous has the parts of location, if it has any. False if that was cancelled.
+static bool
+db_update_folders(FsearchDatabase *db,
+                  FsearchDatabaseNode *location,
+                  FsearchDatabase *previous,
+                  GPtrArray *folders,
+                  bool *cancel,
+                  FsearchDatabaseFolderFunc folder_added,
+                  FsearchDatabaseFolderFunc folder_removed,
+                  void *user_data) {
+    assert(g_atomic_int_get(&location->ref_count) == 1);
+    assert(location->shard == NULL);
+
+    // parents first, so the descendants of removed folders can be skipped
+    g_ptr_array_sort(folders, db_folder_compare_depth);
+
+    DatabaseFolderUpdateContext ctx = {
+        .db = db,
+        .location = location,
+        .previous = previous,
+        .removed_folders = g_hash_table_new(NULL, NULL),
+        .folder_added = folder_added,
+        .folder_removed = folder_removed,
+        .user_data = user_data,
+    };
+    bool res = true;
+    for (uint32_t i = 0; i < folders->len; i++) {
+        if (cancel && *cancel) {
+            res = false;
+            break;
+        }
+        BTreeNode *folder = g_ptr_array_index(folders, i);
+        if (!db_folder_update_is_removed(&ctx, folder)) {
+            db_folder_update(&ctx, folder);
+        }
+    }
+    g_hash_table_destroy(ctx.removed_folders);
+    ctx.removed_folders = NULL;
+    return res;
+}
+
+FsearchDatabase *
+db_new_with_changed_folders(FsearchDatabase *db,
+                            GPtrArray *paths,
+                            FsearchDatabaseFolderFunc folder_added,
+                            FsearchDatabaseFolderFunc folder_removed,
+                            void *user_data) {
+    assert(db != NULL);
+    assert(paths != NULL);
+
+    FsearchDatabase *new_db = db_new(db->includes, db->excludes, db->exclude_files, db->flags);
+    // the locations of new_db so far, and which of them are copies
+    GPtrArray *locations = g_ptr_array_new();
+    GHashTable *copies = g_hash_table_new(NULL, NULL);
+    for (GList *l = db->locations; l != NULL; l = l->next) {
+        FsearchDatabaseNode *location = l->data;
+        BTreeNode *split_folder = NULL;
+        uint32_t parent = 0;
+        if (location->location_name) {
+            split_folder = db_part_find_folder((FsearchDatabaseNode **)locations->pdata, locations->len, location, &parent);
+            if (!split_folder) {
+                // the folder it was split off from is gone, its folders were reported as removed with it
+                continue;
+            }
+        }
+        bool changed = false;
+        for (uint32_t i = 0; i < paths->len && !changed; i++) {
+            changed = db_location_find_node(location, g_ptr_array_index(paths, i)) != NULL;
+        }
+        if (!changed) {
+            // it's shared together with its shard
+            g_atomic_int_inc(&location->ref_count);
+            new_db->locations = g_list_append(new_db->locations, location);
+            g_ptr_array_add(locations, location);
+            continue;
+        }
+
+        // db might still be searched or saved, so the changes are made to a copy of the location. Other
+        // locations and parts are shared, only this one's shard is built again.
+        FsearchDatabaseNode *copy = db_location_copy(location);
+        new_db->locations = g_list_append(new_db->locations, copy);
+        g_ptr_array_add(locations, copy);
+        g_hash_table_add(copies, copy);
+        GPtrArray *folders = g_ptr_array_new();
+        for (uint32_t i = 0; i < paths->len; i++) {
+            BTreeNode *folder = db_location_find_folder(copy, g_ptr_array_index(paths, i));
+            if (folder) {
+                g_ptr_array_add(folders, folder);
+            }
+        }
+        db_update_folders(new_db, copy, db, folders, NULL, folder_added, folder_removed, user_data);
+        g_ptr_array_free(folders, TRUE);
+        folders = NULL;
+
+        if (split_folder && g_hash_table_contains(copies, g_ptr_array_index(locations, parent))) {
+            // the split folder of a copy reports what the root of its part knows now
+            split_folder->size = copy->entries->size;
+            split_folder->mtime = copy->entries->mtime;
+            split_folder->has_metadata = copy->entries->has_metadata;
+        }
+    }
+    g_hash_table_destroy(copies);
+    g_ptr_array_free(locations, TRUE);
+
+    // most shards are those of db, the entries of the others are merged into its list
+    db_build_entries_list(new_db, db, fsearch_thread_pool_get_default());
+    db_update_timestamp(new_db);
+    trace("[database_update] updated %u folders, %u entries\n", paths->len, new_db->num_entries);
+    return new_db;
+}
+
+bool
+db_has_folder(FsearchDatabase *db, const char *path) {
+    assert(db != NULL);
+    assert(path != NULL);
+
+    for (GList *l = db->locations; l != NULL; l = l->next) {
+        if (db_location_find_folder(l->data, path)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+db_foreach_folder(FsearchDatabase *db, FsearchDatabaseFolderFunc func, void *user_data) {
+    assert(db != NULL);
+    assert(func != NULL);
+
+    for (GList *l = db->locations; l != NULL; l = l->next) {
+        FsearchDatabaseNode *location = l->data;
+        if (!location->location_name) {
+            // the roots of parts are their split folders, which are entries
+            func(location->entries, user_data);
+        }
+    }
+    for (uint32_t i = 0; i < db->num_entries; i++) {
+        BTreeNode *node = darray_get_item(db->entries, i);
+        if (node->is_dir) {
+            func(node, user_data);
+        }
+    }
+}
 
-    btree_node_children_foreach(location->entries, db_traverse_tree_add, db);
+static void
+db_entries_clear(FsearchDatabase *db) {
+    // free entries
+    assert(db != NULL);
+
+    for (uint32_t i = 0; i < db->num_shards; i++) {
+        db_shard_unref(db->shards[i]);
+        free(db->shard_global_indices[i]);
+    }
+    free(db->shards);
+    db->shards = NULL;
+    free(db->shard_global_indices);
+    db->shard_global_indices = NULL;
+    db->num_shards = 0;
+    free(db->part_parents);
+    db->part_parents = NULL;
+    free(db->part_folders);
+    db->part_folders = NULL;
+    if (db->part_folder_stats) {
+        g_hash_table_destroy(db->part_folder_stats);
+        db->part_folder_stats = NULL;
+    }
+    for (uint32_t i = 0; i < NUM_DATABASE_SORT_TYPES; i++) {
+        if (db->sort_ranks[i]) {
+            free(db->sort_ranks[i]);
+            db->sort_ranks[i] = NULL;
+        }
+    }
+    if (db->entry_metadata) {
+        g_hash_table_destroy(db->entry_metadata);
+        db->entry_metadata = NULL;
+    }
+    if (db->entries) {
+        darray_free(db->entries);
+        db->entries = NULL;
+    }
+    db->num_entries = 0;
+}
+
+static void
+db_location_free_all(FsearchDatabase *db) {
+    assert(db != NULL);
+    if (!db->locations) {
+        return;
+    }
+
+    trace("[database_location_free_all] freeing...\n");
+    GList *l = db->locations;
+    while (l) {
+        db_location_free(l->data);
+        l = l->next;
+    }
+    g_list_free(db->locations);
+    db->locations = NULL;
+    trace("[database_location_free_all] freed\n");
 }
 
-static FsearchDatabaseNode *
-db_location_get_for_path(FsearchDatabase *db, const char *path) {
+static void
+db_free(FsearchDatabase *db) {
     assert(db != NULL);
-    assert(path != NULL);
 
-    GList *locations = db->locations;
-    for (GList *l = locations; l != NULL; l = l->next) {
-        FsearchDatabaseNode *location = (FsearchDatabaseNode *)l->data;
-        BTreeNode *root = btree_node_get_root(location->entries);
-        const char *location_path = root->name;
-        if (!strcmp(location_path, path)) {
-            return location;
-        }
+    trace("[database_free] freeing...\n");
+    db_lock(db);
+    if (db->ref_count > 0) {
+        trace("[database_free] pending references on free: %d\n", db->ref_count);
     }
-    return NULL;
-}
+    db_entries_clear(db);
+    db_location_free_all(db);
 
-// static bool
-// db_location_remove(FsearchDatabase *db, const char *path) {
-//    assert(db != NULL);
-//    assert(path != NULL);
-//
-//    FsearchDatabaseNode *location = db_location_get_for_path(db, path);
-//    if (location) {
-//        db->locations = g_list_remove(db->locations, location);
-//        db_location_free(location);
-//        db_sort(db);
-//    }
-//
-//    return true;
-//}
+    if (db->includes) {
+        g_list_free_full(db->includes, (GDestroyNotify)fsearch_include_path_free);
+        db->includes = NULL;
+    }
+    if (db->excludes) {
+        g_list_free_full(db->excludes, (GDestroyNotify)fsearch_exclude_path_free);
+        db->excludes = NULL;
+    }
+    if (db->exclude_files) {
+        g_strfreev(db->exclude_files);
+        db->exclude_files = NULL;
+    }
+    if (db->exclude_matcher) {
+        fsearch_exclude_matcher_free(db->exclude_matcher);
+        db->exclude_matcher = NULL;
+    }
+    db_mount_table_free(db->mounts);
+    db->mounts = NULL;
+    db_unlock(db);
 
-static void
-location_build_path(char *path, size_t path_len, const char *location_name) {
-    assert(path != NULL);
-    assert(location_name != NULL);
+    g_mutex_clear(&db->entry_metadata_mutex);
+    g_mutex_clear(&db->mutex);
+    g_free(db);
+    db = NULL;
 
-    const char *location = !strcmp(location_name, "") ? "/" : location_name;
+    malloc_trim(0);
 
-    gchar *path_checksum = g_compute_checksum_for_string(G_CHECKSUM_SHA256, location, -1);
+    trace("[database_free] freed\n");
+    return;
+}
 
-    assert(path_checksum != NULL);
+time_t
+db_get_timestamp(FsearchDatabase *db) {
+    assert(db != NULL);
+    return db->timestamp;
+}
 
-    gchar data_dir[PATH_MAX] = "";
-    db_build_data_dir(data_dir, sizeof(data_dir));
+uint32_t
+db_get_num_entries(FsearchDatabase *db) {
+    assert(db != NULL);
+    return db->num_entries;
+}
 
-    assert(0 <= snprintf(path, path_len, "%s/database/%s", data_dir, path_checksum));
-    g_free(path_checksum);
-    return;
+void
+db_unlock(FsearchDatabase *db) {
+    assert(db != NULL);
+    g_mutex_unlock(&db->mutex);
 }
 
-// static void
-// db_location_delete(FsearchDatabaseNode *location, const char *location_name) {
-//    assert(location != NULL);
-//    assert(location_name != NULL);
-//
-//    gchar database_path[PATH_MAX] = "";
-//    location_build_path(database_path, sizeof(database_path), location_name);
-//
-//    gchar database_file_path[PATH_MAX] = "";
-//    assert(0 <= snprintf(database_file_path, sizeof(database_file_path), "%s/%s", database_path, "database.db"));
-//
-//    g_remove(database_file_path);
-//    g_remove(database_path);
-//}
+void
+db_lock(FsearchDatabase *db) {
+    assert(db != NULL);
+    g_mutex_lock(&db->mutex);
+}
 
-static bool
-db_save_location(FsearchDatabase *db, const char *location_name) {
+bool
+db_try_lock(FsearchDatabase *db) {
     assert(db != NULL);
+    return g_mutex_trylock(&db->mutex);
+}
 
-    gchar database_path[PATH_MAX] = "";
-    location_build_path(database_path, sizeof(database_path), location_name);
-    trace("[database_save] saving %s to %s\n", location_name, database_path);
+DynamicArray *
+db_get_entries(FsearchDatabase *db) {
+    assert(db != NULL);
+    return db->entries;
+}
 
-    gchar database_fname[PATH_MAX] = "";
-    assert(0 <= snprintf(database_fname, sizeof(database_fname), "%s/database.db", database_path));
-    FsearchDatabaseNode *location = db_location_get_for_path(db, location_name);
-    if (location) {
-        db_location_write_to_file(location, database_path);
+uint32_t
+db_get_num_shards(FsearchDatabase *db) {
+    assert(db != NULL);
+    return db->num_shards;
+}
+
+DatabaseShard *
+db_get_shard(FsearchDatabase *db, uint32_t shard_idx, const uint32_t **global_indices) {
+    assert(db != NULL);
+    assert(shard_idx < db->num_shards);
+    if (global_indices) {
+        *global_indices = db->shard_global_indices[shard_idx];
     }
+    return db->shards[shard_idx];
+}
 
-    return true;
+static void
+db_folder_add_stats(BTreeNode *folder, FsearchDatabaseFolderStats *stats) {
+    for (BTreeNode *child = folder->children; child != NULL; child = child->next) {
+        if (child->is_dir) {
+            db_folder_add_stats(child, stats);
+        }
+        else {
+            stats->num_files++;
+            stats->total_size += MAX(child->size, 0);
+        }
+    }
+}
+
+static void
+db_shard_get_folder_stats(FsearchDatabase *db, uint32_t shard_idx, uint32_t idx, FsearchDatabaseFolderStats *stats) {
+    DatabaseShard *shard = db->shards[shard_idx];
+    DatabaseEntryTable *table = shard->entry_table;
+    BTreeNode *folder = darray_get_item(shard->entries, idx);
+    if (table) {
+        stats->num_children = table->num_children[idx];
+        stats->num_files = table->num_files[idx];
+        stats->total_size = table->total_sizes[idx];
+    }
+    else {
+        // only shards whose names don't fit into a table lack one
+        *stats = (FsearchDatabaseFolderStats){.num_children = btree_node_n_children(folder)};
+        db_folder_add_stats(folder, stats);
+    }
+    // the parts below the folder aren't in its shard
+    FsearchDatabaseFolderStats *part_stats =
+        db->part_folder_stats ? g_hash_table_lookup(db->part_folder_stats, folder) : NULL;
+    if (part_stats) {
+        stats->num_children += part_stats->num_children;
+        stats->num_files += part_stats->num_files;
+        stats->total_size += part_stats->total_size;
+    }
 }
 
 bool
-db_save_locations(FsearchDatabase *db) {
+db_get_folder_stats(FsearchDatabase *db, uint32_t idx, FsearchDatabaseFolderStats *stats) {
     assert(db != NULL);
+    assert(stats != NULL);
 
-    // db_update_sort_index (db);
-    GList *locations = db->locations;
-    for (GList *l = locations; l != NULL; l = l->next) {
-        FsearchDatabaseNode *location = (FsearchDatabaseNode *)l->data;
-        BTreeNode *root = btree_node_get_root(location->entries);
-        const char *location_path = root->name;
-        db_save_location(db, location_path);
+    uint32_t shard_idx = 0;
+    uint32_t idx_in_shard = 0;
+    if (!db_get_shard_position(db, idx, &shard_idx, &idx_in_shard)) {
+        return false;
     }
+    DatabaseShard *shard = db->shards[shard_idx];
+    BTreeNode *node = darray_get_item(shard->entries, idx_in_shard);
+    if (!node->is_dir) {
+        return false;
+    }
+    db_shard_get_folder_stats(db, shard_idx, idx_in_shard, stats);
     return true;
 }
 
-static gchar *
-db_location_get_path(const char *location_name) {
-    gchar database_path[PATH_MAX] = "";
-    location_build_path(database_path, sizeof(database_path), location_name);
-
-    gchar database_fname[PATH_MAX] = "";
-    assert(0 <= snprintf(database_fname, sizeof(database_fname), "%s/database.db", database_path));
+typedef struct {
+    off_t size;
+    time_t mtime;
+    bool found;
+} DatabaseEntryMetadata;
 
-    return g_strdup(database_fname);
-}
+// every entry takes a path and an lstat call
+#define DATABASE_METADATA_FETCH_MIN_ENTRIES_PER_THREAD 256
 
-static bool
-db_location_load(FsearchDatabase *db, const char *location_name) {
-    gchar *load_path = db_location_get_path(location_name);
-    if (!load_path) {
-        return false;
-    }
-    FsearchDatabaseNode *location = db_location_load_from_file(load_path);
-    g_free(load_path);
-    load_path = NULL;
+bool
+db_get_entry_metadata(FsearchDatabase *db, uint32_t idx, off_t *size, time_t *mtime) {
+    assert(db != NULL);
+    assert(idx < db->num_entries);
 
-    if (location) {
-        location->num_items = btree_node_n_nodes(location->entries);
-        db->locations = g_list_append(db->locations, location);
-        db->num_entries += location->num_items;
-        db_update_timestamp(db);
+    BTreeNode *node = darray_get_item(db->entries, idx);
+    *size = node->size;
+    *mtime = node->mtime;
+    if (node->has_metadata) {
         return true;
     }
-    db_update_timestamp(db);
-    return false;
-}
 
-static bool
-db_location_add(FsearchDatabase *db, const char *location_name, bool *cancel, void (*callback)(const char *)) {
-    assert(db != NULL);
-    trace("[database_scan] scan location: %s\n", location_name);
-
-    FsearchDatabaseNode *location = db_location_build_tree(db, location_name, cancel, callback);
+    g_mutex_lock(&db->entry_metadata_mutex);
+    if (!db->entry_metadata) {
+        db->entry_metadata = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+    }
+    DatabaseEntryMetadata *metadata = g_hash_table_lookup(db->entry_metadata, GUINT_TO_POINTER(idx));
+    g_mutex_unlock(&db->entry_metadata_mutex);
 
-    if (location) {
-        trace("[database_scan] %s scanned with %d entries\n", location_name, location->num_items);
-        db->locations = g_list_append(db->locations, location);
-        db->num_entries += location->num_items;
-        db_update_timestamp(db);
-        return true;
+    if (!metadata) {
+        // only tried once, the file might be gone already
+        metadata = g_new0(DatabaseEntryMetadata, 1);
+        char path[PATH_MAX] = "";
+        struct stat st;
+        if (btree_node_get_path_full(node, path, sizeof(path)) && !lstat(path, &st)) {
+            metadata->size = st.st_size;
+            metadata->mtime = st.st_mtime;
+            metadata->found = true;
+        }
+        g_mutex_lock(&db->entry_metadata_mutex);
+        DatabaseEntryMetadata *known = g_hash_table_lookup(db->entry_metadata, GUINT_TO_POINTER(idx));
+        if (known) {
+            // another thread looked it up in the meantime
+            g_free(metadata);
+            metadata = known;
+        }
+        else {
+            g_hash_table_insert(db->entry_metadata, GUINT_TO_POINTER(idx), metadata);
+        }
+        g_mutex_unlock(&db->entry_metadata_mutex);
     }
 
-    db_update_timestamp(db);
-    return false;
+    // the metadata is never changed once it's in the table
+    if (metadata->found) {
+        *size = metadata->size;
+        *mtime = metadata->mtime;
+    }
+    return metadata->found;
 }
 
-static void
-db_update_sort_index(FsearchDatabase *db) {
+bool
+db_has_entry_metadata(FsearchDatabase *db, const uint32_t *indices, uint32_t num_indices) {
     assert(db != NULL);
-    assert(db->entries != NULL);
 
-    for (uint32_t i = 0; i < db->num_entries; ++i) {
-        BTreeNode *node = darray_get_item(db->entries, i);
-        node->pos = i;
+    bool known = true;
+    g_mutex_lock(&db->entry_metadata_mutex);
+    for (uint32_t i = 0; known && i < num_indices; i++) {
+        BTreeNode *node = darray_get_item(db->entries, indices[i]);
+        known = node->has_metadata
+             || (db->entry_metadata && g_hash_table_contains(db->entry_metadata, GUINT_TO_POINTER(indices[i])));
     }
+    g_mutex_unlock(&db->entry_metadata_mutex);
+    return known;
 }
 
-static uint32_t
-db_locations_get_num_entries(FsearchDatabase *db) {
-    assert(db != NULL);
-    assert(db->locations != NULL);
+typedef struct {
+    FsearchDatabase *db;
+    const uint32_t *indices;
+} DatabaseMetadataFetchContext;
 
-    uint32_t num_entries = 0;
-    GList *locations = db->locations;
-    for (GList *l = locations; l != NULL; l = l->next) {
-        FsearchDatabaseNode *location = l->data;
-        num_entries += location->num_items;
+static void
+db_fetch_entry_metadata_range(uint32_t start, uint32_t end, gpointer data) {
+    DatabaseMetadataFetchContext *ctx = data;
+    for (uint32_t i = start; i < end; i++) {
+        off_t size = 0;
+        time_t mtime = 0;
+        db_get_entry_metadata(ctx->db, ctx->indices[i], &size, &mtime);
     }
-    return num_entries;
 }
 
-static void
-db_build_initial_entries_list(FsearchDatabase *db) {
+void
+db_fetch_entry_metadata(FsearchDatabase *db, const uint32_t *indices, uint32_t num_indices, FsearchThreadPool *pool) {
     assert(db != NULL);
-    assert(db->num_entries >= 0);
 
-    db_entries_clear(db);
-    uint32_t num_entries = db_locations_get_num_entries(db);
-    trace("[database_build_list] create list for %d entries\n", num_entries);
-    db->entries = darray_new(num_entries);
+    DatabaseMetadataFetchContext ctx = {.db = db, .indices = indices};
+    fsearch_thread_pool_parallel_for(pool,
+                                     num_indices,
+                                     DATABASE_METADATA_FETCH_MIN_ENTRIES_PER_THREAD,
+                                     db_fetch_entry_metadata_range,
+                                     &ctx);
+}
 
-    GList *locations = db->locations;
-    temp_index = 0;
-    for (GList *l = locations; l != NULL; l = l->next) {
-        db_list_add_location(db, l->data);
+bool
+db_get_shard_position(FsearchDatabase *db, uint32_t idx, uint32_t *shard_idx, uint32_t *idx_in_shard) {
+    assert(db != NULL);
+
+    // the global indices of every shard are ascending, there are only a few shards
+    for (uint32_t i = 0; i < db->num_shards; i++) {
+        const uint32_t *global_indices = db->shard_global_indices[i];
+        uint32_t lo = 0;
+        uint32_t hi = db->shards[i]->num_entries;
+        while (lo < hi) {
+            const uint32_t mid = lo + (hi - lo) / 2;
+            if (global_indices[mid] < idx) {
+                lo = mid + 1;
+            }
+            else {
+                hi = mid;
+            }
+        }
+        if (lo < db->shards[i]->num_entries && global_indices[lo] == idx) {
+            *shard_idx = i;
+            *idx_in_shard = lo;
+            return true;
+        }
     }
-    db_sort(db);
-    db_update_sort_index(db);
-    trace("[database_build_list] list created\n");
+    return false;
 }
 
-static void
-db_update_entries_list(FsearchDatabase *db) {
+uint32_t
+db_get_generation(FsearchDatabase *db) {
     assert(db != NULL);
-    assert(db->num_entries >= 0);
+    return db->generation;
+}
 
-    db_entries_clear(db);
-    uint32_t num_entries = db_locations_get_num_entries(db);
-    trace("[database_update_list] create list for %d entries\n", num_entries);
-    db->entries = darray_new(num_entries);
+FsearchDatabaseScanFlags
+db_get_flags(FsearchDatabase *db) {
+    assert(db != NULL);
+    return db->flags;
+}
 
-    GList *locations = db->locations;
-    for (GList *l = locations; l != NULL; l = l->next) {
-        db_list_insert_location(db, l->data);
+static int
+db_sort_compare_roots(const void *a, const void *b) {
+    BTreeNode *root_a = *(BTreeNode **)a;
+    BTreeNode *root_b = *(BTreeNode **)b;
+    return strverscmp(root_a->name, root_b->name);
+}
+
+// Slot of the parent folder of every entry, location roots aren't entries, they're placed behind them
+static uint32_t *
+db_sort_get_parent_slots(FsearchDatabase *db, BTreeNode **roots, uint32_t num_roots) {
+    uint32_t *parent_slots = malloc(MAX(db->num_entries, 1) * sizeof(uint32_t));
+    assert(parent_slots != NULL);
+    for (uint32_t s = 0; s < db->num_shards; s++) {
+        DatabaseShard *shard = db->shards[s];
+        const uint32_t *global_indices = db->shard_global_indices[s];
+        for (uint32_t i = 0; i < shard->num_entries; i++) {
+            const uint32_t parent = db_shard_get_parent(shard, i);
+            uint32_t slot = UINT32_MAX;
+            if (parent != DB_ENTRY_TABLE_NO_PARENT) {
+                slot = global_indices[parent];
+            }
+            else if (db->part_folders && db->part_folders[s]) {
+                // the root of a part is its split folder
+                slot = db->shard_global_indices[db->part_parents[s]][db->part_folders[s]->pos];
+            }
+            else {
+                BTreeNode *node = darray_get_item(shard->entries, i);
+                BTreeNode *folder = node->parent;
+                for (uint32_t r = 0; r < num_roots; r++) {
+                    if (roots[r] == folder) {
+                        slot = db->num_entries + r;
+                        break;
+                    }
+                }
+            }
+            assert(slot != UINT32_MAX);
+            parent_slots[global_indices[i]] = slot;
+        }
     }
-    trace("[database_update_list] updated list\n");
+    return parent_slots;
 }
 
-// static BTreeNode *
-// db_location_get_entries(FsearchDatabaseNode *location) {
-//    assert(location != NULL);
-//    return location->entries;
-//}
+static uint32_t *
+db_build_path_ranks(FsearchDatabase *db) {
+    const uint32_t num_entries = db->num_entries;
+    uint32_t num_roots = 0;
+    BTreeNode **roots = calloc(MAX(g_list_length(db->locations), 1), sizeof(BTreeNode *));
+    assert(roots != NULL);
+    for (GList *l = db->locations; l != NULL; l = l->next) {
+        FsearchDatabaseNode *location = l->data;
+        if (!location->location_name) {
+            roots[num_roots++] = location->entries;
+        }
+    }
+    const uint32_t num_slots = num_entries + num_roots;
+    qsort(roots, num_roots, sizeof(BTreeNode *), db_sort_compare_roots);
+    uint32_t *parent_slots = db_sort_get_parent_slots(db, roots, num_roots);
+
+    // Paths compare component by component, which is the depth first order of the folders with
+    // siblings sorted by name. Folders are already sorted by name among the entries, so linking
+    // them to their parents in reverse order yields the children of every folder in name order.
+    uint32_t *first_child = malloc(num_slots * sizeof(uint32_t));
+    uint32_t *next_sibling = malloc(num_slots * sizeof(uint32_t));
+    uint32_t *folder_ranks = malloc(num_slots * sizeof(uint32_t));
+    uint32_t *stack = malloc(num_slots * sizeof(uint32_t));
+    assert(first_child != NULL && next_sibling != NULL && folder_ranks != NULL && stack != NULL);
+    for (uint32_t i = 0; i < num_slots; i++) {
+        first_child[i] = UINT32_MAX;
+    }
+    for (uint32_t i = num_entries; i > 0; i--) {
+        BTreeNode *node = darray_get_item(db->entries, i - 1);
+        if (!node->is_dir) {
+            continue;
+        }
+        const uint32_t parent = parent_slots[i - 1];
+        next_sibling[i - 1] = first_child[parent];
+        first_child[parent] = i - 1;
+    }
 
-FsearchDatabase *
-db_new(GList *includes, GList *excludes, char **exclude_files, bool exclude_hidden) {
-    FsearchDatabase *db = g_new0(FsearchDatabase, 1);
-    g_mutex_init(&db->mutex);
-    if (includes) {
-        db->includes = g_list_copy_deep(includes, (GCopyFunc)fsearch_include_path_copy, NULL);
+    uint32_t stack_size = 0;
+    for (uint32_t r = num_roots; r > 0; r--) {
+        stack[stack_size++] = num_entries + r - 1;
     }
-    if (excludes) {
-        db->excludes = g_list_copy_deep(excludes, (GCopyFunc)fsearch_exclude_path_copy, NULL);
+    uint32_t rank = 0;
+    while (stack_size > 0) {
+        const uint32_t slot = stack[--stack_size];
+        folder_ranks[slot] = rank++;
+
+        // push the children reversed, so the first one is visited next
+        uint32_t num_children = 0;
+        for (uint32_t child = first_child[slot]; child != UINT32_MAX; child = next_sibling[child]) {
+            num_children++;
+        }
+        uint32_t i = 0;
+        for (uint32_t child = first_child[slot]; child != UINT32_MAX; child = next_sibling[child], i++) {
+            stack[stack_size + num_children - 1 - i] = child;
+        }
+        stack_size += num_children;
     }
-    if (exclude_files) {
-        db->exclude_files = g_strdupv(exclude_files);
+    free(stack);
+    free(next_sibling);
+
+    // Folders first, then by the rank of the parent folder, then by name. That's a counting
+    // sort over the entries, which are in name order already
+    const uint32_t num_buckets = 2 * num_slots;
+    uint32_t *offsets = calloc(num_buckets, sizeof(uint32_t));
+    assert(offsets != NULL);
+    uint32_t *buckets = first_child;
+    for (uint32_t i = 0; i < num_entries; i++) {
+        BTreeNode *node = darray_get_item(db->entries, i);
+        const uint32_t parent = parent_slots[i];
+        buckets[i] = (node->is_dir ? 0 : num_slots) + folder_ranks[parent];
+        offsets[buckets[i]]++;
+    }
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < num_buckets; i++) {
+        const uint32_t count = offsets[i];
+        offsets[i] = offset;
+        offset += count;
+    }
+    uint32_t *ranks = malloc(MAX(num_entries, 1) * sizeof(uint32_t));
+    assert(ranks != NULL);
+    for (uint32_t i = 0; i < num_entries; i++) {
+        ranks[i] = offsets[buckets[i]]++;
     }
-    db->exclude_hidden = exclude_hidden;
-    db->ref_count = 1;
-    return db;
-}
 
-static void
-db_entries_clear(FsearchDatabase *db) {
-    // free entries
-    assert(db != NULL);
+    free(offsets);
+    free(first_child);
+    free(folder_ranks);
+    free(parent_slots);
+    free(roots);
+    return ranks;
+}
 
-    if (db->entries) {
-        darray_free(db->entries);
-        db->entries = NULL;
-    }
-    db->num_entries = 0;
+static int
+db_sort_compare_types(const void *a, const void *b) {
+    return strverscmp(*(const char **)a, *(const char **)b);
 }
 
 static void
-db_location_free_all(FsearchDatabase *db) {
-    assert(db != NULL);
-    if (!db->locations) {
-        return;
-    }
-
-    trace("[database_location_free_all] freeing...\n");
-    GList *l = db->locations;
-    while (l) {
-        db_location_free(l->data);
-        l = l->next;
+db_shard_build_types_chunk(uint32_t start, uint32_t end, gpointer data) {
+    DatabaseShard **shards = data;
+    for (uint32_t s = start; s < end; s++) {
+        DatabaseShard *shard = shards[s];
+        if (g_atomic_pointer_get(&shard->types)) {
+            continue;
+        }
+        const char **types = calloc(MAX(shard->num_entries, 1), sizeof(char *));
+        assert(types != NULL);
+        for (uint32_t j = 0; j < shard->num_entries; j++) {
+            BTreeNode *node = darray_get_item(shard->entries, j);
+            if (node->is_dir) {
+                continue;
+            }
+            // the same description the Type column shows
+            char *description = NULL;
+            fsearch_file_type_get(node->name, false, &description, NULL);
+            types[j] = g_intern_string(description ? description : "Unknown Type");
+            g_free(description);
+            description = NULL;
+        }
+        // another database with the same shard might have been faster
+        if (!g_atomic_pointer_compare_and_exchange(&shard->types, NULL, types)) {
+            free(types);
+        }
+        types = NULL;
     }
-    g_list_free(db->locations);
-    db->locations = NULL;
-    trace("[database_location_free_all] freed\n");
 }
 
-static void
-db_free(FsearchDatabase *db) {
-    assert(db != NULL);
+static uint32_t *
+db_build_type_ranks(FsearchDatabase *db, FsearchThreadPool *pool) {
+    const uint32_t num_entries = db->num_entries;
+    // only the shards which are new since the last database have to look up their types
+    fsearch_thread_pool_parallel_for(pool, db->num_shards, 1, db_shard_build_types_chunk, db->shards);
+    const char **types = calloc(MAX(num_entries, 1), sizeof(char *));
+    assert(types != NULL);
+    for (uint32_t s = 0; s < db->num_shards; s++) {
+        DatabaseShard *shard = db->shards[s];
+        for (uint32_t j = 0; j < shard->num_entries; j++) {
+            types[db->shard_global_indices[s][j]] = shard->types[j];
+        }
+    }
 
-    trace("[database_free] freeing...\n");
-    db_lock(db);
-    if (db->ref_count > 0) {
-        trace("[database_free] pending references on free: %d\n", db->ref_count);
+    // rank of every type, types are interned so they can be compared by address
+    GHashTable *type_ranks = g_hash_table_new(g_direct_hash, g_direct_equal);
+    for (uint32_t i = 0; i < num_entries; i++) {
+        if (types[i]) {
+            g_hash_table_insert(type_ranks, (gpointer)types[i], NULL);
+        }
     }
-    db_entries_clear(db);
-    db_location_free_all(db);
 
-    if (db->includes) {
-        g_list_free_full(db->includes, (GDestroyNotify)fsearch_include_path_free);
-        db->includes = NULL;
+    const uint32_t num_types = g_hash_table_size(type_ranks);
+    const char **sorted_types = calloc(MAX(num_types, 1), sizeof(char *));
+    assert(sorted_types != NULL);
+    GHashTableIter iter;
+    gpointer type = NULL;
+    uint32_t t = 0;
+    g_hash_table_iter_init(&iter, type_ranks);
+    while (g_hash_table_iter_next(&iter, &type, NULL)) {
+        sorted_types[t++] = type;
     }
-    if (db->excludes) {
-        g_list_free_full(db->excludes, (GDestroyNotify)fsearch_exclude_path_free);
-        db->excludes = NULL;
+    qsort(sorted_types, num_types, sizeof(char *), db_sort_compare_types);
+    for (t = 0; t < num_types; t++) {
+        g_hash_table_insert(type_ranks, (gpointer)sorted_types[t], GUINT_TO_POINTER(t + 1));
     }
-    if (db->exclude_files) {
-        g_strfreev(db->exclude_files);
-        db->exclude_files = NULL;
+    free(sorted_types);
+
+    // folders first, then files by type and name
+    FsearchSortItem *items = malloc(MAX(num_entries, 1) * sizeof(FsearchSortItem));
+    assert(items != NULL);
+    for (uint32_t i = 0; i < num_entries; i++) {
+        items[i].key = types[i] ? GPOINTER_TO_UINT(g_hash_table_lookup(type_ranks, types[i])) : 0;
+        items[i].data = GUINT_TO_POINTER(i);
     }
-    db_unlock(db);
-
-    g_mutex_clear(&db->mutex);
-    g_free(db);
-    db = NULL;
-
-    malloc_trim(0);
-
-    trace("[database_free] freed\n");
-    return;
+    g_hash_table_destroy(type_ranks);
+    free(types);
+
+    fsearch_sort_by_rank(items, num_entries);
+    uint32_t *ranks = malloc(MAX(num_entries, 1) * sizeof(uint32_t));
+    assert(ranks != NULL);
+    for (uint32_t i = 0; i < num_entries; i++) {
+        ranks[GPOINTER_TO_UINT(items[i].data)] = i;
+    }
+    free(items);
+    return ranks;
 }
 
-time_t
-db_get_timestamp(FsearchDatabase *db) {
-    assert(db != NULL);
-    return db->timestamp;
-}
+static uint32_t *
+db_build_metadata_ranks(FsearchDatabase *db, FsearchDatabaseSortType sort_type, FsearchThreadPool *pool) {
+    const uint32_t num_entries = db->num_entries;
+    FsearchSortItem *items = malloc(MAX(num_entries, 1) * sizeof(FsearchSortItem));
+    assert(items != NULL);
+    // shard by shard, that way the stats of the folders are at hand in their entry tables
+    for (uint32_t s = 0; s < db->num_shards; s++) {
+        DatabaseShard *shard = db->shards[s];
+        for (uint32_t j = 0; j < shard->num_entries; j++) {
+            BTreeNode *node = darray_get_item(shard->entries, j);
+            const uint32_t i = db->shard_global_indices[s][j];
+            uint64_t key = 0;
+            if (sort_type == DATABASE_SORT_MODIFICATION_TIME) {
+                // order signed times as unsigned keys
+                key = (uint64_t)node->mtime ^ ((uint64_t)1 << 63);
+            }
+            else if (node->is_dir) {
+                // folders first, ordered by their number of children or the size of their contents
+                FsearchDatabaseFolderStats stats = {0};
+                db_shard_get_folder_stats(db, s, j, &stats);
+                key = sort_type == DATABASE_SORT_TOTAL_SIZE ? MIN((uint64_t)stats.total_size, INT64_MAX)
+                                                            : stats.num_children;
+            }
+            else {
+                key = (uint64_t)1 << 63 | MIN((uint64_t)MAX(node->size, 0), INT64_MAX);
+            }
+            items[i].key = key;
+            items[i].data = GUINT_TO_POINTER(i);
+        }
+    }
 
-uint32_t
-db_get_num_entries(FsearchDatabase *db) {
-    assert(db != NULL);
-    return db->num_entries;
+    // the sort is stable, entries with equal keys stay in name order
+    fsearch_sort(items, num_entries, NULL, NULL, pool);
+    uint32_t *ranks = malloc(MAX(num_entries, 1) * sizeof(uint32_t));
+    assert(ranks != NULL);
+    for (uint32_t i = 0; i < num_entries; i++) {
+        ranks[GPOINTER_TO_UINT(items[i].data)] = i;
+    }
+    free(items);
+    return ranks;
 }
 
-void
-db_unlock(FsearchDatabase *db) {
-    assert(db != NULL);
-    g_mutex_unlock(&db->mutex);
-}
+typedef struct {
+    FsearchDatabase *db;
+    FsearchDatabaseSortType sort_type;
+    FsearchThreadPool *pool;
+} DatabaseSortRanksTask;
 
-void
-db_lock(FsearchDatabase *db) {
-    assert(db != NULL);
-    g_mutex_lock(&db->mutex);
+static void
+db_build_sort_ranks_task(gpointer data) {
+    DatabaseSortRanksTask *task = data;
+    FsearchDatabase *db = task->db;
+    switch (task->sort_type) {
+    case DATABASE_SORT_PATH:
+        db->sort_ranks[task->sort_type] = db_build_path_ranks(db);
+        break;
+    case DATABASE_SORT_TYPE:
+        db->sort_ranks[task->sort_type] = db_build_type_ranks(db, task->pool);
+        break;
+    case DATABASE_SORT_SIZE:
+    case DATABASE_SORT_MODIFICATION_TIME:
+    case DATABASE_SORT_TOTAL_SIZE:
+        if (db->flags.names_only) {
+            // that would stat every entry, only the results get their metadata
+            break;
+        }
+        db->sort_ranks[task->sort_type] = db_build_metadata_ranks(db, task->sort_type, task->pool);
+        break;
+    default:
+        break;
+    }
 }
 
-bool
-db_try_lock(FsearchDatabase *db) {
-    assert(db != NULL);
-    return g_mutex_trylock(&db->mutex);
+// Ranks of every sort order, built along with the entries list. That way the thread which sorts
+// the results (usually the main thread) finds them ready, even right after an update.
+static void
+db_build_sort_ranks(FsearchDatabase *db, FsearchThreadPool *pool) {
+    GTimer *timer = fsearch_timer_start();
+    DatabaseSortRanksTask tasks[NUM_DATABASE_SORT_TYPES];
+    FsearchTaskGroup *group = pool ? fsearch_task_group_new(pool) : NULL;
+    for (uint32_t i = 0; i < NUM_DATABASE_SORT_TYPES; i++) {
+        tasks[i].db = db;
+        tasks[i].sort_type = i;
+        tasks[i].pool = pool;
+        if (group) {
+            fsearch_task_group_push(group, db_build_sort_ranks_task, &tasks[i]);
+        }
+        else {
+            db_build_sort_ranks_task(&tasks[i]);
+        }
+    }
+    if (group) {
+        fsearch_task_group_wait(group);
+        fsearch_task_group_free(group);
+        group = NULL;
+    }
+    fsearch_timer_stop(timer, "[database] sort ranks built in %.2f ms\n");
+    timer = NULL;
 }
 
-DynamicArray *
-db_get_entries(FsearchDatabase *db) {
+const uint32_t *
+db_get_sort_ranks(FsearchDatabase *db, FsearchDatabaseSortType sort_type) {
     assert(db != NULL);
-    return db->entries;
+    assert(sort_type < NUM_DATABASE_SORT_TYPES);
+
+    if (!db->entries) {
+        return NULL;
+    }
+    return db->sort_ranks[sort_type];
 }
 
 static int
@@ -977,28 +3962,300 @@ sort_by_name(const void *a, const void *b) {
 //    return strverscmp (path_a, path_b);
 //}
 
+typedef struct {
+    const char *location_name;
+    bool with_trigram_index;
+    // with a memory budget the shards are built one after another once all locations are loaded
+    bool build_shard;
+    FsearchThreadPool *pool;
+    FsearchDatabaseNode *location;
+    // the parts of location, if it's split
+    GList *parts;
+} DatabaseLocationLoadTask;
+
+// Asks the kernel to read the file of a location ahead, so the files of all locations are read
+// at the same time instead of one after the other
+static void
+db_location_prefetch(const char *location_name) {
+    gchar *load_path = db_location_get_path(location_name);
+    if (!load_path) {
+        return;
+    }
+    const int fd = open(load_path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+    g_free(load_path);
+}
+
+static void
+db_location_load_task(gpointer data) {
+    DatabaseLocationLoadTask *task = data;
+    gchar *load_path = db_location_get_path(task->location_name);
+    if (!load_path) {
+        return;
+    }
+    task->location = db_location_load_from_file(load_path, task->pool);
+    g_free(load_path);
+    if (task->location && task->build_shard) {
+        // built here so the shards of all locations are built in parallel too
+        task->parts = db_location_split(task->location);
+        task->location->shard =
+            db_location_build_shard(task->location, task->with_trigram_index, NULL, task->pool);
+        for (GList *l = task->parts; l != NULL; l = l->next) {
+            FsearchDatabaseNode *part = l->data;
+            part->shard = db_location_build_shard(part, task->with_trigram_index, NULL, task->pool);
+        }
+    }
+}
+
 bool
 db_load_from_file(FsearchDatabase *db, const char *path, void (*callback)(const char *)) {
     assert(db != NULL);
 
-    bool ret = false;
+    const gint64 stats_start = fsearch_stats_now();
+    FsearchThreadPool *pool = db->flags.parallel ? fsearch_thread_pool_get_default() : NULL;
+
+    GPtrArray *tasks = g_ptr_array_new_with_free_func(g_free);
     for (GList *l = db->includes; l != NULL; l = l->next) {
         FsearchIncludePath *fs_path = l->data;
         if (!fs_path->enabled) {
             continue;
         }
-        ret = db_location_load(db, fs_path->path) ? true : ret;
+        DatabaseLocationLoadTask *task = g_new0(DatabaseLocationLoadTask, 1);
+        task->location_name = fs_path->path;
+        task->with_trigram_index = db->flags.trigram_index;
+        task->build_shard = !db->flags.memory_budget;
+        task->pool = pool;
+        g_ptr_array_add(tasks, task);
+        db_location_prefetch(fs_path->path);
+    }
+
+    if (pool && tasks->len > 1) {
+        FsearchTaskGroup *group = fsearch_task_group_new(pool);
+        for (guint i = 0; i < tasks->len; i++) {
+            fsearch_task_group_push(group, db_location_load_task, g_ptr_array_index(tasks, i));
+        }
+        fsearch_task_group_wait(group);
+        fsearch_task_group_free(group);
+    }
+    else {
+        for (guint i = 0; i < tasks->len; i++) {
+            db_location_load_task(g_ptr_array_index(tasks, i));
+        }
+    }
+
+    // in the order of the includes, no matter which one finished first
+    bool ret = false;
+    for (guint i = 0; i < tasks->len; i++) {
+        DatabaseLocationLoadTask *task = g_ptr_array_index(tasks, i);
+        if (task->location) {
+            db->locations = g_list_append(db->locations, task->location);
+            db->num_entries += task->location->num_items;
+            for (GList *p = task->parts; p != NULL; p = p->next) {
+                FsearchDatabaseNode *part = p->data;
+                db->locations = g_list_append(db->locations, part);
+                db->num_entries += part->num_items;
+            }
+            g_list_free(task->parts);
+            task->parts = NULL;
+            ret = true;
+        }
     }
+    db_update_timestamp(db);
+    g_ptr_array_free(tasks, TRUE);
+
     if (ret) {
-        db_update_entries_list(db);
+        db_build_entries_list(db, NULL, pool);
+        fsearch_stats_record(FSEARCH_STATS_TIME_LOAD, stats_start);
     }
     return ret;
 }
 
+// whether both databases index the same entries for a location
+static bool
+db_scan_settings_equal(FsearchDatabase *db, FsearchDatabase *other) {
+    if (db->flags.exclude_hidden != other->flags.exclude_hidden || db->flags.names_only != other->flags.names_only
+        || db->flags.follow_symlinks != other->flags.follow_symlinks
+        || db->flags.exclude_virtual_fs != other->flags.exclude_virtual_fs) {
+        return false;
+    }
+    GList *a = db->excludes;
+    GList *b = other->excludes;
+    for (; a && b; a = a->next, b = b->next) {
+        FsearchExcludePath *path_a = a->data;
+        FsearchExcludePath *path_b = b->data;
+        if (path_a->enabled != path_b->enabled || g_strcmp0(path_a->path, path_b->path)) {
+            return false;
+        }
+    }
+    if (a || b) {
+        return false;
+    }
+    const guint num_exclude_files = db->exclude_files ? g_strv_length(db->exclude_files) : 0;
+    if (num_exclude_files != (other->exclude_files ? g_strv_length(other->exclude_files) : 0)) {
+        return false;
+    }
+    for (guint i = 0; i < num_exclude_files; i++) {
+        if (strcmp(db->exclude_files[i], other->exclude_files[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+typedef struct {
+    FsearchDatabaseNode *location;
+    GPtrArray *changed_folders;
+    GString *path;
+    GTimer *timer;
+    bool *cancel;
+    void (*callback)(const char *);
+    bool follow_symlinks;
+} DatabaseChangedFoldersContext;
+
+// Adding, removing or renaming entries changes the mtime of their folder, other folders keep their
+// children. Their subfolders have to be checked all the same, as well as those of changed folders.
+static bool
+db_location_collect_changed_folders(DatabaseChangedFoldersContext *ctx, BTreeNode *folder) {
+    if (*ctx->cancel) {
+        return false;
+    }
+    const char *path = ctx->path->len > 0 ? ctx->path->str : "/";
+    struct stat st;
+    if ((ctx->follow_symlinks ? stat(path, &st) : lstat(path, &st)) || !S_ISDIR(st.st_mode)) {
+        // it's gone, which is a change of its parent
+        return true;
+    }
+    if (!folder->has_metadata || st.st_mtime != folder->mtime || st.st_mtime >= ctx->location->scan_started) {
+        g_ptr_array_add(ctx->changed_folders, folder);
+    }
+    if (ctx->callback && g_timer_elapsed(ctx->timer, NULL) > 0.1) {
+        ctx->callback(path);
+        g_timer_start(ctx->timer);
+    }
+
+    const gsize path_len = ctx->path->len;
+    for (BTreeNode *child = folder->children; child; child = child->next) {
+        if (!child->is_dir) {
+            continue;
+        }
+        g_string_append_c(ctx->path, '/');
+        g_string_append(ctx->path, child->name);
+        const bool res = db_location_collect_changed_folders(ctx, child);
+        g_string_truncate(ctx->path, path_len);
+        if (!res) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the entries below folder get their pos among the location and all of its parts
+static void
+db_join_set_pos(DatabaseJoinContext *ctx, BTreeNode *folder, uint32_t shard) {
+    for (BTreeNode *child = folder->children; child; child = child->next) {
+        child->pos = db_join_get_pos(ctx, child, shard);
+        if (child->children) {
+            db_join_set_pos(ctx, child, shard);
+        }
+    }
+}
+
+// A copy of location of db with its parts joined into it again
+static FsearchDatabaseNode *
+db_location_copy_joined(FsearchDatabase *db, FsearchDatabaseNode *location) {
+    FsearchDatabaseNode *copy = db_location_copy(location);
+    DatabaseJoinContext ctx;
+    if (!db_join_context_init(&ctx, db, location)) {
+        return copy;
+    }
+    // the saved order stays valid, the parts come after the ones they were split off from
+    db_join_set_pos(&ctx, copy->entries, ctx.shard);
+    for (uint32_t s = 0; s < db->num_shards; s++) {
+        FsearchDatabaseNode *part = ctx.locations[s];
+        if (!db->part_folders[s] || strcmp(part->location_name, location->entries->name) != 0) {
+            continue;
+        }
+        BTreeNode *folder = db_location_find_node(copy, part->entries->name);
+        assert(folder != NULL && folder->split);
+        BTreeNode **link = &folder->children;
+        for (BTreeNode *child = part->entries->children; child; child = child->next) {
+            BTreeNode *child_copy = db_location_copy_node(copy->arena, child);
+            child_copy->parent = folder;
+            *link = child_copy;
+            link = &child_copy->next;
+        }
+        db_join_set_pos(&ctx, folder, s);
+        folder->split = false;
+        folder->size = part->entries->size;
+        folder->mtime = part->entries->mtime;
+        folder->has_metadata = part->entries->has_metadata;
+        copy->num_items += part->num_items;
+        db_location_copy_link_targets(copy, part);
+    }
+    db_join_context_clear(&ctx);
+    return copy;
+}
+
+// Adds a location of the previous database to db, with only its changed folders read again.
+// The previous database keeps its tree, db gets an updated copy of it with its parts joined in.
+static bool
+db_location_add_incremental(FsearchDatabase *db,
+                            FsearchDatabase *previous,
+                            FsearchDatabaseNode *previous_location,
+                            bool *cancel,
+                            void (*callback)(const char *)) {
+    const time_t scan_started = time(NULL);
+    FsearchDatabaseNode *location = db_location_copy_joined(previous, previous_location);
+    BTreeNode *root = location->entries;
+    trace("[database_scan] incremental scan of location: %s\n", root->name);
+
+    DatabaseChangedFoldersContext ctx = {
+        .location = location,
+        .changed_folders = g_ptr_array_new(),
+        .path = g_string_new(root->name),
+        .timer = g_timer_new(),
+        .cancel = cancel,
+        .callback = callback,
+        .follow_symlinks = db->flags.follow_symlinks,
+    };
+    bool res = db_location_collect_changed_folders(&ctx, root);
+    g_string_free(ctx.path, TRUE);
+    g_timer_destroy(ctx.timer);
+
+    if (res) {
+        trace("[database_scan] %u changed folders\n", ctx.changed_folders->len);
+        db->locations = g_list_append(db->locations, location);
+        res = db_update_folders(db, location, NULL, ctx.changed_folders, cancel, NULL, NULL, NULL);
+        if (res) {
+            location->scan_started = scan_started;
+            db->num_entries += location->num_items;
+        }
+        else {
+            db->locations = g_list_remove(db->locations, location);
+        }
+    }
+    if (!res) {
+        db_location_free(location);
+        location = NULL;
+    }
+    g_ptr_array_free(ctx.changed_folders, TRUE);
+    db_update_timestamp(db);
+    return res;
+}
+
 bool
-db_scan(FsearchDatabase *db, bool *cancel, void (*callback)(const char *)) {
+db_scan(FsearchDatabase *db, FsearchDatabase *previous, bool *cancel, void (*callback)(const char *)) {
     assert(db != NULL);
 
+    const gint64 stats_start = fsearch_stats_now();
+    FsearchThreadPool *pool = db->flags.parallel ? fsearch_thread_pool_get_default() : NULL;
+    if (previous && !db_scan_settings_equal(db, previous)) {
+        previous = NULL;
+    }
+
     bool ret = false;
     bool init_list = false;
     for (GList *l = db->includes; l != NULL; l = l->next) {
@@ -1009,7 +4266,35 @@ db_scan(FsearchDatabase *db, bool *cancel, void (*callback)(const char *)) {
         if (!fs_path->enabled) {
             continue;
         }
-        if (fs_path->update && db_location_add(db, fs_path->path, cancel, callback)) {
+        FsearchDatabaseNode *previous_location = NULL;
+        if (fs_path->update && previous) {
+            previous_location = db_location_get_for_path(previous, !strcmp(fs_path->path, "/") ? "" : fs_path->path);
+        }
+        if (previous_location) {
+            if (db_location_add_incremental(db, previous, previous_location, cancel, callback)) {
+                init_list = true;
+            }
+            else if (*cancel) {
+                // the previous state of the location and its parts is kept, the saved one might be older
+                for (GList *p = previous->locations; p != NULL; p = p->next) {
+                    FsearchDatabaseNode *location = p->data;
+                    if (location == previous_location
+                        || (location->location_name && !strcmp(location->location_name, previous_location->entries->name))) {
+                        g_atomic_int_inc(&location->ref_count);
+                        db->locations = g_list_append(db->locations, location);
+                        db->num_entries += location->num_items;
+                    }
+                }
+            }
+            else if (db_location_add(db, fs_path->path, pool, cancel, callback)) {
+                init_list = true;
+            }
+            else {
+                continue;
+            }
+            ret = true;
+        }
+        else if (fs_path->update && db_location_add(db, fs_path->path, pool, cancel, callback)) {
             ret = true;
             init_list = true;
         }
@@ -1018,16 +4303,13 @@ db_scan(FsearchDatabase *db, bool *cancel, void (*callback)(const char *)) {
         }
     }
     if (ret) {
-        if (init_list) {
-            if (callback) {
-                callback(_("Sorting..."));
-            }
-            db_build_initial_entries_list(db);
-        }
-        else {
-            db_update_entries_list(db);
+        if (init_list && callback) {
+            // only the scanned locations need to be sorted, loaded ones keep their saved order
+            callback(_("Sorting..."));
         }
+        db_build_entries_list(db, NULL, pool);
     }
+    fsearch_stats_record(FSEARCH_STATS_TIME_SCAN, stats_start);
     return ret;
 }
 
@@ -1037,7 +4319,19 @@ db_sort(FsearchDatabase *db) {
     assert(db->entries != NULL);
 
     trace("[database] sorting...\n");
-    darray_sort(db->entries, sort_by_name);
+    const uint32_t num_entries = darray_get_num_items(db->entries);
+    FsearchSortItem *items = malloc(MAX(num_entries, 1) * sizeof(FsearchSortItem));
+    assert(items != NULL);
+    for (uint32_t i = 0; i < num_entries; i++) {
+        BTreeNode *node = darray_get_item(db->entries, i);
+        items[i].key = fsearch_sort_get_name_key(node->name, node->is_dir);
+        items[i].data = node;
+    }
+    fsearch_sort(items, num_entries, db_sort_compare_nodes, NULL, NULL);
+    for (uint32_t i = 0; i < num_entries; i++) {
+        darray_set_item(db->entries, items[i].data, i);
+    }
+    free(items);
     trace("[database] sorted\n");
 }
 
@@ -1050,15 +4344,48 @@ db_ref(FsearchDatabase *db) {
     trace("[database_ref] increased to: %d\n", db->ref_count);
 }
 
+// databases are torn down one after the other on a thread of their own, like saves
+static GMutex db_free_mutex;
+static GCond db_free_cond;
+static GThreadPool *db_free_pool = NULL;
+static uint32_t db_free_num_pending = 0;
+
+static void
+db_free_thread(gpointer data, gpointer user_data) {
+    db_free(data);
+
+    g_mutex_lock(&db_free_mutex);
+    db_free_num_pending--;
+    g_cond_broadcast(&db_free_cond);
+    g_mutex_unlock(&db_free_mutex);
+}
+
+void
+db_free_wait(void) {
+    g_mutex_lock(&db_free_mutex);
+    while (db_free_num_pending > 0) {
+        g_cond_wait(&db_free_cond, &db_free_mutex);
+    }
+    g_mutex_unlock(&db_free_mutex);
+}
+
 void
 db_unref(FsearchDatabase *db) {
     assert(db != NULL);
     db_lock(db);
-    db->ref_count--;
+    const int32_t ref_count = --db->ref_count;
     db_unlock(db);
-    trace("[database_unref] dropped to: %d\n", db->ref_count);
-    if (db->ref_count <= 0) {
-        db_free(db);
+    trace("[database_unref] dropped to: %d\n", ref_count);
+    if (ref_count <= 0) {
+        // tearing down millions of entries takes a while, don't make the caller
+        // (usually the main thread after switching to a new database) wait for it
+        g_mutex_lock(&db_free_mutex);
+        if (!db_free_pool) {
+            db_free_pool = g_thread_pool_new(db_free_thread, NULL, 1, FALSE, NULL);
+        }
+        db_free_num_pending++;
+        g_thread_pool_push(db_free_pool, db, NULL);
+        g_mutex_unlock(&db_free_mutex);
     }
 }
 
@@ -20,6 +20,8 @@
 
 #include "array.h"
 #include "btree.h"
+#include "database_shard.h"
+#include "fsearch_thread_pool.h"
 #include <glib.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -28,6 +30,47 @@ typedef struct _FsearchDatabase FsearchDatabase;
 
 typedef struct _FsearchDatabaseNode FsearchDatabaseNode;
 
+typedef struct _FsearchDatabaseScanFlags {
+    bool exclude_hidden;
+    // enter folders behind symbolic links, each of them only once per location
+    bool follow_symlinks;
+    // don't enter the mount points of proc, sysfs and other pseudo file systems
+    bool exclude_virtual_fs;
+    // crawl directories with multiple threads
+    bool parallel;
+    // don't stat files whose type is already known from readdir, their size and
+    // modification time get fetched on demand instead. Folders are stat'ed all the same,
+    // so incremental scans know which of them changed.
+    bool names_only;
+    // build an index of the trigrams in all names, which speeds up
+    // searches for selective queries at the cost of memory
+    bool trigram_index;
+    // save the locations in the compact format, the files are a lot smaller but have to be decoded
+    // when they're loaded
+    bool compact_database;
+    // the packed copies of the entries and the trigram indexes only get what's left of that many
+    // bytes after the nodes, 0 for no limit. The nodes always stay in memory, locations without
+    // room for a copy are searched through them, which is slower.
+    size_t memory_budget;
+} FsearchDatabaseScanFlags;
+
+typedef enum {
+    DATABASE_SORT_PATH,
+    DATABASE_SORT_SIZE,
+    DATABASE_SORT_MODIFICATION_TIME,
+    DATABASE_SORT_TYPE,
+    // like DATABASE_SORT_SIZE, but folders are ordered by the size of all files below them
+    DATABASE_SORT_TOTAL_SIZE,
+    NUM_DATABASE_SORT_TYPES,
+} FsearchDatabaseSortType;
+
+typedef struct {
+    uint32_t num_children;
+    // the files anywhere below the folder and the sum of their sizes
+    uint32_t num_files;
+    int64_t total_size;
+} FsearchDatabaseFolderStats;
+
 bool
 db_make_data_dir(void);
 
@@ -37,21 +80,39 @@ db_build_data_dir(char *path, size_t len);
 bool
 db_load_from_file(FsearchDatabase *db, const char *path, void (*callback)(const char *));
 
+// With a previous database of the same settings, its locations are scanned incrementally: only folders
+// whose mtime changed are read again, the others keep their entries. That's done on copies of the
+// locations of previous, like with db_new_with_changed_folders. Sizes and modification times of
+// files in unchanged folders aren't updated that way.
 bool
-db_scan(FsearchDatabase *db, bool *cancel, void (*callback)(const char *));
+db_scan(FsearchDatabase *db, FsearchDatabase *previous, bool *cancel, void (*callback)(const char *));
 
 void
 db_ref(FsearchDatabase *db);
 
+// Drops a reference, the last one frees the database on a background thread.
 void
 db_unref(FsearchDatabase *db);
 
+// Returns once all databases whose last reference was dropped so far are freed
+void
+db_free_wait(void);
+
 FsearchDatabase *
-db_new(GList *includes, GList *excludes, char **exclude_files, bool exclude_hidden);
+db_new(GList *includes, GList *excludes, char **exclude_files, FsearchDatabaseScanFlags flags);
 
 bool
 db_save_locations(FsearchDatabase *db);
 
+// Saves the locations of db on a background thread, which holds a reference to it until it's done.
+// Saves run in the order they were started.
+void
+db_save_locations_async(FsearchDatabase *db);
+
+// Returns once all saves started so far are written
+void
+db_save_wait(void);
+
 time_t
 db_get_timestamp(FsearchDatabase *db);
 
@@ -70,6 +131,72 @@ db_try_lock(FsearchDatabase *db);
 DynamicArray *
 db_get_entries(FsearchDatabase *db);
 
+// The entries of every location are searched in a shard of their own
+uint32_t
+db_get_num_shards(FsearchDatabase *db);
+
+// global_indices maps the index of every entry of the shard to its index in the entries of db
+DatabaseShard *
+db_get_shard(FsearchDatabase *db, uint32_t shard_idx, const uint32_t **global_indices);
+
+// The shard of entry idx of db and its index in there
+bool
+db_get_shard_position(FsearchDatabase *db, uint32_t idx, uint32_t *shard_idx, uint32_t *idx_in_shard);
+
+// The stats of folder idx of db, they're computed once the shard of its location is built.
+// Sizes are only known if the database was indexed with metadata.
+bool
+db_get_folder_stats(FsearchDatabase *db, uint32_t idx, FsearchDatabaseFolderStats *stats);
+
+// Size and modification time of entry idx of db. Entries indexed without them get them from the file
+// system the first time they're asked for, they're kept with db then. False if they're not known.
+bool
+db_get_entry_metadata(FsearchDatabase *db, uint32_t idx, off_t *size, time_t *mtime);
+
+// Whether the metadata of all the entries at indices is known already, without asking the file system
+bool
+db_has_entry_metadata(FsearchDatabase *db, const uint32_t *indices, uint32_t num_indices);
+
+// Gets the metadata of all the entries at indices which don't have it yet, spread over the workers of pool
+void
+db_fetch_entry_metadata(FsearchDatabase *db, const uint32_t *indices, uint32_t num_indices, FsearchThreadPool *pool);
+
+// Identifies the current entries list, it changes whenever the list is rebuilt
+// and is never the same for two different databases
+uint32_t
+db_get_generation(FsearchDatabase *db);
+
+FsearchDatabaseScanFlags
+db_get_flags(FsearchDatabase *db);
+
+// Rank of every entry in the given order, indexed by the entry's index in db. The name order needs no ranks,
+// it's the order of the entries itself. Ranks are built along with the entries, by the scan, load or update
+// which built them; returns NULL if they can't be provided, e.g. sizes for databases indexed without metadata.
+const uint32_t *
+db_get_sort_ranks(FsearchDatabase *db, FsearchDatabaseSortType sort_type);
+
 void
 db_sort(FsearchDatabase *db);
 
+typedef void (*FsearchDatabaseFolderFunc)(BTreeNode *folder, void *user_data);
+
+// Calls func for every folder of the database, including the roots of the locations
+void
+db_foreach_folder(FsearchDatabase *db, FsearchDatabaseFolderFunc func, void *user_data);
+
+// Whether one of the locations of db has a folder at path
+bool
+db_has_folder(FsearchDatabase *db, const char *path);
+
+// Reads the folders at the given paths again and returns a new database with their changes, without
+// scanning anything else. db isn't modified and can still be searched in the meantime: the new database
+// shares the unchanged locations with it and gets a copy of the others, which is updated.
+// folder_added and folder_removed are called for every folder which was added to or removed from
+// the copies, paths which aren't folders of db are skipped.
+FsearchDatabase *
+db_new_with_changed_folders(FsearchDatabase *db,
+                            GPtrArray *paths,
+                            FsearchDatabaseFolderFunc folder_added,
+                            FsearchDatabaseFolderFunc folder_removed,
+                            void *user_data);
+
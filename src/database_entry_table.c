@@ -0,0 +1,405 @@
+/*
+   FSearch - A fast file search utility
+   Copyright © 2020 Christian Boxdörfer
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+   */
+
+#include "database_entry_table.h"
+#include "debug.h"
+#include "fsearch_memory.h"
+#include "string_utils.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+// Post-order, so the stats of all subfolders are complete before they're added to the folder
+static void
+db_entry_table_add_folder_stats(DatabaseEntryTable *table, uint32_t idx, BTreeNode *folder) {
+    for (BTreeNode *child = folder->children; child != NULL; child = child->next) {
+        const uint32_t child_idx = child->pos;
+        assert(child_idx < table->num_entries);
+        table->num_children[idx]++;
+        if (child->is_dir) {
+            db_entry_table_add_folder_stats(table, child_idx, child);
+            table->num_files[idx] += table->num_files[child_idx];
+            table->total_sizes[idx] += table->total_sizes[child_idx];
+        }
+        else {
+            table->num_files[idx]++;
+            table->total_sizes[idx] += MAX(child->size, 0);
+        }
+    }
+}
+
+DatabaseEntryTable *
+db_entry_table_new(DynamicArray *entries, uint32_t num_entries) {
+    assert(entries != NULL);
+
+    // the entries must be in their final order already, node->pos is the index of the parent
+    size_t names_len = 0;
+    for (uint32_t i = 0; i < num_entries; i++) {
+        BTreeNode *node = darray_get_item(entries, i);
+        if (!node) {
+            trace("[entry_table] entries have gaps, no table created\n");
+            return NULL;
+        }
+        names_len += strlen(node->name) + 1;
+    }
+    if (names_len >= DB_ENTRY_TABLE_FOLDED_COPY) {
+        trace("[entry_table] names don't fit into the table: %zu bytes\n", names_len);
+        return NULL;
+    }
+
+    DatabaseEntryTable *table = calloc(1, sizeof(DatabaseEntryTable));
+    assert(table != NULL);
+
+    table->num_entries = num_entries;
+    table->names = fsearch_memory_malloc(MAX(names_len, 1));
+    table->name_offsets = fsearch_memory_malloc((num_entries + 1) * sizeof(uint32_t));
+    table->folded_name_offsets = fsearch_memory_malloc(MAX(num_entries, 1) * sizeof(uint32_t));
+    table->is_dir = fsearch_memory_calloc(num_entries / 64 + 1, sizeof(uint64_t));
+    table->parents = fsearch_memory_malloc(MAX(num_entries, 1) * sizeof(uint32_t));
+    table->sizes = fsearch_memory_malloc(MAX(num_entries, 1) * sizeof(int64_t));
+    table->mtimes = fsearch_memory_malloc(MAX(num_entries, 1) * sizeof(int64_t));
+    table->num_children = fsearch_memory_calloc(MAX(num_entries, 1), sizeof(uint32_t));
+    table->num_files = fsearch_memory_calloc(MAX(num_entries, 1), sizeof(uint32_t));
+    table->total_sizes = fsearch_memory_calloc(MAX(num_entries, 1), sizeof(int64_t));
+    table->signatures = fsearch_memory_malloc(MAX(num_entries, 1) * sizeof(uint64_t));
+    table->extension_ids = fsearch_memory_malloc(MAX(num_entries, 1) * sizeof(uint16_t));
+    table->extensions = g_ptr_array_new_with_free_func(g_free);
+    assert(table->names != NULL);
+    assert(table->name_offsets != NULL);
+    assert(table->folded_name_offsets != NULL);
+    assert(table->is_dir != NULL);
+    assert(table->parents != NULL);
+    assert(table->sizes != NULL);
+    assert(table->mtimes != NULL);
+    assert(table->num_children != NULL);
+    assert(table->num_files != NULL);
+    assert(table->total_sizes != NULL);
+    assert(table->signatures != NULL);
+    assert(table->extension_ids != NULL);
+    g_mutex_init(&table->parent_paths_mutex);
+
+    // there are far fewer extensions than entries, the ids are looked up by text while the table is built
+    GHashTable *extension_ids = g_hash_table_new(g_str_hash, g_str_equal);
+
+    // most names are folded already, so the copies are few
+    GString *folded_names = g_string_new(NULL);
+    bool folded_names_fit = true;
+
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < num_entries; i++) {
+        BTreeNode *node = darray_get_item(entries, i);
+        gpointer id = NULL;
+
+        const size_t len = strlen(node->name) + 1;
+        memcpy(table->names + offset, node->name, len);
+        table->name_offsets[i] = offset;
+        table->folded_name_offsets[i] = offset;
+        offset += len;
+
+        char *folded = folded_names_fit ? fs_str_fold(node->name) : NULL;
+        if (folded || folded_names_fit) {
+            // names which don't change when folded are their own folded version
+            table->signatures[i] = db_entry_table_get_signature(folded ? folded : node->name);
+        }
+        else {
+            // without the folded name nothing can be ruled out
+            table->signatures[i] = UINT64_MAX;
+        }
+        if (folded) {
+            const size_t folded_len = strlen(folded) + 1;
+            if (folded_names->len + folded_len < DB_ENTRY_TABLE_FOLDED_COPY) {
+                table->folded_name_offsets[i] = folded_names->len | DB_ENTRY_TABLE_FOLDED_COPY;
+                g_string_append_len(folded_names, folded, folded_len);
+            }
+            else {
+                folded_names_fit = false;
+            }
+            g_free(folded);
+            folded = NULL;
+        }
+
+        const char *ext = strrchr(node->name, '.');
+        if (!ext) {
+            table->extension_ids[i] = DB_ENTRY_TABLE_NO_EXTENSION;
+        }
+        else if (g_hash_table_lookup_extended(extension_ids, ext + 1, NULL, &id)) {
+            table->extension_ids[i] = GPOINTER_TO_UINT(id);
+        }
+        else if (table->extensions->len + 1 < DB_ENTRY_TABLE_EXTENSION_UNKNOWN) {
+            g_ptr_array_add(table->extensions, g_strdup(ext + 1));
+            table->extension_ids[i] = table->extensions->len;
+            g_hash_table_insert(extension_ids,
+                                g_ptr_array_index(table->extensions, table->extensions->len - 1),
+                                GUINT_TO_POINTER(table->extension_ids[i]));
+        }
+        else {
+            table->extension_ids[i] = DB_ENTRY_TABLE_EXTENSION_UNKNOWN;
+        }
+
+        if (node->is_dir) {
+            table->is_dir[i / 64] |= (uint64_t)1 << (i % 64);
+        }
+        BTreeNode *parent = node->parent;
+        table->parents[i] = parent && parent->parent ? parent->pos : DB_ENTRY_TABLE_NO_PARENT;
+        table->sizes[i] = node->size;
+        table->mtimes[i] = node->mtime;
+    }
+    table->name_offsets[num_entries] = offset;
+    g_hash_table_destroy(extension_ids);
+    extension_ids = NULL;
+
+    // the root of the location isn't part of the entries, its folders are where the subtrees start
+    for (uint32_t i = 0; i < num_entries; i++) {
+        if (table->parents[i] == DB_ENTRY_TABLE_NO_PARENT && db_entry_table_is_dir(table, i)) {
+            db_entry_table_add_folder_stats(table, i, darray_get_item(entries, i));
+        }
+    }
+
+    if (folded_names_fit) {
+        trace("[entry_table] folded copies of names: %zu bytes\n", (size_t)folded_names->len);
+        table->folded_names = g_string_free(folded_names, FALSE);
+    }
+    else {
+        // searches fold the names themselves then
+        trace("[entry_table] folded names don't fit into the table\n");
+        g_string_free(folded_names, TRUE);
+        free(table->folded_name_offsets);
+        table->folded_name_offsets = NULL;
+    }
+
+    trace("[entry_table] created table for %d entries\n", num_entries);
+    return table;
+}
+
+size_t
+db_entry_table_estimate_size(DynamicArray *entries, uint32_t num_entries, size_t *names_len) {
+    assert(entries != NULL);
+
+    size_t len = 0;
+    for (uint32_t i = 0; i < num_entries; i++) {
+        BTreeNode *node = darray_get_item(entries, i);
+        if (node) {
+            len += strlen(node->name) + 1;
+        }
+    }
+    if (names_len) {
+        *names_len = len;
+    }
+    // the offsets of the name and its folded version, the parent, size and mtime, the folder
+    // aggregates, the signature and the extension id. Most names are folded already, so their
+    // folded copies are left out.
+    const size_t entry_size = 2 * sizeof(uint32_t) + sizeof(uint32_t) + 2 * sizeof(int64_t) + 2 * sizeof(uint32_t)
+                            + sizeof(int64_t) + sizeof(uint64_t) + sizeof(uint16_t);
+    return len + (size_t)num_entries * entry_size + (num_entries / 64 + 1) * sizeof(uint64_t);
+}
+
+void
+db_entry_table_free(DatabaseEntryTable *table) {
+    if (!table) {
+        return;
+    }
+    free(table->names);
+    free(table->name_offsets);
+    g_free(table->folded_names);
+    free(table->folded_name_offsets);
+    free(table->is_dir);
+    free(table->parents);
+    free(table->sizes);
+    free(table->mtimes);
+    free(table->num_children);
+    free(table->num_files);
+    free(table->total_sizes);
+    free(table->signatures);
+    free(table->extension_ids);
+    if (table->extensions) {
+        g_ptr_array_free(table->extensions, TRUE);
+        table->extensions = NULL;
+    }
+    g_free(table->parent_paths);
+    free(table->parent_path_offsets);
+    g_mutex_clear(&table->parent_paths_mutex);
+    free(table);
+    table = NULL;
+}
+
+uint64_t *
+db_entry_table_get_extension_set(DatabaseEntryTable *table, char **extensions, bool match_case) {
+    assert(table != NULL);
+    assert(extensions != NULL);
+
+    GHashTable *wanted = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    for (char **e = extensions; *e; e++) {
+        g_hash_table_add(wanted, match_case ? g_strdup(*e) : g_ascii_strdown(*e, -1));
+    }
+    uint64_t *extension_set = calloc(DB_ENTRY_TABLE_EXTENSION_UNKNOWN / 64 + 1, sizeof(uint64_t));
+    assert(extension_set != NULL);
+    for (uint32_t i = 0; i < table->extensions->len; i++) {
+        const char *ext = g_ptr_array_index(table->extensions, i);
+        char *key = match_case ? NULL : g_ascii_strdown(ext, -1);
+        if (g_hash_table_contains(wanted, key ? key : ext)) {
+            const uint32_t id = i + 1;
+            extension_set[id / 64] |= (uint64_t)1 << (id % 64);
+        }
+        g_free(key);
+        key = NULL;
+    }
+    g_hash_table_destroy(wanted);
+    wanted = NULL;
+    return extension_set;
+}
+
+typedef struct {
+    DatabaseEntryTable *table;
+    DynamicArray *entries;
+    GString *paths;
+    // offset of the path of every folder among the entries, UINT32_MAX if it wasn't added yet
+    uint32_t *folder_offsets;
+    GPtrArray *roots;
+    GArray *root_offsets;
+} DatabaseEntryTablePathContext;
+
+static uint32_t
+db_entry_table_add_path(DatabaseEntryTablePathContext *ctx, const char *parent_path, const char *name) {
+    if (ctx->paths->len > UINT32_MAX - PATH_MAX) {
+        return UINT32_MAX;
+    }
+    const uint32_t offset = ctx->paths->len;
+    // paths are truncated at PATH_MAX, just like btree_node_get_path_full does
+    char path[PATH_MAX] = "";
+    if (parent_path) {
+        snprintf(path, sizeof(path), "%s/%s", parent_path, name);
+    }
+    else {
+        snprintf(path, sizeof(path), "%s", name);
+    }
+    g_string_append_len(ctx->paths, path, strlen(path) + 1);
+    return offset;
+}
+
+static uint32_t
+db_entry_table_get_root_offset(DatabaseEntryTablePathContext *ctx, BTreeNode *root) {
+    // location roots aren't entries, their path is just their name
+    for (uint32_t i = 0; i < ctx->roots->len; i++) {
+        if (g_ptr_array_index(ctx->roots, i) == root) {
+            return g_array_index(ctx->root_offsets, uint32_t, i);
+        }
+    }
+    const uint32_t offset = db_entry_table_add_path(ctx, NULL, root->name);
+    g_ptr_array_add(ctx->roots, root);
+    g_array_append_val(ctx->root_offsets, offset);
+    return offset;
+}
+
+// The folders are followed through the parents of the table rather than the nodes,
+// whose pos fields belong to the latest database, when several of them share the nodes.
+static uint32_t
+db_entry_table_get_folder_offset(DatabaseEntryTablePathContext *ctx, uint32_t folder) {
+    if (ctx->folder_offsets[folder] != UINT32_MAX) {
+        return ctx->folder_offsets[folder];
+    }
+
+    // the first ancestor with a known path isn't far away, siblings share their whole chain
+    uint32_t chain[PATH_MAX / 2];
+    uint32_t chain_len = 0;
+    uint32_t temp = folder;
+    while (temp != DB_ENTRY_TABLE_NO_PARENT && ctx->folder_offsets[temp] == UINT32_MAX &&
+           chain_len < G_N_ELEMENTS(chain)) {
+        chain[chain_len++] = temp;
+        temp = ctx->table->parents[temp];
+    }
+    uint32_t offset = 0;
+    if (temp == DB_ENTRY_TABLE_NO_PARENT) {
+        BTreeNode *node = darray_get_item(ctx->entries, chain[chain_len - 1]);
+        offset = db_entry_table_get_root_offset(ctx, node->parent);
+    }
+    else {
+        offset = db_entry_table_get_folder_offset(ctx, temp);
+    }
+    while (chain_len > 0 && offset != UINT32_MAX) {
+        const uint32_t idx = chain[--chain_len];
+        // the parent path might move when the paths grow, so it's copied first
+        char parent_path[PATH_MAX] = "";
+        g_strlcpy(parent_path, ctx->paths->str + offset, sizeof(parent_path));
+        offset = db_entry_table_add_path(ctx, parent_path, db_entry_table_get_name(ctx->table, idx));
+        ctx->folder_offsets[idx] = offset;
+    }
+    return offset;
+}
+
+bool
+db_entry_table_ensure_parent_paths(DatabaseEntryTable *table, DynamicArray *entries) {
+    assert(table != NULL);
+    assert(entries != NULL);
+
+    g_mutex_lock(&table->parent_paths_mutex);
+    if (table->parent_paths) {
+        g_mutex_unlock(&table->parent_paths_mutex);
+        return true;
+    }
+
+    const uint32_t num_entries = table->num_entries;
+    DatabaseEntryTablePathContext ctx = {0};
+    ctx.table = table;
+    ctx.entries = entries;
+    ctx.paths = g_string_sized_new(4096);
+    ctx.folder_offsets = malloc(MAX(num_entries, 1) * sizeof(uint32_t));
+    assert(ctx.folder_offsets != NULL);
+    memset(ctx.folder_offsets, 0xff, MAX(num_entries, 1) * sizeof(uint32_t));
+    ctx.roots = g_ptr_array_new();
+    ctx.root_offsets = g_array_new(FALSE, FALSE, sizeof(uint32_t));
+
+    uint32_t *parent_path_offsets = malloc(MAX(num_entries, 1) * sizeof(uint32_t));
+    assert(parent_path_offsets != NULL);
+
+    bool res = true;
+    for (uint32_t i = 0; i < num_entries; i++) {
+        const uint32_t parent = table->parents[i];
+        uint32_t offset = 0;
+        if (parent == DB_ENTRY_TABLE_NO_PARENT) {
+            BTreeNode *node = darray_get_item(entries, i);
+            offset = db_entry_table_get_root_offset(&ctx, node->parent);
+        }
+        else {
+            offset = db_entry_table_get_folder_offset(&ctx, parent);
+        }
+        if (offset == UINT32_MAX) {
+            trace("[entry_table] paths don't fit into the table\n");
+            res = false;
+            break;
+        }
+        parent_path_offsets[i] = offset;
+    }
+
+    free(ctx.folder_offsets);
+    g_ptr_array_free(ctx.roots, TRUE);
+    g_array_free(ctx.root_offsets, TRUE);
+    if (res) {
+        trace("[entry_table] built parent paths: %zu bytes\n", (size_t)ctx.paths->len);
+        table->parent_path_offsets = parent_path_offsets;
+        table->parent_paths = g_string_free(ctx.paths, FALSE);
+    }
+    else {
+        free(parent_path_offsets);
+        g_string_free(ctx.paths, TRUE);
+    }
+    g_mutex_unlock(&table->parent_paths_mutex);
+    return res;
+}
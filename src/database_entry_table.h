@@ -0,0 +1,184 @@
+/*
+   FSearch - A fast file search utility
+   Copyright © 2020 Christian Boxdörfer
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+   */
+
+#pragma once
+
+#include "array.h"
+#include "btree.h"
+#include <glib.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define DB_ENTRY_TABLE_NO_PARENT UINT32_MAX
+// extension ids of names without a dot and of names whose extension didn't get an id of its own
+#define DB_ENTRY_TABLE_NO_EXTENSION 0
+#define DB_ENTRY_TABLE_EXTENSION_UNKNOWN UINT16_MAX
+// set in folded_name_offsets for names which have a folded copy
+#define DB_ENTRY_TABLE_FOLDED_COPY ((uint32_t)1 << 31)
+
+// Packed copy of the search relevant data of all database entries,
+// in the same order as the entries array. Meant to be streamed through
+// linearly by the search workers, without touching the nodes.
+typedef struct _DatabaseEntryTable {
+    uint32_t num_entries;
+
+    // all names, each one NUL terminated
+    char *names;
+    // start of each name in names, the array has num_entries + 1 elements,
+    // so the length of a name is name_offsets[i + 1] - name_offsets[i] - 1
+    uint32_t *name_offsets;
+
+    // Normalized, lower case copies of the names for case insensitive UTF-8 searches.
+    // Only names which change when folded get a copy in folded_names, with
+    // DB_ENTRY_TABLE_FOLDED_COPY set in their folded_name_offsets entry.
+    // All others point to their name in names.
+    char *folded_names;
+    uint32_t *folded_name_offsets;
+
+    // one bit per entry, set for folders
+    uint64_t *is_dir;
+    // index of the parent entry or DB_ENTRY_TABLE_NO_PARENT for the
+    // children of a location root, which isn't part of the entries
+    uint32_t *parents;
+    int64_t *sizes;
+    int64_t *mtimes;
+    // Aggregates of every folder, all 0 for files: its number of children, the number of
+    // files anywhere below it and the sum of their sizes
+    uint32_t *num_children;
+    uint32_t *num_files;
+    int64_t *total_sizes;
+    // Bitmap of the bytes in the folded name of every entry, see db_entry_table_get_signature.
+    // Entries which lack a bit of the literals a token needs can't match it.
+    uint64_t *signatures;
+    // Id of the text behind the last dot of every name, the texts themselves are in extensions,
+    // where id i is element i - 1
+    uint16_t *extension_ids;
+    GPtrArray *extensions;
+
+    // Path of the parent folder of every entry, built on first use by
+    // db_entry_table_ensure_parent_paths. Every folder's path is stored once in
+    // parent_paths, parent_path_offsets[i] is where the one of entry i starts.
+    char *parent_paths;
+    uint32_t *parent_path_offsets;
+    GMutex parent_paths_mutex;
+} DatabaseEntryTable;
+
+DatabaseEntryTable *
+db_entry_table_new(DynamicArray *entries, uint32_t num_entries);
+
+void
+db_entry_table_free(DatabaseEntryTable *table);
+
+// Roughly the memory a table of the entries takes up, without the parent paths which are
+// built on demand. names_len is set to the length of all names.
+size_t
+db_entry_table_estimate_size(DynamicArray *entries, uint32_t num_entries, size_t *names_len);
+
+bool
+db_entry_table_ensure_parent_paths(DatabaseEntryTable *table, DynamicArray *entries);
+
+// Bitset over the extension ids with the bits of the given extensions set, free the result
+uint64_t *
+db_entry_table_get_extension_set(DatabaseEntryTable *table, char **extensions, bool match_case);
+
+static inline bool
+db_entry_table_extension_is_known(DatabaseEntryTable *table, uint32_t idx) {
+    return table->extension_ids[idx] != DB_ENTRY_TABLE_EXTENSION_UNKNOWN;
+}
+
+static inline bool
+db_entry_table_extension_is_in(DatabaseEntryTable *table, uint32_t idx, const uint64_t *extension_set) {
+    const uint16_t id = table->extension_ids[idx];
+    return extension_set[id / 64] & ((uint64_t)1 << (id % 64));
+}
+
+// Letters (regardless of their case) and digits get a bit of their own, all other bytes share the rest
+static inline uint64_t
+db_entry_table_get_signature_bit(unsigned char c) {
+    if (c >= 'a' && c <= 'z') {
+        return (uint64_t)1 << (c - 'a');
+    }
+    if (c >= 'A' && c <= 'Z') {
+        return (uint64_t)1 << (c - 'A');
+    }
+    if (c >= '0' && c <= '9') {
+        return (uint64_t)1 << (26 + c - '0');
+    }
+    return (uint64_t)1 << (36 + c % 28);
+}
+
+static inline uint64_t
+db_entry_table_get_signature(const char *str) {
+    uint64_t signature = 0;
+    for (const unsigned char *c = (const unsigned char *)str; *c != '\0'; c++) {
+        signature |= db_entry_table_get_signature_bit(*c);
+    }
+    return signature;
+}
+
+static inline const char *
+db_entry_table_get_name(DatabaseEntryTable *table, uint32_t idx) {
+    return table->names + table->name_offsets[idx];
+}
+
+static inline uint32_t
+db_entry_table_get_name_len(DatabaseEntryTable *table, uint32_t idx) {
+    return table->name_offsets[idx + 1] - table->name_offsets[idx] - 1;
+}
+
+static inline bool
+db_entry_table_has_folded_names(DatabaseEntryTable *table) {
+    return table->folded_names != NULL;
+}
+
+static inline const char *
+db_entry_table_get_folded_name(DatabaseEntryTable *table, uint32_t idx) {
+    const uint32_t offset = table->folded_name_offsets[idx];
+    if (offset & DB_ENTRY_TABLE_FOLDED_COPY) {
+        return table->folded_names + (offset & ~DB_ENTRY_TABLE_FOLDED_COPY);
+    }
+    return table->names + offset;
+}
+
+static inline bool
+db_entry_table_is_dir(DatabaseEntryTable *table, uint32_t idx) {
+    return table->is_dir[idx / 64] & ((uint64_t)1 << (idx % 64));
+}
+
+static inline bool
+db_entry_table_has_parent_paths(DatabaseEntryTable *table) {
+    return table->parent_paths != NULL;
+}
+
+// Same as btree_node_get_path_full, the parent paths must have been built
+static inline void
+db_entry_table_get_path_full(DatabaseEntryTable *table, uint32_t idx, char *path, size_t path_len) {
+    const char *parent_path = table->parent_paths + table->parent_path_offsets[idx];
+    const size_t parent_len = MIN(strlen(parent_path), path_len - 1);
+    memcpy(path, parent_path, parent_len);
+    if (parent_len + 1 >= path_len) {
+        path[parent_len] = '\0';
+        return;
+    }
+    path[parent_len] = '/';
+    const size_t name_len = MIN(db_entry_table_get_name_len(table, idx), path_len - parent_len - 2);
+    memcpy(path + parent_len + 1, db_entry_table_get_name(table, idx), name_len);
+    path[parent_len + 1 + name_len] = '\0';
+}
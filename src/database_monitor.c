@@ -0,0 +1,353 @@
+/*
+   FSearch - A fast file search utility
+   Copyright © 2020 Christian Boxdörfer
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+   */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "database_monitor.h"
+#include "debug.h"
+
+// changes are applied once no new events arrived for that long, but no later than
+// the maximum delay after the first one, so a constant stream doesn't hold them back forever
+#define DB_MONITOR_QUIET_TIME_US (1 * G_USEC_PER_SEC)
+#define DB_MONITOR_MAX_DELAY_US (5 * G_USEC_PER_SEC)
+// the updated database is saved at most this often, and once more when the monitor is freed
+#define DB_MONITOR_SAVE_INTERVAL_US (60 * G_USEC_PER_SEC)
+
+#define DB_MONITOR_FOLDER_EVENTS                                                                                       \
+    (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR |            \
+     IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+// files which are written to are picked up once they're closed, not with every single write
+#define DB_MONITOR_METADATA_EVENTS (IN_CLOSE_WRITE | IN_ATTRIB)
+
+struct _FsearchDatabaseMonitor {
+    FsearchDatabase *db;
+    FsearchDatabaseMonitorFunc callback;
+    void *user_data;
+
+    int inotify_fd;
+    // wakes up the thread when the monitor is freed
+    int wakeup_fd;
+    volatile gint stopped;
+    GThread *thread;
+    uint32_t mask;
+
+    // path of every watched folder by its watch descriptor and the other way round. The nodes
+    // belong to the database they came from, each update has copies of the changed folders.
+    GHashTable *folders_by_wd;
+    GHashTable *wds_by_folder;
+    // the paths of the folders with changes since the last update
+    GHashTable *changed_folders;
+    gint64 first_change_time;
+    gint64 last_change_time;
+    gint64 last_save_time;
+    // whether db has changes which aren't saved yet
+    bool unsaved;
+    bool out_of_watches;
+};
+
+static bool
+db_monitor_is_watched(FsearchDatabaseMonitor *monitor, const char *path) {
+    gpointer wd = NULL;
+    if (!g_hash_table_lookup_extended(monitor->wds_by_folder, path, NULL, &wd)) {
+        return false;
+    }
+    return !g_strcmp0(g_hash_table_lookup(monitor->folders_by_wd, wd), path);
+}
+
+static void
+db_monitor_watch_path(FsearchDatabaseMonitor *monitor, const char *path) {
+    if (monitor->out_of_watches || g_atomic_int_get(&monitor->stopped)) {
+        // adding the initial watches takes a while for large databases, don't hold up db_monitor_free
+        return;
+    }
+    const int wd = inotify_add_watch(monitor->inotify_fd, path, monitor->mask);
+    if (wd < 0) {
+        if (errno == ENOSPC) {
+            // fs.inotify.max_user_watches is too low, the remaining folders won't be updated
+            trace("[database_monitor] out of inotify watches at: %s\n", path);
+            monitor->out_of_watches = true;
+        }
+        return;
+    }
+    // a folder moved to a new path keeps its watch, the old path loses it
+    g_hash_table_insert(monitor->folders_by_wd, GINT_TO_POINTER(wd), g_strdup(path));
+    g_hash_table_insert(monitor->wds_by_folder, g_strdup(path), GINT_TO_POINTER(wd));
+}
+
+static void
+db_monitor_add_watch(BTreeNode *folder, void *user_data) {
+    char path[PATH_MAX] = "";
+    if (btree_node_get_path_full(folder, path, sizeof(path))) {
+        db_monitor_watch_path(user_data, path);
+    }
+}
+
+static void
+db_monitor_remove_watch(BTreeNode *folder, void *user_data) {
+    FsearchDatabaseMonitor *monitor = user_data;
+    char path[PATH_MAX] = "";
+    if (!btree_node_get_path_full(folder, path, sizeof(path))) {
+        return;
+    }
+    g_hash_table_remove(monitor->changed_folders, path);
+
+    gpointer wd = NULL;
+    if (!g_hash_table_lookup_extended(monitor->wds_by_folder, path, NULL, &wd)) {
+        return;
+    }
+    g_hash_table_remove(monitor->wds_by_folder, path);
+    if (!g_strcmp0(g_hash_table_lookup(monitor->folders_by_wd, wd), path)) {
+        g_hash_table_remove(monitor->folders_by_wd, wd);
+        inotify_rm_watch(monitor->inotify_fd, GPOINTER_TO_INT(wd));
+    }
+}
+
+static void
+db_monitor_folder_changed(FsearchDatabaseMonitor *monitor, const char *path) {
+    const gint64 now = g_get_monotonic_time();
+    if (g_hash_table_size(monitor->changed_folders) == 0) {
+        monitor->first_change_time = now;
+    }
+    monitor->last_change_time = now;
+    g_hash_table_add(monitor->changed_folders, g_strdup(path));
+}
+
+// false if events were lost
+static bool
+db_monitor_handle_event(FsearchDatabaseMonitor *monitor, const struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        return false;
+    }
+    gpointer wd = GINT_TO_POINTER(event->wd);
+    const char *watched_path = g_hash_table_lookup(monitor->folders_by_wd, wd);
+    if (!watched_path) {
+        return true;
+    }
+    char *path = g_strdup(watched_path);
+    if (event->mask & IN_IGNORED) {
+        // the folder is gone or unmounted, the kernel dropped its watch already
+        g_hash_table_remove(monitor->folders_by_wd, wd);
+        g_hash_table_remove(monitor->wds_by_folder, path);
+    }
+    if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        // That's a change of the parent as well, which might have no watch of its own. The parent
+        // of a location root is no folder of the database, it's skipped by the update.
+        char *parent = g_path_get_dirname(path);
+        db_monitor_folder_changed(monitor, parent);
+        g_free(parent);
+    }
+    // Once the folder moved away, whatever has its path now is read again and watched anew,
+    // e.g. a new folder of the same name.
+    db_monitor_folder_changed(monitor, path);
+    g_free(path);
+    return true;
+}
+
+// false if events were lost
+static bool
+db_monitor_read_events(FsearchDatabaseMonitor *monitor) {
+    char buffer[16 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (true) {
+        const ssize_t len = read(monitor->inotify_fd, buffer, sizeof(buffer));
+        if (len <= 0) {
+            return true;
+        }
+        for (char *ptr = buffer; ptr < buffer + len;) {
+            const struct inotify_event *event = (const struct inotify_event *)ptr;
+            if (!db_monitor_handle_event(monitor, event)) {
+                return false;
+            }
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+static void
+db_monitor_apply_changes(FsearchDatabaseMonitor *monitor) {
+    // the removed folders are dropped from the changed ones during the update, so they're copied
+    GPtrArray *paths = g_ptr_array_new_with_free_func(g_free);
+    GHashTableIter iter;
+    gpointer path = NULL;
+    g_hash_table_iter_init(&iter, monitor->changed_folders);
+    while (g_hash_table_iter_next(&iter, &path, NULL)) {
+        g_ptr_array_add(paths, g_strdup(path));
+    }
+
+    FsearchDatabase *db =
+        db_new_with_changed_folders(monitor->db, paths, db_monitor_add_watch, db_monitor_remove_watch, monitor);
+    g_ptr_array_free(paths, TRUE);
+    paths = NULL;
+
+    // the others lost their watch if they were replaced by a new folder
+    g_hash_table_iter_init(&iter, monitor->changed_folders);
+    while (g_hash_table_iter_next(&iter, &path, NULL)) {
+        if (!db_monitor_is_watched(monitor, path) && db_has_folder(db, path)) {
+            db_monitor_watch_path(monitor, path);
+        }
+    }
+    g_hash_table_remove_all(monitor->changed_folders);
+
+    db_unref(monitor->db);
+    monitor->db = db;
+    monitor->unsaved = true;
+    db_ref(db);
+    monitor->callback(db, monitor->user_data);
+}
+
+static void
+db_monitor_save(FsearchDatabaseMonitor *monitor) {
+    db_save_locations_async(monitor->db);
+    monitor->last_save_time = g_get_monotonic_time();
+    monitor->unsaved = false;
+}
+
+// when the changes collected so far are applied: once nothing changed for a while, but no later than
+// some time after the first change
+static gint64
+db_monitor_get_deadline(FsearchDatabaseMonitor *monitor) {
+    return MIN(monitor->last_change_time + DB_MONITOR_QUIET_TIME_US,
+               monitor->first_change_time + DB_MONITOR_MAX_DELAY_US);
+}
+
+static gpointer
+db_monitor_thread(gpointer user_data) {
+    FsearchDatabaseMonitor *monitor = user_data;
+
+    db_foreach_folder(monitor->db, db_monitor_add_watch, monitor);
+    trace("[database_monitor] watching %u folders\n", g_hash_table_size(monitor->folders_by_wd));
+
+    while (true) {
+        int timeout = -1;
+        if (g_hash_table_size(monitor->changed_folders) > 0) {
+            // rounded up, so poll doesn't return just before the deadline
+            timeout = (int)MAX((db_monitor_get_deadline(monitor) - g_get_monotonic_time() + 999) / 1000, 0);
+        }
+        else if (monitor->unsaved) {
+            const gint64 save_time = monitor->last_save_time + DB_MONITOR_SAVE_INTERVAL_US;
+            timeout = (int)MAX((save_time - g_get_monotonic_time() + 999) / 1000, 0);
+        }
+
+        struct pollfd fds[2] = {
+            {.fd = monitor->inotify_fd, .events = POLLIN},
+            {.fd = monitor->wakeup_fd, .events = POLLIN},
+        };
+        const int res = poll(fds, G_N_ELEMENTS(fds), timeout);
+        if (res < 0 && errno != EINTR) {
+            trace("[database_monitor] poll failed: %s\n", strerror(errno));
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            break;
+        }
+        if (fds[0].revents & POLLIN && !db_monitor_read_events(monitor)) {
+            trace("[database_monitor] event queue overflown\n");
+            g_hash_table_remove_all(monitor->changed_folders);
+            monitor->callback(NULL, monitor->user_data);
+            continue;
+        }
+        // checked after every wakeup, a steady stream of events would otherwise delay the changes forever
+        if (g_hash_table_size(monitor->changed_folders) > 0
+            && g_get_monotonic_time() >= db_monitor_get_deadline(monitor)) {
+            db_monitor_apply_changes(monitor);
+        }
+        if (monitor->unsaved && g_get_monotonic_time() >= monitor->last_save_time + DB_MONITOR_SAVE_INTERVAL_US) {
+            db_monitor_save(monitor);
+        }
+    }
+    return NULL;
+}
+
+FsearchDatabaseMonitor *
+db_monitor_new(FsearchDatabase *db, FsearchDatabaseMonitorFunc callback, void *user_data) {
+    assert(db != NULL);
+    assert(callback != NULL);
+
+    const int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        trace("[database_monitor] inotify not available: %s\n", strerror(errno));
+        return NULL;
+    }
+    const int wakeup_fd = eventfd(0, EFD_CLOEXEC);
+    if (wakeup_fd < 0) {
+        close(inotify_fd);
+        return NULL;
+    }
+
+    FsearchDatabaseMonitor *monitor = g_new0(FsearchDatabaseMonitor, 1);
+    db_ref(db);
+    monitor->db = db;
+    monitor->callback = callback;
+    monitor->user_data = user_data;
+    monitor->inotify_fd = inotify_fd;
+    monitor->wakeup_fd = wakeup_fd;
+    monitor->mask = DB_MONITOR_FOLDER_EVENTS;
+    if (!db_get_flags(db).names_only) {
+        monitor->mask |= DB_MONITOR_METADATA_EVENTS;
+    }
+    if (db_get_flags(db).follow_symlinks) {
+        // the folders behind links are watched through the links
+        monitor->mask &= ~IN_DONT_FOLLOW;
+    }
+    monitor->folders_by_wd = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+    monitor->wds_by_folder = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    monitor->changed_folders = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    // the database was just loaded, scanned or saved
+    monitor->last_save_time = g_get_monotonic_time();
+    monitor->thread = g_thread_new("fsearch_db_monitor", db_monitor_thread, monitor);
+    return monitor;
+}
+
+void
+db_monitor_free(FsearchDatabaseMonitor *monitor) {
+    if (!monitor) {
+        return;
+    }
+    g_atomic_int_set(&monitor->stopped, 1);
+    const uint64_t wakeup = 1;
+    if (write(monitor->wakeup_fd, &wakeup, sizeof(wakeup)) != sizeof(wakeup)) {
+        trace("[database_monitor] failed to wake up the monitor thread\n");
+    }
+    g_thread_join(monitor->thread);
+    monitor->thread = NULL;
+    if (monitor->unsaved) {
+        // db_save_wait waits for it
+        db_monitor_save(monitor);
+    }
+
+    // closing the inotify descriptor drops all of its watches
+    close(monitor->inotify_fd);
+    close(monitor->wakeup_fd);
+    g_hash_table_destroy(monitor->folders_by_wd);
+    g_hash_table_destroy(monitor->wds_by_folder);
+    g_hash_table_destroy(monitor->changed_folders);
+    db_unref(monitor->db);
+    monitor->db = NULL;
+    g_free(monitor);
+    monitor = NULL;
+}
@@ -0,0 +1,39 @@
+/*
+   FSearch - A fast file search utility
+   Copyright © 2020 Christian Boxdörfer
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+   */
+
+#pragma once
+
+#include "database.h"
+#include <stdbool.h>
+
+// Keeps a database up to date with inotify watches on all of its folders. Changes are
+// collected until things calm down for a moment and then applied in one go, see
+// db_new_with_changed_folders. The updated database is saved every minute at most, and
+// once more when the monitor is freed.
+typedef struct _FsearchDatabaseMonitor FsearchDatabaseMonitor;
+
+// Called from the monitor thread with a new reference to the updated database.
+// db is NULL if events were lost and the database needs a full rescan.
+typedef void (*FsearchDatabaseMonitorFunc)(FsearchDatabase *db, void *user_data);
+
+// NULL if inotify isn't available
+FsearchDatabaseMonitor *
+db_monitor_new(FsearchDatabase *db, FsearchDatabaseMonitorFunc callback, void *user_data);
+
+void
+db_monitor_free(FsearchDatabaseMonitor *monitor);
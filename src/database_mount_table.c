@@ -0,0 +1,223 @@
+/*
+   FSearch - A fast file search utility
+   Copyright © 2020 Christian Boxdörfer
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+   */
+
+
+#define _GNU_SOURCE
+
+#include "database_mount_table.h"
+#include "debug.h"
+
+#include <assert.h>
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/sysmacros.h>
+
+struct DatabaseMountTable {
+    GPtrArray *mounts;
+    // path -> topmost DatabaseMount mounted there
+    GHashTable *mounts_by_path;
+    // dev_t -> first DatabaseMount of the device
+    GHashTable *mounts_by_device;
+    uint32_t num_devices;
+};
+
+static const char *virtual_fs_types[] = {
+    "autofs", "binfmt_misc", "bpf", "cgroup", "cgroup2", "configfs", "debugfs", "devpts",
+    "devtmpfs", "efivarfs", "fusectl", "hugetlbfs", "mqueue", "nfsd", "nsfs", "proc", "pstore",
+    "rpc_pipefs", "securityfs", "selinuxfs", "sysfs", "tracefs", NULL,
+};
+
+static const char *remote_fs_types[] = {
+    "9p", "afs", "ceph", "cifs", "davfs", "glusterfs", "lustre", "ncpfs", "nfs", "nfs4", "smb3",
+    "smbfs", "fuse.davfs2", "fuse.rclone", "fuse.s3fs", "fuse.sshfs", "fuse.gvfsd-fuse", NULL,
+};
+
+static bool
+db_mount_fs_type_is_one_of(const char *fs_type, const char **types) {
+    for (uint32_t i = 0; types[i]; i++) {
+        if (!strcmp(fs_type, types[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// mountinfo writes spaces, tabs, newlines and backslashes in paths as octal escapes like \040
+static void
+db_mount_unescape(char *str) {
+    char *out = str;
+    for (const char *in = str; *in; out++) {
+        if (in[0] == '\\' && in[1] >= '0' && in[1] <= '3' && in[2] >= '0' && in[2] <= '7' && in[3] >= '0'
+            && in[3] <= '7') {
+            *out = (char)(((in[1] - '0') << 6) | ((in[2] - '0') << 3) | (in[3] - '0'));
+            in += 4;
+        }
+        else {
+            *out = *in++;
+        }
+    }
+    *out = '\0';
+}
+
+static void
+db_mount_free(DatabaseMount *mount) {
+    g_free(mount->path);
+    g_free(mount->fs_type);
+    g_free(mount);
+}
+
+// A line looks like: 36 35 98:0 /root /mnt/point rw,noatime shared:1 - ext4 /dev/sda1 rw
+// with any number of optional fields before the separator
+static DatabaseMount *
+db_mount_parse(char *line) {
+    g_strchomp(line);
+    char **fields = g_strsplit(line, " ", -1);
+    const guint num_fields = g_strv_length(fields);
+    guint separator = 6;
+    while (separator < num_fields && strcmp(fields[separator], "-")) {
+        separator++;
+    }
+    unsigned int major_num = 0;
+    unsigned int minor_num = 0;
+    if (separator + 1 >= num_fields || sscanf(fields[2], "%u:%u", &major_num, &minor_num) != 2) {
+        g_strfreev(fields);
+        return NULL;
+    }
+
+    DatabaseMount *mount = g_new0(DatabaseMount, 1);
+    db_mount_unescape(fields[4]);
+    const size_t path_len = strlen(fields[4]);
+    mount->path = path_len > 1 && fields[4][path_len - 1] == '/' ? g_strndup(fields[4], path_len - 1)
+                                                                 : g_strdup(fields[4]);
+    mount->fs_type = g_strdup(fields[separator + 1]);
+    mount->device = makedev(major_num, minor_num);
+    mount->is_virtual = db_mount_fs_type_is_one_of(mount->fs_type, virtual_fs_types);
+    mount->is_remote = db_mount_fs_type_is_one_of(mount->fs_type, remote_fs_types);
+    g_strfreev(fields);
+    return mount;
+}
+
+static guint
+db_mount_device_hash(gconstpointer key) {
+    const dev_t device = *(const dev_t *)key;
+    return g_int64_hash(&(gint64){(gint64)device});
+}
+
+static gboolean
+db_mount_device_equal(gconstpointer a, gconstpointer b) {
+    return *(const dev_t *)a == *(const dev_t *)b;
+}
+
+DatabaseMountTable *
+db_mount_table_new(void) {
+    DatabaseMountTable *table = g_new0(DatabaseMountTable, 1);
+    table->mounts = g_ptr_array_new_with_free_func((GDestroyNotify)db_mount_free);
+    table->mounts_by_path = g_hash_table_new(g_str_hash, g_str_equal);
+    table->mounts_by_device = g_hash_table_new(db_mount_device_hash, db_mount_device_equal);
+
+    FILE *fp = fopen("/proc/self/mountinfo", "re");
+    if (!fp) {
+        trace("[database_mount_table] failed to open mountinfo\n");
+        return table;
+    }
+    char *line = NULL;
+    size_t line_size = 0;
+    while (getline(&line, &line_size, fp) > 0) {
+        DatabaseMount *mount = db_mount_parse(line);
+        if (!mount) {
+            continue;
+        }
+        // the mounts are listed in the order they were mounted, so later ones are on top
+        g_ptr_array_add(table->mounts, mount);
+        g_hash_table_insert(table->mounts_by_path, mount->path, mount);
+        DatabaseMount *device_mount = g_hash_table_lookup(table->mounts_by_device, &mount->device);
+        if (device_mount) {
+            mount->device_idx = device_mount->device_idx;
+        }
+        else {
+            mount->device_idx = table->num_devices++;
+            g_hash_table_insert(table->mounts_by_device, &mount->device, mount);
+        }
+    }
+    free(line);
+    fclose(fp);
+    return table;
+}
+
+void
+db_mount_table_free(DatabaseMountTable *table) {
+    if (!table) {
+        return;
+    }
+    g_hash_table_destroy(table->mounts_by_path);
+    g_hash_table_destroy(table->mounts_by_device);
+    g_ptr_array_free(table->mounts, TRUE);
+    g_free(table);
+}
+
+const DatabaseMount *
+db_mount_table_lookup(DatabaseMountTable *table, const char *path) {
+    assert(table != NULL);
+    assert(path != NULL);
+    return g_hash_table_lookup(table->mounts_by_path, path[0] ? path : "/");
+}
+
+const DatabaseMount *
+db_mount_table_find(DatabaseMountTable *table, const char *path) {
+    assert(table != NULL);
+    assert(path != NULL);
+
+    // the mount of the closest of path and its parents which is a mount point
+    char *parent = g_strdup(path);
+    const DatabaseMount *mount = NULL;
+    while (!(mount = db_mount_table_lookup(table, parent))) {
+        char *slash = strrchr(parent, '/');
+        if (!slash || parent[0] == '\0' || !strcmp(parent, "/")) {
+            break;
+        }
+        *(slash == parent ? slash + 1 : slash) = '\0';
+    }
+    g_free(parent);
+    return mount;
+}
+
+const DatabaseMount *
+db_mount_table_lookup_device(DatabaseMountTable *table, dev_t device) {
+    assert(table != NULL);
+    return g_hash_table_lookup(table->mounts_by_device, &device);
+}
+
+uint32_t
+db_mount_table_get_num_devices(DatabaseMountTable *table) {
+    assert(table != NULL);
+    return table->num_devices;
+}
+
+uint32_t
+db_mount_table_get_num_mounts(DatabaseMountTable *table) {
+    assert(table != NULL);
+    return table->mounts->len;
+}
+
+const DatabaseMount *
+db_mount_table_get_mount(DatabaseMountTable *table, uint32_t idx) {
+    assert(table != NULL);
+    assert(idx < table->mounts->len);
+    return g_ptr_array_index(table->mounts, idx);
+}
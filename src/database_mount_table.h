@@ -0,0 +1,68 @@
+/*
+   FSearch - A fast file search utility
+   Copyright © 2020 Christian Boxdörfer
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+   */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct DatabaseMountTable DatabaseMountTable;
+
+typedef struct DatabaseMount {
+    // where it's mounted, without a trailing slash except for the root
+    char *path;
+    char *fs_type;
+    dev_t device;
+    // the mounts of the same device share it, it's below db_mount_table_get_num_devices
+    uint32_t device_idx;
+    // proc, sysfs and the like, their entries don't exist on any disk
+    bool is_virtual;
+    // nfs, cifs and other network file systems, reading them may take a lot longer than local disks
+    bool is_remote;
+} DatabaseMount;
+
+// Reads the mounts of the process from /proc/self/mountinfo. The table is empty if that fails.
+DatabaseMountTable *
+db_mount_table_new(void);
+
+void
+db_mount_table_free(DatabaseMountTable *table);
+
+// The mount whose mount point is path, NULL if there's none. If several are mounted on top of
+// each other it's the topmost one, which is the one that's visible.
+const DatabaseMount *
+db_mount_table_lookup(DatabaseMountTable *table, const char *path);
+
+// The mount path lies on, NULL if the table is empty
+const DatabaseMount *
+db_mount_table_find(DatabaseMountTable *table, const char *path);
+
+// A mount of device, NULL if there's none
+const DatabaseMount *
+db_mount_table_lookup_device(DatabaseMountTable *table, dev_t device);
+
+uint32_t
+db_mount_table_get_num_devices(DatabaseMountTable *table);
+
+uint32_t
+db_mount_table_get_num_mounts(DatabaseMountTable *table);
+
+const DatabaseMount *
+db_mount_table_get_mount(DatabaseMountTable *table, uint32_t idx);
@@ -22,7 +22,6 @@
 #include <assert.h>
 #include <ctype.h>
 #include <fnmatch.h>
-#include <pcre.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,391 +29,2374 @@
 #include <unistd.h>
 
 #include "debug.h"
+#include "fsearch_stats.h"
 #include "fsearch_timer.h"
 #include "fsearch_window.h"
 #include "string_utils.h"
 #include "token.h"
 
-struct _DatabaseSearchEntry {
-    BTreeNode *node;
+// entries sampled to estimate how many entries a token matches
+#define DB_SEARCH_SELECTIVITY_SAMPLES 1024
+// entries the workers take from the shared cursor at once
+#define DB_SEARCH_CHUNK_SIZE 4096
+// entries of a chunk searched between two checks whether a new query came in
+#define DB_SEARCH_CANCEL_CHECK_INTERVAL 256
+// how often the matches found so far are handed out while a search is running
+#define DB_SEARCH_STREAM_INTERVAL_MS 16
+// matches are stored in pages of that many entry indices, the matches of a chunk are never split up
+#define DB_SEARCH_BUFFER_PAGE_SIZE (64 * 1024)
+// searches whose matches are kept, and how many matches they may hold together
+#define DB_SEARCH_CACHE_SIZE 32
+#define DB_SEARCH_CACHE_MAX_MATCHES (4 * 1024 * 1024)
+// The score of a match of a ranked search: how well the name matches in the top bits, then the boosts
+// for shallow and recently modified entries, then how short the name is
+#define DB_SEARCH_RANK_QUALITY_SHIFT 20
+#define DB_SEARCH_RANK_BOOST_SHIFT 12
+#define DB_SEARCH_RANK_MAX_DEPTH 15
+#define DB_SEARCH_RANK_MAX_RECENCY 15
+#define DB_SEARCH_RANK_MAX_NAME_LEN 4095
+
+typedef struct search_chunk_s {
+    uint32_t shard;
+    uint32_t start_pos;
+    uint32_t end_pos;
+    // indices in the shard of the matches, they live in the buffer of the worker which searched the chunk
+    uint32_t *results;
+    uint32_t num_results;
+    bool done;
+} search_chunk_t;
+
+typedef struct search_shard_s {
+    DatabaseShard *shard;
+    const uint32_t *global_indices;
+    // indices in the shard of the entries to search, NULL to search all of them
+    uint32_t *candidates;
+    // the extensions the filter accepts, if it only checks those
+    uint64_t *extension_set;
+    // the same for every ext: token of the query, NULL for all others
+    uint64_t **token_extension_sets;
+    uint32_t num_token_extension_sets;
+    uint32_t num_entries;
+    // the chunks of the shard are [first_chunk, first_chunk + num_chunks) of the search
+    uint32_t first_chunk;
+    uint32_t num_chunks;
+
+    // The first num_chunks_in_order chunks of the shard are finished.
+    // With max_results no more than the first max_results matches of every shard are used.
+    // Once the finished chunks in front hold that many, every chunk of the shard after
+    // last_needed_chunk is skipped or left right away.
+    uint32_t num_chunks_in_order;
+    uint32_t num_results_in_order;
+    volatile gint last_needed_chunk;
+} search_shard_t;
+
+// How far the matches of a shard got merged, chunks from end on aren't merged yet
+typedef struct search_cursor_s {
+    uint32_t chunk;
     uint32_t pos;
+    uint32_t end;
+} search_cursor_t;
+
+// Pages which only ever get as many matches as there are, instead of a slot for
+// every entry searched. They're reused by the next search.
+typedef struct _DatabaseSearchBuffer {
+    GPtrArray *pages;
+    uint32_t num_used_pages;
+    // used slots of the last used page
+    uint32_t pos;
+} DatabaseSearchBuffer;
+
+struct _DatabaseSearchService {
+    FsearchThreadPool *pool;
+    volatile gint ref_count;
+
+    GThread *search_thread;
+    bool search_thread_terminate;
+    // set once nobody waits for the running query any more, its workers give up before their next chunk
+    volatile gint search_terminate;
+    GMutex query_mutex;
+    GCond search_thread_start_cond;
+    // signalled whenever the running query's results were handed out
+    GCond search_done_cond;
+
+    // the searches with a query waiting, in the order they get their turn
+    GQueue *pending;
+    // the searches which wait for the running query, the first one's query is the one searched
+    // and the others are identical. A search which moved on leaves NULL in the first slot.
+    GPtrArray *running_searches;
+    GPtrArray *running_queries;
+    // matches of the running query were handed out already, too late for anyone to join it
+    bool running_streamed;
+
+    // matches of recently completed searches, most recently used first.
+    // The same query is answered from it right away, a query which only narrows
+    // one of them down (e.g. more characters typed) is run on its matches only.
+    GQueue *cache;
+    uint32_t cache_num_matches;
+
+    // one per worker for the matches of the chunks it searches, kept from one search to the next
+    DatabaseSearchBuffer *buffers;
+    uint32_t num_buffers;
 };
 
-typedef struct search_context_s {
+typedef struct search_context_s search_context_t;
+
+// what a fuzzy token's name needs in its signature, see db_entry_table_get_signature
+typedef struct search_fuzzy_signature_s {
+    uint64_t mask;
+    // every edit loses at most one bit of mask
+    uint32_t min_bits;
+} search_fuzzy_signature_t;
+
+// a match of a ranked search, with its index in the database
+typedef struct search_ranked_s {
+    uint32_t score;
+    uint32_t idx;
+} search_ranked_t;
+
+// The best matches of a ranked search so far, as a heap with the worst of them on top
+typedef struct search_ranking_s {
+    search_ranked_t *matches;
+    uint32_t len;
+    uint32_t size;
+    // no more than that many are kept, 0 for all of them
+    uint32_t max_len;
+} search_ranking_t;
+
+// How db_search_chunk_literal_loop matches literal text token against the names
+typedef enum {
+    SEARCH_LITERAL_NONE = 0,
+    // the text as it is
+    SEARCH_LITERAL_CASE,
+    // ASCII text in any case
+    SEARCH_LITERAL_ICASE,
+    // the text in the folded names
+    SEARCH_LITERAL_FOLDED,
+    // the token don't all share one of the above
+    SEARCH_LITERAL_MIXED,
+} search_literal_t;
+
+typedef struct search_worker_s {
+    search_context_t *ctx;
+    DatabaseSearchBuffer *buffer;
+    // the best matches of the chunks this worker searched, if the search is ranked
+    search_ranking_t ranking;
+} search_worker_t;
+
+// Shared by all workers of a search. The entries of every shard are split into chunks,
+// which the workers take from next_chunk until none are left, so a slow part of the
+// database (long paths, deep directories, ...) doesn't hold up the rest. The chunks
+// of all shards are handed out by where they start in the database, so the shards
+// progress alike and their matches can be merged while the search is running.
+struct search_context_s {
     FsearchQuery *query;
-    BTreeNode **results;
-    bool *terminate;
-    uint32_t num_results;
-    uint32_t start_pos;
-    uint32_t end_pos;
-} search_thread_context_t;
+    search_worker_t *workers;
+    uint32_t num_workers;
+    volatile gint *terminate;
+    search_shard_t *shards;
+    uint32_t num_shards;
+    // the signature bits every match has, see db_entry_table_get_signature
+    uint64_t signature_mask;
+    // for every token, if any of them is fuzzy
+    search_fuzzy_signature_t *fuzzy_signatures;
+    // ranked searches need all matches, otherwise it's the query's max_results
+    uint32_t max_results;
+    bool is_ranked;
+    // set if all token are literal text about the names and there are no filter token,
+    // with how each token is matched
+    search_literal_t literal;
+    search_literal_t *token_literals;
+    // the time which the modification times are ranked against
+    int64_t now;
+    search_chunk_t *chunks;
+    uint32_t *chunk_order;
+    uint32_t num_chunks;
+    volatile gint next_chunk;
+    // the matches merged so far
+    search_cursor_t *cursors;
+
+    GMutex progress_mutex;
+    GCond progress_cond;
+};
 
 static DatabaseSearchResult *
-db_search(DatabaseSearch *search, FsearchQuery *q);
+db_search(DatabaseSearchService *service, FsearchQuery *q);
 
 static DatabaseSearchResult *
 db_search_empty(FsearchQuery *query);
 
-DatabaseSearchEntry *
-db_search_entry_new(BTreeNode *node, uint32_t pos);
+static void
+db_search_cache_clear(DatabaseSearchService *service);
+
+static bool
+db_search_filter_equal(FsearchFilter *f1, FsearchFilter *f2);
+
+static bool
+db_search_flags_equal(FsearchQueryFlags *f1, FsearchQueryFlags *f2);
+
+static void
+db_search_notify_cancelled(FsearchQuery *query) {
+    if (query->db) {
+        db_unref(query->db);
+    }
+    if (query->callback_cancelled) {
+        query->callback_cancelled(query->callback_cancelled_data);
+    }
+}
+
+static DatabaseSearchResult *
+db_search_result_copy(DatabaseSearchResult *result) {
+    DatabaseSearchResult *copy = calloc(1, sizeof(DatabaseSearchResult));
+    assert(copy != NULL);
+    *copy = *result;
+    if (result->results) {
+        copy->results = g_array_sized_new(FALSE, FALSE, sizeof(uint32_t), result->results->len);
+        g_array_append_vals(copy->results, result->results->data, result->results->len);
+    }
+    return copy;
+}
+
+static void
+db_search_result_free(DatabaseSearchResult *result) {
+    if (result->results) {
+        g_array_free(result->results, TRUE);
+        result->results = NULL;
+    }
+    free(result);
+    result = NULL;
+}
+
+// Both have the same results, so one search can answer both of them
+static bool
+db_search_query_equal(FsearchQuery *q1, FsearchQuery *q2) {
+    return q1->db == q2->db && !g_strcmp0(q1->text, q2->text) && db_search_flags_equal(&q1->flags, &q2->flags)
+        && db_search_filter_equal(q1->filter, q2->filter) && q1->max_results == q2->max_results
+        && q1->pass_on_empty_query == q2->pass_on_empty_query
+        && (q1->callback_partial != NULL) == (q2->callback_partial != NULL);
+}
+
+static bool
+db_search_service_is_running(DatabaseSearchService *service, DatabaseSearch *search) {
+    for (uint32_t i = 0; i < service->running_searches->len; i++) {
+        if (g_ptr_array_index(service->running_searches, i) == search) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether anyone but except still waits for the running query
+static bool
+db_search_service_has_waiters(DatabaseSearchService *service, DatabaseSearch *except) {
+    for (uint32_t i = 0; i < service->running_searches->len; i++) {
+        DatabaseSearch *search = g_ptr_array_index(service->running_searches, i);
+        if (search && search != except) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void
+db_search_service_add_running(DatabaseSearchService *service, DatabaseSearch *search, FsearchQuery *query) {
+    g_ptr_array_add(service->running_searches, search);
+    g_ptr_array_add(service->running_queries, query);
+}
+
+// search doesn't wait for the running query any more. Only the query of a search which
+// joined it is dropped right away, the first one's is still searched.
+static void
+db_search_service_leave_running(DatabaseSearchService *service, DatabaseSearch *search) {
+    for (uint32_t i = 0; i < service->running_searches->len; i++) {
+        if (g_ptr_array_index(service->running_searches, i) != search) {
+            continue;
+        }
+        if (i == 0) {
+            g_ptr_array_index(service->running_searches, 0) = NULL;
+            continue;
+        }
+        FsearchQuery *query = g_ptr_array_index(service->running_queries, i);
+        db_search_notify_cancelled(query);
+        fsearch_query_free(query);
+        g_ptr_array_remove_index(service->running_searches, i);
+        g_ptr_array_remove_index(service->running_queries, i);
+        i--;
+    }
+}
+
+// Hands result to every search waiting for the running query, NULL tells them it was cancelled.
+// The last one gets result itself, the others a copy of it.
+static void
+db_search_service_deliver(DatabaseSearchService *service, DatabaseSearchResult *result, bool partial) {
+    int32_t last = -1;
+    for (uint32_t i = 0; i < service->running_searches->len; i++) {
+        if (g_ptr_array_index(service->running_searches, i)) {
+            last = (int32_t)i;
+        }
+    }
+    for (uint32_t i = 0; i < service->running_searches->len; i++) {
+        FsearchQuery *query = g_ptr_array_index(service->running_queries, i);
+        const bool is_waiting = g_ptr_array_index(service->running_searches, i) != NULL;
+        if (result && is_waiting) {
+            DatabaseSearchResult *r = (int32_t)i == last ? result : db_search_result_copy(result);
+            r->cb_data = query->callback_data;
+            if (partial) {
+                db_ref(query->db);
+                r->db = query->db;
+                query->callback_partial(r);
+            }
+            else {
+                // the query's reference goes to the result
+                r->db = query->db;
+                query->callback(r);
+            }
+        }
+        else if (!partial) {
+            db_search_notify_cancelled(query);
+        }
+        if (!partial) {
+            fsearch_query_free(query);
+        }
+    }
+    if (result && last < 0) {
+        db_search_result_free(result);
+    }
+}
+
+// Every search with an identical query waiting gets the results of query too
+static void
+db_search_service_join_pending(DatabaseSearchService *service, FsearchQuery *query) {
+    GList *link = g_queue_peek_head_link(service->pending);
+    while (link) {
+        GList *next = link->next;
+        DatabaseSearch *search = link->data;
+        if (db_search_query_equal(search->query_ctx, query)) {
+            db_search_service_add_running(service, search, search->query_ctx);
+            search->query_ctx = NULL;
+            g_queue_delete_link(service->pending, link);
+            fsearch_stats_add(FSEARCH_STATS_SEARCH_JOINED, 1);
+        }
+        link = next;
+    }
+}
+
+static gpointer
+db_search_thread(gpointer user_data) {
+    DatabaseSearchService *service = user_data;
+
+    g_mutex_lock(&service->query_mutex);
+    while (true) {
+        // a query might have been queued before this thread got here
+        while (g_queue_is_empty(service->pending) && !service->search_thread_terminate) {
+            g_cond_wait(&service->search_thread_start_cond, &service->query_mutex);
+        }
+        if (service->search_thread_terminate) {
+            break;
+        }
+        // the searches take turns, so a window which keeps on searching can't hold up the others
+        DatabaseSearch *search = g_queue_pop_head(service->pending);
+        FsearchQuery *query = search->query_ctx;
+        search->query_ctx = NULL;
+        db_search_service_add_running(service, search, query);
+        db_search_service_join_pending(service, query);
+        service->running_streamed = false;
+        g_atomic_int_set(&service->search_terminate, false);
+        g_mutex_unlock(&service->query_mutex);
+        // if query is empty string we are done here
+        DatabaseSearchResult *result = NULL;
+        if (fs_str_is_empty(query->text)) {
+            if (query->pass_on_empty_query) {
+                result = db_search_empty(query);
+            }
+            else {
+                result = calloc(1, sizeof(DatabaseSearchResult));
+            }
+        }
+        else {
+            result = db_search(service, query);
+        }
+        g_mutex_lock(&service->query_mutex);
+        db_search_service_deliver(service, result, false);
+        g_ptr_array_set_size(service->running_searches, 0);
+        g_ptr_array_set_size(service->running_queries, 0);
+        g_cond_broadcast(&service->search_done_cond);
+    }
+    g_mutex_unlock(&service->query_mutex);
+    return NULL;
+}
+
+static void
+search_ranking_init(search_ranking_t *ranking, uint32_t max_len) {
+    ranking->matches = NULL;
+    ranking->len = 0;
+    ranking->size = 0;
+    ranking->max_len = max_len;
+}
+
+static void
+search_ranking_clear(search_ranking_t *ranking) {
+    g_free(ranking->matches);
+    ranking->matches = NULL;
+    ranking->len = 0;
+    ranking->size = 0;
+}
+
+static void
+search_context_free(search_context_t *ctx) {
+    if (!ctx) {
+        return;
+    }
+    // the buffers belong to the DatabaseSearch
+    if (ctx->workers) {
+        for (uint32_t i = 0; i < ctx->num_workers; i++) {
+            search_ranking_clear(&ctx->workers[i].ranking);
+        }
+        g_free(ctx->workers);
+        ctx->workers = NULL;
+    }
+    if (ctx->shards) {
+        for (uint32_t i = 0; i < ctx->num_shards; i++) {
+            free(ctx->shards[i].candidates);
+            ctx->shards[i].candidates = NULL;
+            free(ctx->shards[i].extension_set);
+            ctx->shards[i].extension_set = NULL;
+            for (uint32_t j = 0; j < ctx->shards[i].num_token_extension_sets; j++) {
+                free(ctx->shards[i].token_extension_sets[j]);
+            }
+            g_free(ctx->shards[i].token_extension_sets);
+            ctx->shards[i].token_extension_sets = NULL;
+        }
+        g_free(ctx->shards);
+        ctx->shards = NULL;
+    }
+    if (ctx->chunks) {
+        g_free(ctx->chunks);
+        ctx->chunks = NULL;
+    }
+    if (ctx->chunk_order) {
+        g_free(ctx->chunk_order);
+        ctx->chunk_order = NULL;
+    }
+    if (ctx->cursors) {
+        g_free(ctx->cursors);
+        ctx->cursors = NULL;
+    }
+    if (ctx->fuzzy_signatures) {
+        g_free(ctx->fuzzy_signatures);
+        ctx->fuzzy_signatures = NULL;
+    }
+    g_free(ctx->token_literals);
+    ctx->token_literals = NULL;
+    g_mutex_clear(&ctx->progress_mutex);
+    g_cond_clear(&ctx->progress_cond);
+    g_free(ctx);
+    ctx = NULL;
+}
+
+// index in the database of the first entry of a chunk
+static inline uint32_t
+search_context_get_chunk_start(search_context_t *ctx, uint32_t chunk_idx) {
+    search_chunk_t *chunk = &ctx->chunks[chunk_idx];
+    search_shard_t *shard = &ctx->shards[chunk->shard];
+    const uint32_t i = shard->candidates ? shard->candidates[chunk->start_pos] : chunk->start_pos;
+    return shard->global_indices[i];
+}
+
+static int
+search_context_compare_chunk_keys(const void *a, const void *b) {
+    const uint64_t key_a = *(const uint64_t *)a;
+    const uint64_t key_b = *(const uint64_t *)b;
+    return key_a < key_b ? -1 : key_a > key_b;
+}
+
+// Takes over shards and their candidates, fuzzy_signatures and token_literals
+static search_context_t *
+search_context_new(FsearchQuery *query,
+                   volatile gint *terminate,
+                   search_shard_t *shards,
+                   uint32_t num_shards,
+                   uint64_t signature_mask,
+                   search_fuzzy_signature_t *fuzzy_signatures,
+                   search_literal_t *token_literals,
+                   bool is_ranked,
+                   DatabaseSearchBuffer *buffers,
+                   uint32_t num_buffers) {
+    search_context_t *ctx = calloc(1, sizeof(search_context_t));
+    assert(ctx != NULL);
+    assert(num_buffers > 0);
+
+    ctx->query = query;
+    ctx->terminate = terminate;
+    ctx->shards = shards;
+    ctx->num_shards = num_shards;
+    ctx->signature_mask = signature_mask;
+    ctx->fuzzy_signatures = fuzzy_signatures;
+    ctx->token_literals = token_literals;
+    for (uint32_t i = 0; token_literals && i < query->num_token; i++) {
+        ctx->literal = i == 0 || token_literals[i] == ctx->literal ? token_literals[i] : SEARCH_LITERAL_MIXED;
+    }
+    ctx->max_results = is_ranked ? 0 : query->max_results;
+    ctx->is_ranked = is_ranked;
+    ctx->now = g_get_real_time() / G_USEC_PER_SEC;
+    ctx->num_workers = num_buffers;
+    ctx->workers = g_new0(search_worker_t, num_buffers);
+    for (uint32_t i = 0; i < num_buffers; i++) {
+        ctx->workers[i].ctx = ctx;
+        ctx->workers[i].buffer = &buffers[i];
+        search_ranking_init(&ctx->workers[i].ranking, query->max_results);
+    }
+
+    ctx->num_chunks = 0;
+    for (uint32_t i = 0; i < num_shards; i++) {
+        search_shard_t *shard = &shards[i];
+        shard->first_chunk = ctx->num_chunks;
+        shard->num_chunks = (shard->num_entries + DB_SEARCH_CHUNK_SIZE - 1) / DB_SEARCH_CHUNK_SIZE;
+        shard->num_chunks_in_order = 0;
+        shard->num_results_in_order = 0;
+        shard->last_needed_chunk = (gint)(shard->first_chunk + shard->num_chunks) - 1;
+        ctx->num_chunks += shard->num_chunks;
+    }
+    assert(ctx->num_chunks > 0);
+
+    ctx->chunks = g_new0(search_chunk_t, ctx->num_chunks);
+    for (uint32_t i = 0; i < num_shards; i++) {
+        search_shard_t *shard = &shards[i];
+        for (uint32_t j = 0; j < shard->num_chunks; j++) {
+            search_chunk_t *chunk = &ctx->chunks[shard->first_chunk + j];
+            chunk->shard = i;
+            chunk->start_pos = j * DB_SEARCH_CHUNK_SIZE;
+            chunk->end_pos = MIN(chunk->start_pos + DB_SEARCH_CHUNK_SIZE, shard->num_entries) - 1;
+            chunk->results = NULL;
+            chunk->num_results = 0;
+            chunk->done = false;
+        }
+    }
+
+    // the chunks are handed out by where they start, the index of the chunk goes into the low bits
+    uint64_t *keys = g_new(uint64_t, ctx->num_chunks);
+    for (uint32_t i = 0; i < ctx->num_chunks; i++) {
+        keys[i] = ((uint64_t)search_context_get_chunk_start(ctx, i) << 32) | i;
+    }
+    if (num_shards > 1) {
+        qsort(keys, ctx->num_chunks, sizeof(uint64_t), search_context_compare_chunk_keys);
+    }
+    ctx->chunk_order = g_new(uint32_t, ctx->num_chunks);
+    for (uint32_t i = 0; i < ctx->num_chunks; i++) {
+        ctx->chunk_order[i] = (uint32_t)keys[i];
+    }
+    g_free(keys);
+    keys = NULL;
+    ctx->next_chunk = 0;
+
+    ctx->cursors = g_new0(search_cursor_t, num_shards);
+    for (uint32_t i = 0; i < num_shards; i++) {
+        ctx->cursors[i].chunk = shards[i].first_chunk;
+        ctx->cursors[i].end = shards[i].first_chunk;
+    }
+
+    g_mutex_init(&ctx->progress_mutex);
+    g_cond_init(&ctx->progress_cond);
+    return ctx;
+}
+
+static inline bool
+search_context_chunk_is_needed(search_context_t *ctx, uint32_t chunk_idx) {
+    search_shard_t *shard = &ctx->shards[ctx->chunks[chunk_idx].shard];
+    return (gint)chunk_idx <= g_atomic_int_get(&shard->last_needed_chunk);
+}
+
+// the progress mutex must be held
+static inline bool
+search_shard_is_complete(search_shard_t *shard) {
+    return (gint)(shard->first_chunk + shard->num_chunks_in_order) == shard->last_needed_chunk + 1;
+}
+
+// the progress mutex must be held
+static inline bool
+search_context_is_complete(search_context_t *ctx) {
+    for (uint32_t i = 0; i < ctx->num_shards; i++) {
+        if (!search_shard_is_complete(&ctx->shards[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Lets the cursors go up to the chunks finished in order and returns the index in the database
+// below which all matches are known. The progress mutex must be held.
+static uint32_t
+search_context_get_merge_bound(search_context_t *ctx, search_cursor_t *cursors) {
+    uint32_t bound = UINT32_MAX;
+    for (uint32_t i = 0; i < ctx->num_shards; i++) {
+        search_shard_t *shard = &ctx->shards[i];
+        cursors[i].end = shard->first_chunk + shard->num_chunks_in_order;
+        if (!search_shard_is_complete(shard)) {
+            bound = MIN(bound, search_context_get_chunk_start(ctx, cursors[i].end));
+        }
+    }
+    return bound;
+}
+
+static void
+search_context_chunk_done(search_context_t *ctx, uint32_t chunk_idx) {
+    const uint32_t max_results = ctx->max_results;
+    search_shard_t *shard = &ctx->shards[ctx->chunks[chunk_idx].shard];
+    g_mutex_lock(&ctx->progress_mutex);
+    ctx->chunks[chunk_idx].done = true;
+    while ((gint)(shard->first_chunk + shard->num_chunks_in_order) <= shard->last_needed_chunk
+           && ctx->chunks[shard->first_chunk + shard->num_chunks_in_order].done) {
+        shard->num_results_in_order += ctx->chunks[shard->first_chunk + shard->num_chunks_in_order].num_results;
+        shard->num_chunks_in_order++;
+        if (max_results && shard->num_results_in_order >= max_results) {
+            // nothing after this is needed, so the chunks which follow don't count
+            g_atomic_int_set(&shard->last_needed_chunk, (gint)(shard->first_chunk + shard->num_chunks_in_order) - 1);
+            break;
+        }
+    }
+    g_cond_signal(&ctx->progress_cond);
+    g_mutex_unlock(&ctx->progress_mutex);
+}
+
+static inline bool
+search_context_is_cancelled(search_context_t *ctx) {
+    return g_atomic_int_get(ctx->terminate);
+}
+
+// wakes up the search thread if it's waiting for progress which won't come anymore
+static void
+search_context_cancel(search_context_t *ctx) {
+    g_mutex_lock(&ctx->progress_mutex);
+    g_cond_signal(&ctx->progress_cond);
+    g_mutex_unlock(&ctx->progress_mutex);
+}
+
+static inline bool
+filter_node_type(bool is_dir, FsearchQuery *query) {
+    if (!query->filter) {
+        return true;
+    }
+    if (query->filter->type == FSEARCH_FILTER_FILES && is_dir) {
+        return false;
+    }
+    if (query->filter->type == FSEARCH_FILTER_FOLDERS && !is_dir) {
+        return false;
+    }
+    return true;
+}
+
+// The entries out of 64 with the given folder bits which have the type the filter wants
+static inline uint64_t
+filter_node_type_mask(FsearchQuery *query, uint64_t is_dir) {
+    if (!query->filter || query->filter->type == FSEARCH_FILTER_NONE) {
+        return UINT64_MAX;
+    }
+    return query->filter->type == FSEARCH_FILTER_FOLDERS ? is_dir : ~is_dir;
+}
+
+static inline void
+db_search_get_path_full(DatabaseEntryTable *table,
+                        DynamicArray *entries,
+                        BTreeNode **node,
+                        uint32_t idx,
+                        char full_path[PATH_MAX]) {
+    if (table && db_entry_table_has_parent_paths(table)) {
+        // the parent's path is built once per database, not once per entry
+        db_entry_table_get_path_full(table, idx, full_path, PATH_MAX);
+        return;
+    }
+    if (!*node) {
+        *node = darray_get_item(entries, idx);
+    }
+    btree_node_get_path_full(*node, full_path, PATH_MAX);
+}
+
+// An entry the token are matched against, its path is only built once a token needs it
+typedef struct {
+    DatabaseEntryTable *table;
+    DynamicArray *entries;
+    BTreeNode *node;
+    uint32_t idx;
+    const char *name;
+    const char *path;
+    char *full_path;
+    bool has_folded_names;
+} search_entry_t;
+
+static inline const char *
+search_entry_get_path(search_entry_t *entry) {
+    if (!entry->path) {
+        db_search_get_path_full(entry->table, entry->entries, &entry->node, entry->idx, entry->full_path);
+        entry->path = entry->full_path;
+    }
+    return entry->path;
+}
+
+static inline BTreeNode *
+search_entry_get_node(search_entry_t *entry) {
+    if (!entry->node) {
+        entry->node = darray_get_item(entry->entries, entry->idx);
+    }
+    return entry->node;
+}
+
+static inline bool
+search_token_is_range(FsearchToken *t) {
+    return t->type == FSEARCH_TOKEN_SIZE || t->type == FSEARCH_TOKEN_DATE_MODIFIED;
+}
+
+static inline bool
+db_search_entry_in_range(search_entry_t *entry, FsearchToken *t) {
+    int64_t value = 0;
+    if (entry->table) {
+        value = t->type == FSEARCH_TOKEN_SIZE ? entry->table->sizes[entry->idx] : entry->table->mtimes[entry->idx];
+    }
+    else {
+        BTreeNode *node = search_entry_get_node(entry);
+        value = t->type == FSEARCH_TOKEN_SIZE ? node->size : node->mtime;
+    }
+    return value >= t->min && value <= t->max;
+}
+
+static bool
+db_search_entry_has_extension(search_entry_t *entry, FsearchToken *t) {
+    const char *ext = NULL;
+    if (entry->table && db_entry_table_extension_is_known(entry->table, entry->idx)) {
+        const uint16_t id = entry->table->extension_ids[entry->idx];
+        if (id == DB_ENTRY_TABLE_NO_EXTENSION) {
+            return false;
+        }
+        ext = g_ptr_array_index(entry->table->extensions, id - 1);
+    }
+    else {
+        const char *dot = strrchr(entry->name, '.');
+        if (!dot) {
+            return false;
+        }
+        ext = dot + 1;
+    }
+    for (uint32_t i = 0; t->extensions[i]; i++) {
+        if (t->match_case ? !strcmp(t->extensions[i], ext) : !g_ascii_strcasecmp(t->extensions[i], ext)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool
+db_search_entry_has_parent(search_entry_t *entry, FsearchToken *t) {
+    char parent_path[PATH_MAX] = "";
+    const char *path = parent_path;
+    if (entry->table && db_entry_table_has_parent_paths(entry->table)) {
+        path = entry->table->parent_paths + entry->table->parent_path_offsets[entry->idx];
+    }
+    else {
+        btree_node_get_path(search_entry_get_node(entry), parent_path, sizeof(parent_path));
+    }
+    return t->match_case ? !strcmp(path, t->text) : !g_ascii_strcasecmp(path, t->text);
+}
+
+static bool
+db_search_entry_matches_predicate(search_entry_t *entry, FsearchToken *t, bool search_in_path, bool auto_search_in_path);
+
+static inline bool
+db_search_token_is_about_name(FsearchToken *t, bool search_in_path, bool auto_search_in_path) {
+    return t->type == FSEARCH_TOKEN_TEXT && !search_in_path && !(auto_search_in_path && t->has_separator);
+}
+
+// Matches a text token against the name of entry idx
+static inline bool
+db_search_name_matches_token(DatabaseEntryTable *table,
+                             uint32_t idx,
+                             const char *name,
+                             bool has_folded_names,
+                             FsearchToken *t) {
+    if (t->search_func_folded && has_folded_names) {
+        return t->search_func_folded(db_entry_table_get_folded_name(table, idx), t->text, t);
+    }
+    if (t->search_func_len && table) {
+        // the names' lengths are already known from the entry table
+        return t->search_func_len(name, db_entry_table_get_name_len(table, idx), t);
+    }
+    return t->search_func(name, t->text, t);
+}
+
+// Text token are matched against the name, unless the flags say they are about the path
+static inline bool
+db_search_entry_matches_token(search_entry_t *entry, FsearchToken *t, bool search_in_path, bool auto_search_in_path) {
+    if (t->type != FSEARCH_TOKEN_TEXT) {
+        return db_search_entry_matches_predicate(entry, t, search_in_path, auto_search_in_path);
+    }
+    if (!db_search_token_is_about_name(t, search_in_path, auto_search_in_path)) {
+        return t->search_func(search_entry_get_path(entry), t->text, t);
+    }
+    return db_search_name_matches_token(entry->table, entry->idx, entry->name, entry->has_folded_names, t);
+}
+
+static bool
+db_search_entry_matches_predicate(search_entry_t *entry, FsearchToken *t, bool search_in_path, bool auto_search_in_path) {
+    switch (t->type) {
+    case FSEARCH_TOKEN_SIZE:
+    case FSEARCH_TOKEN_DATE_MODIFIED:
+        return db_search_entry_in_range(entry, t);
+    case FSEARCH_TOKEN_EXTENSION:
+        return db_search_entry_has_extension(entry, t);
+    case FSEARCH_TOKEN_PARENT:
+        return db_search_entry_has_parent(entry, t);
+    case FSEARCH_TOKEN_AND:
+        for (uint32_t i = 0; t->children[i]; i++) {
+            if (!db_search_entry_matches_token(entry, t->children[i], search_in_path, auto_search_in_path)) {
+                return false;
+            }
+        }
+        return true;
+    case FSEARCH_TOKEN_OR:
+        for (uint32_t i = 0; t->children[i]; i++) {
+            if (db_search_entry_matches_token(entry, t->children[i], search_in_path, auto_search_in_path)) {
+                return true;
+            }
+        }
+        return false;
+    case FSEARCH_TOKEN_NOT:
+        return !db_search_entry_matches_token(entry, t->children[0], search_in_path, auto_search_in_path);
+    default:
+        return false;
+    }
+}
+
+static inline bool
+filter_node(FsearchQuery *query, search_entry_t *entry, bool is_dir) {
+    if (!query->filter) {
+        return true;
+    }
+    if (query->filter->type == FSEARCH_FILTER_NONE && query->filter->query == NULL) {
+        return true;
+    }
+    if (!filter_node_type(is_dir, query)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < query->num_filter_token; i++) {
+        if (!db_search_entry_matches_token(entry, query->filter_token[i], query->filter->search_in_path, false)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The entries at the n positions from k on whose values all lie in the ranges, one bit each
+static inline uint64_t
+db_search_get_range_mask(DatabaseEntryTable *table,
+                         const uint32_t *candidates,
+                         uint32_t k,
+                         uint32_t n,
+                         FsearchToken **ranges,
+                         uint32_t num_ranges) {
+    uint64_t mask = n < 64 ? ((uint64_t)1 << n) - 1 : UINT64_MAX;
+    for (uint32_t r = 0; r < num_ranges && mask; r++) {
+        const int64_t *values = ranges[r]->type == FSEARCH_TOKEN_SIZE ? table->sizes : table->mtimes;
+        // a single unsigned comparison per entry and no branches
+        const uint64_t min = (uint64_t)ranges[r]->min;
+        const uint64_t span = (uint64_t)ranges[r]->max - min;
+        uint64_t in_range = 0;
+        if (candidates) {
+            for (uint32_t j = 0; j < n; j++) {
+                in_range |= (uint64_t)((uint64_t)values[candidates[k + j]] - min <= span) << j;
+            }
+        }
+        else {
+            for (uint32_t j = 0; j < n; j++) {
+                in_range |= (uint64_t)((uint64_t)values[k + j] - min <= span) << j;
+            }
+        }
+        mask &= in_range;
+    }
+    return mask;
+}
+
+// The entries at the n positions from k on whose names the fuzzy token t matches, one bit each. The names
+// are matched a few at once, those which the signature rules out aren't matched at all.
+static uint64_t
+db_search_get_fuzzy_mask(DatabaseEntryTable *table,
+                         const uint32_t *candidates,
+                         uint32_t k,
+                         uint32_t n,
+                         bool has_folded_names,
+                         FsearchToken *t,
+                         const search_fuzzy_signature_t *signature) {
+    const char *names[64];
+    uint32_t positions[64];
+    uint32_t num_names = 0;
+    for (uint32_t j = 0; j < n; j++) {
+        const uint32_t i = candidates ? candidates[k + j] : k + j;
+        if (signature && (uint32_t)__builtin_popcountll(table->signatures[i] & signature->mask) < signature->min_bits) {
+            continue;
+        }
+        // the same name as db_search_name_matches_token
+        names[num_names] = t->search_func_folded && has_folded_names ? db_entry_table_get_folded_name(table, i)
+                                                                      : db_entry_table_get_name(table, i);
+        positions[num_names] = j;
+        num_names++;
+    }
+    const uint64_t matched = fsearch_token_fuzzy_match_names(t, names, num_names);
+    uint64_t mask = 0;
+    for (uint32_t j = 0; j < num_names; j++) {
+        mask |= ((matched >> j) & 1) << positions[j];
+    }
+    return mask;
+}
+
+static bool
+db_search_token_is_fuzzy(FsearchToken *t) {
+    if (t->fuzzy_peq) {
+        return true;
+    }
+    for (uint32_t i = 0; t->children && t->children[i]; i++) {
+        if (db_search_token_is_fuzzy(t->children[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Ranked searches return the best matches first, instead of in database order. Fuzzy
+// searches always are, a search which doesn't know which part of a long name someone
+// means would mostly find the wrong ones first otherwise.
+static bool
+db_search_query_is_ranked(FsearchQuery *q) {
+    if (q->flags.enable_ranking) {
+        return true;
+    }
+    for (uint32_t i = 0; i < q->num_token; i++) {
+        if (db_search_token_is_fuzzy(q->token[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The signature bits of every fuzzy token matched against the names, NULL if there are none
+static search_fuzzy_signature_t *
+db_search_get_fuzzy_signatures(FsearchQuery *q) {
+    search_fuzzy_signature_t *signatures = NULL;
+    for (uint32_t i = 0; i < q->num_token; i++) {
+        FsearchToken *t = q->token[i];
+        if (!t->fuzzy_peq || !db_search_token_is_about_name(t, q->flags.search_in_path, q->flags.auto_search_in_path)) {
+            continue;
+        }
+        if (t->search_func_folded == NULL && fs_str_is_utf8(t->text)) {
+            // the signatures are built from the folded names, which a case sensitive text might not be part of
+            continue;
+        }
+        if (!signatures) {
+            signatures = g_new0(search_fuzzy_signature_t, q->num_token);
+        }
+        signatures[i].mask = db_entry_table_get_signature(t->text);
+        const uint32_t num_bits = (uint32_t)__builtin_popcountll(signatures[i].mask);
+        signatures[i].min_bits = num_bits - MIN(num_bits, t->fuzzy_max_edits);
+    }
+    return signatures;
+}
+
+// How well t matches a name, see fsearch_token_get_score
+static uint32_t
+db_search_get_token_score(FsearchToken *t, const char *name, const char *folded_name) {
+    uint32_t score = 0;
+    switch (t->type) {
+    case FSEARCH_TOKEN_TEXT:
+        // path searches are ranked by the names as well, the paths of all matches would be too expensive
+        return fsearch_token_get_score(t, t->search_func_folded && folded_name ? folded_name : name);
+    case FSEARCH_TOKEN_AND:
+        for (uint32_t i = 0; t->children[i]; i++) {
+            score += db_search_get_token_score(t->children[i], name, folded_name);
+        }
+        return score;
+    case FSEARCH_TOKEN_OR:
+        for (uint32_t i = 0; t->children[i]; i++) {
+            score = MAX(score, db_search_get_token_score(t->children[i], name, folded_name));
+        }
+        return score;
+    default:
+        return 0;
+    }
+}
+
+// Ranks by how well the name matches the query (the scores of all token added up) first,
+// then by how close to the top of its location and how recently modified the entry is,
+// then by shorter names. False if the score is certainly below min_score, without the rest
+// of it being worked out.
+static bool
+db_search_get_entry_score(FsearchQuery *q,
+                          DatabaseShard *shard,
+                          uint32_t idx,
+                          int64_t now,
+                          uint32_t min_score,
+                          uint32_t *score) {
+    DatabaseEntryTable *table = shard->entry_table;
+    BTreeNode *node = NULL;
+    const char *name = NULL;
+    const char *folded_name = NULL;
+    uint32_t name_len = 0;
+    if (table) {
+        name = db_entry_table_get_name(table, idx);
+        name_len = db_entry_table_get_name_len(table, idx);
+        folded_name = db_entry_table_has_folded_names(table) ? db_entry_table_get_folded_name(table, idx) : NULL;
+    }
+    else {
+        node = darray_get_item(shard->entries, idx);
+        name = node->name;
+        name_len = (uint32_t)strlen(name);
+    }
+
+    uint32_t quality = 0;
+    for (uint32_t i = 0; i < q->num_token; i++) {
+        quality += db_search_get_token_score(q->token[i], name, folded_name);
+    }
+    quality = MIN(quality, UINT32_MAX >> DB_SEARCH_RANK_QUALITY_SHIFT);
+    const uint32_t max_score = (quality << DB_SEARCH_RANK_QUALITY_SHIFT) | ((1u << DB_SEARCH_RANK_QUALITY_SHIFT) - 1);
+    if (max_score < min_score) {
+        return false;
+    }
+
+    uint32_t depth = MIN(shard->root_depth, DB_SEARCH_RANK_MAX_DEPTH);
+    int64_t mtime = 0;
+    if (table) {
+        for (uint32_t p = table->parents[idx]; p != DB_ENTRY_TABLE_NO_PARENT && depth < DB_SEARCH_RANK_MAX_DEPTH;
+             p = table->parents[p]) {
+            depth++;
+        }
+        mtime = table->mtimes[idx];
+    }
+    else {
+        for (BTreeNode *p = node->parent; p && p->parent && depth < DB_SEARCH_RANK_MAX_DEPTH; p = p->parent) {
+            depth++;
+        }
+        mtime = node->mtime;
+    }
+    // one step less for every time the age in days doubles
+    const uint64_t age_days = mtime < now ? (uint64_t)(now - mtime) / (24 * 60 * 60) : 0;
+    const uint32_t age_bits = age_days ? 64 - __builtin_clzll(age_days) : 0;
+    const uint32_t recency = DB_SEARCH_RANK_MAX_RECENCY - MIN(age_bits, DB_SEARCH_RANK_MAX_RECENCY);
+    const uint32_t boost = DB_SEARCH_RANK_MAX_DEPTH - depth + recency;
+
+    *score = (quality << DB_SEARCH_RANK_QUALITY_SHIFT) | (boost << DB_SEARCH_RANK_BOOST_SHIFT)
+           | (DB_SEARCH_RANK_MAX_NAME_LEN - MIN(name_len, DB_SEARCH_RANK_MAX_NAME_LEN));
+    return true;
+}
+
+// true if a ranks below b, of two matches with the same score the one further down the database does
+static inline bool
+search_ranked_is_worse(const search_ranked_t *a, const search_ranked_t *b) {
+    return a->score < b->score || (a->score == b->score && a->idx > b->idx);
+}
+
+static void
+search_ranked_sift_down(search_ranked_t *heap, uint32_t len, uint32_t i) {
+    while (true) {
+        const uint32_t left = 2 * i + 1;
+        if (left >= len) {
+            break;
+        }
+        uint32_t worst = left;
+        if (left + 1 < len && search_ranked_is_worse(&heap[left + 1], &heap[left])) {
+            worst = left + 1;
+        }
+        if (!search_ranked_is_worse(&heap[worst], &heap[i])) {
+            break;
+        }
+        const search_ranked_t tmp = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = tmp;
+        i = worst;
+    }
+}
+
+// the score a match needs at least to be kept
+static inline uint32_t
+search_ranking_get_min_score(search_ranking_t *ranking) {
+    return ranking->max_len && ranking->len == ranking->max_len ? ranking->matches[0].score : 0;
+}
+
+// Keeps the max_len best matches pushed so far, so nothing has to be sorted but those
+static void
+search_ranking_push(search_ranking_t *ranking, search_ranked_t match) {
+    if (ranking->max_len == 0 || ranking->len < ranking->max_len) {
+        if (ranking->len == ranking->size) {
+            ranking->size = MAX(ranking->size * 2, 64);
+            if (ranking->max_len) {
+                ranking->size = MIN(ranking->size, ranking->max_len);
+            }
+            ranking->matches = g_renew(search_ranked_t, ranking->matches, ranking->size);
+        }
+        search_ranked_t *heap = ranking->matches;
+        uint32_t i = ranking->len++;
+        while (i > 0 && search_ranked_is_worse(&match, &heap[(i - 1) / 2])) {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        heap[i] = match;
+    }
+    else if (search_ranked_is_worse(&ranking->matches[0], &match)) {
+        ranking->matches[0] = match;
+        search_ranked_sift_down(ranking->matches, ranking->len, 0);
+    }
+}
+
+static inline bool
+db_search_entry_is_dir(DatabaseEntryTable *table, DynamicArray *entries, uint32_t idx) {
+    if (table) {
+        return db_entry_table_is_dir(table, idx);
+    }
+    BTreeNode *node = darray_get_item(entries, idx);
+    return node->is_dir;
+}
+
+static void
+search_buffer_init(DatabaseSearchBuffer *buffer) {
+    buffer->pages = g_ptr_array_new_with_free_func(free);
+    buffer->num_used_pages = 0;
+    buffer->pos = 0;
+}
+
+static void
+search_buffer_clear(DatabaseSearchBuffer *buffer) {
+    g_ptr_array_free(buffer->pages, TRUE);
+    buffer->pages = NULL;
+}
+
+// pages the last search didn't need are given back, the others are reused
+static void
+search_buffer_reset(DatabaseSearchBuffer *buffer) {
+    const uint32_t num_kept = MAX(buffer->num_used_pages, 1);
+    if (buffer->pages->len > num_kept) {
+        g_ptr_array_set_size(buffer->pages, num_kept);
+    }
+    buffer->num_used_pages = 0;
+    buffer->pos = 0;
+}
+
+// room for len matches, only the ones committed stay used
+static uint32_t *
+search_buffer_reserve(DatabaseSearchBuffer *buffer, uint32_t len) {
+    assert(len <= DB_SEARCH_BUFFER_PAGE_SIZE);
+    if (buffer->num_used_pages == 0 || buffer->pos + len > DB_SEARCH_BUFFER_PAGE_SIZE) {
+        if (buffer->num_used_pages == buffer->pages->len) {
+            uint32_t *page = malloc(DB_SEARCH_BUFFER_PAGE_SIZE * sizeof(uint32_t));
+            assert(page != NULL);
+            g_ptr_array_add(buffer->pages, page);
+        }
+        buffer->num_used_pages++;
+        buffer->pos = 0;
+    }
+    uint32_t *page = g_ptr_array_index(buffer->pages, buffer->num_used_pages - 1);
+    return page + buffer->pos;
+}
+
+static inline void
+search_buffer_commit(DatabaseSearchBuffer *buffer, uint32_t len) {
+    buffer->pos += len;
+}
+
+static void
+db_search_chunk(search_worker_t *worker, uint32_t chunk_idx) {
+    search_context_t *ctx = worker->ctx;
+    DatabaseSearchBuffer *buffer = worker->buffer;
+    search_ranking_t *ranking = ctx->is_ranked ? &worker->ranking : NULL;
+    search_chunk_t *chunk = &ctx->chunks[chunk_idx];
+    search_shard_t *shard = &ctx->shards[chunk->shard];
+    FsearchQuery *query = ctx->query;
+    const uint32_t start = chunk->start_pos;
+    const uint32_t end = chunk->end_pos;
+    const uint32_t *candidates = shard->candidates;
+    const uint32_t max_results = ctx->max_results;
+    const uint32_t num_token = query->num_token;
+    FsearchToken **token = query->token;
+    const uint32_t search_in_path = query->flags.search_in_path;
+    const uint32_t auto_search_in_path = query->flags.auto_search_in_path;
+    DynamicArray *entries = shard->shard->entries;
+    DatabaseEntryTable *table = shard->shard->entry_table;
+    const bool has_folded_names = table && db_entry_table_has_folded_names(table);
+    const uint64_t signature_mask = ctx->signature_mask;
+    const uint64_t *signatures = table && signature_mask ? table->signatures : NULL;
+    const search_fuzzy_signature_t *fuzzy_signatures = table ? ctx->fuzzy_signatures : NULL;
+    const uint64_t *extension_set = shard->extension_set;
+    uint64_t **token_extension_sets = shard->token_extension_sets;
+    uint32_t *results = search_buffer_reserve(buffer, end - start + 1);
+
+    if (!entries) {
+        chunk->results = results;
+        chunk->num_results = 0;
+        trace("[database_search] entries empty\n");
+        // streaming and merging wait for every chunk
+        search_context_chunk_done(ctx, chunk_idx);
+        return;
+    }
+
+    // the sizes and dates the query asks for are compared for 64 entries at once, before anything else
+    FsearchToken *ranges[num_token + 1];
+    uint32_t num_ranges = 0;
+    for (uint32_t j = 0; table && j < num_token; j++) {
+        if (search_token_is_range(token[j])) {
+            ranges[num_ranges++] = token[j];
+        }
+    }
+    uint64_t range_mask = UINT64_MAX;
+
+    // fuzzy token are matched against the names of 64 entries at once too, once the first of them needs it
+    uint64_t fuzzy_masks[num_token + 1];
+    uint32_t fuzzy_mask_starts[num_token + 1];
+    for (uint32_t j = 0; j < num_token; j++) {
+        fuzzy_mask_starts[j] = UINT32_MAX;
+    }
+
+    uint32_t num_results = 0;
+    char full_path[PATH_MAX] = "";
+    for (uint32_t k = start; k <= end; k++) {
+        if ((k - start) % DB_SEARCH_CANCEL_CHECK_INTERVAL == 0 && search_context_is_cancelled(ctx)) {
+            // the chunk is abandoned, it's never marked as done
+            return;
+        }
+        if (max_results && (num_results == max_results || !search_context_chunk_is_needed(ctx, chunk_idx))) {
+            break;
+        }
+        if (num_ranges > 0) {
+            if ((k - start) % 64 == 0) {
+                range_mask = db_search_get_range_mask(table, candidates, k, MIN(end - k + 1, 64), ranges, num_ranges);
+            }
+            if (!(range_mask & ((uint64_t)1 << ((k - start) % 64)))) {
+                continue;
+            }
+        }
+        const uint32_t i = candidates ? candidates[k] : k;
+        if (signatures && (signatures[i] & signature_mask) != signature_mask) {
+            continue;
+        }
+        // the nodes are only touched for matches and path searches,
+        // everything else is streamed from the packed entry table
+        BTreeNode *node = NULL;
+        const char *name = NULL;
+        bool is_dir = false;
+        if (table) {
+            name = db_entry_table_get_name(table, i);
+            is_dir = db_entry_table_is_dir(table, i);
+        }
+        else {
+            node = darray_get_item(entries, i);
+            if (!node) {
+                continue;
+            }
+            name = node->name;
+            is_dir = node->is_dir;
+        }
+        if (!filter_node_type(is_dir, query)) {
+            continue;
+        }
+        search_entry_t entry = {
+            .table = table,
+            .entries = entries,
+            .node = node,
+            .idx = i,
+            .name = name,
+            .path = NULL,
+            .full_path = full_path,
+            .has_folded_names = has_folded_names,
+        };
+        // most filters only check the extension, which is known from its id
+        const bool filtered_by_extension = extension_set && db_entry_table_extension_is_known(table, i);
+        if (filtered_by_extension && !db_entry_table_extension_is_in(table, i, extension_set)) {
+            continue;
+        }
+        if (!filtered_by_extension && query->filter_token && !filter_node(query, &entry, is_dir)) {
+            continue;
+        }
+
+        bool matches = true;
+        for (uint32_t j = 0; matches && j < num_token; j++) {
+            FsearchToken *t = token[j];
+            if (table && t->fuzzy_peq && db_search_token_is_about_name(t, search_in_path, auto_search_in_path)) {
+                const uint32_t block_start = k - (k - start) % 64;
+                if (fuzzy_mask_starts[j] != block_start) {
+                    fuzzy_masks[j] = db_search_get_fuzzy_mask(table,
+                                                              candidates,
+                                                              block_start,
+                                                              MIN(end - block_start + 1, 64),
+                                                              has_folded_names,
+                                                              t,
+                                                              fuzzy_signatures ? &fuzzy_signatures[j] : NULL);
+                    fuzzy_mask_starts[j] = block_start;
+                }
+                matches = (fuzzy_masks[j] >> (k - block_start)) & 1;
+            }
+            else if (db_search_token_is_about_name(t, search_in_path, auto_search_in_path)) {
+                // the common case, which doesn't need anything but the name
+                matches = db_search_name_matches_token(table, i, name, has_folded_names, t);
+            }
+            else if (token_extension_sets && token_extension_sets[j] && db_entry_table_extension_is_known(table, i)) {
+                matches = db_entry_table_extension_is_in(table, i, token_extension_sets[j]);
+            }
+            else if (num_ranges == 0 || !search_token_is_range(t)) {
+                // the ranges were checked already
+                matches = db_search_entry_matches_token(&entry, t, search_in_path, auto_search_in_path);
+            }
+        }
+        if (matches) {
+            results[num_results] = i;
+            num_results++;
+            uint32_t score = 0;
+            if (ranking
+                && db_search_get_entry_score(
+                    query, shard->shard, i, ctx->now, search_ranking_get_min_score(ranking), &score)) {
+                search_ranked_t match = {.score = score, .idx = shard->global_indices[i]};
+                search_ranking_push(ranking, match);
+            }
+        }
+    }
+    chunk->results = results;
+    chunk->num_results = num_results;
+    search_buffer_commit(buffer, num_results);
+    search_context_chunk_done(ctx, chunk_idx);
+}
+
+// How each token of q is matched by db_search_chunk_literal_loop, NULL if the query needs more than that
+static search_literal_t *
+db_search_get_token_literals(FsearchQuery *q, bool is_ranked) {
+    if (is_ranked || q->filter_token || q->num_token == 0) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < q->num_token; i++) {
+        FsearchToken *t = q->token[i];
+        if (!t->is_literal
+            || !db_search_token_is_about_name(t, q->flags.search_in_path, q->flags.auto_search_in_path)) {
+            return NULL;
+        }
+    }
+    search_literal_t *token_literals = g_new(search_literal_t, q->num_token);
+    for (uint32_t i = 0; i < q->num_token; i++) {
+        FsearchToken *t = q->token[i];
+        token_literals[i] = t->match_case          ? SEARCH_LITERAL_CASE
+                            : t->search_func_folded ? SEARCH_LITERAL_FOLDED
+                                                    : SEARCH_LITERAL_ICASE;
+    }
+    return token_literals;
+}
+
+static inline bool
+db_search_literal_matches(DatabaseEntryTable *table, uint32_t idx, FsearchToken *t, search_literal_t literal) {
+    switch (literal) {
+    case SEARCH_LITERAL_CASE:
+        return memmem(db_entry_table_get_name(table, idx),
+                      db_entry_table_get_name_len(table, idx),
+                      t->text,
+                      t->text_len);
+    case SEARCH_LITERAL_ICASE:
+        return fs_str_case_contains(db_entry_table_get_name(table, idx), t->text, t->text_len);
+    case SEARCH_LITERAL_FOLDED:
+        return strstr(db_entry_table_get_folded_name(table, idx), t->text);
+    default:
+        return false;
+    }
+}
+
+// db_search_chunk for the queries with token literals, which are most of them. literal and
+// with_candidates are constant wherever this is inlined, so each combination gets its own loop
+// with nothing in it but the signature check and direct calls to the matching function.
+static inline __attribute__((always_inline)) void
+db_search_chunk_literal_loop(search_worker_t *worker,
+                             uint32_t chunk_idx,
+                             search_literal_t literal,
+                             bool with_candidates) {
+    search_context_t *ctx = worker->ctx;
+    search_chunk_t *chunk = &ctx->chunks[chunk_idx];
+    search_shard_t *shard = &ctx->shards[chunk->shard];
+    FsearchQuery *query = ctx->query;
+    const uint32_t start = chunk->start_pos;
+    const uint32_t end = chunk->end_pos;
+    const uint32_t *candidates = shard->candidates;
+    const uint32_t max_results = ctx->max_results;
+    const uint32_t num_token = query->num_token;
+    FsearchToken **token = query->token;
+    const search_literal_t *token_literals = ctx->token_literals;
+    DatabaseEntryTable *table = shard->shard->entry_table;
+    const uint64_t *signatures = table->signatures;
+    const uint64_t signature_mask = ctx->signature_mask;
+    const bool filter_type = query->filter && query->filter->type != FSEARCH_FILTER_NONE;
+    uint32_t *results = search_buffer_reserve(worker->buffer, end - start + 1);
+
+    uint32_t num_results = 0;
+    for (uint32_t k = start; k <= end; k++) {
+        if ((k - start) % DB_SEARCH_CANCEL_CHECK_INTERVAL == 0) {
+            if (search_context_is_cancelled(ctx)) {
+                // the chunk is abandoned, it's never marked as done
+                return;
+            }
+            if (max_results && !search_context_chunk_is_needed(ctx, chunk_idx)) {
+                break;
+            }
+        }
+        const uint32_t i = with_candidates ? candidates[k] : k;
+        if ((signatures[i] & signature_mask) != signature_mask) {
+            continue;
+        }
+        if (filter_type && !filter_node_type(db_entry_table_is_dir(table, i), query)) {
+            continue;
+        }
+        bool matches = true;
+        for (uint32_t j = 0; matches && j < num_token; j++) {
+            matches = db_search_literal_matches(table,
+                                                i,
+                                                token[j],
+                                                literal == SEARCH_LITERAL_MIXED ? token_literals[j] : literal);
+        }
+        if (matches) {
+            results[num_results++] = i;
+            if (num_results == max_results) {
+                break;
+            }
+        }
+    }
+    chunk->results = results;
+    chunk->num_results = num_results;
+    search_buffer_commit(worker->buffer, num_results);
+    search_context_chunk_done(ctx, chunk_idx);
+}
+
+static void
+db_search_chunk_literal_all(search_worker_t *worker, uint32_t chunk_idx) {
+    switch (worker->ctx->literal) {
+    case SEARCH_LITERAL_CASE:
+        db_search_chunk_literal_loop(worker, chunk_idx, SEARCH_LITERAL_CASE, false);
+        break;
+    case SEARCH_LITERAL_ICASE:
+        db_search_chunk_literal_loop(worker, chunk_idx, SEARCH_LITERAL_ICASE, false);
+        break;
+    case SEARCH_LITERAL_FOLDED:
+        db_search_chunk_literal_loop(worker, chunk_idx, SEARCH_LITERAL_FOLDED, false);
+        break;
+    default:
+        db_search_chunk_literal_loop(worker, chunk_idx, SEARCH_LITERAL_MIXED, false);
+        break;
+    }
+}
+
+// the same for the candidates of the trigram index
+static void
+db_search_chunk_literal_candidates(search_worker_t *worker, uint32_t chunk_idx) {
+    switch (worker->ctx->literal) {
+    case SEARCH_LITERAL_CASE:
+        db_search_chunk_literal_loop(worker, chunk_idx, SEARCH_LITERAL_CASE, true);
+        break;
+    case SEARCH_LITERAL_ICASE:
+        db_search_chunk_literal_loop(worker, chunk_idx, SEARCH_LITERAL_ICASE, true);
+        break;
+    case SEARCH_LITERAL_FOLDED:
+        db_search_chunk_literal_loop(worker, chunk_idx, SEARCH_LITERAL_FOLDED, true);
+        break;
+    default:
+        db_search_chunk_literal_loop(worker, chunk_idx, SEARCH_LITERAL_MIXED, true);
+        break;
+    }
+}
+
+// Whether the chunk can be searched by db_search_chunk_literal_loop, which needs the entry table
+// and, for folded token, the folded names in there
+static inline bool
+search_context_chunk_is_literal(search_context_t *ctx, uint32_t chunk_idx) {
+    if (ctx->literal == SEARCH_LITERAL_NONE) {
+        return false;
+    }
+    DatabaseEntryTable *table = ctx->shards[ctx->chunks[chunk_idx].shard].shard->entry_table;
+    if (!table) {
+        return false;
+    }
+    for (uint32_t i = 0; i < ctx->query->num_token; i++) {
+        if (ctx->token_literals[i] == SEARCH_LITERAL_FOLDED && !db_entry_table_has_folded_names(table)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void
+db_search_worker(void *user_data) {
+    search_worker_t *worker = user_data;
+    search_context_t *ctx = worker->ctx;
+    assert(ctx != NULL);
+
+    // a new query only has to wait for a few entries per worker, no matter how many there are
+    while (true) {
+        if (search_context_is_cancelled(ctx)) {
+            search_context_cancel(ctx);
+            break;
+        }
+        const uint32_t next = (uint32_t)g_atomic_int_add(&ctx->next_chunk, 1);
+        if (next >= ctx->num_chunks) {
+            break;
+        }
+        const uint32_t chunk_idx = ctx->chunk_order[next];
+        if (!search_context_chunk_is_needed(ctx, chunk_idx)) {
+            // other shards might still need their chunks
+            continue;
+        }
+        if (search_context_chunk_is_literal(ctx, chunk_idx)) {
+            if (ctx->shards[ctx->chunks[chunk_idx].shard].candidates) {
+                db_search_chunk_literal_candidates(worker, chunk_idx);
+            }
+            else {
+                db_search_chunk_literal_all(worker, chunk_idx);
+            }
+        }
+        else {
+            db_search_chunk(worker, chunk_idx);
+        }
+    }
+}
+
+static DatabaseSearchResult *
+db_search_result_new(GArray *results, uint32_t num_folders, uint32_t num_files) {
+    DatabaseSearchResult *result_ctx = calloc(1, sizeof(DatabaseSearchResult));
+    assert(result_ctx != NULL);
+    result_ctx->results = results;
+    result_ctx->num_folders = num_folders;
+    result_ctx->num_files = num_files;
+    return result_ctx;
+}
+
+// Takes over the matches of ranking and turns them into the result, best match first
+static DatabaseSearchResult *
+db_search_ranked_result_new(FsearchQuery *q, search_ranking_t *ranking) {
+    search_ranked_t *heap = ranking->matches;
+    const uint32_t len = ranking->len;
+    for (uint32_t n = len; n > 1; n--) {
+        const search_ranked_t worst = heap[0];
+        heap[0] = heap[n - 1];
+        heap[n - 1] = worst;
+        search_ranked_sift_down(heap, n - 1, 0);
+    }
+    GArray *results = g_array_sized_new(FALSE, FALSE, sizeof(uint32_t), len);
+    DynamicArray *entries = db_get_entries(q->db);
+    uint32_t num_folders = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        g_array_append_val(results, heap[i].idx);
+        BTreeNode *node = darray_get_item(entries, heap[i].idx);
+        if (node->is_dir) {
+            num_folders++;
+        }
+    }
+    search_ranking_clear(ranking);
+
+    DatabaseSearchResult *result = db_search_result_new(results, num_folders, len - num_folders);
+    result->is_ranked = true;
+    return result;
+}
+
+// Every worker kept the best matches it found, the best of those are the result
+static DatabaseSearchResult *
+db_search_merge_rankings(search_context_t *ctx) {
+    // the first heap is as large as the result may get, so the others are added to it
+    search_ranking_t ranking = ctx->workers[0].ranking;
+    search_ranking_init(&ctx->workers[0].ranking, ranking.max_len);
+    for (uint32_t i = 1; i < ctx->num_workers; i++) {
+        search_ranking_t *worker_ranking = &ctx->workers[i].ranking;
+        for (uint32_t j = 0; j < worker_ranking->len; j++) {
+            search_ranking_push(&ranking, worker_ranking->matches[j]);
+        }
+        search_ranking_clear(worker_ranking);
+    }
+    return db_search_ranked_result_new(ctx->query, &ranking);
+}
+
+// Whether matching t needs the paths of the entries or their parents
+static bool
+db_search_token_needs_paths(FsearchToken *t, bool search_in_path, bool auto_search_in_path) {
+    if (t->type == FSEARCH_TOKEN_PARENT) {
+        return true;
+    }
+    if (t->type == FSEARCH_TOKEN_TEXT) {
+        return search_in_path || (auto_search_in_path && t->has_separator);
+    }
+    for (uint32_t i = 0; t->children && t->children[i]; i++) {
+        if (db_search_token_needs_paths(t->children[i], search_in_path, auto_search_in_path)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool
+db_search_filter_needs_paths(FsearchQuery *q) {
+    for (uint32_t i = 0; q->filter && i < q->num_filter_token; i++) {
+        if (db_search_token_needs_paths(q->filter_token[i], q->filter->search_in_path, false)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool
+db_search_query_needs_paths(FsearchQuery *q) {
+    if (db_search_filter_needs_paths(q)) {
+        return true;
+    }
+    for (uint32_t i = 0; i < q->num_token; i++) {
+        if (db_search_token_needs_paths(q->token[i], q->flags.search_in_path, q->flags.auto_search_in_path)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether entry idx of shard passes the filter, all but its type
+static bool
+db_search_empty_filter_entry(FsearchQuery *query, DatabaseShard *shard, const uint64_t *extension_set, uint32_t idx) {
+    DatabaseEntryTable *table = shard->entry_table;
+    if (extension_set && db_entry_table_extension_is_known(table, idx)) {
+        return db_entry_table_extension_is_in(table, idx, extension_set);
+    }
+    if (!query->filter_token) {
+        return true;
+    }
+    char full_path[PATH_MAX] = "";
+    search_entry_t entry = {
+        .table = table,
+        .entries = shard->entries,
+        .node = NULL,
+        .idx = idx,
+        .name = NULL,
+        .path = NULL,
+        .full_path = full_path,
+        .has_folded_names = table && db_entry_table_has_folded_names(table),
+    };
+    entry.name = table ? db_entry_table_get_name(table, idx) : search_entry_get_node(&entry)->name;
+    const bool is_dir = db_search_entry_is_dir(table, shard->entries, idx);
+    return filter_node(query, &entry, is_dir);
+}
+
+static DatabaseSearchResult *
+db_search_empty(FsearchQuery *query) {
+    assert(query != NULL);
+    assert(query->db != NULL);
+
+    const uint32_t num_entries = db_get_num_entries(query->db);
+    const uint32_t num_results = query->max_results == 0 ? num_entries : MIN(query->max_results, num_entries);
+    GArray *results = g_array_sized_new(FALSE, FALSE, sizeof(uint32_t), num_results);
+
+    // The entries passing the filter are marked in a bitset in database order, shard by shard.
+    // The type is checked for 64 entries at once, most filters only need the extension ids then.
+    const uint32_t num_words = num_entries / 64 + 1;
+    uint64_t *matches = calloc(num_words, sizeof(uint64_t));
+    uint64_t *folders = calloc(num_words, sizeof(uint64_t));
+    assert(matches != NULL);
+    assert(folders != NULL);
+    for (uint32_t s = 0; s < db_get_num_shards(query->db); s++) {
+        const uint32_t *global_indices = NULL;
+        DatabaseShard *shard = db_get_shard(query->db, s, &global_indices);
+        DatabaseEntryTable *table = shard->entry_table;
+        if (table && db_search_filter_needs_paths(query)) {
+            db_entry_table_ensure_parent_paths(table, shard->entries);
+        }
+        uint64_t *extension_set = NULL;
+        if (table && query->filter_extensions) {
+            extension_set = db_entry_table_get_extension_set(table, query->filter_extensions, query->filter->match_case);
+        }
+        for (uint32_t w = 0; w * 64 < shard->num_entries; w++) {
+            uint64_t is_dir = 0;
+            if (table) {
+                is_dir = table->is_dir[w];
+            }
+            else {
+                for (uint32_t j = w * 64; j < MIN(w * 64 + 64, shard->num_entries); j++) {
+                    BTreeNode *node = darray_get_item(shard->entries, j);
+                    is_dir |= node->is_dir ? (uint64_t)1 << (j % 64) : 0;
+                }
+            }
+            uint64_t bits = filter_node_type_mask(query, is_dir);
+            if (shard->num_entries - w * 64 < 64) {
+                bits &= ((uint64_t)1 << (shard->num_entries - w * 64)) - 1;
+            }
+            while (bits) {
+                const uint32_t j = w * 64 + __builtin_ctzll(bits);
+                bits &= bits - 1;
+                if (!db_search_empty_filter_entry(query, shard, extension_set, j)) {
+                    continue;
+                }
+                const uint32_t i = global_indices[j];
+                matches[i / 64] |= (uint64_t)1 << (i % 64);
+                if (is_dir & ((uint64_t)1 << (j % 64))) {
+                    folders[i / 64] |= (uint64_t)1 << (i % 64);
+                }
+            }
+        }
+        free(extension_set);
+        extension_set = NULL;
+    }
+
+    uint32_t num_folders = 0;
+    uint32_t pos = 0;
+    for (uint32_t w = 0; w < num_words && pos < num_results; w++) {
+        uint64_t bits = matches[w];
+        while (bits && pos < num_results) {
+            const uint32_t i = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            g_array_append_val(results, i);
+            num_folders += folders[w] & ((uint64_t)1 << (i % 64)) ? 1 : 0;
+            pos++;
+        }
+    }
+    free(matches);
+    free(folders);
+    return db_search_result_new(results, num_folders, pos - num_folders);
+}
+
+static bool
+db_search_filter_equal(FsearchFilter *f1, FsearchFilter *f2) {
+    if (!f1 || !f2) {
+        return f1 == f2;
+    }
+    return f1->type == f2->type && !g_strcmp0(f1->query, f2->query) && f1->match_case == f2->match_case
+        && f1->enable_regex == f2->enable_regex && f1->search_in_path == f2->search_in_path;
+}
+
+typedef struct _DatabaseSearchCacheEntry {
+    // the query split at whitespace and joined with single spaces, or as is for regex queries
+    char *key;
+    uint32_t db_generation;
+    FsearchFilter *filter;
+    FsearchQueryFlags flags;
+    FsearchToken **token;
+
+    // indices of all matching entries, in database order
+    uint32_t *matches;
+    uint32_t num_matches;
+    uint32_t num_folders;
+} DatabaseSearchCacheEntry;
+
+static char *
+db_search_cache_key_new(FsearchQuery *q) {
+    if (q->flags.enable_regex && fs_str_is_regex(q->text)) {
+        return g_strdup(q->text);
+    }
+    char **query_split = fs_str_split(q->text);
+    char *key = g_strjoinv(" ", query_split);
+    g_strfreev(query_split);
+    query_split = NULL;
+    return key;
+}
+
+static bool
+db_search_flags_equal(FsearchQueryFlags *f1, FsearchQueryFlags *f2) {
+    return f1->match_case == f2->match_case && f1->auto_match_case == f2->auto_match_case
+        && f1->enable_regex == f2->enable_regex && f1->enable_fuzzy == f2->enable_fuzzy
+        && f1->enable_ranking == f2->enable_ranking
+        && f1->search_in_path == f2->search_in_path && f1->auto_search_in_path == f2->auto_search_in_path;
+}
+
+static void
+db_search_cache_entry_free(DatabaseSearchCacheEntry *entry) {
+    if (!entry) {
+        return;
+    }
+    g_free(entry->key);
+    entry->key = NULL;
+    if (entry->filter) {
+        fsearch_filter_free(entry->filter);
+        entry->filter = NULL;
+    }
+    if (entry->token) {
+        fsearch_tokens_free(entry->token);
+        entry->token = NULL;
+    }
+    free(entry->matches);
+    entry->matches = NULL;
+    g_free(entry);
+    entry = NULL;
+}
+
+static void
+db_search_cache_remove(DatabaseSearchService *service, GList *link) {
+    DatabaseSearchCacheEntry *entry = link->data;
+    service->cache_num_matches -= entry->num_matches;
+    db_search_cache_entry_free(entry);
+    g_queue_delete_link(service->cache, link);
+}
+
+static void
+db_search_cache_clear(DatabaseSearchService *service) {
+    while (!g_queue_is_empty(service->cache)) {
+        db_search_cache_remove(service, g_queue_peek_head_link(service->cache));
+    }
+}
 
+// Drops everything found in other databases or before the entries list was rebuilt
 static void
-db_search_entry_free(DatabaseSearchEntry *entry);
+db_search_cache_purge(DatabaseSearchService *service, uint32_t db_generation) {
+    GList *link = g_queue_peek_head_link(service->cache);
+    while (link) {
+        GList *next = link->next;
+        DatabaseSearchCacheEntry *entry = link->data;
+        if (entry->db_generation != db_generation) {
+            db_search_cache_remove(service, link);
+        }
+        link = next;
+    }
+}
 
-static void
-db_search_notify_cancelled(FsearchQuery *query) {
-    if (query->db) {
-        db_unref(query->db);
+static bool
+db_search_cache_entry_matches_query(DatabaseSearchCacheEntry *entry, FsearchQuery *q) {
+    return entry->db_generation == db_get_generation(q->db) && db_search_flags_equal(&entry->flags, &q->flags)
+        && db_search_filter_equal(entry->filter, q->filter);
+}
+
+// Every entry matching q also matches the query of the cache entry
+static bool
+db_search_cache_entry_is_refined_by(DatabaseSearchCacheEntry *entry, FsearchQuery *q) {
+    if (!db_search_cache_entry_matches_query(entry, q)) {
+        return false;
     }
-    if (query->callback_cancelled) {
-        query->callback_cancelled(query->callback_cancelled_data);
+    // so each of its token has to be implied by one of the new token
+    for (uint32_t i = 0; entry->token[i]; i++) {
+        bool refined = false;
+        for (uint32_t j = 0; j < q->num_token; j++) {
+            if (fsearch_token_is_refined_by(entry->token[i], q->token[j])) {
+                refined = true;
+                break;
+            }
+        }
+        if (!refined) {
+            return false;
+        }
     }
+    return true;
 }
 
-static gpointer
-db_search_thread(gpointer user_data) {
-    DatabaseSearch *search = user_data;
+static DatabaseSearchCacheEntry *
+db_search_cache_lookup(DatabaseSearchService *service, FsearchQuery *q, const char *key) {
+    for (GList *link = g_queue_peek_head_link(service->cache); link != NULL; link = link->next) {
+        DatabaseSearchCacheEntry *entry = link->data;
+        if (!strcmp(entry->key, key) && db_search_cache_entry_matches_query(entry, q)) {
+            g_queue_unlink(service->cache, link);
+            g_queue_push_head_link(service->cache, link);
+            return entry;
+        }
+    }
+    return NULL;
+}
 
-    g_mutex_lock(&search->query_mutex);
-    while (true) {
-        g_cond_wait(&search->search_thread_start_cond, &search->query_mutex);
-        if (search->search_thread_terminate) {
-            break;
+// The cached search with the fewest matches which q narrows down, if any
+static DatabaseSearchCacheEntry *
+db_search_cache_lookup_refined(DatabaseSearchService *service, FsearchQuery *q) {
+    GList *best = NULL;
+    for (GList *link = g_queue_peek_head_link(service->cache); link != NULL; link = link->next) {
+        DatabaseSearchCacheEntry *entry = link->data;
+        if ((!best || entry->num_matches < ((DatabaseSearchCacheEntry *)best->data)->num_matches)
+            && db_search_cache_entry_is_refined_by(entry, q)) {
+            best = link;
         }
-        while (search->query_ctx) {
-            FsearchQuery *query = search->query_ctx;
-            if (!query) {
-                break;
-            }
-            search->query_ctx = NULL;
-            search->search_terminate = false;
-            g_mutex_unlock(&search->query_mutex);
-            // if query is empty string we are done here
-            DatabaseSearchResult *result = NULL;
-            if (fs_str_is_empty(query->text)) {
-                if (query->pass_on_empty_query) {
-                    result = db_search_empty(query);
-                }
-                else {
-                    result = calloc(1, sizeof(DatabaseSearchResult));
-                }
-            }
-            else {
-                result = db_search(search, query);
+    }
+    if (!best) {
+        return NULL;
+    }
+    g_queue_unlink(service->cache, best);
+    g_queue_push_head_link(service->cache, best);
+    return best->data;
+}
+
+// Merges the matches of all shards below the index bound into results, ordered by their index in the database.
+// All of them must be in chunks in front of the cursors' ends. pos and the numbers of folders and files continue
+// from where they are, with max_results nothing is added past it.
+static void
+db_search_merge_results(search_context_t *ctx,
+                        search_cursor_t *cursors,
+                        uint32_t bound,
+                        GArray *results,
+                        uint32_t *pos,
+                        uint32_t *num_folders,
+                        uint32_t *num_files) {
+    const uint32_t max_results = ctx->max_results;
+    while (!max_results || *pos < max_results) {
+        // there are only a few shards, so the next match is looked up among all of them
+        int32_t min_shard = -1;
+        uint32_t min_idx = bound;
+        for (uint32_t i = 0; i < ctx->num_shards; i++) {
+            search_cursor_t *cursor = &cursors[i];
+            while (cursor->chunk < cursor->end && cursor->pos >= ctx->chunks[cursor->chunk].num_results) {
+                cursor->chunk++;
+                cursor->pos = 0;
             }
-            g_mutex_lock(&search->query_mutex);
-            if (result) {
-                result->cb_data = query->callback_data;
-                result->db = query->db;
-                query->callback(result);
+            if (cursor->chunk >= cursor->end) {
+                continue;
             }
-            else {
-                db_search_notify_cancelled(query);
+            const uint32_t idx = ctx->shards[i].global_indices[ctx->chunks[cursor->chunk].results[cursor->pos]];
+            if (idx < min_idx) {
+                min_shard = (int32_t)i;
+                min_idx = idx;
             }
-            fsearch_query_free(query);
-            query = NULL;
         }
+        if (min_shard < 0) {
+            break;
+        }
+        search_cursor_t *cursor = &cursors[min_shard];
+        DatabaseShard *shard = ctx->shards[min_shard].shard;
+        const uint32_t idx_in_shard = ctx->chunks[cursor->chunk].results[cursor->pos++];
+        if (db_search_entry_is_dir(shard->entry_table, shard->entries, idx_in_shard)) {
+            (*num_folders)++;
+        }
+        else {
+            (*num_files)++;
+        }
+        g_array_append_val(results, min_idx);
+        (*pos)++;
     }
-    g_mutex_unlock(&search->query_mutex);
-    return NULL;
 }
 
 static void
-search_thread_context_free(search_thread_context_t *ctx) {
-    if (!ctx) {
-        return;
+db_search_cache_add(DatabaseSearchService *service, FsearchQuery *q, const char *key, search_context_t *ctx) {
+    uint32_t num_matches = 0;
+    for (uint32_t i = 0; i < ctx->num_chunks; i++) {
+        num_matches += ctx->chunks[i].num_results;
     }
-    if (ctx->results) {
-        g_free(ctx->results);
-        ctx->results = NULL;
+    if (ctx->max_results && num_matches >= ctx->max_results) {
+        // chunks might have been left early, so not all matches are known
+        return;
     }
-    if (ctx) {
-        g_free(ctx);
-        ctx = NULL;
+    if (num_matches > DB_SEARCH_CACHE_MAX_MATCHES) {
+        return;
     }
-}
-
-static search_thread_context_t *
-search_thread_context_new(FsearchQuery *query, bool *terminate, uint32_t start_pos, uint32_t end_pos) {
-    search_thread_context_t *ctx = calloc(1, sizeof(search_thread_context_t));
-    assert(ctx != NULL);
-    assert(end_pos >= start_pos);
-
-    ctx->query = query;
-    ctx->terminate = terminate;
-    ctx->results = calloc(end_pos - start_pos + 1, sizeof(BTreeNode *));
-    assert(ctx->results != NULL);
 
-    ctx->num_results = 0;
-    ctx->start_pos = start_pos;
-    ctx->end_pos = end_pos;
-    return ctx;
-}
+    DatabaseSearchCacheEntry *entry = g_new0(DatabaseSearchCacheEntry, 1);
+    entry->matches = calloc(num_matches + 1, sizeof(uint32_t));
+    assert(entry->matches != NULL);
 
-static inline bool
-filter_node(BTreeNode *node, FsearchQuery *query, const char *haystack) {
-    if (!query->filter) {
-        return true;
+    search_cursor_t cursors[ctx->num_shards];
+    for (uint32_t i = 0; i < ctx->num_shards; i++) {
+        search_shard_t *shard = &ctx->shards[i];
+        cursors[i].chunk = shard->first_chunk;
+        cursors[i].pos = 0;
+        cursors[i].end = (uint32_t)(shard->last_needed_chunk + 1);
     }
-    if (query->filter->type == FSEARCH_FILTER_NONE && query->filter->query == NULL) {
-        return true;
+    GArray *matches = g_array_sized_new(FALSE, FALSE, sizeof(uint32_t), num_matches);
+    uint32_t pos = 0;
+    uint32_t num_folders = 0;
+    uint32_t num_files = 0;
+    db_search_merge_results(ctx, cursors, UINT32_MAX, matches, &pos, &num_folders, &num_files);
+    assert(matches->len == num_matches);
+    if (num_matches > 0) {
+        memcpy(entry->matches, matches->data, num_matches * sizeof(uint32_t));
     }
-    bool is_dir = node->is_dir;
-    if (query->filter->type == FSEARCH_FILTER_FILES && is_dir) {
-        return false;
+    g_array_free(matches, TRUE);
+    matches = NULL;
+
+    entry->num_matches = num_matches;
+    entry->num_folders = num_folders;
+    entry->key = g_strdup(key);
+    entry->db_generation = db_get_generation(q->db);
+    if (q->filter) {
+        entry->filter = fsearch_filter_new(q->filter->type,
+                                           q->filter->name,
+                                           q->filter->query,
+                                           q->filter->match_case,
+                                           q->filter->enable_regex,
+                                           q->filter->search_in_path);
     }
-    if (query->filter->type == FSEARCH_FILTER_FOLDERS && !is_dir) {
-        return false;
+    // the query is freed once its results are delivered, so take over its token
+    entry->token = q->token;
+    q->token = NULL;
+    entry->flags = q->flags;
+
+    g_queue_push_head(service->cache, entry);
+    service->cache_num_matches += num_matches;
+    while (g_queue_get_length(service->cache) > DB_SEARCH_CACHE_SIZE
+           || service->cache_num_matches > DB_SEARCH_CACHE_MAX_MATCHES) {
+        db_search_cache_remove(service, g_queue_peek_tail_link(service->cache));
     }
-    if (query->filter_token) {
-        uint32_t num_found = 0;
-        while (true) {
-            if (num_found == query->num_filter_token) {
-                return true;
+}
+
+static DatabaseSearchResult *
+db_search_result_new_from_cache(FsearchQuery *q, DatabaseSearchCacheEntry *entry) {
+    if (db_search_query_is_ranked(q)) {
+        // the cache holds all matches in database order
+        const int64_t now = g_get_real_time() / G_USEC_PER_SEC;
+        search_ranking_t ranking;
+        search_ranking_init(&ranking, q->max_results);
+        for (uint32_t i = 0; i < entry->num_matches; i++) {
+            uint32_t shard_idx = 0;
+            uint32_t idx_in_shard = 0;
+            if (!db_get_shard_position(q->db, entry->matches[i], &shard_idx, &idx_in_shard)) {
+                continue;
             }
-            FsearchToken *t = query->filter_token[num_found++];
-            if (!t) {
-                return false;
+            search_ranked_t match = {.score = 0, .idx = entry->matches[i]};
+            if (db_search_get_entry_score(q,
+                                          db_get_shard(q->db, shard_idx, NULL),
+                                          idx_in_shard,
+                                          now,
+                                          search_ranking_get_min_score(&ranking),
+                                          &match.score)) {
+                search_ranking_push(&ranking, match);
             }
-
-            if (!t->search_func(haystack, t->text, t)) {
-                return false;
+        }
+        return db_search_ranked_result_new(q, &ranking);
+    }
+    const uint32_t num_results = q->max_results ? MIN(q->max_results, entry->num_matches) : entry->num_matches;
+    GArray *results = g_array_sized_new(FALSE, FALSE, sizeof(uint32_t), num_results);
+    g_array_append_vals(results, entry->matches, num_results);
+
+    uint32_t num_folders = entry->num_folders;
+    if (num_results < entry->num_matches) {
+        // only part of the matches is used, their folders have to be counted
+        DynamicArray *entries = db_get_entries(q->db);
+        num_folders = 0;
+        for (uint32_t i = 0; i < num_results; i++) {
+            BTreeNode *node = darray_get_item(entries, entry->matches[i]);
+            if (node->is_dir) {
+                num_folders++;
             }
         }
-        return false;
     }
-    return true;
+    const uint32_t num_files = num_results - num_folders;
+    return db_search_result_new(results, num_folders, num_files);
 }
 
-static void *
-db_search_worker(void *user_data) {
-    search_thread_context_t *ctx = (search_thread_context_t *)user_data;
-    assert(ctx != NULL);
-    assert(ctx->results != NULL);
-
-    FsearchQuery *query = ctx->query;
-    const uint32_t start = ctx->start_pos;
-    const uint32_t end = ctx->end_pos;
-    const uint32_t max_results = query->max_results;
-    const uint32_t num_token = query->num_token;
-    FsearchToken **token = query->token;
-    const uint32_t search_in_path = query->flags.search_in_path;
-    const uint32_t auto_search_in_path = query->flags.auto_search_in_path;
-    DynamicArray *entries = db_get_entries(query->db);
-    BTreeNode **results = ctx->results;
-
-    if (!entries) {
-        ctx->num_results = 0;
-        trace("[database_search] entries empty\n");
-        return NULL;
+static void
+db_search_sort_token_by_selectivity(FsearchQuery *q, DatabaseShard *shard) {
+    DatabaseEntryTable *table = shard ? shard->entry_table : NULL;
+    if (!table || q->num_token < 2 || table->num_entries == 0) {
+        return;
     }
-
-    uint32_t num_results = 0;
+    const uint32_t num_token = q->num_token;
+    const uint32_t step = MAX(table->num_entries / DB_SEARCH_SELECTIVITY_SAMPLES, 1);
     char full_path[PATH_MAX] = "";
-    for (uint32_t i = start; i <= end; i++) {
-        if (*ctx->terminate) {
-            return NULL;
-        }
-        if (max_results && num_results == max_results) {
-            break;
+    uint32_t num_matches[num_token];
+    for (uint32_t i = 0; i < num_token; i++) {
+        FsearchToken *t = q->token[i];
+        if (search_token_is_range(t)) {
+            // those are checked before all others anyway
+            num_matches[i] = 0;
+            continue;
         }
-        BTreeNode *node = darray_get_item(entries, i);
-        if (!node) {
+        if (db_search_token_needs_paths(t, q->flags.search_in_path, q->flags.auto_search_in_path)) {
+            // building the path is the most expensive part, so those go last
+            num_matches[i] = UINT32_MAX;
             continue;
         }
-        const char *haystack_path = NULL;
-        const char *haystack_name = node->name;
-        if (search_in_path || query->filter->search_in_path) {
-            btree_node_get_path_full(node, full_path, sizeof(full_path));
-            haystack_path = full_path;
+        num_matches[i] = 0;
+        for (uint32_t j = 0; j < table->num_entries; j += step) {
+            search_entry_t entry = {
+                .table = table,
+                .entries = shard->entries,
+                .node = NULL,
+                .idx = j,
+                .name = db_entry_table_get_name(table, j),
+                .path = NULL,
+                .full_path = full_path,
+                .has_folded_names = db_entry_table_has_folded_names(table),
+            };
+            num_matches[i] += db_search_entry_matches_token(&entry, t, false, false) ? 1 : 0;
         }
+    }
 
-        if (!filter_node(node, query, query->filter->search_in_path ? haystack_path : haystack_name)) {
-            continue;
+    // the token which rejects the most entries is checked first,
+    // a stable insertion sort, there are only a few of them
+    for (uint32_t i = 1; i < num_token; i++) {
+        FsearchToken *t = q->token[i];
+        const uint32_t n = num_matches[i];
+        uint32_t j = i;
+        while (j > 0 && num_matches[j - 1] > n) {
+            q->token[j] = q->token[j - 1];
+            num_matches[j] = num_matches[j - 1];
+            j--;
         }
+        q->token[j] = t;
+        num_matches[j] = n;
+    }
+}
 
-        uint32_t num_found = 0;
-        while (true) {
-            if (num_found == num_token) {
-                results[num_results] = node;
-                num_results++;
-                break;
-            }
-            FsearchToken *t = token[num_found++];
-            if (!t) {
-                break;
-            }
-
-            const char *haystack = NULL;
-            if (search_in_path || (auto_search_in_path && t->has_separator)) {
-                if (!haystack_path) {
-                    btree_node_get_path_full(node, full_path, sizeof(full_path));
-                    haystack_path = full_path;
-                }
-                haystack = haystack_path;
-            }
-            else {
-                haystack = haystack_name;
-            }
-            if (!t->search_func(haystack, t->text, t)) {
-                break;
-            }
+// The strings which the folded names of all matches contain, NULL if the token are matched against the paths
+static GPtrArray *
+db_search_get_name_literals(FsearchQuery *q) {
+    if (q->flags.search_in_path) {
+        return NULL;
+    }
+    GPtrArray *literals = g_ptr_array_new_with_free_func(g_free);
+    for (uint32_t i = 0; i < q->num_token; i++) {
+        FsearchToken *t = q->token[i];
+        if (q->flags.auto_search_in_path && t->has_separator) {
+            // those are only known to be in the paths
+            continue;
         }
+        fsearch_token_add_folded_literals(t, literals);
     }
-    ctx->num_results = num_results;
-    return NULL;
+    return literals;
 }
 
-static DatabaseSearchResult *
-db_search_result_new(GPtrArray *results, uint32_t num_folders, uint32_t num_files) {
-    DatabaseSearchResult *result_ctx = calloc(1, sizeof(DatabaseSearchResult));
-    assert(result_ctx != NULL);
-    result_ctx->results = results;
-    result_ctx->num_folders = num_folders;
-    result_ctx->num_files = num_files;
-    return result_ctx;
+// Restricts the shards with a trigram index to the candidates it finds, returns whether any of them was
+static bool
+db_search_add_index_candidates(GPtrArray *literals, search_shard_t *shards, uint32_t num_shards) {
+    if (!literals) {
+        return false;
+    }
+    bool res = false;
+    for (uint32_t i = 0; i < num_shards; i++) {
+        search_shard_t *shard = &shards[i];
+        if (!shard->shard->trigram_index) {
+            continue;
+        }
+        uint32_t num_candidates = 0;
+        uint32_t *candidates = db_trigram_index_get_candidates(shard->shard->trigram_index, literals, &num_candidates);
+        if (candidates) {
+            shard->candidates = candidates;
+            shard->num_entries = num_candidates;
+            res = true;
+        }
+    }
+    return res;
 }
 
-static DatabaseSearchResult *
-db_search_empty(FsearchQuery *query) {
-    assert(query != NULL);
-    assert(query->db != NULL);
-
-    const uint32_t num_entries = db_get_num_entries(query->db);
-    const uint32_t num_results = query->max_results == 0 ? num_entries : MIN(query->max_results, num_entries);
-    GPtrArray *results = g_ptr_array_sized_new(num_results);
-    g_ptr_array_set_free_func(results, (GDestroyNotify)db_search_entry_free);
-
-    DynamicArray *entries = db_get_entries(query->db);
-
-    uint32_t num_folders = 0;
-    uint32_t num_files = 0;
-    uint32_t pos = 0;
+// Splits the matches of a cached search up into the candidates of every shard
+static void
+db_search_add_cache_candidates(FsearchQuery *q,
+                               DatabaseSearchCacheEntry *cached,
+                               search_shard_t *shards,
+                               uint32_t num_shards) {
+    for (uint32_t i = 0; i < num_shards; i++) {
+        shards[i].candidates = malloc(MAX(cached->num_matches, 1) * sizeof(uint32_t));
+        assert(shards[i].candidates != NULL);
+        shards[i].num_entries = 0;
+    }
+    for (uint32_t i = 0; i < cached->num_matches; i++) {
+        uint32_t shard_idx = 0;
+        uint32_t idx_in_shard = 0;
+        if (db_get_shard_position(q->db, cached->matches[i], &shard_idx, &idx_in_shard)) {
+            search_shard_t *shard = &shards[shard_idx];
+            shard->candidates[shard->num_entries++] = idx_in_shard;
+        }
+    }
+}
 
-    char full_path[PATH_MAX] = "";
-    for (uint32_t i = 0; pos < num_results && i < num_entries; ++i) {
-        BTreeNode *node = darray_get_item(entries, i);
-        if (!node) {
-            continue;
+// While the workers are running, hands the matches of the chunks finished in
+// order so far to the callback_partial of everyone waiting for q every DB_SEARCH_STREAM_INTERVAL_MS.
+// Only matches which no shard can add any more in front of are handed out.
+static void
+db_search_stream_results(DatabaseSearchService *service,
+                         FsearchQuery *q,
+                         search_context_t *ctx,
+                         uint32_t *pos,
+                         uint32_t *num_folders,
+                         uint32_t *num_files) {
+    uint32_t last_bound = 0;
+    while (true) {
+        g_mutex_lock(&ctx->progress_mutex);
+        const gint64 end_time = g_get_monotonic_time() + DB_SEARCH_STREAM_INTERVAL_MS * G_TIME_SPAN_MILLISECOND;
+        while (!search_context_is_complete(ctx) && !search_context_is_cancelled(ctx)) {
+            if (!g_cond_wait_until(&ctx->progress_cond, &ctx->progress_mutex, end_time)) {
+                break;
+            }
         }
+        const bool complete = search_context_is_complete(ctx);
+        const uint32_t bound = complete ? 0 : search_context_get_merge_bound(ctx, ctx->cursors);
+        g_mutex_unlock(&ctx->progress_mutex);
 
-        const char *haystack_path = NULL;
-        const char *haystack_name = node->name;
-        if (query->filter->search_in_path) {
-            btree_node_get_path_full(node, full_path, sizeof(full_path));
-            haystack_path = full_path;
+        if (complete || search_context_is_cancelled(ctx)) {
+            // the rest is handed out with the final result
+            break;
         }
-        if (!filter_node(node, query, query->filter->search_in_path ? haystack_path : haystack_name)) {
+        if (bound == last_bound) {
             continue;
         }
-        if (node->is_dir) {
-            num_folders++;
-        }
-        else {
-            num_files++;
+        last_bound = bound;
+
+        const uint32_t first_pos = *pos;
+        GArray *results = g_array_new(FALSE, FALSE, sizeof(uint32_t));
+        db_search_merge_results(ctx, ctx->cursors, bound, results, pos, num_folders, num_files);
+        if (results->len == 0) {
+            g_array_free(results, TRUE);
+            continue;
         }
-        DatabaseSearchEntry *entry = db_search_entry_new(node, pos);
-        g_ptr_array_add(results, entry);
-        pos++;
+
+        DatabaseSearchResult *result = db_search_result_new(results, *num_folders, *num_files);
+        result->num_streamed = first_pos;
+        g_mutex_lock(&service->query_mutex);
+        service->running_streamed = true;
+        db_search_service_deliver(service, result, true);
+        g_mutex_unlock(&service->query_mutex);
     }
-    return db_search_result_new(results, num_folders, num_files);
 }
 
 static DatabaseSearchResult *
-db_search(DatabaseSearch *search, FsearchQuery *q) {
-    assert(search != NULL);
+db_search(DatabaseSearchService *service, FsearchQuery *q) {
+    assert(service != NULL);
+
+    const gint64 stats_start = fsearch_stats_now();
+    db_search_cache_purge(service, db_get_generation(q->db));
+    char *cache_key = db_search_cache_key_new(q);
+    DatabaseSearchCacheEntry *cached = db_search_cache_lookup(service, q, cache_key);
+    if (cached) {
+        trace("[search] %u matches found in cache\n", cached->num_matches);
+        g_free(cache_key);
+        fsearch_stats_add(FSEARCH_STATS_SEARCH_CACHE_HITS, 1);
+        DatabaseSearchResult *result = db_search_result_new_from_cache(q, cached);
+        fsearch_stats_record(FSEARCH_STATS_TIME_SEARCH, stats_start);
+        return result;
+    }
 
-    const uint32_t num_entries = db_get_num_entries(q->db);
-    if (num_entries == 0) {
+    if (!q->token) {
+        g_free(cache_key);
         return db_search_result_new(NULL, 0, 0);
     }
-    const uint32_t num_threads = MIN(fsearch_thread_pool_get_num_threads(search->pool), num_entries);
-    const uint32_t num_items_per_thread = num_entries / num_threads;
 
-    search_thread_context_t *thread_data[num_threads];
-    memset(thread_data, 0, num_threads * sizeof(search_thread_context_t *));
+    // every shard is searched on its own, their matches are merged by their index in the database
+    const uint32_t num_shards = db_get_num_shards(q->db);
+    search_shard_t *shards = g_new0(search_shard_t, MAX(num_shards, 1));
+    DatabaseShard *largest_shard = NULL;
+    for (uint32_t i = 0; i < num_shards; i++) {
+        search_shard_t *shard = &shards[i];
+        shard->shard = db_get_shard(q->db, i, &shard->global_indices);
+        shard->num_entries = shard->shard->num_entries;
+        DatabaseEntryTable *table = shard->shard->entry_table;
+        if (table && q->filter_extensions) {
+            shard->extension_set = db_entry_table_get_extension_set(table, q->filter_extensions, q->filter->match_case);
+        }
+        if (table && (!largest_shard || table->num_entries > largest_shard->entry_table->num_entries)) {
+            largest_shard = shard->shard;
+        }
+    }
 
+    // only scan the matches of a cached search if the query just narrows it down,
+    // otherwise the trigram index might rule out most of the entries
+    GPtrArray *literals = db_search_get_name_literals(q);
+    if ((cached = db_search_cache_lookup_refined(service, q))) {
+        db_search_add_cache_candidates(q, cached, shards, num_shards);
+    }
+    else if (db_search_add_index_candidates(literals, shards, num_shards)) {
+        fsearch_stats_add(FSEARCH_STATS_SEARCH_INDEX_HITS, 1);
+    }
+    // entries whose signature lacks any of the literals' bits are rejected before their names are compared
+    uint64_t signature_mask = 0;
+    if (literals) {
+        for (uint32_t i = 0; i < literals->len; i++) {
+            signature_mask |= db_entry_table_get_signature(g_ptr_array_index(literals, i));
+        }
+        g_ptr_array_free(literals, TRUE);
+        literals = NULL;
+    }
+    uint32_t num_entries = 0;
+    for (uint32_t i = 0; i < num_shards; i++) {
+        num_entries += shards[i].num_entries;
+    }
+    if (num_entries == 0) {
+        for (uint32_t i = 0; i < num_shards; i++) {
+            free(shards[i].candidates);
+            free(shards[i].extension_set);
+        }
+        g_free(shards);
+        g_free(cache_key);
+        return db_search_result_new(NULL, 0, 0);
+    }
     const uint32_t max_results = q->max_results;
-    const bool limit_results = max_results ? true : false;
-    uint32_t start_pos = 0;
-    uint32_t end_pos = num_items_per_thread - 1;
+    const bool is_ranked = db_search_query_is_ranked(q);
 
-    if (!q->token) {
-        return db_search_result_new(NULL, 0, 0);
+    if (db_search_query_needs_paths(q)) {
+        for (uint32_t i = 0; i < num_shards; i++) {
+            DatabaseShard *shard = shards[i].shard;
+            if (shard->entry_table && shards[i].num_entries > 0) {
+                db_entry_table_ensure_parent_paths(shard->entry_table, shard->entries);
+            }
+        }
+    }
+    db_search_sort_token_by_selectivity(q, largest_shard);
+    for (uint32_t i = 0; i < q->num_token; i++) {
+        FsearchToken *t = q->token[i];
+        if (t->type != FSEARCH_TOKEN_EXTENSION) {
+            continue;
+        }
+        // each shard has its own extension ids, the token is then checked like the filter
+        for (uint32_t j = 0; j < num_shards; j++) {
+            search_shard_t *shard = &shards[j];
+            if (!shard->shard->entry_table) {
+                continue;
+            }
+            if (!shard->token_extension_sets) {
+                shard->token_extension_sets = g_new0(uint64_t *, q->num_token);
+                shard->num_token_extension_sets = q->num_token;
+            }
+            shard->token_extension_sets[i] =
+                db_entry_table_get_extension_set(shard->shard->entry_table, t->extensions, t->match_case);
+        }
     }
 
+    gint64 stats_phase_start = fsearch_stats_record(FSEARCH_STATS_TIME_SEARCH_PREPARE, stats_start);
     GTimer *timer = fsearch_timer_start();
-    GList *threads = fsearch_thread_pool_get_threads(search->pool);
+    for (uint32_t i = 0; i < service->num_buffers; i++) {
+        search_buffer_reset(&service->buffers[i]);
+    }
+    search_context_t *ctx = search_context_new(q,
+                                               &service->search_terminate,
+                                               shards,
+                                               num_shards,
+                                               signature_mask,
+                                               db_search_get_fuzzy_signatures(q),
+                                               db_search_get_token_literals(q, is_ranked),
+                                               is_ranked,
+                                               service->buffers,
+                                               service->num_buffers);
+    shards = NULL;
+    const uint32_t num_threads = MIN(ctx->num_workers, ctx->num_chunks);
+    FsearchTaskGroup *group = fsearch_task_group_new(service->pool);
     for (uint32_t i = 0; i < num_threads; i++) {
-        thread_data[i] = search_thread_context_new(q,
-                                                   &search->search_terminate,
-                                                   start_pos,
-                                                   i == num_threads - 1 ? num_entries - 1 : end_pos);
-
-        start_pos = end_pos + 1;
-        end_pos += num_items_per_thread;
-
-        fsearch_thread_pool_push_data(search->pool, threads, db_search_worker, thread_data[i]);
-        threads = threads->next;
+        fsearch_task_group_push(group, db_search_worker, &ctx->workers[i]);
     }
 
-    threads = fsearch_thread_pool_get_threads(search->pool);
-    while (threads) {
-        fsearch_thread_pool_wait_for_thread(search->pool, threads);
-        threads = threads->next;
+    uint32_t num_folders = 0;
+    uint32_t num_files = 0;
+    uint32_t pos = 0;
+    if (q->callback_partial && !is_ranked) {
+        // until all matches are known it's unclear which are the best
+        db_search_stream_results(service, q, ctx, &pos, &num_folders, &num_files);
     }
-    if (search->search_terminate) {
-        for (uint32_t i = 0; i < num_threads; i++) {
-            search_thread_context_t *ctx = thread_data[i];
-            search_thread_context_free(ctx);
-        }
+
+    fsearch_task_group_free(group);
+    group = NULL;
+    if (g_atomic_int_get(&service->search_terminate)) {
+        search_context_free(ctx);
+        g_free(cache_key);
         fsearch_timer_stop(timer, "[search] search aborted after %.2f ms\n");
         timer = NULL;
         return NULL;
     }
 
+    stats_phase_start = fsearch_stats_record(FSEARCH_STATS_TIME_SEARCH_MATCH, stats_phase_start);
+
     // get total number of entries found
     uint32_t num_results = 0;
-    for (uint32_t i = 0; i < num_threads; ++i) {
-        num_results += thread_data[i]->num_results;
+    for (uint32_t i = 0; i < ctx->num_chunks; ++i) {
+        num_results += ctx->chunks[i].num_results;
     }
+    DatabaseSearchResult *result = is_ranked ? db_search_merge_rankings(ctx) : NULL;
 
-    GPtrArray *results = g_ptr_array_sized_new(MIN(num_results, max_results));
-    g_ptr_array_set_free_func(results, (GDestroyNotify)db_search_entry_free);
+    db_search_cache_add(service, q, cache_key, ctx);
+    g_free(cache_key);
+    cache_key = NULL;
 
-    uint32_t num_folders = 0;
-    uint32_t num_files = 0;
+    if (!result) {
+        num_results -= MIN(pos, num_results);
+        GArray *results =
+            g_array_sized_new(FALSE, FALSE, sizeof(uint32_t), max_results ? MIN(num_results, max_results) : num_results);
 
-    uint32_t pos = 0;
-    for (uint32_t i = 0; i < num_threads; i++) {
-        search_thread_context_t *ctx = thread_data[i];
-        if (!ctx) {
-            break;
-        }
-        for (uint32_t j = 0; j < ctx->num_results; ++j) {
-            if (limit_results) {
-                if (pos >= max_results) {
-                    break;
-                }
-            }
-            BTreeNode *node = ctx->results[j];
-            if (node->is_dir) {
-                num_folders++;
-            }
-            else {
-                num_files++;
-            }
-            DatabaseSearchEntry *entry = db_search_entry_new(node, pos);
-            g_ptr_array_add(results, entry);
-            pos++;
+        const uint32_t num_streamed = pos;
+        for (uint32_t i = 0; i < ctx->num_shards; i++) {
+            ctx->cursors[i].end = (uint32_t)(ctx->shards[i].last_needed_chunk + 1);
         }
-        search_thread_context_free(ctx);
+        db_search_merge_results(ctx, ctx->cursors, UINT32_MAX, results, &pos, &num_folders, &num_files);
+        result = db_search_result_new(results, num_folders, num_files);
+        result->num_streamed = num_streamed;
     }
+    search_context_free(ctx);
 
+    trace("[search] searched %u of %u entries in %u shards\n", num_entries, db_get_num_entries(q->db), num_shards);
     fsearch_timer_stop(timer, "[search] search finished in %.2f ms\n");
     timer = NULL;
+    fsearch_stats_record(FSEARCH_STATS_TIME_SEARCH_MERGE, stats_phase_start);
+    fsearch_stats_record(FSEARCH_STATS_TIME_SEARCH, stats_start);
+    fsearch_stats_add(FSEARCH_STATS_SEARCH_ENTRIES, num_entries);
+    fsearch_stats_add(FSEARCH_STATS_SEARCH_MATCHES, result->num_streamed + result->results->len);
 
-    return db_search_result_new(results, num_folders, num_files);
+    return result;
 }
 
 void
@@ -423,7 +2405,7 @@ db_search_results_clear(DatabaseSearch *search) {
 
     // free entries
     if (search->results) {
-        g_ptr_array_free(search->results, TRUE);
+        g_array_free(search->results, TRUE);
         search->results = NULL;
     }
     search->num_folders = 0;
@@ -436,66 +2418,111 @@ db_search_free(DatabaseSearch *search) {
     assert(search != NULL);
 
     db_search_results_clear(search);
-    g_mutex_lock(&search->query_mutex);
+    DatabaseSearchService *service = search->service;
+    g_mutex_lock(&service->query_mutex);
     if (search->query_ctx) {
         fsearch_query_free(search->query_ctx);
         search->query_ctx = NULL;
+        g_queue_remove(service->pending, search);
+    }
+    if (db_search_service_is_running(service, search)) {
+        if (g_ptr_array_index(service->running_searches, 0) != search) {
+            db_search_service_leave_running(service, search);
+        }
+        else {
+            // its callbacks still get called, so wait for them like for its own thread before
+            if (!db_search_service_has_waiters(service, search)) {
+                g_atomic_int_set(&service->search_terminate, true);
+            }
+            while (db_search_service_is_running(service, search)) {
+                g_cond_wait(&service->search_done_cond, &service->query_mutex);
+            }
+        }
     }
-    g_mutex_unlock(&search->query_mutex);
+    g_mutex_unlock(&service->query_mutex);
 
-    search->search_thread_terminate = true;
-    g_cond_signal(&search->search_thread_start_cond);
-    g_thread_join(search->search_thread);
-    g_mutex_clear(&search->query_mutex);
-    g_cond_clear(&search->search_thread_start_cond);
+    db_search_service_unref(service);
+    search->service = NULL;
     g_free(search);
     search = NULL;
     return;
 }
 
-BTreeNode *
-db_search_entry_get_node(DatabaseSearchEntry *entry) {
-    return entry->node;
-}
-
-uint32_t
-db_search_entry_get_pos(DatabaseSearchEntry *entry) {
-    return entry->pos;
-}
+DatabaseSearch *
+db_search_new(DatabaseSearchService *service) {
+    assert(service != NULL);
+    DatabaseSearch *db_search = calloc(1, sizeof(DatabaseSearch));
+    assert(db_search != NULL);
 
-void
-db_search_entry_set_pos(DatabaseSearchEntry *entry, uint32_t pos) {
-    entry->pos = pos;
+    db_search->service = db_search_service_ref(service);
+    return db_search;
 }
 
-static void
-db_search_entry_free(DatabaseSearchEntry *entry) {
-    if (entry) {
-        g_free(entry);
-        entry = NULL;
+DatabaseSearchService *
+db_search_service_new(FsearchThreadPool *pool) {
+    DatabaseSearchService *service = calloc(1, sizeof(DatabaseSearchService));
+    assert(service != NULL);
+
+    service->pool = pool;
+    service->ref_count = 1;
+    service->num_buffers = MAX(1, fsearch_thread_pool_get_num_threads(pool));
+    service->buffers = g_new0(DatabaseSearchBuffer, service->num_buffers);
+    for (uint32_t i = 0; i < service->num_buffers; i++) {
+        search_buffer_init(&service->buffers[i]);
     }
+    service->cache = g_queue_new();
+    service->pending = g_queue_new();
+    service->running_searches = g_ptr_array_new();
+    service->running_queries = g_ptr_array_new();
+    g_mutex_init(&service->query_mutex);
+    g_cond_init(&service->search_thread_start_cond);
+    g_cond_init(&service->search_done_cond);
+    service->search_thread = g_thread_new("fsearch_search_thread", db_search_thread, service);
+    return service;
 }
 
-DatabaseSearchEntry *
-db_search_entry_new(BTreeNode *node, uint32_t pos) {
-    DatabaseSearchEntry *entry = calloc(1, sizeof(DatabaseSearchEntry));
-    assert(entry != NULL);
-
-    entry->node = node;
-    entry->pos = pos;
-    return entry;
+DatabaseSearchService *
+db_search_service_ref(DatabaseSearchService *service) {
+    assert(service != NULL);
+    g_atomic_int_inc(&service->ref_count);
+    return service;
 }
 
-DatabaseSearch *
-db_search_new(FsearchThreadPool *pool) {
-    DatabaseSearch *db_search = calloc(1, sizeof(DatabaseSearch));
-    assert(db_search != NULL);
+void
+db_search_service_unref(DatabaseSearchService *service) {
+    assert(service != NULL);
+    if (!g_atomic_int_dec_and_test(&service->ref_count)) {
+        return;
+    }
 
-    db_search->pool = pool;
-    g_mutex_init(&db_search->query_mutex);
-    g_cond_init(&db_search->search_thread_start_cond);
-    db_search->search_thread = g_thread_new("fsearch_search_thread", db_search_thread, db_search);
-    return db_search;
+    g_mutex_lock(&service->query_mutex);
+    // every search holds a reference, so none of them can have a query left
+    assert(g_queue_is_empty(service->pending));
+    service->search_thread_terminate = true;
+    g_mutex_unlock(&service->query_mutex);
+
+    g_cond_signal(&service->search_thread_start_cond);
+    g_thread_join(service->search_thread);
+    service->search_thread = NULL;
+    db_search_cache_clear(service);
+    g_queue_free(service->cache);
+    service->cache = NULL;
+    g_queue_free(service->pending);
+    service->pending = NULL;
+    g_ptr_array_free(service->running_searches, TRUE);
+    service->running_searches = NULL;
+    g_ptr_array_free(service->running_queries, TRUE);
+    service->running_queries = NULL;
+    for (uint32_t i = 0; i < service->num_buffers; i++) {
+        search_buffer_clear(&service->buffers[i]);
+    }
+    g_free(service->buffers);
+    service->buffers = NULL;
+    g_mutex_clear(&service->query_mutex);
+    g_cond_clear(&service->search_thread_start_cond);
+    g_cond_clear(&service->search_done_cond);
+    g_free(service);
+    service = NULL;
 }
 
 uint32_t
@@ -516,30 +2543,19 @@ db_search_get_num_folders(DatabaseSearch *search) {
     return search->num_folders;
 }
 
-static void
-update_index(DatabaseSearch *search) {
-    assert(search != NULL);
-
-    for (uint32_t i = 0; i < search->results->len; ++i) {
-        DatabaseSearchEntry *entry = g_ptr_array_index(search->results, i);
-        entry->pos = i;
-    }
-}
-
 void
-db_search_remove_entry(DatabaseSearch *search, DatabaseSearchEntry *entry) {
-    if (search == NULL) {
+db_search_remove_entry(DatabaseSearch *search, uint32_t row) {
+    if (search == NULL || search->results == NULL) {
         return;
     }
-    if (entry == NULL) {
+    if (row >= search->results->len) {
         return;
     }
 
-    g_ptr_array_remove(search->results, (void *)entry);
-    update_index(search);
+    g_array_remove_index(search->results, row);
 }
 
-GPtrArray *
+GArray *
 db_search_get_results(DatabaseSearch *search) {
     assert(search != NULL);
     return search->results;
@@ -547,15 +2563,33 @@ db_search_get_results(DatabaseSearch *search) {
 
 void
 db_search_queue(DatabaseSearch *search, FsearchQuery *query) {
-    g_mutex_lock(&search->query_mutex);
+    DatabaseSearchService *service = search->service;
+    g_mutex_lock(&service->query_mutex);
     if (search->query_ctx) {
+        // it keeps its turn
         db_search_notify_cancelled(search->query_ctx);
         fsearch_query_free(search->query_ctx);
         search->query_ctx = NULL;
     }
-    search->query_ctx = query;
-    search->search_terminate = true;
-    g_mutex_unlock(&search->query_mutex);
-    g_cond_signal(&search->search_thread_start_cond);
+    else {
+        g_queue_push_tail(service->pending, search);
+    }
+    db_search_service_leave_running(service, search);
+
+    if (service->running_queries->len > 0 && !service->running_streamed
+        && !g_atomic_int_get(&service->search_terminate)
+        && db_search_query_equal(g_ptr_array_index(service->running_queries, 0), query)) {
+        // the same query is searched already, its results are handed out to this search as well
+        g_queue_remove(service->pending, search);
+        db_search_service_add_running(service, search, query);
+        fsearch_stats_add(FSEARCH_STATS_SEARCH_JOINED, 1);
+    }
+    else {
+        search->query_ctx = query;
+    }
+    if (service->running_queries->len > 0 && !db_search_service_has_waiters(service, NULL)) {
+        g_atomic_int_set(&service->search_terminate, true);
+    }
+    g_mutex_unlock(&service->query_mutex);
+    g_cond_signal(&service->search_thread_start_cond);
 }
-
@@ -27,51 +27,59 @@
 #include <stdint.h>
 
 typedef struct _DatabaseSearch DatabaseSearch;
-typedef struct _DatabaseSearchEntry DatabaseSearchEntry;
+typedef struct _DatabaseSearchService DatabaseSearchService;
 
 // search modes
 enum {
     DB_SEARCH_MODE_NORMAL = 0,
     DB_SEARCH_MODE_REGEX = 1,
+    DB_SEARCH_MODE_FUZZY = 2,
 };
 
 typedef struct _DatabaseSearchResult {
     FsearchDatabase *db;
-    GPtrArray *results;
+    // indices into the database's entries of the matches from row num_streamed
+    // on, the ones before were handed out with partial results while the
+    // search was running
+    GArray *results;
+    uint32_t num_streamed;
     void *cb_data;
+    // all matches found so far, including the streamed ones
     uint32_t num_folders;
     uint32_t num_files;
+    // the matches are ordered best first instead of by their position in the database
+    bool is_ranked;
 } DatabaseSearchResult;
 
-struct _DatabaseSearch {
-    GPtrArray *results;
-    FsearchThreadPool *pool;
+// Runs the queries of all searches created with it one after another on its own thread,
+// taking turns between them, and shares its cache of recent matches among them. Identical
+// queries which are waiting or running at the same time are only searched once.
+DatabaseSearchService *
+db_search_service_new(FsearchThreadPool *pool);
 
-    GThread *search_thread;
-    bool search_terminate;
-    bool search_thread_terminate;
-    GMutex query_mutex;
-    GCond search_thread_start_cond;
+DatabaseSearchService *
+db_search_service_ref(DatabaseSearchService *service);
 
-    FsearchQuery *query_ctx;
+// The last reference must be dropped after all searches created with it are freed
+void
+db_search_service_unref(DatabaseSearchService *service);
+
+struct _DatabaseSearch {
+    // indices into the database's entries, the row of a match is its position
+    GArray *results;
     uint32_t num_folders;
     uint32_t num_files;
+
+    DatabaseSearchService *service;
+    // the newest query, until the service gets to it. Guarded by the service.
+    FsearchQuery *query_ctx;
 };
 
 void
 db_search_free(DatabaseSearch *search);
 
 DatabaseSearch *
-db_search_new(FsearchThreadPool *pool);
-
-BTreeNode *
-db_search_entry_get_node(DatabaseSearchEntry *entry);
-
-uint32_t
-db_search_entry_get_pos(DatabaseSearchEntry *entry);
-
-void
-db_search_entry_set_pos(DatabaseSearchEntry *entry, uint32_t pos);
+db_search_new(DatabaseSearchService *service);
 
 void
 db_search_results_clear(DatabaseSearch *search);
@@ -85,12 +93,13 @@ db_search_get_num_files(DatabaseSearch *search);
 uint32_t
 db_search_get_num_folders(DatabaseSearch *search);
 
-GPtrArray *
+GArray *
 db_search_get_results(DatabaseSearch *search);
 
 void
-db_search_remove_entry(DatabaseSearch *search, DatabaseSearchEntry *entry);
+db_search_remove_entry(DatabaseSearch *search, uint32_t row);
 
+// Replaces the query of search which didn't run yet, or gives up on its running one
 void
 db_search_queue(DatabaseSearch *search, FsearchQuery *query);
 
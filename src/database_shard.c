@@ -0,0 +1,107 @@
+/*
+   FSearch - A fast file search utility
+   Copyright © 2020 Christian Boxdörfer
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+   */
+
+#include "database_shard.h"
+#include "debug.h"
+#include "fsearch_timer.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+DatabaseShard *
+db_shard_new(DynamicArray *entries, uint32_t num_entries, bool with_trigram_index, size_t *memory_left) {
+    assert(entries != NULL);
+
+    DatabaseShard *shard = calloc(1, sizeof(DatabaseShard));
+    assert(shard != NULL);
+    shard->entries = entries;
+    shard->num_entries = num_entries;
+    shard->with_trigram_index = with_trigram_index;
+    shard->ref_count = 1;
+
+    size_t names_len = 0;
+    const size_t table_size = db_entry_table_estimate_size(entries, num_entries, &names_len);
+    // the posting lists take up about two bytes for every byte of the names
+    const size_t index_size = with_trigram_index ? 2 * names_len : 0;
+    if (memory_left && table_size > *memory_left) {
+        trace("[database_shard] no room for the table of %u entries: %zu bytes\n", num_entries, table_size);
+        return shard;
+    }
+    shard->entry_table = db_entry_table_new(entries, num_entries);
+    if (shard->entry_table) {
+        shard->size = table_size;
+    }
+    if (shard->entry_table && with_trigram_index) {
+        if (memory_left && table_size + index_size > *memory_left) {
+            trace("[database_shard] no room for the trigram index of %u entries\n", num_entries);
+        }
+        else {
+            GTimer *timer = fsearch_timer_start();
+            shard->trigram_index = db_trigram_index_new(shard->entry_table);
+            fsearch_timer_stop(timer, "[database_shard] trigram index built in %.2f ms\n");
+            timer = NULL;
+            shard->size += index_size;
+        }
+    }
+    if (memory_left) {
+        *memory_left -= MIN(shard->size, *memory_left);
+    }
+    return shard;
+}
+
+uint32_t
+db_shard_get_parent(DatabaseShard *shard, uint32_t idx) {
+    assert(shard != NULL);
+    assert(idx < shard->num_entries);
+    if (shard->entry_table) {
+        return shard->entry_table->parents[idx];
+    }
+    BTreeNode *node = darray_get_item(shard->entries, idx);
+    BTreeNode *parent = node->parent;
+    return parent && parent->parent ? parent->pos : DB_ENTRY_TABLE_NO_PARENT;
+}
+
+DatabaseShard *
+db_shard_ref(DatabaseShard *shard) {
+    assert(shard != NULL);
+    g_atomic_int_inc(&shard->ref_count);
+    return shard;
+}
+
+void
+db_shard_unref(DatabaseShard *shard) {
+    if (!shard || !g_atomic_int_dec_and_test(&shard->ref_count)) {
+        return;
+    }
+    if (shard->trigram_index) {
+        db_trigram_index_free(shard->trigram_index);
+        shard->trigram_index = NULL;
+    }
+    if (shard->entry_table) {
+        db_entry_table_free(shard->entry_table);
+        shard->entry_table = NULL;
+    }
+    if (shard->entries) {
+        darray_free(shard->entries);
+        shard->entries = NULL;
+    }
+    free(shard->types);
+    shard->types = NULL;
+    free(shard);
+    shard = NULL;
+}
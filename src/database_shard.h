@@ -0,0 +1,71 @@
+/*
+   FSearch - A fast file search utility
+   Copyright © 2020 Christian Boxdörfer
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+   */
+
+
+#pragma once
+
+#include "array.h"
+#include "database_entry_table.h"
+#include "database_trigram_index.h"
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Searchable copy of the entries of one location, in name order. It's built once and
+// shared by every database which contains the location unchanged, so rebuilding the
+// entries list after a change in one location leaves the shards of the others alone.
+typedef struct _DatabaseShard {
+    // the nodes of the location, their index is what the shard's table and index refer to
+    DynamicArray *entries;
+    uint32_t num_entries;
+    // packed copy of the entries for the search
+    DatabaseEntryTable *entry_table;
+    // optional index of the trigrams in the entry names
+    DatabaseTrigramIndex *trigram_index;
+    // whether the trigram index was asked for, it might still be missing without a table
+    bool with_trigram_index;
+    // roughly the memory taken up by the table and the index
+    size_t size;
+    // how far the entries without a parent in the shard are below the root of their location,
+    // more than none for the parts of large locations
+    uint32_t root_depth;
+    // interned description of the file type of every entry, NULL for folders. It's looked up
+    // once for the type ranks of the first database with the shard, the others reuse it.
+    const char **types;
+
+    volatile gint ref_count;
+} DatabaseShard;
+
+// Takes over entries, which must be in name order. Their pos fields must be their index in the
+// shard already, the table links the entries to their parents through them. With memory_left
+// the table and the index are only built if they fit into it, and their size is taken from it.
+// Without them the shard is searched through its nodes.
+DatabaseShard *
+db_shard_new(DynamicArray *entries, uint32_t num_entries, bool with_trigram_index, size_t *memory_left);
+
+// Index of the parent folder of entry idx in the shard, DB_ENTRY_TABLE_NO_PARENT for the
+// children of the location root. Shards without a table know it from the pos fields of the
+// nodes, which don't change as long as the shard is in use.
+uint32_t
+db_shard_get_parent(DatabaseShard *shard, uint32_t idx);
+
+DatabaseShard *
+db_shard_ref(DatabaseShard *shard);
+
+void
+db_shard_unref(DatabaseShard *shard);
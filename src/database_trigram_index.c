@@ -0,0 +1,342 @@
+/*
+   FSearch - A fast file search utility
+   Copyright © 2020 Christian Boxdörfer
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+   */
+
+#include "database_trigram_index.h"
+#include "debug.h"
+#include "fsearch_memory.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DB_TRIGRAM_INDEX_MIN_SLOTS (1 << 16)
+#define DB_TRIGRAM_INDEX_NO_SLOT UINT32_MAX
+// a list is only intersected with the candidates if decoding it
+// is cheaper than searching the candidates which it might remove
+#define DB_TRIGRAM_INDEX_MAX_LIST_RATIO 32
+
+typedef struct {
+    uint32_t *keys;
+    uint32_t *counts;
+    // last entry added to every list and the encoded size of the list
+    uint32_t *last;
+    uint64_t *sizes;
+    uint32_t mask;
+    uint32_t num_lists;
+} DatabaseTrigramIndexBuilder;
+
+static inline uint32_t
+db_trigram_key(const char *p) {
+    return ((uint32_t)(uint8_t)p[0] << 16 | (uint32_t)(uint8_t)p[1] << 8 | (uint32_t)(uint8_t)p[2]) + 1;
+}
+
+static inline uint32_t
+db_trigram_hash(uint32_t key) {
+    key ^= key >> 16;
+    key *= 0x45d9f3b;
+    key ^= key >> 16;
+    return key;
+}
+
+static inline uint32_t
+db_trigram_varint_len(uint32_t value) {
+    return 1 + (value >= (1u << 7)) + (value >= (1u << 14)) + (value >= (1u << 21)) + (value >= (1u << 28));
+}
+
+static inline uint8_t *
+db_trigram_varint_write(uint8_t *p, uint32_t value) {
+    while (value >= 0x80) {
+        *p++ = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    *p++ = value;
+    return p;
+}
+
+static inline const uint8_t *
+db_trigram_varint_read(const uint8_t *p, uint32_t *value) {
+    uint32_t res = 0;
+    uint32_t shift = 0;
+    while (*p & 0x80) {
+        res |= (uint32_t)(*p++ & 0x7f) << shift;
+        shift += 7;
+    }
+    res |= (uint32_t)*p++ << shift;
+    *value = res;
+    return p;
+}
+
+static uint32_t
+db_trigram_find_slot(const uint32_t *keys, uint32_t mask, uint32_t key) {
+    uint32_t slot = db_trigram_hash(key) & mask;
+    while (keys[slot] && keys[slot] != key) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static void
+db_trigram_builder_grow(DatabaseTrigramIndexBuilder *builder) {
+    const uint32_t old_num_slots = builder->mask + 1;
+    const uint32_t num_slots = old_num_slots * 2;
+    uint32_t *keys = calloc(num_slots, sizeof(uint32_t));
+    uint32_t *counts = calloc(num_slots, sizeof(uint32_t));
+    uint32_t *last = calloc(num_slots, sizeof(uint32_t));
+    uint64_t *sizes = calloc(num_slots, sizeof(uint64_t));
+    assert(keys != NULL);
+    assert(counts != NULL);
+    assert(last != NULL);
+    assert(sizes != NULL);
+
+    for (uint32_t i = 0; i < old_num_slots; i++) {
+        if (!builder->keys[i]) {
+            continue;
+        }
+        const uint32_t slot = db_trigram_find_slot(keys, num_slots - 1, builder->keys[i]);
+        keys[slot] = builder->keys[i];
+        counts[slot] = builder->counts[i];
+        last[slot] = builder->last[i];
+        sizes[slot] = builder->sizes[i];
+    }
+    free(builder->keys);
+    free(builder->counts);
+    free(builder->last);
+    free(builder->sizes);
+    builder->keys = keys;
+    builder->counts = counts;
+    builder->last = last;
+    builder->sizes = sizes;
+    builder->mask = num_slots - 1;
+}
+
+static uint32_t
+db_trigram_builder_get_slot(DatabaseTrigramIndexBuilder *builder, uint32_t key) {
+    uint32_t slot = db_trigram_find_slot(builder->keys, builder->mask, key);
+    if (builder->keys[slot]) {
+        return slot;
+    }
+    // keep the table at most half full
+    if ((builder->num_lists + 1) * 2 > builder->mask + 1) {
+        db_trigram_builder_grow(builder);
+        slot = db_trigram_find_slot(builder->keys, builder->mask, key);
+    }
+    builder->keys[slot] = key;
+    builder->last[slot] = UINT32_MAX;
+    builder->num_lists++;
+    return slot;
+}
+
+DatabaseTrigramIndex *
+db_trigram_index_new(DatabaseEntryTable *table) {
+    assert(table != NULL);
+    if (!db_entry_table_has_folded_names(table)) {
+        trace("[trigram_index] entry table has no folded names\n");
+        return NULL;
+    }
+
+    const uint32_t num_entries = table->num_entries;
+    DatabaseTrigramIndexBuilder builder = {0};
+    builder.mask = DB_TRIGRAM_INDEX_MIN_SLOTS - 1;
+    builder.keys = calloc(DB_TRIGRAM_INDEX_MIN_SLOTS, sizeof(uint32_t));
+    builder.counts = calloc(DB_TRIGRAM_INDEX_MIN_SLOTS, sizeof(uint32_t));
+    builder.last = calloc(DB_TRIGRAM_INDEX_MIN_SLOTS, sizeof(uint32_t));
+    builder.sizes = calloc(DB_TRIGRAM_INDEX_MIN_SLOTS, sizeof(uint64_t));
+    assert(builder.keys != NULL);
+    assert(builder.counts != NULL);
+    assert(builder.last != NULL);
+    assert(builder.sizes != NULL);
+
+    // first pass: find all trigrams and the size of their lists
+    for (uint32_t i = 0; i < num_entries; i++) {
+        const char *name = db_entry_table_get_folded_name(table, i);
+        for (const char *p = name; p[0] && p[1] && p[2]; p++) {
+            const uint32_t slot = db_trigram_builder_get_slot(&builder, db_trigram_key(p));
+            if (builder.last[slot] == i) {
+                // the trigram occurs more than once in this name
+                continue;
+            }
+            builder.sizes[slot] += db_trigram_varint_len(i - builder.last[slot] - 1);
+            builder.counts[slot]++;
+            builder.last[slot] = i;
+        }
+    }
+
+    DatabaseTrigramIndex *index = calloc(1, sizeof(DatabaseTrigramIndex));
+    assert(index != NULL);
+
+    const uint32_t num_slots = builder.mask + 1;
+    index->num_entries = num_entries;
+    index->keys = builder.keys;
+    index->counts = builder.counts;
+    index->mask = builder.mask;
+    index->num_lists = builder.num_lists;
+    index->offsets = fsearch_memory_malloc(num_slots * sizeof(uint64_t));
+    assert(index->offsets != NULL);
+
+    // the sizes become the write position of every list
+    uint64_t postings_len = 0;
+    for (uint32_t i = 0; i < num_slots; i++) {
+        index->offsets[i] = postings_len;
+        postings_len += builder.sizes[i];
+        builder.sizes[i] = index->offsets[i];
+        builder.last[i] = UINT32_MAX;
+    }
+    index->postings_len = postings_len;
+    index->postings = fsearch_memory_malloc(MAX(postings_len, 1));
+    assert(index->postings != NULL);
+
+    // second pass: fill the lists
+    for (uint32_t i = 0; i < num_entries; i++) {
+        const char *name = db_entry_table_get_folded_name(table, i);
+        for (const char *p = name; p[0] && p[1] && p[2]; p++) {
+            const uint32_t slot = db_trigram_find_slot(index->keys, index->mask, db_trigram_key(p));
+            if (builder.last[slot] == i) {
+                continue;
+            }
+            uint8_t *dest = index->postings + builder.sizes[slot];
+            builder.sizes[slot] += db_trigram_varint_write(dest, i - builder.last[slot] - 1) - dest;
+            builder.last[slot] = i;
+        }
+    }
+    free(builder.last);
+    free(builder.sizes);
+
+    trace("[trigram_index] %d trigrams, %zu bytes of postings\n", index->num_lists, index->postings_len);
+    return index;
+}
+
+void
+db_trigram_index_free(DatabaseTrigramIndex *index) {
+    if (!index) {
+        return;
+    }
+    free(index->keys);
+    free(index->counts);
+    free(index->offsets);
+    free(index->postings);
+    free(index);
+    index = NULL;
+}
+
+static uint32_t
+db_trigram_index_lookup(DatabaseTrigramIndex *index, const char *p) {
+    const uint32_t slot = db_trigram_find_slot(index->keys, index->mask, db_trigram_key(p));
+    return index->keys[slot] ? slot : DB_TRIGRAM_INDEX_NO_SLOT;
+}
+
+static uint32_t
+db_trigram_index_intersect(DatabaseTrigramIndex *index, uint32_t slot, uint32_t *candidates, uint32_t num_candidates) {
+    const uint8_t *p = index->postings + index->offsets[slot];
+    const uint32_t count = index->counts[slot];
+
+    uint32_t num_kept = 0;
+    uint32_t j = 0;
+    uint32_t value = UINT32_MAX;
+    for (uint32_t i = 0; i < count && j < num_candidates; i++) {
+        uint32_t delta = 0;
+        p = db_trigram_varint_read(p, &delta);
+        value += delta + 1;
+        while (j < num_candidates && candidates[j] < value) {
+            j++;
+        }
+        if (j < num_candidates && candidates[j] == value) {
+            candidates[num_kept++] = value;
+            j++;
+        }
+    }
+    return num_kept;
+}
+
+static int
+db_trigram_index_compare_slots(const void *a, const void *b, void *user_data) {
+    DatabaseTrigramIndex *index = user_data;
+    const uint32_t slot_a = *(const uint32_t *)a;
+    const uint32_t slot_b = *(const uint32_t *)b;
+    const uint32_t count_a = index->counts[slot_a];
+    const uint32_t count_b = index->counts[slot_b];
+    if (count_a != count_b) {
+        return count_a < count_b ? -1 : 1;
+    }
+    // keeps repeated trigrams next to each other
+    return slot_a < slot_b ? -1 : slot_a > slot_b;
+}
+
+uint32_t *
+db_trigram_index_get_candidates(DatabaseTrigramIndex *index, GPtrArray *literals, uint32_t *num_candidates) {
+    assert(index != NULL);
+    assert(literals != NULL);
+    assert(num_candidates != NULL);
+
+    GArray *slots = g_array_new(FALSE, FALSE, sizeof(uint32_t));
+    bool missing = false;
+    for (uint32_t i = 0; i < literals->len && !missing; i++) {
+        const char *literal = g_ptr_array_index(literals, i);
+        for (const char *p = literal; p[0] && p[1] && p[2]; p++) {
+            const uint32_t slot = db_trigram_index_lookup(index, p);
+            if (slot == DB_TRIGRAM_INDEX_NO_SLOT) {
+                // no name contains this trigram
+                missing = true;
+                break;
+            }
+            g_array_append_val(slots, slot);
+        }
+    }
+
+    uint32_t *candidates = NULL;
+    if (missing) {
+        candidates = calloc(1, sizeof(uint32_t));
+        assert(candidates != NULL);
+        *num_candidates = 0;
+    }
+    else if (slots->len > 0) {
+        g_array_sort_with_data(slots, db_trigram_index_compare_slots, index);
+        const uint32_t first = g_array_index(slots, uint32_t, 0);
+        const uint32_t first_count = index->counts[first];
+        if (first_count <= index->num_entries / 2) {
+            candidates = malloc((first_count + 1) * sizeof(uint32_t));
+            assert(candidates != NULL);
+
+            const uint8_t *p = index->postings + index->offsets[first];
+            uint32_t value = UINT32_MAX;
+            for (uint32_t i = 0; i < first_count; i++) {
+                uint32_t delta = 0;
+                p = db_trigram_varint_read(p, &delta);
+                value += delta + 1;
+                candidates[i] = value;
+            }
+
+            uint32_t num = first_count;
+            uint32_t prev_slot = first;
+            for (uint32_t i = 1; i < slots->len && num > 0; i++) {
+                const uint32_t slot = g_array_index(slots, uint32_t, i);
+                if (slot == prev_slot) {
+                    continue;
+                }
+                if (index->counts[slot] / DB_TRIGRAM_INDEX_MAX_LIST_RATIO > num) {
+                    // the lists are sorted by size, the remaining ones are even longer
+                    break;
+                }
+                num = db_trigram_index_intersect(index, slot, candidates, num);
+                prev_slot = slot;
+            }
+            *num_candidates = num;
+        }
+    }
+    g_array_free(slots, TRUE);
+    return candidates;
+}
@@ -0,0 +1,55 @@
+/*
+   FSearch - A fast file search utility
+   Copyright © 2020 Christian Boxdörfer
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+   */
+
+#pragma once
+
+#include "database_entry_table.h"
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Inverted index from every three byte sequence in the folded names
+// (see fs_str_fold) to the entries which contain it. The entry indices of
+// every posting list are sorted and stored delta and varint encoded.
+typedef struct _DatabaseTrigramIndex {
+    uint32_t num_entries;
+
+    // open addressing hash table, slot i holds the list of trigram keys[i] - 1,
+    // empty slots have a key of 0
+    uint32_t *keys;
+    uint32_t mask;
+    uint32_t num_lists;
+
+    // number of entries in the list of every slot and where it starts in postings
+    uint32_t *counts;
+    uint64_t *offsets;
+    uint8_t *postings;
+    size_t postings_len;
+} DatabaseTrigramIndex;
+
+DatabaseTrigramIndex *
+db_trigram_index_new(DatabaseEntryTable *table);
+
+void
+db_trigram_index_free(DatabaseTrigramIndex *index);
+
+// Sorted indices of all entries whose folded name contains every one of literals,
+// possibly with some which don't. NULL if the literals don't rule out enough
+// entries to be worth it, in which case all entries have to be searched.
+uint32_t *
+db_trigram_index_get_candidates(DatabaseTrigramIndex *index, GPtrArray *literals, uint32_t *num_candidates);
@@ -22,11 +22,15 @@
 
 #include "clipboard.h"
 #include "database.h"
+#include "database_monitor.h"
 #include "database_search.h"
 #include "debug.h"
 #include "fsearch.h"
 #include "fsearch_config.h"
+#include "fsearch_daemon.h"
 #include "fsearch_limits.h"
+#include "fsearch_memory.h"
+#include "fsearch_stats.h"
 #include "fsearch_timer.h"
 #include "fsearch_window.h"
 #include "preferences_ui.h"
@@ -48,6 +52,8 @@ struct _FsearchApplication {
     FsearchDatabase *db;
     FsearchConfig *config;
     FsearchThreadPool *pool;
+    // runs the queries of all windows
+    DatabaseSearchService *search_service;
 
     GList *filters;
 
@@ -56,6 +62,10 @@ struct _FsearchApplication {
     bool db_thread_cancel;
     int num_database_update_active;
     GThread *db_thread;
+
+    FsearchDatabaseMonitor *db_monitor;
+    // tells the updates of the current monitor apart from those of stopped ones
+    guint db_monitor_serial;
     GMutex mutex;
 };
 
@@ -68,6 +78,9 @@ G_DEFINE_TYPE(FsearchApplication, fsearch_application, GTK_TYPE_APPLICATION)
 static gpointer
 scan_database(gpointer user_data);
 
+static void
+database_monitor_stop(FsearchApplication *app);
+
 static void
 fsearch_action_enable(const char *action_name);
 
@@ -91,10 +104,10 @@ fsearch_application_get_db(FsearchApplication *fsearch) {
     return db;
 }
 
-FsearchThreadPool *
-fsearch_application_get_thread_pool(FsearchApplication *fsearch) {
+DatabaseSearchService *
+fsearch_application_get_search_service(FsearchApplication *fsearch) {
     g_assert(FSEARCH_IS_APPLICATION(fsearch));
-    return fsearch->pool;
+    return fsearch->search_service;
 }
 
 FsearchConfig *
@@ -135,9 +148,26 @@ build_location_callback(const char *text) {
 
 static gint
 fsearch_options_handler(GApplication *gapp, GVariantDict *options, gpointer data) {
-    gboolean version = FALSE, updatedb = FALSE;
+    gboolean version = FALSE, updatedb = FALSE, daemon = FALSE, json = FALSE, null = FALSE;
+    const char *query = NULL;
+    gint limit = 0;
     g_variant_dict_lookup(options, "version", "b", &version);
     g_variant_dict_lookup(options, "updatedb", "b", &updatedb);
+    g_variant_dict_lookup(options, "daemon", "b", &daemon);
+    g_variant_dict_lookup(options, "query", "&s", &query);
+    g_variant_dict_lookup(options, "json", "b", &json);
+    g_variant_dict_lookup(options, "null", "b", &null);
+    g_variant_dict_lookup(options, "limit", "i", &limit);
+
+    if (query) {
+        FsearchDaemonFormat format = json ? FSEARCH_DAEMON_FORMAT_JSON
+                                   : null ? FSEARCH_DAEMON_FORMAT_NUL
+                                          : FSEARCH_DAEMON_FORMAT_LINE;
+        return fsearch_daemon_query(FSEARCH_APPLICATION(gapp)->config, query, format, MAX(limit, 0));
+    }
+    if (daemon) {
+        return fsearch_daemon_run(FSEARCH_APPLICATION(gapp)->config);
+    }
 
     if (version) {
         g_printf(PACKAGE_NAME " " VERSION "\n");
@@ -154,6 +184,7 @@ fsearch_options_handler(GApplication *gapp, GVariantDict *options, gpointer data
         if (fsearch->db) {
             db_unref(fsearch->db);
         }
+        db_free_wait();
 
         printf("done!\n");
     }
@@ -170,6 +201,8 @@ fsearch_application_init(FsearchApplication *app) {
         if (!config_load_default(app->config)) {
         }
     }
+    fsearch_stats_set_enabled(app->config->collect_performance_stats);
+    fsearch_memory_set_policy(app->config->index_huge_pages, app->config->index_interleave);
     app->db = NULL;
     app->startup_finished = false;
     app->filters = fsearch_filter_get_default();
@@ -189,6 +222,41 @@ fsearch_application_init(FsearchApplication *app) {
                                   G_OPTION_ARG_NONE,
                                   _("Update the database"),
                                   NULL);
+    g_application_add_main_option(G_APPLICATION(app),
+                                  "daemon",
+                                  '\0',
+                                  G_OPTION_FLAG_NONE,
+                                  G_OPTION_ARG_NONE,
+                                  _("Run without a window and answer queries on a local socket"),
+                                  NULL);
+    g_application_add_main_option(G_APPLICATION(app),
+                                  "query",
+                                  'q',
+                                  G_OPTION_FLAG_NONE,
+                                  G_OPTION_ARG_STRING,
+                                  _("Print the results of a query from the running daemon"),
+                                  "QUERY");
+    g_application_add_main_option(G_APPLICATION(app),
+                                  "json",
+                                  '\0',
+                                  G_OPTION_FLAG_NONE,
+                                  G_OPTION_ARG_NONE,
+                                  _("Print the results as JSON lines"),
+                                  NULL);
+    g_application_add_main_option(G_APPLICATION(app),
+                                  "null",
+                                  '0',
+                                  G_OPTION_FLAG_NONE,
+                                  G_OPTION_ARG_NONE,
+                                  _("Separate the results with NUL characters"),
+                                  NULL);
+    g_application_add_main_option(G_APPLICATION(app),
+                                  "limit",
+                                  '\0',
+                                  G_OPTION_FLAG_NONE,
+                                  G_OPTION_ARG_INT,
+                                  _("Print at most this many results"),
+                                  "N");
 
     g_signal_connect(app, "handle-local-options", G_CALLBACK(fsearch_options_handler), app);
 }
@@ -208,24 +276,29 @@ fsearch_application_shutdown(GApplication *app) {
         }
     }
 
+    database_monitor_stop(fsearch);
     if (fsearch->db_thread) {
         trace("[exit] waiting for database thread to exit...\n");
         fsearch->db_thread_cancel = true;
         g_thread_join(fsearch->db_thread);
         trace("[exit] database thread finished.\n");
     }
+    db_save_wait();
 
+    if (fsearch->search_service) {
+        // windows which are still around keep it alive until they're gone
+        db_search_service_unref(fsearch->search_service);
+        fsearch->search_service = NULL;
+    }
     if (fsearch->db) {
         db_unref(fsearch->db);
     }
+    db_free_wait();
     if (fsearch->filters) {
         g_list_free_full(fsearch->filters, (GDestroyNotify)fsearch_filter_free);
         fsearch->filters = NULL;
     }
 
-    if (fsearch->pool) {
-        fsearch_thread_pool_free(fsearch->pool);
-    }
     config_save(fsearch->config);
     config_free(fsearch->config);
     g_mutex_clear(&fsearch->mutex);
@@ -251,24 +324,85 @@ prepare_windows_for_db_update(FsearchApplication *app) {
     return;
 }
 
+typedef struct {
+    FsearchDatabase *db;
+    guint monitor_serial;
+} FsearchMonitorUpdate;
+
+static gboolean
+monitored_database_cb(gpointer user_data) {
+    FsearchApplication *self = FSEARCH_APPLICATION_DEFAULT;
+    FsearchMonitorUpdate *update = user_data;
+    FsearchDatabase *db = update->db;
+    const bool is_current = self->db_monitor && update->monitor_serial == self->db_monitor_serial;
+    g_free(update);
+    update = NULL;
+
+    if (!is_current) {
+        if (db) {
+            db_unref(db);
+        }
+        return G_SOURCE_REMOVE;
+    }
+    if (!db) {
+        // events were lost, only a full rescan catches up with them
+        fsearch_database_update(true);
+        return G_SOURCE_REMOVE;
+    }
+
+    // the windows keep their results of the old database until the searches are done again
+    g_mutex_lock(&self->mutex);
+    FsearchDatabase *old_db = self->db;
+    self->db = db;
+    g_mutex_unlock(&self->mutex);
+    if (old_db) {
+        db_unref(old_db);
+    }
+    g_signal_emit(self, signals[DATABASE_UPDATE_FINISHED], 0);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+database_monitor_cb(FsearchDatabase *db, void *user_data) {
+    FsearchMonitorUpdate *update = g_new0(FsearchMonitorUpdate, 1);
+    update->db = db;
+    update->monitor_serial = GPOINTER_TO_UINT(user_data);
+    g_idle_add(monitored_database_cb, update);
+}
+
+static void
+database_monitor_start(FsearchApplication *app) {
+    database_monitor_stop(app);
+    if (!app->db || !app->config->monitor_database) {
+        return;
+    }
+    app->db_monitor_serial++;
+    app->db_monitor = db_monitor_new(app->db, database_monitor_cb, GUINT_TO_POINTER(app->db_monitor_serial));
+}
+
+static void
+database_monitor_stop(FsearchApplication *app) {
+    if (!app->db_monitor) {
+        return;
+    }
+    db_monitor_free(app->db_monitor);
+    app->db_monitor = NULL;
+}
+
 static gboolean
 updated_database_cb(gpointer user_data) {
     FsearchApplication *self = FSEARCH_APPLICATION_DEFAULT;
     g_mutex_lock(&self->mutex);
     FsearchDatabase *db = user_data;
+    FsearchDatabase *old_db = NULL;
     if (!self->db_thread_cancel) {
-        prepare_windows_for_db_update(self);
-        if (self->db) {
-            db_unref(self->db);
-        }
-        if (db) {
-            db_lock(db);
-            self->db = db;
-            db_unlock(db);
-        }
-        else {
-            self->db = NULL;
+        if (!db) {
+            prepare_windows_for_db_update(self);
         }
+        // the windows keep searching the old database until the searches are done again
+        // on the new one, the last of them to drop it frees the old one in the background
+        old_db = self->db;
+        self->db = db;
     }
     else if (db) {
         db_unref(db);
@@ -280,6 +414,12 @@ updated_database_cb(gpointer user_data) {
         fsearch_action_disable("cancel_update_database");
     }
     g_mutex_unlock(&self->mutex);
+    if (old_db) {
+        db_unref(old_db);
+    }
+    if (self->num_database_update_active == 0) {
+        database_monitor_start(self);
+    }
     g_signal_emit(self, signals[DATABASE_UPDATE_FINISHED], 0);
     return G_SOURCE_REMOVE;
 }
@@ -316,16 +456,31 @@ update_database_thread(bool rescan) {
     GTimer *timer = fsearch_timer_start();
 
     g_mutex_lock(&app->mutex);
+    FsearchDatabaseScanFlags scan_flags = {
+        .exclude_hidden = app->config->exclude_hidden_items,
+        .follow_symlinks = app->config->follow_symlinks,
+        .exclude_virtual_fs = app->config->exclude_virtual_fs,
+        .parallel = app->config->parallel_scan,
+        .names_only = app->config->index_names_only,
+        .trigram_index = app->config->index_trigrams,
+        .compact_database = app->config->compact_database,
+        .memory_budget = (size_t)app->config->memory_budget * 1024 * 1024,
+    };
     FsearchDatabase *db = db_new(app->config->locations,
                                  app->config->exclude_locations,
                                  app->config->exclude_files,
-                                 app->config->exclude_hidden_items);
+                                 scan_flags);
+    // an incremental scan starts from the trees of the current database, which keeps its own entries
+    FsearchDatabase *previous_db = rescan && app->config->incremental_scan ? fsearch_application_get_db(app) : NULL;
     g_mutex_unlock(&app->mutex);
     db_lock(db);
     if (rescan) {
-        db_scan(db, &app->db_thread_cancel, app->config->show_indexing_status ? build_location_callback : NULL);
+        db_scan(db,
+                previous_db,
+                &app->db_thread_cancel,
+                app->config->show_indexing_status ? build_location_callback : NULL);
         if (!app->db_thread_cancel) {
-            db_save_locations(db);
+            db_save_locations_async(db);
         }
     }
     else {
@@ -336,6 +491,10 @@ update_database_thread(bool rescan) {
     timer = NULL;
 
     db_unlock(db);
+    if (previous_db) {
+        db_unref(previous_db);
+        previous_db = NULL;
+    }
 
     g_idle_add(updated_database_cb, db);
     app->db_thread = NULL;
@@ -392,6 +551,98 @@ about_activated(GSimpleAction *action, GVariant *parameter, gpointer app) {
     }
 }
 
+enum {
+    STATS_RESPONSE_RESET = 1,
+    STATS_RESPONSE_COPY,
+};
+
+static void
+stats_dialog_update(GtkTextView *text_view) {
+    char *text = fsearch_stats_dump();
+    gtk_text_buffer_set_text(gtk_text_view_get_buffer(text_view), text, -1);
+    g_free(text);
+}
+
+static gboolean
+stats_dialog_update_cb(gpointer user_data) {
+    stats_dialog_update(GTK_TEXT_VIEW(user_data));
+    return G_SOURCE_CONTINUE;
+}
+
+static void
+stats_dialog_destroy_cb(GtkWidget *widget, gpointer user_data) {
+    g_source_remove(GPOINTER_TO_UINT(user_data));
+}
+
+static void
+stats_dialog_collect_toggled_cb(GtkToggleButton *button, gpointer user_data) {
+    FsearchApplication *app = FSEARCH_APPLICATION_DEFAULT;
+    app->config->collect_performance_stats = gtk_toggle_button_get_active(button);
+    fsearch_stats_set_enabled(app->config->collect_performance_stats);
+    config_save(app->config);
+    stats_dialog_update(GTK_TEXT_VIEW(user_data));
+}
+
+static void
+stats_dialog_response_cb(GtkDialog *dialog, gint response_id, gpointer user_data) {
+    GtkTextView *text_view = user_data;
+    if (response_id == STATS_RESPONSE_RESET) {
+        fsearch_stats_reset();
+        stats_dialog_update(text_view);
+    }
+    else if (response_id == STATS_RESPONSE_COPY) {
+        char *text = fsearch_stats_dump();
+        gtk_clipboard_set_text(gtk_clipboard_get(GDK_SELECTION_CLIPBOARD), text, -1);
+        g_free(text);
+    }
+    else {
+        gtk_widget_destroy(GTK_WIDGET(dialog));
+    }
+}
+
+static void
+statistics_activated(GSimpleAction *action, GVariant *parameter, gpointer gapp) {
+    g_assert(FSEARCH_IS_APPLICATION(gapp));
+    FsearchApplication *app = FSEARCH_APPLICATION(gapp);
+
+    GtkWindow *win_active = gtk_application_get_active_window(GTK_APPLICATION(app));
+    GtkWidget *dialog = gtk_dialog_new_with_buttons(_("Performance Statistics"),
+                                                    win_active,
+                                                    GTK_DIALOG_DESTROY_WITH_PARENT,
+                                                    _("_Reset"),
+                                                    STATS_RESPONSE_RESET,
+                                                    _("_Copy"),
+                                                    STATS_RESPONSE_COPY,
+                                                    _("_Close"),
+                                                    GTK_RESPONSE_CLOSE,
+                                                    NULL);
+    gtk_window_set_default_size(GTK_WINDOW(dialog), 720, 560);
+
+    GtkWidget *text_view = gtk_text_view_new();
+    gtk_text_view_set_editable(GTK_TEXT_VIEW(text_view), FALSE);
+    gtk_text_view_set_monospace(GTK_TEXT_VIEW(text_view), TRUE);
+    gtk_text_view_set_left_margin(GTK_TEXT_VIEW(text_view), 6);
+    gtk_text_view_set_top_margin(GTK_TEXT_VIEW(text_view), 6);
+    GtkWidget *scrolled_window = gtk_scrolled_window_new(NULL, NULL);
+    gtk_widget_set_vexpand(scrolled_window, TRUE);
+    gtk_container_add(GTK_CONTAINER(scrolled_window), text_view);
+
+    GtkWidget *collect_button = gtk_check_button_new_with_label(_("Collect statistics"));
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(collect_button), app->config->collect_performance_stats);
+    g_signal_connect(collect_button, "toggled", G_CALLBACK(stats_dialog_collect_toggled_cb), text_view);
+
+    GtkWidget *content_area = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
+    gtk_box_set_spacing(GTK_BOX(content_area), 6);
+    gtk_box_pack_start(GTK_BOX(content_area), collect_button, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(content_area), scrolled_window, TRUE, TRUE, 0);
+
+    stats_dialog_update(GTK_TEXT_VIEW(text_view));
+    const guint update_id = g_timeout_add_seconds(1, stats_dialog_update_cb, text_view);
+    g_signal_connect(dialog, "destroy", G_CALLBACK(stats_dialog_destroy_cb), GUINT_TO_POINTER(update_id));
+    g_signal_connect(dialog, "response", G_CALLBACK(stats_dialog_response_cb), text_view);
+    gtk_widget_show_all(dialog);
+}
+
 static void
 quit_activated(GSimpleAction *action, GVariant *parameter, gpointer app) {
     g_application_quit(G_APPLICATION(app));
@@ -444,6 +695,7 @@ fsearch_load_database(void) {
     FsearchApplication *app = FSEARCH_APPLICATION_DEFAULT;
     if (app->config->locations) {
         fsearch_action_disable("update_database");
+        database_monitor_stop(app);
         if (app->db_thread) {
             app->db_thread_cancel = true;
             g_thread_join(app->db_thread);
@@ -460,6 +712,7 @@ void
 fsearch_database_update(bool scan) {
     FsearchApplication *app = FSEARCH_APPLICATION_DEFAULT;
     fsearch_action_disable("update_database");
+    database_monitor_stop(app);
     if (app->db_thread) {
         app->db_thread_cancel = true;
         g_thread_join(app->db_thread);
@@ -528,6 +781,7 @@ static GActionEntry app_entries[] = {{"new_window", new_window_activated, NULL,
                                      {"update_database", update_database_activated, NULL, NULL, NULL},
                                      {"cancel_update_database", cancel_update_database_activated, NULL, NULL, NULL},
                                      {"preferences", preferences_activated, "u", NULL, NULL},
+                                     {"statistics", statistics_activated, NULL, NULL, NULL},
                                      {"quit", quit_activated, NULL, NULL, NULL}};
 
 static void
@@ -571,7 +825,8 @@ fsearch_application_startup(GApplication *app) {
     gtk_application_set_accels_for_action(GTK_APPLICATION(app), "app.preferences(uint32 0)", preferences);
     static const gchar *quit[] = {"<control>q", NULL};
     gtk_application_set_accels_for_action(GTK_APPLICATION(app), "app.quit", quit);
-    FSEARCH_APPLICATION(app)->pool = fsearch_thread_pool_init();
+    FSEARCH_APPLICATION(app)->pool = fsearch_thread_pool_get_default();
+    FSEARCH_APPLICATION(app)->search_service = db_search_service_new(FSEARCH_APPLICATION(app)->pool);
 }
 
 static void
@@ -19,8 +19,8 @@ along with this program; if not, see <http://www.gnu.org/licenses/>.
 #pragma once
 
 #include "database.h"
+#include "database_search.h"
 #include "fsearch_config.h"
-#include "fsearch_thread_pool.h"
 #include <glib.h>
 #include <gtk/gtk.h>
 #include <inttypes.h>
@@ -59,5 +59,5 @@ fsearch_application_state_unlock(FsearchApplication *fsearch);
 void
 fsearch_application_update_listview_config(void);
 
-FsearchThreadPool *
-fsearch_application_get_thread_pool(FsearchApplication *fsearch);
+DatabaseSearchService *
+fsearch_application_get_search_service(FsearchApplication *fsearch);
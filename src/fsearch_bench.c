@@ -0,0 +1,548 @@
+/*
+   FSearch - A fast file search utility
+   Copyright © 2020 Christian Boxdörfer
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+   */
+
+#define _GNU_SOURCE
+
+// Benchmarks of the database and search code, built with make bench.
+// Results are printed as JSON, with the duration percentiles of every benchmark.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <glib.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "database.h"
+#include "database_search.h"
+#include "fsearch_filter.h"
+#include "fsearch_include_path.h"
+#include "fsearch_memory.h"
+#include "fsearch_sort.h"
+#include "fsearch_stats.h"
+#include "fsearch_thread_pool.h"
+#include "query.h"
+
+typedef struct {
+    char *name;
+    // duration of every run in ms
+    GArray *samples;
+    // entries processed per run, for the throughput
+    uint64_t num_items;
+    // number of results of a search, or -1
+    int64_t num_results;
+} BenchResult;
+
+typedef struct {
+    const char *name;
+    const char *text;
+    bool enable_regex;
+    bool search_in_path;
+    bool enable_fuzzy;
+    bool enable_ranking;
+} BenchQuery;
+
+typedef struct {
+    GMutex mutex;
+    GCond cond;
+    bool done;
+    uint32_t num_results;
+} BenchSearch;
+
+static gint opt_num_files = 200000;
+static gint opt_depth = 3;
+static gint opt_fanout = 12;
+static gint opt_runs = 10;
+static gint opt_seed = 1;
+static gchar *opt_location = NULL;
+static gboolean opt_replay = FALSE;
+static gboolean opt_parallel = TRUE;
+static gboolean opt_compact = FALSE;
+static gint opt_memory_budget = 0;
+static gboolean opt_huge_pages = TRUE;
+static gboolean opt_interleave = FALSE;
+static gboolean opt_keep = FALSE;
+static gboolean opt_stats = FALSE;
+static gchar *opt_output = NULL;
+
+static GOptionEntry bench_options[] = {
+    {"files", 'n', 0, G_OPTION_ARG_INT, &opt_num_files, "Number of files in the synthetic tree", "N"},
+    {"depth", 'd', 0, G_OPTION_ARG_INT, &opt_depth, "Depth of the synthetic tree", "N"},
+    {"fanout", 'f', 0, G_OPTION_ARG_INT, &opt_fanout, "Subfolders of every folder of the synthetic tree", "N"},
+    {"runs", 'r', 0, G_OPTION_ARG_INT, &opt_runs, "Runs of every benchmark", "N"},
+    {"seed", 's', 0, G_OPTION_ARG_INT, &opt_seed, "Seed of the synthetic tree", "N"},
+    {"location", 'l', 0, G_OPTION_ARG_FILENAME, &opt_location, "Scan this folder instead of a synthetic tree", "DIR"},
+    {"replay",
+     0,
+     0,
+     G_OPTION_ARG_NONE,
+     &opt_replay,
+     "Load the database fsearch saved for --location instead of scanning it",
+     NULL},
+    {"serial", 0, G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, &opt_parallel, "Scan with a single thread", NULL},
+    {"compact", 0, 0, G_OPTION_ARG_NONE, &opt_compact, "Save the database in the compact format", NULL},
+    {"memory-budget",
+     0,
+     0,
+     G_OPTION_ARG_INT,
+     &opt_memory_budget,
+     "Memory the nodes and search tables may take up, only tables which don't fit are left out",
+     "MIB"},
+    {"no-huge-pages",
+     0,
+     G_OPTION_FLAG_REVERSE,
+     G_OPTION_ARG_NONE,
+     &opt_huge_pages,
+     "Don't back the index with huge pages",
+     NULL},
+    {"interleave", 0, 0, G_OPTION_ARG_NONE, &opt_interleave, "Spread the index over all NUMA nodes", NULL},
+    {"keep", 0, 0, G_OPTION_ARG_NONE, &opt_keep, "Don't delete the synthetic tree", NULL},
+    {"stats", 0, 0, G_OPTION_ARG_NONE, &opt_stats, "Print the performance statistics to stderr", NULL},
+    {"output", 'o', 0, G_OPTION_ARG_FILENAME, &opt_output, "Write the results to this file", "FILE"},
+    {NULL},
+};
+
+// Names are made from these words, with UTF-8 ones to exercise case folding
+static const char *bench_words[] = {
+    "report", "Größe", "café",    "photo", "invoice", "Backup", "notes", "Übersicht",
+    "résumé", "data",  "project", "DRAFT", "日本語",  "final",  "Straße", "ΑΡΧΕΊΟ",
+};
+
+static const char *bench_extensions[] = {
+    ".txt", ".pdf", ".jpg", ".png", ".c", ".h", ".tar.gz", ".mp3", ".odt", "",
+};
+
+static const BenchQuery bench_queries[] = {
+    {"plain", "invoice", false, false},
+    {"plain_multiple_words", "report 7", false, false},
+    {"icase_utf8", "über", false, false},
+    {"icase_utf8_rare", "αρχείο_1", false, false},
+    {"wildcard", "photo*.jpg", false, false},
+    {"regex", "^not.s_[0-9]+7\\.txt$", true, false},
+    {"path", "dir_3/", false, true},
+    {"predicate_size", "size:>1k", false, false},
+    {"predicate_extension", "ext:pdf;jpg report|photo", false, false},
+    {"fuzzy", "reprot", false, false, true},
+    {"ranked", "report", false, false, false, true},
+    {"no_match", "xyzzy", false, false},
+};
+
+static const struct {
+    const char *name;
+    FsearchDatabaseSortType type;
+} bench_sort_columns[] = {
+    {"path", DATABASE_SORT_PATH},
+    {"size", DATABASE_SORT_SIZE},
+    {"modification_time", DATABASE_SORT_MODIFICATION_TIME},
+    {"type", DATABASE_SORT_TYPE},
+    {"total_size", DATABASE_SORT_TOTAL_SIZE},
+};
+
+static GPtrArray *bench_results = NULL;
+
+static BenchResult *
+bench_result_new(const char *name, uint64_t num_items) {
+    BenchResult *result = g_new0(BenchResult, 1);
+    result->name = g_strdup(name);
+    result->samples = g_array_new(FALSE, FALSE, sizeof(double));
+    result->num_items = num_items;
+    result->num_results = -1;
+    g_ptr_array_add(bench_results, result);
+    return result;
+}
+
+static void
+bench_result_free(BenchResult *result) {
+    g_array_free(result->samples, TRUE);
+    g_free(result->name);
+    g_free(result);
+}
+
+static void
+bench_result_add(BenchResult *result, gint64 start) {
+    const double ms = (g_get_monotonic_time() - start) / 1000.0;
+    g_array_append_val(result->samples, ms);
+}
+
+static int
+bench_compare_samples(gconstpointer a, gconstpointer b) {
+    const double x = *(const double *)a;
+    const double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// nearest rank percentile of sorted samples
+static double
+bench_percentile(GArray *samples, double p) {
+    if (samples->len == 0) {
+        return 0;
+    }
+    const uint32_t rank = (uint32_t)ceil(p / 100.0 * samples->len);
+    return g_array_index(samples, double, MAX(rank, 1) - 1);
+}
+
+static void
+bench_print_results(FILE *fp, uint32_t num_entries) {
+    fprintf(fp,
+            "{\n  \"entries\": %u,\n  \"runs\": %d,\n  \"threads\": %u,\n  \"benchmarks\": [\n",
+            num_entries,
+            opt_runs,
+            fsearch_thread_pool_get_num_threads(fsearch_thread_pool_get_default()));
+    for (uint32_t i = 0; i < bench_results->len; i++) {
+        BenchResult *result = g_ptr_array_index(bench_results, i);
+        g_array_sort(result->samples, bench_compare_samples);
+        double sum = 0;
+        for (uint32_t j = 0; j < result->samples->len; j++) {
+            sum += g_array_index(result->samples, double, j);
+        }
+        const double mean = result->samples->len ? sum / result->samples->len : 0;
+        const double p50 = bench_percentile(result->samples, 50);
+        fprintf(fp,
+                "    {\"name\": \"%s\", \"runs\": %u, \"min_ms\": %.3f, \"p50_ms\": %.3f, \"p90_ms\": %.3f, "
+                "\"p99_ms\": %.3f, \"max_ms\": %.3f, \"mean_ms\": %.3f, \"items_per_sec\": %.0f",
+                result->name,
+                result->samples->len,
+                bench_percentile(result->samples, 0),
+                p50,
+                bench_percentile(result->samples, 90),
+                bench_percentile(result->samples, 99),
+                bench_percentile(result->samples, 100),
+                mean,
+                p50 > 0 ? result->num_items / (p50 / 1000.0) : 0);
+        if (result->num_results >= 0) {
+            fprintf(fp, ", \"results\": %" G_GINT64_FORMAT, result->num_results);
+        }
+        fprintf(fp, "}%s\n", i + 1 < bench_results->len ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+}
+
+// Synthetic tree
+
+static void
+bench_create_folders(GPtrArray *folders, const char *path, uint32_t depth) {
+    g_ptr_array_add(folders, g_strdup(path));
+    if (depth == 0) {
+        return;
+    }
+    for (int i = 0; i < opt_fanout; i++) {
+        char *child = g_strdup_printf("%s/dir_%d", path, i);
+        if (!mkdir(child, 0700)) {
+            bench_create_folders(folders, child, depth - 1);
+        }
+        g_free(child);
+    }
+}
+
+static bool
+bench_create_tree(const char *root) {
+    GPtrArray *folders = g_ptr_array_new_with_free_func(g_free);
+    bench_create_folders(folders, root, opt_depth);
+
+    GRand *rand = g_rand_new_with_seed(opt_seed);
+    bool ret = true;
+    for (int i = 0; i < opt_num_files && ret; i++) {
+        const char *folder = g_ptr_array_index(folders, g_rand_int_range(rand, 0, folders->len));
+        const char *word = bench_words[g_rand_int_range(rand, 0, G_N_ELEMENTS(bench_words))];
+        const char *ext = bench_extensions[g_rand_int_range(rand, 0, G_N_ELEMENTS(bench_extensions))];
+        char *path = g_strdup_printf("%s/%s_%d%s", folder, word, i, ext);
+        const int fd = open(path, O_CREAT | O_WRONLY | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            g_printerr("failed to create %s: %s\n", path, g_strerror(errno));
+            ret = false;
+        }
+        else {
+            close(fd);
+        }
+        g_free(path);
+    }
+    g_rand_free(rand);
+    g_ptr_array_free(folders, TRUE);
+    return ret;
+}
+
+static int
+bench_remove_cb(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    return remove(path);
+}
+
+static void
+bench_remove_tree(const char *root) {
+    nftw(root, bench_remove_cb, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+// Benchmarks
+
+static FsearchDatabase *
+bench_db_new(GList *includes) {
+    FsearchDatabaseScanFlags flags = {
+        .parallel = opt_parallel,
+        .compact_database = opt_compact,
+        .memory_budget = (size_t)MAX(opt_memory_budget, 0) * 1024 * 1024,
+    };
+    return db_new(includes, NULL, NULL, flags);
+}
+
+static FsearchDatabase *
+bench_scan(GList *includes) {
+    BenchResult *result = bench_result_new("scan", 0);
+    FsearchDatabase *db = NULL;
+    for (int i = 0; i < opt_runs; i++) {
+        if (db) {
+            db_unref(db);
+        }
+        db = bench_db_new(includes);
+        bool cancel = false;
+        const gint64 start = g_get_monotonic_time();
+        db_scan(db, NULL, &cancel, NULL);
+        bench_result_add(result, start);
+    }
+    result->num_items = db_get_num_entries(db);
+    return db;
+}
+
+static void
+bench_save(FsearchDatabase *db) {
+    BenchResult *result = bench_result_new("save", db_get_num_entries(db));
+    for (int i = 0; i < opt_runs; i++) {
+        const gint64 start = g_get_monotonic_time();
+        db_save_locations(db);
+        bench_result_add(result, start);
+    }
+}
+
+static FsearchDatabase *
+bench_load(GList *includes) {
+    BenchResult *result = bench_result_new("load", 0);
+    FsearchDatabase *db = NULL;
+    for (int i = 0; i < opt_runs; i++) {
+        if (db) {
+            db_unref(db);
+        }
+        db = bench_db_new(includes);
+        const gint64 start = g_get_monotonic_time();
+        if (!db_load_from_file(db, NULL, NULL)) {
+            g_printerr("failed to load the database\n");
+            db_unref(db);
+            return NULL;
+        }
+        bench_result_add(result, start);
+    }
+    result->num_items = db_get_num_entries(db);
+    return db;
+}
+
+static void
+bench_sort(FsearchDatabase *db) {
+    BenchResult *result = bench_result_new("db_sort", db_get_num_entries(db));
+    for (int i = 0; i < opt_runs; i++) {
+        const gint64 start = g_get_monotonic_time();
+        db_sort(db);
+        bench_result_add(result, start);
+    }
+}
+
+// The ranks of every column are built along with the entries list, so they're part of the load. What's left
+// for list_model_sort is sorting all results by them.
+static void
+bench_sort_by_columns(FsearchDatabase *db) {
+    const uint32_t num_entries = db_get_num_entries(db);
+    for (uint32_t c = 0; c < G_N_ELEMENTS(bench_sort_columns); c++) {
+        char *sort_name = g_strdup_printf("list_model_sort_%s", bench_sort_columns[c].name);
+        BenchResult *sort_result = bench_result_new(sort_name, num_entries);
+        g_free(sort_name);
+
+        const uint32_t *ranks = db_get_sort_ranks(db, bench_sort_columns[c].type);
+        for (int i = 0; i < opt_runs; i++) {
+            // all entries as results in reverse order, the worst case of the stable radix sort
+            FsearchSortItem *items = g_new(FsearchSortItem, MAX(num_entries, 1));
+            for (uint32_t j = 0; j < num_entries; j++) {
+                const uint32_t idx = num_entries - j - 1;
+                items[j].key = ranks ? ranks[idx] : idx;
+                items[j].data = GUINT_TO_POINTER(idx);
+            }
+            const gint64 start = g_get_monotonic_time();
+            fsearch_sort_by_rank(items, num_entries);
+            bench_result_add(sort_result, start);
+            g_free(items);
+        }
+    }
+}
+
+static void
+bench_search_cb(void *data) {
+    DatabaseSearchResult *result = data;
+    BenchSearch *search = result->cb_data;
+    if (result->results) {
+        search->num_results = result->results->len;
+        g_array_free(result->results, TRUE);
+    }
+    if (result->db) {
+        db_unref(result->db);
+    }
+    free(result);
+
+    g_mutex_lock(&search->mutex);
+    search->done = true;
+    g_cond_signal(&search->cond);
+    g_mutex_unlock(&search->mutex);
+}
+
+static void
+bench_search(FsearchDatabase *db) {
+    FsearchFilter *filter = fsearch_filter_new(FSEARCH_FILTER_NONE, "All", NULL, false, false, false);
+    for (uint32_t q = 0; q < G_N_ELEMENTS(bench_queries); q++) {
+        char *name = g_strdup_printf("search_%s", bench_queries[q].name);
+        BenchResult *result = bench_result_new(name, db_get_num_entries(db));
+        g_free(name);
+
+        for (int i = 0; i < opt_runs; i++) {
+            // a new service every run, repeated queries would be answered from the cache otherwise
+            DatabaseSearchService *service = db_search_service_new(fsearch_thread_pool_get_default());
+            DatabaseSearch *db_search = db_search_new(service);
+            BenchSearch search = {};
+            g_mutex_init(&search.mutex);
+            g_cond_init(&search.cond);
+
+            FsearchQueryFlags flags = {
+                .enable_regex = bench_queries[q].enable_regex,
+                .search_in_path = bench_queries[q].search_in_path,
+                .enable_fuzzy = bench_queries[q].enable_fuzzy,
+                .enable_ranking = bench_queries[q].enable_ranking,
+            };
+            db_ref(db);
+            FsearchQuery *query = fsearch_query_new(
+                bench_queries[q].text, db, filter, bench_search_cb, &search, NULL, NULL, NULL, 0, flags, true);
+
+            const gint64 start = g_get_monotonic_time();
+            db_search_queue(db_search, query);
+            g_mutex_lock(&search.mutex);
+            while (!search.done) {
+                g_cond_wait(&search.cond, &search.mutex);
+            }
+            g_mutex_unlock(&search.mutex);
+            bench_result_add(result, start);
+
+            result->num_results = search.num_results;
+            db_search_free(db_search);
+            db_search_service_unref(service);
+            g_mutex_clear(&search.mutex);
+            g_cond_clear(&search.cond);
+        }
+    }
+    fsearch_filter_free(filter);
+}
+
+int
+main(int argc, char *argv[]) {
+    GError *error = NULL;
+    GOptionContext *context = g_option_context_new("- benchmark the fsearch database and search");
+    g_option_context_add_main_entries(context, bench_options, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        g_option_context_free(context);
+        return EXIT_FAILURE;
+    }
+    g_option_context_free(context);
+    opt_runs = MAX(opt_runs, 1);
+    fsearch_stats_set_enabled(opt_stats);
+    fsearch_memory_set_policy(opt_huge_pages, opt_interleave);
+    if (opt_replay && !opt_location) {
+        g_printerr("--replay needs a --location\n");
+        return EXIT_FAILURE;
+    }
+
+    char *tmp_dir = g_dir_make_tmp("fsearch_bench_XXXXXX", &error);
+    if (!tmp_dir) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        return EXIT_FAILURE;
+    }
+    if (!opt_replay) {
+        // keep the databases of the benchmark apart from the real ones
+        char *data_dir = g_build_filename(tmp_dir, "data", NULL);
+        g_setenv("XDG_DATA_HOME", data_dir, TRUE);
+        g_free(data_dir);
+    }
+    db_make_data_dir();
+
+    char *location = NULL;
+    if (opt_location) {
+        location = g_canonicalize_filename(opt_location, NULL);
+    }
+    else {
+        location = g_build_filename(tmp_dir, "tree", NULL);
+        g_printerr("creating %d files...\n", opt_num_files);
+        if (mkdir(location, 0700) || !bench_create_tree(location)) {
+            return EXIT_FAILURE;
+        }
+    }
+    GList *includes = g_list_append(NULL, fsearch_include_path_new(location, true, true, 0, 0));
+
+    bench_results = g_ptr_array_new_with_free_func((GDestroyNotify)bench_result_free);
+    int res = EXIT_FAILURE;
+    if (!opt_replay) {
+        g_printerr("scanning %s...\n", location);
+        FsearchDatabase *scanned_db = bench_scan(includes);
+        bench_save(scanned_db);
+        db_unref(scanned_db);
+    }
+    g_printerr("loading...\n");
+    FsearchDatabase *db = bench_load(includes);
+    if (db) {
+        g_printerr("sorting...\n");
+        bench_sort(db);
+        bench_sort_by_columns(db);
+        g_printerr("searching...\n");
+        bench_search(db);
+
+        if (opt_stats) {
+            char *stats = fsearch_stats_dump();
+            g_printerr("%s", stats);
+            g_free(stats);
+        }
+
+        FILE *fp = opt_output ? fopen(opt_output, "w") : stdout;
+        if (fp) {
+            bench_print_results(fp, db_get_num_entries(db));
+            res = EXIT_SUCCESS;
+            if (fp != stdout) {
+                fclose(fp);
+            }
+        }
+        db_unref(db);
+    }
+    db_free_wait();
+
+    g_list_free_full(includes, (GDestroyNotify)fsearch_include_path_free);
+    g_ptr_array_free(bench_results, TRUE);
+    if (!opt_keep) {
+        bench_remove_tree(tmp_dir);
+    }
+    else {
+        g_printerr("kept %s\n", tmp_dir);
+    }
+    g_free(location);
+    g_free(tmp_dir);
+    return res;
+}
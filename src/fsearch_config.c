@@ -183,9 +183,12 @@ config_load(FsearchConfig *config) {
         config->enable_dark_theme = config_load_boolean(key_file, "Interface", "enable_dark_theme", false);
         config->show_menubar = config_load_boolean(key_file, "Interface", "show_menubar", true);
         config->show_statusbar = config_load_boolean(key_file, "Interface", "show_statusbar", true);
+        config->collect_performance_stats =
+            config_load_boolean(key_file, "Interface", "collect_performance_stats", false);
         config->show_filter = config_load_boolean(key_file, "Interface", "show_filter", true);
         config->show_search_button = config_load_boolean(key_file, "Interface", "show_search_button", true);
         config->show_base_2_units = config_load_boolean(key_file, "Interface", "show_base_2_units", false);
+        config->show_folder_sizes = config_load_boolean(key_file, "Interface", "show_folder_sizes", false);
         config->action_after_file_open =
             config_load_integer(key_file, "Interface", "action_after_file_open", ACTION_AFTER_OPEN_NOTHING);
         config->action_after_file_open_keyboard =
@@ -237,6 +240,8 @@ config_load(FsearchConfig *config) {
         config->auto_search_in_path = config_load_boolean(key_file, "Search", "auto_search_in_path", true);
         config->match_case = config_load_boolean(key_file, "Search", "match_case", false);
         config->enable_regex = config_load_boolean(key_file, "Search", "enable_regex", false);
+        config->enable_fuzzy = config_load_boolean(key_file, "Search", "enable_fuzzy", false);
+        config->enable_ranking = config_load_boolean(key_file, "Search", "enable_ranking", false);
         config->search_in_path = config_load_boolean(key_file, "Search", "search_in_path", false);
         config->hide_results_on_empty_search =
             config_load_boolean(key_file, "Search", "hide_results_on_empty_search", true);
@@ -249,6 +254,17 @@ config_load(FsearchConfig *config) {
         config->exclude_hidden_items =
             config_load_boolean(key_file, "Database", "exclude_hidden_files_and_folders", false);
         config->follow_symlinks = config_load_boolean(key_file, "Database", "follow_symbolic_links", false);
+        config->exclude_virtual_fs =
+            config_load_boolean(key_file, "Database", "exclude_virtual_file_systems", true);
+        config->parallel_scan = config_load_boolean(key_file, "Database", "parallel_scan", true);
+        config->index_names_only = config_load_boolean(key_file, "Database", "index_names_only", false);
+        config->index_trigrams = config_load_boolean(key_file, "Database", "index_trigrams", false);
+        config->compact_database = config_load_boolean(key_file, "Database", "compact_database", false);
+        config->monitor_database = config_load_boolean(key_file, "Database", "monitor_database", false);
+        config->incremental_scan = config_load_boolean(key_file, "Database", "incremental_scan", false);
+        config->memory_budget = config_load_integer(key_file, "Database", "memory_budget", 0);
+        config->index_huge_pages = config_load_boolean(key_file, "Database", "index_huge_pages", true);
+        config->index_interleave = config_load_boolean(key_file, "Database", "index_interleave", false);
 
         char *exclude_files_str = config_load_string(key_file, "Database", "exclude_files", NULL);
         if (exclude_files_str) {
@@ -283,6 +299,8 @@ config_load_default(FsearchConfig *config) {
     config->search_as_you_type = true;
     config->match_case = false;
     config->enable_regex = false;
+    config->enable_fuzzy = false;
+    config->enable_ranking = false;
     config->search_in_path = false;
     config->hide_results_on_empty_search = true;
     config->limit_results = true;
@@ -298,9 +316,11 @@ config_load_default(FsearchConfig *config) {
     config->double_click_path = false;
     config->show_menubar = true;
     config->show_statusbar = true;
+    config->collect_performance_stats = false;
     config->show_filter = true;
     config->show_search_button = true;
     config->show_base_2_units = false;
+    config->show_folder_sizes = false;
     config->action_after_file_open = ACTION_AFTER_OPEN_NOTHING;
     config->action_after_file_open_keyboard = false;
     config->action_after_file_open_mouse = false;
@@ -340,6 +360,16 @@ config_load_default(FsearchConfig *config) {
     config->update_database_on_launch = true;
     config->exclude_hidden_items = false;
     config->follow_symlinks = false;
+    config->exclude_virtual_fs = true;
+    config->parallel_scan = true;
+    config->index_names_only = false;
+    config->index_trigrams = false;
+    config->compact_database = false;
+    config->monitor_database = false;
+    config->incremental_scan = false;
+    config->memory_budget = 0;
+    config->index_huge_pages = true;
+    config->index_interleave = false;
 
     // Locations
     config->locations = NULL;
@@ -424,9 +454,11 @@ config_save(FsearchConfig *config) {
     g_key_file_set_boolean(key_file, "Interface", "enable_dark_theme", config->enable_dark_theme);
     g_key_file_set_boolean(key_file, "Interface", "show_menubar", config->show_menubar);
     g_key_file_set_boolean(key_file, "Interface", "show_statusbar", config->show_statusbar);
+    g_key_file_set_boolean(key_file, "Interface", "collect_performance_stats", config->collect_performance_stats);
     g_key_file_set_boolean(key_file, "Interface", "show_filter", config->show_filter);
     g_key_file_set_boolean(key_file, "Interface", "show_search_button", config->show_search_button);
     g_key_file_set_boolean(key_file, "Interface", "show_base_2_units", config->show_base_2_units);
+    g_key_file_set_boolean(key_file, "Interface", "show_folder_sizes", config->show_folder_sizes);
     g_key_file_set_integer(key_file, "Interface", "action_after_file_open", config->action_after_file_open);
     g_key_file_set_boolean(key_file,
                            "Interface",
@@ -480,6 +512,8 @@ config_save(FsearchConfig *config) {
     g_key_file_set_boolean(key_file, "Search", "auto_match_case", config->auto_match_case);
     g_key_file_set_boolean(key_file, "Search", "search_in_path", config->search_in_path);
     g_key_file_set_boolean(key_file, "Search", "enable_regex", config->enable_regex);
+    g_key_file_set_boolean(key_file, "Search", "enable_fuzzy", config->enable_fuzzy);
+    g_key_file_set_boolean(key_file, "Search", "enable_ranking", config->enable_ranking);
     g_key_file_set_boolean(key_file, "Search", "match_case", config->match_case);
     g_key_file_set_boolean(key_file, "Search", "hide_results_on_empty_search", config->hide_results_on_empty_search);
     g_key_file_set_boolean(key_file, "Search", "limit_results", config->limit_results);
@@ -489,6 +523,16 @@ config_save(FsearchConfig *config) {
     g_key_file_set_boolean(key_file, "Database", "update_database_on_launch", config->update_database_on_launch);
     g_key_file_set_boolean(key_file, "Database", "exclude_hidden_files_and_folders", config->exclude_hidden_items);
     g_key_file_set_boolean(key_file, "Database", "follow_symbolic_links", config->follow_symlinks);
+    g_key_file_set_boolean(key_file, "Database", "exclude_virtual_file_systems", config->exclude_virtual_fs);
+    g_key_file_set_boolean(key_file, "Database", "parallel_scan", config->parallel_scan);
+    g_key_file_set_boolean(key_file, "Database", "index_names_only", config->index_names_only);
+    g_key_file_set_boolean(key_file, "Database", "index_trigrams", config->index_trigrams);
+    g_key_file_set_boolean(key_file, "Database", "compact_database", config->compact_database);
+    g_key_file_set_boolean(key_file, "Database", "monitor_database", config->monitor_database);
+    g_key_file_set_boolean(key_file, "Database", "incremental_scan", config->incremental_scan);
+    g_key_file_set_integer(key_file, "Database", "memory_budget", config->memory_budget);
+    g_key_file_set_boolean(key_file, "Database", "index_huge_pages", config->index_huge_pages);
+    g_key_file_set_boolean(key_file, "Database", "index_interleave", config->index_interleave);
 
     config_save_include_locations(key_file, config->locations, "location");
     config_save_exclude_locations(key_file, config->exclude_locations, "exclude_location");
@@ -37,11 +37,15 @@ struct _FsearchConfig {
     bool hide_results_on_empty_search;
     bool search_in_path;
     bool enable_regex;
+    bool enable_fuzzy;
+    bool enable_ranking;
     bool match_case;
     bool auto_search_in_path;
     bool auto_match_case;
     bool search_as_you_type;
     bool show_base_2_units;
+    // folders show and are sorted by the size of all files below them
+    bool show_folder_sizes;
 
     // Applications
     char *folder_open_cmd;
@@ -70,6 +74,8 @@ struct _FsearchConfig {
     // View menu
     bool show_menubar;
     bool show_statusbar;
+    // record timings of scans and searches, see fsearch_stats.h
+    bool collect_performance_stats;
     bool show_filter;
     bool show_search_button;
 
@@ -99,6 +105,24 @@ struct _FsearchConfig {
     bool update_database_on_launch;
     bool exclude_hidden_items;
     bool follow_symlinks;
+    // don't descend into proc, sysfs and other pseudo file systems mounted below a location
+    bool exclude_virtual_fs;
+    bool parallel_scan;
+    bool index_names_only;
+    bool index_trigrams;
+    // smaller database files, which take longer to load
+    bool compact_database;
+    // keep the database up to date with inotify
+    bool monitor_database;
+    // only read folders again whose mtime changed since the last scan
+    bool incremental_scan;
+    // how much memory the nodes and the search tables and indexes of the database may take up
+    // in MiB, 0 for no limit. Only the tables and indexes are left out to stay below it.
+    uint32_t memory_budget;
+    // back the large arrays of the index with transparent huge pages and
+    // spread them over all NUMA nodes, see fsearch_memory.h
+    bool index_huge_pages;
+    bool index_interleave;
 
     uint32_t num_results;
 
@@ -0,0 +1,762 @@
+/*
+   FSearch - A fast file search utility
+   Copyright © 2020 Christian Boxdörfer
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+   */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <glib-unix.h>
+#include <glib.h>
+#include <glib/gi18n.h>
+#include <linux/limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "database.h"
+#include "database_monitor.h"
+#include "database_search.h"
+#include "debug.h"
+#include "fsearch_daemon.h"
+#include "fsearch_filter.h"
+#include "fsearch_stats.h"
+#include "fsearch_thread_pool.h"
+#include "query.h"
+
+#define FSEARCH_DAEMON_MAX_REQUEST_SIZE (64 * 1024)
+// output is collected up to this size before it's sent
+#define FSEARCH_DAEMON_OUTPUT_BUFFER_SIZE (64 * 1024)
+// a client which doesn't finish its request or stops reading the results for this long is dropped
+#define FSEARCH_DAEMON_CLIENT_TIMEOUT_SEC 5
+
+typedef struct {
+    FsearchConfig *config;
+    GMainLoop *loop;
+    char *socket_path;
+    int listen_fd;
+    int wakeup_fd;
+    GThread *accept_thread;
+    volatile gint stopped;
+
+    // the database is replaced by the monitor thread and by rescans on the main thread
+    GMutex mutex;
+    GCond clients_cond;
+    FsearchDatabase *db;
+    FsearchDatabaseMonitor *monitor;
+    uint32_t num_clients;
+    // runs the queries of all clients, identical ones only once
+    DatabaseSearchService *search_service;
+} FsearchDaemon;
+
+typedef struct {
+    FsearchDaemon *daemon;
+    int fd;
+    FsearchDaemonFormat format;
+    FsearchDatabase *db;
+    GString *out;
+    // the client went away, the rest of the results is dropped
+    bool failed;
+
+    // the results the search thread handed over, they're sent by the client's own thread
+    GMutex mutex;
+    GCond cond;
+    GQueue results;
+    bool done;
+} FsearchDaemonClient;
+
+static char *
+daemon_get_socket_path(void) {
+    return g_build_filename(g_get_user_runtime_dir(), "fsearch", "fsearch.socket", NULL);
+}
+
+static bool
+daemon_fill_address(struct sockaddr_un *addr, const char *path) {
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+static int
+daemon_connect(const char *path) {
+    struct sockaddr_un addr;
+    if (!daemon_fill_address(&addr, path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        const int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+static bool
+daemon_write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        const ssize_t written = send(fd, data, len, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        len -= written;
+    }
+    return true;
+}
+
+// Configuration
+
+static FsearchDatabase *
+daemon_build_database(FsearchConfig *config, FsearchDatabase *previous, bool rescan) {
+    FsearchDatabaseScanFlags scan_flags = {
+        .exclude_hidden = config->exclude_hidden_items,
+        .follow_symlinks = config->follow_symlinks,
+        .exclude_virtual_fs = config->exclude_virtual_fs,
+        .parallel = config->parallel_scan,
+        .names_only = config->index_names_only,
+        .trigram_index = config->index_trigrams,
+        .compact_database = config->compact_database,
+        .memory_budget = (size_t)config->memory_budget * 1024 * 1024,
+    };
+    FsearchDatabase *db = db_new(config->locations, config->exclude_locations, config->exclude_files, scan_flags);
+    if (!rescan && db_load_from_file(db, NULL, NULL)) {
+        return db;
+    }
+    bool cancel = false;
+    db_scan(db, config->incremental_scan ? previous : NULL, &cancel, NULL);
+    db_save_locations_async(db);
+    return db;
+}
+
+static void
+daemon_set_database(FsearchDaemon *daemon, FsearchDatabase *db) {
+    g_mutex_lock(&daemon->mutex);
+    FsearchDatabase *old_db = daemon->db;
+    daemon->db = db;
+    g_mutex_unlock(&daemon->mutex);
+    if (old_db) {
+        // queries which are still running keep their own reference
+        db_unref(old_db);
+    }
+}
+
+static FsearchDatabase *
+daemon_get_database(FsearchDaemon *daemon) {
+    g_mutex_lock(&daemon->mutex);
+    FsearchDatabase *db = daemon->db;
+    if (db) {
+        db_ref(db);
+    }
+    g_mutex_unlock(&daemon->mutex);
+    return db;
+}
+
+static void
+daemon_monitor_cb(FsearchDatabase *db, void *user_data);
+
+static void
+daemon_monitor_start(FsearchDaemon *daemon) {
+    if (!daemon->config->monitor_database || !daemon->db) {
+        return;
+    }
+    daemon->monitor = db_monitor_new(daemon->db, daemon_monitor_cb, daemon);
+}
+
+static void
+daemon_monitor_stop(FsearchDaemon *daemon) {
+    if (!daemon->monitor) {
+        return;
+    }
+    db_monitor_free(daemon->monitor);
+    daemon->monitor = NULL;
+}
+
+static gboolean
+daemon_rescan_cb(gpointer user_data) {
+    FsearchDaemon *daemon = user_data;
+    trace("[daemon] rescanning the database\n");
+    // only one thread may update the database at a time
+    daemon_monitor_stop(daemon);
+    FsearchDatabase *previous = daemon_get_database(daemon);
+    FsearchDatabase *db = daemon_build_database(daemon->config, previous, true);
+    if (previous) {
+        db_unref(previous);
+    }
+    daemon_set_database(daemon, db);
+    daemon_monitor_start(daemon);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+daemon_monitor_cb(FsearchDatabase *db, void *user_data) {
+    FsearchDaemon *daemon = user_data;
+    if (!db) {
+        // events were lost, only a full rescan catches up with them
+        g_idle_add(daemon_rescan_cb, daemon);
+        return;
+    }
+    daemon_set_database(daemon, db);
+}
+
+// Output
+
+// Names are bytes, JSON wants UTF-8: invalid sequences become U+FFFD
+static void
+daemon_append_json_string(GString *out, const char *str) {
+    g_string_append_c(out, '"');
+    const char *p = str;
+    while (*p) {
+        const unsigned char c = *p;
+        if (c == '"' || c == '\\') {
+            g_string_append_c(out, '\\');
+            g_string_append_c(out, c);
+            p++;
+        }
+        else if (c < 0x20) {
+            g_string_append_printf(out, "\\u%04x", c);
+            p++;
+        }
+        else if (c < 0x80) {
+            g_string_append_c(out, c);
+            p++;
+        }
+        else if (g_utf8_get_char_validated(p, -1) < (gunichar)-2) {
+            const char *next = g_utf8_next_char(p);
+            g_string_append_len(out, p, next - p);
+            p = next;
+        }
+        else {
+            g_string_append(out, "\\ufffd");
+            p++;
+        }
+    }
+    g_string_append_c(out, '"');
+}
+
+static void
+daemon_client_flush(FsearchDaemonClient *client) {
+    if (!client->failed && client->out->len > 0 && !daemon_write_all(client->fd, client->out->str, client->out->len)) {
+        trace("[daemon] client went away: %s\n", g_strerror(errno));
+        client->failed = true;
+    }
+    g_string_truncate(client->out, 0);
+}
+
+static void
+daemon_client_append_node(FsearchDaemonClient *client, BTreeNode *node) {
+    char path[PATH_MAX] = "";
+    btree_node_get_path_full(node, path, sizeof(path));
+
+    GString *out = client->out;
+    switch (client->format) {
+    case FSEARCH_DAEMON_FORMAT_NUL:
+        g_string_append_len(out, path, strlen(path) + 1);
+        break;
+    case FSEARCH_DAEMON_FORMAT_JSON:
+        g_string_append(out, "{\"path\":");
+        daemon_append_json_string(out, path);
+        g_string_append(out, ",\"name\":");
+        daemon_append_json_string(out, node->name);
+        g_string_append_printf(out,
+                               ",\"type\":\"%s\",\"size\":%" G_GINT64_FORMAT ",\"mtime\":%" G_GINT64_FORMAT "}\n",
+                               node->is_dir ? "folder" : "file",
+                               (gint64)node->size,
+                               (gint64)node->mtime);
+        break;
+    default:
+        g_string_append(out, path);
+        g_string_append_c(out, '\n');
+        break;
+    }
+    if (out->len >= FSEARCH_DAEMON_OUTPUT_BUFFER_SIZE) {
+        daemon_client_flush(client);
+    }
+}
+
+static void
+daemon_client_append_error(FsearchDaemonClient *client, const char *error) {
+    trace("[daemon] %s\n", error);
+    if (client->format != FSEARCH_DAEMON_FORMAT_JSON) {
+        return;
+    }
+    g_string_append(client->out, "{\"error\":");
+    daemon_append_json_string(client->out, error);
+    g_string_append(client->out, "}\n");
+}
+
+// Searching, the callbacks are called on the search thread. It's shared by all clients, so they
+// only queue the results and the client's thread sends them.
+
+static void
+daemon_client_append_result(FsearchDaemonClient *client, DatabaseSearchResult *result) {
+    DynamicArray *entries = db_get_entries(client->db);
+    for (uint32_t i = 0; !client->failed && result->results && entries && i < result->results->len; i++) {
+        BTreeNode *node = darray_get_item(entries, g_array_index(result->results, uint32_t, i));
+        if (node) {
+            daemon_client_append_node(client, node);
+        }
+    }
+    if (result->results) {
+        g_array_free(result->results, TRUE);
+        result->results = NULL;
+    }
+    if (result->db) {
+        db_unref(result->db);
+        result->db = NULL;
+    }
+    free(result);
+}
+
+static void
+daemon_client_push_result(FsearchDaemonClient *client, DatabaseSearchResult *result, bool done) {
+    g_mutex_lock(&client->mutex);
+    if (result) {
+        g_queue_push_tail(&client->results, result);
+    }
+    client->done = client->done || done;
+    g_cond_signal(&client->cond);
+    g_mutex_unlock(&client->mutex);
+}
+
+static void
+daemon_search_partial_cb(void *data) {
+    DatabaseSearchResult *result = data;
+    daemon_client_push_result(result->cb_data, result, false);
+}
+
+static void
+daemon_search_finished_cb(void *data) {
+    DatabaseSearchResult *result = data;
+    daemon_client_push_result(result->cb_data, result, true);
+}
+
+static void
+daemon_search_cancelled_cb(void *data) {
+    daemon_client_push_result(data, NULL, true);
+}
+
+// Sends the results as they come in, until the search is done
+static void
+daemon_client_send_results(FsearchDaemonClient *client) {
+    g_mutex_lock(&client->mutex);
+    while (true) {
+        DatabaseSearchResult *result = g_queue_pop_head(&client->results);
+        if (result) {
+            g_mutex_unlock(&client->mutex);
+            daemon_client_append_result(client, result);
+            g_mutex_lock(&client->mutex);
+        }
+        else if (client->done) {
+            break;
+        }
+        else {
+            g_cond_wait(&client->cond, &client->mutex);
+        }
+    }
+    g_mutex_unlock(&client->mutex);
+}
+
+// Requests
+
+static bool
+daemon_client_read_request(FsearchDaemonClient *client, GString *request) {
+    char buffer[4096];
+    while (!strstr(request->str, "\n\n")) {
+        if (request->len > FSEARCH_DAEMON_MAX_REQUEST_SIZE) {
+            return false;
+        }
+        const ssize_t len = recv(client->fd, buffer, sizeof(buffer), 0);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            // the client might just close its end after the last line
+            return len == 0 && request->len > 0;
+        }
+        g_string_append_len(request, buffer, len);
+    }
+    return true;
+}
+
+static void
+daemon_client_run(FsearchDaemonClient *client) {
+    GString *request = g_string_new(NULL);
+    if (!daemon_client_read_request(client, request)) {
+        trace("[daemon] incomplete request\n");
+        g_string_free(request, TRUE);
+        return;
+    }
+
+    const char *text = NULL;
+    uint32_t limit = 0;
+    FsearchQueryFlags flags = {
+        .auto_match_case = client->daemon->config->auto_match_case,
+        .auto_search_in_path = client->daemon->config->auto_search_in_path,
+    };
+    char **lines = g_strsplit(request->str, "\n", -1);
+    for (char **line = lines; *line && **line; line++) {
+        char *value = strchr(*line, '=');
+        if (!value) {
+            continue;
+        }
+        *value++ = '\0';
+        if (!strcmp(*line, "query")) {
+            text = value;
+        }
+        else if (!strcmp(*line, "format")) {
+            if (!strcmp(value, "json")) {
+                client->format = FSEARCH_DAEMON_FORMAT_JSON;
+            }
+            else if (!strcmp(value, "nul")) {
+                client->format = FSEARCH_DAEMON_FORMAT_NUL;
+            }
+        }
+        else if (!strcmp(*line, "limit")) {
+            limit = strtoul(value, NULL, 10);
+        }
+        else if (!strcmp(*line, "match_case")) {
+            flags.match_case = !strcmp(value, "1");
+        }
+        else if (!strcmp(*line, "regex")) {
+            flags.enable_regex = !strcmp(value, "1");
+        }
+        else if (!strcmp(*line, "fuzzy")) {
+            flags.enable_fuzzy = !strcmp(value, "1");
+        }
+        else if (!strcmp(*line, "rank")) {
+            flags.enable_ranking = !strcmp(value, "1");
+        }
+        else if (!strcmp(*line, "path")) {
+            flags.search_in_path = !strcmp(value, "1");
+        }
+    }
+
+    client->db = daemon_get_database(client->daemon);
+    if (!text) {
+        daemon_client_append_error(client, "no query");
+    }
+    else if (!client->db) {
+        daemon_client_append_error(client, "no database");
+    }
+    else {
+        FsearchFilter *filter = fsearch_filter_new(FSEARCH_FILTER_NONE, "All", NULL, false, false, false);
+        DatabaseSearch *search = db_search_new(client->daemon->search_service);
+        // the query takes its own reference, client->db is only used to look up the results
+        db_ref(client->db);
+        FsearchQuery *q = fsearch_query_new(text,
+                                            client->db,
+                                            filter,
+                                            daemon_search_finished_cb,
+                                            client,
+                                            daemon_search_partial_cb,
+                                            daemon_search_cancelled_cb,
+                                            client,
+                                            limit,
+                                            flags,
+                                            true);
+        db_search_queue(search, q);
+        daemon_client_send_results(client);
+
+        db_search_free(search);
+        fsearch_filter_free(filter);
+    }
+    daemon_client_flush(client);
+
+    if (client->db) {
+        db_unref(client->db);
+        client->db = NULL;
+    }
+    g_strfreev(lines);
+    g_string_free(request, TRUE);
+}
+
+static gpointer
+daemon_client_thread(gpointer user_data) {
+    FsearchDaemonClient *client = user_data;
+    FsearchDaemon *daemon = client->daemon;
+
+    daemon_client_run(client);
+
+    close(client->fd);
+    g_string_free(client->out, TRUE);
+    g_mutex_clear(&client->mutex);
+    g_cond_clear(&client->cond);
+    g_free(client);
+
+    g_mutex_lock(&daemon->mutex);
+    daemon->num_clients--;
+    g_cond_signal(&daemon->clients_cond);
+    g_mutex_unlock(&daemon->mutex);
+    return NULL;
+}
+
+static gpointer
+daemon_accept_thread(gpointer user_data) {
+    FsearchDaemon *daemon = user_data;
+    struct pollfd fds[2] = {
+        {.fd = daemon->listen_fd, .events = POLLIN},
+        {.fd = daemon->wakeup_fd, .events = POLLIN},
+    };
+    while (!g_atomic_int_get(&daemon->stopped)) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (!(fds[0].revents & POLLIN)) {
+            continue;
+        }
+        const int fd = accept4(daemon->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        const struct timeval timeout = {.tv_sec = FSEARCH_DAEMON_CLIENT_TIMEOUT_SEC};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        FsearchDaemonClient *client = g_new0(FsearchDaemonClient, 1);
+        client->daemon = daemon;
+        client->fd = fd;
+        client->format = FSEARCH_DAEMON_FORMAT_LINE;
+        client->out = g_string_sized_new(FSEARCH_DAEMON_OUTPUT_BUFFER_SIZE);
+        g_mutex_init(&client->mutex);
+        g_cond_init(&client->cond);
+        g_queue_init(&client->results);
+
+        g_mutex_lock(&daemon->mutex);
+        daemon->num_clients++;
+        g_mutex_unlock(&daemon->mutex);
+        g_thread_unref(g_thread_new("fsearch_daemon_client", daemon_client_thread, client));
+    }
+    return NULL;
+}
+
+static int
+daemon_listen(const char *path) {
+    struct sockaddr_un addr;
+    if (!daemon_fill_address(&addr, path)) {
+        g_printerr(_("Socket path is too long: %s\n"), path);
+        return -1;
+    }
+
+    int fd = daemon_connect(path);
+    if (fd >= 0) {
+        close(fd);
+        g_printerr(_("Another daemon is already running at %s\n"), path);
+        return -1;
+    }
+    // nobody listens on a socket which is still there, it's left over from a daemon which crashed
+    unlink(path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, SOMAXCONN)) {
+        g_printerr(_("Failed to listen on %s: %s\n"), path, g_strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+static gboolean
+daemon_quit_cb(gpointer user_data) {
+    FsearchDaemon *daemon = user_data;
+    g_main_loop_quit(daemon->loop);
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+daemon_dump_stats_cb(gpointer user_data) {
+    char *stats = fsearch_stats_dump();
+    g_printerr("%s", stats);
+    g_free(stats);
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+daemon_hangup_cb(gpointer user_data) {
+    daemon_rescan_cb(user_data);
+    return G_SOURCE_CONTINUE;
+}
+
+int
+fsearch_daemon_run(FsearchConfig *config) {
+    g_assert(config != NULL);
+
+    FsearchDaemon *daemon = g_new0(FsearchDaemon, 1);
+    daemon->config = config;
+    daemon->socket_path = daemon_get_socket_path();
+    g_mutex_init(&daemon->mutex);
+    g_cond_init(&daemon->clients_cond);
+
+    int res = EXIT_FAILURE;
+    char *socket_dir = g_path_get_dirname(daemon->socket_path);
+    const bool has_socket_dir = !g_mkdir_with_parents(socket_dir, 0700);
+    g_free(socket_dir);
+    if (!has_socket_dir || (daemon->listen_fd = daemon_listen(daemon->socket_path)) < 0) {
+        goto out;
+    }
+    daemon->wakeup_fd = eventfd(0, EFD_CLOEXEC);
+    if (daemon->wakeup_fd < 0) {
+        g_printerr(_("Failed to create an event file descriptor: %s\n"), g_strerror(errno));
+        close(daemon->listen_fd);
+        unlink(daemon->socket_path);
+        goto out;
+    }
+
+    GTimer *timer = g_timer_new();
+    daemon->db = daemon_build_database(config, NULL, config->update_database_on_launch);
+    g_printerr(_("%'u entries loaded in %.2f s, listening on %s\n"),
+               db_get_num_entries(daemon->db),
+               g_timer_elapsed(timer, NULL),
+               daemon->socket_path);
+    g_timer_destroy(timer);
+    timer = NULL;
+    daemon_monitor_start(daemon);
+    daemon->search_service = db_search_service_new(fsearch_thread_pool_get_default());
+
+    daemon->loop = g_main_loop_new(NULL, FALSE);
+    const guint sigint_id = g_unix_signal_add(SIGINT, daemon_quit_cb, daemon);
+    const guint sigterm_id = g_unix_signal_add(SIGTERM, daemon_quit_cb, daemon);
+    const guint sighup_id = g_unix_signal_add(SIGHUP, daemon_hangup_cb, daemon);
+    const guint sigusr1_id = g_unix_signal_add(SIGUSR1, daemon_dump_stats_cb, daemon);
+    daemon->accept_thread = g_thread_new("fsearch_daemon_accept", daemon_accept_thread, daemon);
+
+    g_main_loop_run(daemon->loop);
+
+    g_atomic_int_set(&daemon->stopped, true);
+    const uint64_t wakeup = 1;
+    if (write(daemon->wakeup_fd, &wakeup, sizeof(wakeup)) < 0) {
+        trace("[daemon] failed to wake up the accept thread\n");
+    }
+    g_thread_join(daemon->accept_thread);
+    daemon->accept_thread = NULL;
+    unlink(daemon->socket_path);
+
+    g_mutex_lock(&daemon->mutex);
+    while (daemon->num_clients > 0) {
+        g_cond_wait(&daemon->clients_cond, &daemon->mutex);
+    }
+    g_mutex_unlock(&daemon->mutex);
+    db_search_service_unref(daemon->search_service);
+    daemon->search_service = NULL;
+
+    g_source_remove(sigint_id);
+    g_source_remove(sigterm_id);
+    g_source_remove(sighup_id);
+    g_source_remove(sigusr1_id);
+    g_main_loop_unref(daemon->loop);
+    daemon->loop = NULL;
+
+    daemon_monitor_stop(daemon);
+    daemon_set_database(daemon, NULL);
+    db_save_wait();
+    db_free_wait();
+    close(daemon->wakeup_fd);
+    close(daemon->listen_fd);
+    res = EXIT_SUCCESS;
+
+out:
+    g_mutex_clear(&daemon->mutex);
+    g_cond_clear(&daemon->clients_cond);
+    g_free(daemon->socket_path);
+    g_free(daemon);
+    return res;
+}
+
+int
+fsearch_daemon_query(FsearchConfig *config, const char *query, FsearchDaemonFormat format, uint32_t limit) {
+    g_assert(config != NULL);
+    g_assert(query != NULL);
+
+    char *socket_path = daemon_get_socket_path();
+    const int fd = daemon_connect(socket_path);
+    if (fd < 0) {
+        g_printerr(_("Can't connect to the daemon at %s: %s\n"), socket_path, g_strerror(errno));
+        g_printerr(_("Start it with: fsearch --daemon\n"));
+        g_free(socket_path);
+        return EXIT_FAILURE;
+    }
+    g_free(socket_path);
+    socket_path = NULL;
+
+    // every line is a key, the query must not end early
+    char *text = g_strdelimit(g_strdup(query), "\n", ' ');
+    const char *format_names[] = {"line", "nul", "json"};
+    char *request = g_strdup_printf("format=%s\nlimit=%u\nmatch_case=%d\nregex=%d\nfuzzy=%d\nrank=%d\npath=%d\nquery=%s\n\n",
+                                    format_names[format],
+                                    limit,
+                                    config->match_case,
+                                    config->enable_regex,
+                                    config->enable_fuzzy,
+                                    config->enable_ranking,
+                                    config->search_in_path,
+                                    text);
+    g_free(text);
+    text = NULL;
+
+    int res = EXIT_SUCCESS;
+    if (!daemon_write_all(fd, request, strlen(request))) {
+        g_printerr(_("Failed to send the query: %s\n"), g_strerror(errno));
+        res = EXIT_FAILURE;
+    }
+    shutdown(fd, SHUT_WR);
+    g_free(request);
+    request = NULL;
+
+    char buffer[FSEARCH_DAEMON_OUTPUT_BUFFER_SIZE];
+    while (res == EXIT_SUCCESS) {
+        const ssize_t len = read(fd, buffer, sizeof(buffer));
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len < 0) {
+            g_printerr(_("Failed to read the results: %s\n"), g_strerror(errno));
+            res = EXIT_FAILURE;
+        }
+        if (len <= 0) {
+            break;
+        }
+        if (fwrite(buffer, 1, len, stdout) != (size_t)len) {
+            // e.g. the output is piped into head
+            res = EXIT_FAILURE;
+        }
+    }
+    close(fd);
+    fflush(stdout);
+    return res;
+}
@@ -0,0 +1,57 @@
+/*
+   FSearch - A fast file search utility
+   Copyright © 2020 Christian Boxdörfer
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+   */
+
+#pragma once
+
+#include "fsearch_config.h"
+#include <stdint.h>
+
+// Headless mode: the daemon keeps the database in memory (and up to date, if the
+// database is monitored) and answers queries on the UNIX socket
+// $XDG_RUNTIME_DIR/fsearch/fsearch.socket. SIGHUP makes it rescan the database,
+// SIGUSR1 prints the performance statistics (see fsearch_stats.h) to stderr.
+//
+// A request is a list of "key=value" lines which ends with an empty line:
+//   query=<text>        what to search for, an empty query matches everything
+//   format=<format>     line (default), nul or json
+//   limit=<n>           at most n results, 0 (default) for all of them
+//   match_case=<0|1>    the same as the search options, all of them default to 0
+//   regex=<0|1>
+//   fuzzy=<0|1>
+//   rank=<0|1>
+//   path=<0|1>
+// The daemon sends back the matches in database order (best first with fuzzy or rank) and closes the connection.
+// With line and nul every full path is followed by '\n' or '\0', json sends one
+// object per line:
+//   {"path":"/usr/lib","name":"lib","type":"folder","size":4096,"mtime":1600000000}
+// A request the daemon can't answer gets a single {"error":"..."} line with json
+// and nothing at all otherwise.
+
+typedef enum {
+    FSEARCH_DAEMON_FORMAT_LINE,
+    FSEARCH_DAEMON_FORMAT_NUL,
+    FSEARCH_DAEMON_FORMAT_JSON,
+} FsearchDaemonFormat;
+
+// Runs until SIGINT or SIGTERM, returns the exit status
+int
+fsearch_daemon_run(FsearchConfig *config);
+
+// Sends query to the running daemon and writes its answer to stdout, returns the exit status
+int
+fsearch_daemon_query(FsearchConfig *config, const char *query, FsearchDaemonFormat format, uint32_t limit);
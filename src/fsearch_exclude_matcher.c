@@ -0,0 +1,158 @@
+/*
+   FSearch - A fast file search utility
+   Copyright © 2020 Christian Boxdörfer
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+   */
+
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fsearch_exclude_matcher.h"
+#include "fsearch_exclude_path.h"
+
+struct FsearchExcludeMatcher {
+    // path -> enabled
+    GHashTable *directories;
+
+    // the patterns are split up by their shape, only the ones which don't fit any
+    // of the cheap checks are left to fnmatch:
+    // "name", without any wildcard
+    GHashTable *names;
+    // "*.ext", ext without any dot, looked up with the text behind the last dot of the name
+    GHashTable *extensions;
+    // "*text" and "text*"
+    GPtrArray *suffixes;
+    GPtrArray *prefixes;
+    GPtrArray *globs;
+};
+
+static bool
+pattern_is_literal(const char *text, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (strchr("*?[\\", text[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void
+fsearch_exclude_matcher_add_pattern(FsearchExcludeMatcher *matcher, const char *pattern) {
+    const size_t len = strlen(pattern);
+    if (pattern_is_literal(pattern, len)) {
+        g_hash_table_add(matcher->names, g_strdup(pattern));
+    }
+    else if (len > 0 && pattern[0] == '*' && pattern_is_literal(pattern + 1, len - 1)) {
+        if (len > 2 && pattern[1] == '.' && !strchr(pattern + 2, '.')) {
+            g_hash_table_add(matcher->extensions, g_strdup(pattern + 2));
+        }
+        else {
+            g_ptr_array_add(matcher->suffixes, g_strdup(pattern + 1));
+        }
+    }
+    else if (len > 0 && pattern[len - 1] == '*' && pattern_is_literal(pattern, len - 1)) {
+        g_ptr_array_add(matcher->prefixes, g_strndup(pattern, len - 1));
+    }
+    else {
+        g_ptr_array_add(matcher->globs, g_strdup(pattern));
+    }
+}
+
+FsearchExcludeMatcher *
+fsearch_exclude_matcher_new(GList *excludes, char **exclude_files) {
+    FsearchExcludeMatcher *matcher = calloc(1, sizeof(FsearchExcludeMatcher));
+    assert(matcher != NULL);
+
+    matcher->directories = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    for (GList *l = excludes; l != NULL; l = l->next) {
+        FsearchExcludePath *fs_path = l->data;
+        if (fs_path->path && !g_hash_table_contains(matcher->directories, fs_path->path)) {
+            g_hash_table_insert(matcher->directories, g_strdup(fs_path->path), GINT_TO_POINTER(fs_path->enabled));
+        }
+    }
+
+    matcher->names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    matcher->extensions = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    matcher->suffixes = g_ptr_array_new_with_free_func(g_free);
+    matcher->prefixes = g_ptr_array_new_with_free_func(g_free);
+    matcher->globs = g_ptr_array_new_with_free_func(g_free);
+    for (int i = 0; exclude_files && exclude_files[i]; i++) {
+        fsearch_exclude_matcher_add_pattern(matcher, exclude_files[i]);
+    }
+    return matcher;
+}
+
+void
+fsearch_exclude_matcher_free(FsearchExcludeMatcher *matcher) {
+    if (!matcher) {
+        return;
+    }
+    g_hash_table_destroy(matcher->directories);
+    g_hash_table_destroy(matcher->names);
+    g_hash_table_destroy(matcher->extensions);
+    g_ptr_array_free(matcher->suffixes, TRUE);
+    g_ptr_array_free(matcher->prefixes, TRUE);
+    g_ptr_array_free(matcher->globs, TRUE);
+    free(matcher);
+    matcher = NULL;
+}
+
+bool
+fsearch_exclude_matcher_file_is_excluded(FsearchExcludeMatcher *matcher, const char *name) {
+    if (g_hash_table_size(matcher->extensions) > 0) {
+        const char *ext = strrchr(name, '.');
+        if (ext && g_hash_table_contains(matcher->extensions, ext + 1)) {
+            return true;
+        }
+    }
+    if (g_hash_table_size(matcher->names) > 0 && g_hash_table_contains(matcher->names, name)) {
+        return true;
+    }
+    if (matcher->suffixes->len > 0 || matcher->prefixes->len > 0) {
+        const size_t name_len = strlen(name);
+        for (guint i = 0; i < matcher->suffixes->len; i++) {
+            const char *suffix = g_ptr_array_index(matcher->suffixes, i);
+            const size_t suffix_len = strlen(suffix);
+            if (suffix_len <= name_len && !memcmp(name + name_len - suffix_len, suffix, suffix_len)) {
+                return true;
+            }
+        }
+        for (guint i = 0; i < matcher->prefixes->len; i++) {
+            const char *prefix = g_ptr_array_index(matcher->prefixes, i);
+            if (!strncmp(name, prefix, strlen(prefix))) {
+                return true;
+            }
+        }
+    }
+    for (guint i = 0; i < matcher->globs->len; i++) {
+        if (!fnmatch(g_ptr_array_index(matcher->globs, i), name, 0)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool
+fsearch_exclude_matcher_directory_is_excluded(FsearchExcludeMatcher *matcher, const char *path) {
+    if (g_hash_table_size(matcher->directories) == 0) {
+        return false;
+    }
+    return GPOINTER_TO_INT(g_hash_table_lookup(matcher->directories, path)) != 0;
+}
@@ -0,0 +1,43 @@
+/*
+   FSearch - A fast file search utility
+   Copyright © 2020 Christian Boxdörfer
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+   */
+
+
+#pragma once
+
+#include <glib.h>
+#include <stdbool.h>
+
+// The exclude rules of a database, compiled once so that checking an entry doesn't have to
+// walk all of them. Matches exactly what fnmatch(pattern, name, 0) and comparing the full
+// path with each exclude path did.
+typedef struct FsearchExcludeMatcher FsearchExcludeMatcher;
+
+// excludes is a list of FsearchExcludePath, for equal paths the first one wins
+FsearchExcludeMatcher *
+fsearch_exclude_matcher_new(GList *excludes, char **exclude_files);
+
+void
+fsearch_exclude_matcher_free(FsearchExcludeMatcher *matcher);
+
+// true if the name of a file or folder matches one of the exclude_files patterns
+bool
+fsearch_exclude_matcher_file_is_excluded(FsearchExcludeMatcher *matcher, const char *name);
+
+// true if path is one of the enabled exclude paths
+bool
+fsearch_exclude_matcher_directory_is_excluded(FsearchExcludeMatcher *matcher, const char *path);
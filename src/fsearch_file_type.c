@@ -0,0 +1,224 @@
+/*
+   FSearch - A fast file search utility
+   Copyright © 2020 Christian Boxdörfer
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+   */
+
+#define _GNU_SOURCE
+
+#include "fsearch_file_type.h"
+#include <limits.h>
+#include <string.h>
+
+typedef struct {
+    char *description;
+    GIcon *icon;
+} FsearchFileType;
+
+// extension -> FsearchFileType
+static GHashTable *file_types = NULL;
+static GHashTable *special_stems = NULL;
+static FsearchFileType *folder_type = NULL;
+static GMutex file_types_mutex;
+
+static FsearchFileType *
+file_type_new(const char *content_type) {
+    FsearchFileType *type = g_new0(FsearchFileType, 1);
+    if (content_type) {
+        type->description = g_content_type_get_description(content_type);
+        type->icon = g_content_type_get_icon(content_type);
+    }
+    return type;
+}
+
+static FsearchFileType *
+file_type_new_for_name(const char *name) {
+    gchar *content_type = g_content_type_guess(name, NULL, 0, NULL);
+    FsearchFileType *type = file_type_new(content_type);
+    g_free(content_type);
+    content_type = NULL;
+    return type;
+}
+
+static FsearchFileType *
+file_type_new_for_folder(void) {
+    FsearchFileType *type = file_type_new("inode/directory");
+    g_free(type->description);
+    type->description = g_strdup("Folder");
+    return type;
+}
+
+static void
+file_type_free(FsearchFileType *type) {
+    if (!type) {
+        return;
+    }
+    g_free(type->description);
+    type->description = NULL;
+    if (type->icon) {
+        g_object_unref(type->icon);
+        type->icon = NULL;
+    }
+    g_free(type);
+}
+
+static void
+file_type_copy(FsearchFileType *type, char **description, GIcon **icon) {
+    if (description) {
+        *description = g_strdup(type->description);
+    }
+    if (icon) {
+        *icon = type->icon ? g_object_ref(type->icon) : NULL;
+    }
+}
+
+// "gz" for foo.gz, "tar.gz" for foo.tar.gz and NULL for names like foo or .foo
+static const char *
+file_type_get_key(const char *name) {
+    const char *last = strrchr(name, '.');
+    if (!last || last == name || last[1] == '\0') {
+        return NULL;
+    }
+    const char *key = last;
+    // the leading dot of hidden files doesn't start an extension
+    for (const char *c = last - 1; c > name; c--) {
+        if (*c == '.') {
+            key = c;
+            break;
+        }
+    }
+    return key + 1;
+}
+
+// names with a stem in here have a type of their own, e.g. README.txt or Makefile.am
+static bool
+file_type_has_special_stem(const char *name, const char *key) {
+    if (!special_stems) {
+        return false;
+    }
+    char stem[NAME_MAX + 1] = "";
+    const size_t stem_len = key - 1 - name;
+    if (stem_len >= sizeof(stem)) {
+        return false;
+    }
+    memcpy(stem, name, stem_len);
+    stem[stem_len] = '\0';
+    return g_hash_table_contains(special_stems, stem);
+}
+
+static bool
+file_type_content_types_equal(const char *name_a, const char *name_b) {
+    gchar *content_type_a = g_content_type_guess(name_a, NULL, 0, NULL);
+    gchar *content_type_b = g_content_type_guess(name_b, NULL, 0, NULL);
+    const bool equal = g_strcmp0(content_type_a, content_type_b) == 0;
+    g_free(content_type_a);
+    content_type_a = NULL;
+    g_free(content_type_b);
+    content_type_b = NULL;
+    return equal;
+}
+
+bool
+fsearch_file_type_peek(const char *name, bool is_dir, char **description, GIcon **icon) {
+    const char *key = is_dir ? NULL : file_type_get_key(name);
+    if (!is_dir && !key) {
+        return false;
+    }
+
+    g_mutex_lock(&file_types_mutex);
+    FsearchFileType *type = NULL;
+    if (is_dir) {
+        type = folder_type;
+    }
+    else if (file_types && !file_type_has_special_stem(name, key)) {
+        type = g_hash_table_lookup(file_types, key);
+    }
+    if (type) {
+        file_type_copy(type, description, icon);
+    }
+    g_mutex_unlock(&file_types_mutex);
+    return type != NULL;
+}
+
+static void
+file_type_get_for_name(const char *name, char **description, GIcon **icon) {
+    FsearchFileType *type = file_type_new_for_name(name);
+    file_type_copy(type, description, icon);
+    file_type_free(type);
+    type = NULL;
+}
+
+void
+fsearch_file_type_get(const char *name, bool is_dir, char **description, GIcon **icon) {
+    if (fsearch_file_type_peek(name, is_dir, description, icon)) {
+        return;
+    }
+    if (is_dir) {
+        FsearchFileType *type = file_type_new_for_folder();
+        g_mutex_lock(&file_types_mutex);
+        if (folder_type) {
+            file_type_free(type);
+        }
+        else {
+            folder_type = type;
+        }
+        file_type_copy(folder_type, description, icon);
+        g_mutex_unlock(&file_types_mutex);
+        return;
+    }
+
+    const char *key = file_type_get_key(name);
+    if (!key) {
+        file_type_get_for_name(name, description, icon);
+        return;
+    }
+
+    // The type is looked up for the extension alone, so names which have a type of their
+    // own don't decide it for all other files with that extension.
+    gchar *probe = g_strconcat("file.", key, NULL);
+    const bool is_special = !file_type_content_types_equal(name, probe);
+    if (is_special) {
+        g_mutex_lock(&file_types_mutex);
+        if (!special_stems) {
+            special_stems = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+        }
+        g_hash_table_add(special_stems, g_strndup(name, key - 1 - name));
+        g_mutex_unlock(&file_types_mutex);
+
+        g_free(probe);
+        probe = NULL;
+        file_type_get_for_name(name, description, icon);
+        return;
+    }
+    // looked up without holding the lock, another thread might have added it in the meantime
+    FsearchFileType *type = file_type_new_for_name(probe);
+    g_free(probe);
+    probe = NULL;
+
+    g_mutex_lock(&file_types_mutex);
+    if (!file_types) {
+        file_types = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)file_type_free);
+    }
+    FsearchFileType *known = g_hash_table_lookup(file_types, key);
+    if (known) {
+        file_type_free(type);
+        type = known;
+    }
+    else {
+        g_hash_table_insert(file_types, g_strdup(key), type);
+    }
+    file_type_copy(type, description, icon);
+    g_mutex_unlock(&file_types_mutex);
+}
@@ -0,0 +1,36 @@
+/*
+   FSearch - A fast file search utility
+   Copyright © 2020 Christian Boxdörfer
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+   */
+
+#pragma once
+
+#include <gio/gio.h>
+#include <stdbool.h>
+
+// File types and their icons, looked up once per file name extension (or two
+// for names like foo.tar.gz) and shared by the whole process. Folders all have
+// the same type. Names without an extension, or with a type of their own like
+// README.md, are looked up every time.
+
+// The description and icon of the type of the file called name, icon may be NULL.
+// Both have to be freed.
+void
+fsearch_file_type_get(const char *name, bool is_dir, char **description, GIcon **icon);
+
+// Same as fsearch_file_type_get, but only if it's cached. Returns false otherwise.
+bool
+fsearch_file_type_peek(const char *name, bool is_dir, char **description, GIcon **icon);
@@ -46,6 +46,41 @@ fsearch_filter_free(FsearchFilter *filter) {
     free(filter);
     filter = NULL;
 }
+char **
+fsearch_filter_get_extensions(FsearchFilter *filter) {
+    assert(filter != NULL);
+
+    if (!filter->query || !filter->enable_regex || filter->search_in_path) {
+        return NULL;
+    }
+    const char *prefix = "\\.(";
+    const char *suffix = ")$";
+    const size_t query_len = strlen(filter->query);
+    if (query_len <= strlen(prefix) + strlen(suffix) || strncmp(filter->query, prefix, strlen(prefix)) != 0
+        || strcmp(filter->query + query_len - strlen(suffix), suffix) != 0) {
+        return NULL;
+    }
+
+    // every alternative has to be plain text, which can't contain another dot
+    char *alternatives = g_strndup(filter->query + strlen(prefix), query_len - strlen(prefix) - strlen(suffix));
+    char **extensions = g_strsplit(alternatives, "|", -1);
+    g_free(alternatives);
+    alternatives = NULL;
+    for (char **ext = extensions; *ext; ext++) {
+        if (**ext == '\0') {
+            g_strfreev(extensions);
+            return NULL;
+        }
+        for (const char *c = *ext; *c; c++) {
+            if (!g_ascii_isalnum(*c) && *c != '_' && *c != '-') {
+                g_strfreev(extensions);
+                return NULL;
+            }
+        }
+    }
+    return extensions;
+}
+
 static const char *document_filter =
     "\\.(c|chm|cpp|csv|cxx|doc|docm|docx|dot|dotm|dotx|h|hpp|htm|html|hxx|ini|java|lua|mht|mhtml|"
     "odt|pdf|potx|potm|ppam|ppsm|ppsx|pps|ppt|pptm|pptx|rtf|sldm|sldx|thmx|txt|vsd|wpd|wps|wri|"
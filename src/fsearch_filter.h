@@ -29,6 +29,11 @@ fsearch_filter_new(FsearchFilterFileType type,
 void
 fsearch_filter_free(FsearchFilter *filter);
 
+// The extensions of the names matched by the filter's query, if the query does nothing but check
+// for them, like the default ones "\\.(ext1|ext2|...)$" do. NULL otherwise, g_strfreev the result.
+char **
+fsearch_filter_get_extensions(FsearchFilter *filter);
+
 GList *
 fsearch_filter_get_default();
 
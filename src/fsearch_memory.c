@@ -0,0 +1,158 @@
+/*
+   FSearch - A fast file search utility
+   Copyright © 2020 Christian Boxdörfer
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+   */
+
+#define _GNU_SOURCE
+#include "fsearch_memory.h"
+#include "debug.h"
+
+#include <glib.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+// the size of a huge page on most systems, smaller allocations aren't worth the system calls
+#define FSEARCH_MEMORY_ADVISE_MIN_SIZE (2 * 1024 * 1024)
+
+// from linux/mempolicy.h, which isn't installed everywhere
+#define FSEARCH_MEMORY_MPOL_INTERLEAVE 3
+#define FSEARCH_MEMORY_MAX_NODES 1024
+#define FSEARCH_MEMORY_NODE_MASK_BITS (8 * sizeof(unsigned long))
+
+static volatile gint memory_huge_pages = 0;
+static volatile gint memory_interleave = 0;
+
+static unsigned long memory_node_mask[FSEARCH_MEMORY_MAX_NODES / FSEARCH_MEMORY_NODE_MASK_BITS];
+static uint32_t memory_num_nodes = 0;
+static gsize memory_nodes_initialized = 0;
+
+static void
+memory_read_nodes(void) {
+    // a list of ranges, e.g. 0-1,4
+    char *contents = NULL;
+    if (!g_file_get_contents("/sys/devices/system/node/online", &contents, NULL, NULL)) {
+        return;
+    }
+    char *s = contents;
+    while (*s) {
+        char *end = NULL;
+        const unsigned long first = strtoul(s, &end, 10);
+        if (end == s) {
+            break;
+        }
+        unsigned long last = first;
+        s = end;
+        if (*s == '-') {
+            s++;
+            last = strtoul(s, &end, 10);
+            if (end == s) {
+                break;
+            }
+            s = end;
+        }
+        for (unsigned long node = first; node <= last && node < FSEARCH_MEMORY_MAX_NODES; node++) {
+            memory_node_mask[node / FSEARCH_MEMORY_NODE_MASK_BITS] |= 1UL << (node % FSEARCH_MEMORY_NODE_MASK_BITS);
+            memory_num_nodes++;
+        }
+        if (*s != ',') {
+            break;
+        }
+        s++;
+    }
+    g_free(contents);
+    trace("[memory] %u NUMA nodes online\n", memory_num_nodes);
+}
+
+static uint32_t
+memory_get_num_nodes(void) {
+    if (g_once_init_enter(&memory_nodes_initialized)) {
+        memory_read_nodes();
+        g_once_init_leave(&memory_nodes_initialized, 1);
+    }
+    return memory_num_nodes;
+}
+
+static bool
+memory_policy_is_set(void) {
+    return g_atomic_int_get(&memory_huge_pages) || g_atomic_int_get(&memory_interleave);
+}
+
+void
+fsearch_memory_set_policy(bool huge_pages, bool interleave) {
+    g_atomic_int_set(&memory_huge_pages, huge_pages);
+    g_atomic_int_set(&memory_interleave, interleave);
+}
+
+void
+fsearch_memory_advise(void *mem, size_t size) {
+    if (!mem || size < FSEARCH_MEMORY_ADVISE_MIN_SIZE || !memory_policy_is_set()) {
+        return;
+    }
+    const uintptr_t page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+    const uintptr_t start = ((uintptr_t)mem + page_size - 1) & ~(page_size - 1);
+    const uintptr_t end = ((uintptr_t)mem + size) & ~(page_size - 1);
+    if (end <= start) {
+        return;
+    }
+
+    // both are only hints: the memory works the same if the kernel doesn't support them
+#ifdef MADV_HUGEPAGE
+    if (g_atomic_int_get(&memory_huge_pages)) {
+        madvise((void *)start, end - start, MADV_HUGEPAGE);
+    }
+#endif
+#ifdef SYS_mbind
+    if (g_atomic_int_get(&memory_interleave) && memory_get_num_nodes() > 1) {
+        syscall(SYS_mbind,
+                (void *)start,
+                (unsigned long)(end - start),
+                FSEARCH_MEMORY_MPOL_INTERLEAVE,
+                memory_node_mask,
+                (unsigned long)FSEARCH_MEMORY_MAX_NODES + 1,
+                0);
+    }
+#endif
+}
+
+void *
+fsearch_memory_malloc(size_t size) {
+    void *mem = malloc(size);
+    fsearch_memory_advise(mem, size);
+    return mem;
+}
+
+void *
+fsearch_memory_calloc(size_t num_items, size_t item_size) {
+    if (item_size && num_items > SIZE_MAX / item_size) {
+        return NULL;
+    }
+    const size_t size = num_items * item_size;
+    if (size < FSEARCH_MEMORY_ADVISE_MIN_SIZE || !memory_policy_is_set()) {
+        return calloc(num_items, item_size);
+    }
+    // zeroed only once the policy is set, so the pages get placed according to it
+    void *mem = fsearch_memory_malloc(size);
+    if (mem) {
+        memset(mem, 0, size);
+    }
+    return mem;
+}
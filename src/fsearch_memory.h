@@ -0,0 +1,47 @@
+/*
+   FSearch - A fast file search utility
+   Copyright © 2020 Christian Boxdörfer
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+   */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Placement of the large arrays of the index, e.g. the node and name blocks
+// and the columns of the entry table. They stay around for as long as the
+// database and every search thread reads all of them, so they can be backed
+// by transparent huge pages, which saves most of the TLB misses of a full
+// scan, and on machines with several NUMA nodes their pages can be spread
+// over all nodes, so that not every thread has to read the memory of the
+// node which built the index. Smaller allocations aren't affected.
+
+// Applies to everything allocated afterwards, both are off by default
+void
+fsearch_memory_set_policy(bool huge_pages, bool interleave);
+
+// Applies the policy to the whole pages of [mem, mem + size). Pages which
+// were touched already keep their node.
+void
+fsearch_memory_advise(void *mem, size_t size);
+
+// Like malloc and calloc, the memory is released with free
+void *
+fsearch_memory_malloc(size_t size);
+
+void *
+fsearch_memory_calloc(size_t num_items, size_t item_size);
@@ -0,0 +1,357 @@
+/*
+   FSearch - A fast file search utility
+   Copyright © 2020 Christian Boxdörfer
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+   */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fsearch_sort.h"
+
+// below that it's not worth to wake up other threads
+#define FSEARCH_SORT_MIN_ITEMS_PER_THREAD 8192
+#define FSEARCH_SORT_INSERTION_SORT_SIZE 32
+
+typedef struct {
+    FsearchSortCompareFunc compare_func;
+    void *user_data;
+} FsearchSortContext;
+
+typedef struct {
+    const FsearchSortContext *ctx;
+    FsearchSortItem *items;
+    FsearchSortItem *tmp;
+    uint32_t num_items;
+
+    // the merge of a and b which ends up in out[out_start, out_end)
+    const FsearchSortItem *a;
+    uint32_t len_a;
+    const FsearchSortItem *b;
+    uint32_t len_b;
+    FsearchSortItem *out;
+    uint32_t out_start;
+    uint32_t out_end;
+} FsearchSortTask;
+
+static inline int
+fsearch_sort_compare(const FsearchSortContext *ctx, const FsearchSortItem *a, const FsearchSortItem *b) {
+    if (a->key != b->key) {
+        return a->key < b->key ? -1 : 1;
+    }
+    return ctx->compare_func ? ctx->compare_func(a->data, b->data, ctx->user_data) : 0;
+}
+
+static void
+fsearch_sort_merge(const FsearchSortContext *ctx,
+                   const FsearchSortItem *a,
+                   uint32_t len_a,
+                   const FsearchSortItem *b,
+                   uint32_t len_b,
+                   FsearchSortItem *out) {
+    uint32_t i = 0;
+    uint32_t j = 0;
+    while (i < len_a && j < len_b) {
+        // take from a on ties to keep the sort stable
+        if (fsearch_sort_compare(ctx, &b[j], &a[i]) < 0) {
+            *out++ = b[j++];
+        }
+        else {
+            *out++ = a[i++];
+        }
+    }
+    memcpy(out, a + i, (len_a - i) * sizeof(FsearchSortItem));
+    out += len_a - i;
+    memcpy(out, b + j, (len_b - j) * sizeof(FsearchSortItem));
+}
+
+static void
+fsearch_sort_insertion_sort(const FsearchSortContext *ctx, FsearchSortItem *items, uint32_t num_items) {
+    for (uint32_t i = 1; i < num_items; i++) {
+        FsearchSortItem item = items[i];
+        uint32_t j = i;
+        while (j > 0 && fsearch_sort_compare(ctx, &item, &items[j - 1]) < 0) {
+            items[j] = items[j - 1];
+            j--;
+        }
+        items[j] = item;
+    }
+}
+
+static void
+fsearch_sort_chunk(const FsearchSortContext *ctx, FsearchSortItem *items, FsearchSortItem *tmp, uint32_t num_items) {
+    for (uint32_t i = 0; i < num_items; i += FSEARCH_SORT_INSERTION_SORT_SIZE) {
+        const uint32_t len = MIN(FSEARCH_SORT_INSERTION_SORT_SIZE, num_items - i);
+        fsearch_sort_insertion_sort(ctx, items + i, len);
+    }
+
+    // bottom up merge sort, alternating between items and tmp
+    FsearchSortItem *src = items;
+    FsearchSortItem *dst = tmp;
+    for (uint32_t width = FSEARCH_SORT_INSERTION_SORT_SIZE; width < num_items; width *= 2) {
+        for (uint32_t i = 0; i < num_items; i += 2 * width) {
+            const uint32_t len_a = MIN(width, num_items - i);
+            const uint32_t len_b = MIN(width, num_items - i - len_a);
+            fsearch_sort_merge(ctx, src + i, len_a, src + i + len_a, len_b, dst + i);
+        }
+        FsearchSortItem *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if (src != items) {
+        memcpy(items, src, num_items * sizeof(FsearchSortItem));
+    }
+}
+
+static uint32_t
+fsearch_sort_get_split(const FsearchSortContext *ctx,
+                       const FsearchSortItem *a,
+                       uint32_t len_a,
+                       const FsearchSortItem *b,
+                       uint32_t len_b,
+                       uint32_t k) {
+    // number of items of a among the first k items of the stable merge of a and b
+    uint32_t lo = k > len_b ? k - len_b : 0;
+    uint32_t hi = MIN(k, len_a);
+    while (lo < hi) {
+        const uint32_t i = lo + (hi - lo) / 2;
+        const uint32_t j = k - i;
+        if (j > 0 && fsearch_sort_compare(ctx, &a[i], &b[j - 1]) <= 0) {
+            lo = i + 1;
+        }
+        else {
+            hi = i;
+        }
+    }
+    return lo;
+}
+
+static void
+fsearch_sort_chunk_tasks(uint32_t start, uint32_t end, gpointer data) {
+    FsearchSortTask *tasks = data;
+    for (uint32_t i = start; i < end; i++) {
+        FsearchSortTask *task = &tasks[i];
+        fsearch_sort_chunk(task->ctx, task->items, task->tmp, task->num_items);
+    }
+}
+
+static void
+fsearch_sort_merge_tasks(uint32_t start, uint32_t end, gpointer data) {
+    FsearchSortTask *tasks = data;
+    for (uint32_t i = start; i < end; i++) {
+        FsearchSortTask *task = &tasks[i];
+        const uint32_t start_a = fsearch_sort_get_split(task->ctx, task->a, task->len_a, task->b, task->len_b, task->out_start);
+        const uint32_t end_a = fsearch_sort_get_split(task->ctx, task->a, task->len_a, task->b, task->len_b, task->out_end);
+        const uint32_t start_b = task->out_start - start_a;
+        const uint32_t end_b = task->out_end - end_a;
+        fsearch_sort_merge(task->ctx,
+                           task->a + start_a,
+                           end_a - start_a,
+                           task->b + start_b,
+                           end_b - start_b,
+                           task->out + task->out_start);
+    }
+}
+
+// Merges pairs of the runs items[run_starts[i], run_starts[i + 1]) until only one is left, each merge is
+// split up between num_threads threads. run_starts has num_runs + 1 entries and is changed.
+static void
+fsearch_sort_merge_runs_with_tmp(const FsearchSortContext *ctx,
+                                 FsearchSortItem *items,
+                                 FsearchSortItem *tmp,
+                                 uint32_t num_items,
+                                 uint32_t *run_starts,
+                                 uint32_t num_runs,
+                                 uint32_t num_threads,
+                                 FsearchThreadPool *pool) {
+    // merge pairs of runs until only one is left, each merge is split up between all threads
+    FsearchSortTask tasks[num_threads];
+    FsearchSortItem *src = items;
+    FsearchSortItem *dst = tmp;
+    while (num_runs > 1) {
+        uint32_t num_merged_runs = 0;
+        for (uint32_t r = 0; r < num_runs; r += 2) {
+            const uint32_t start = run_starts[r];
+            if (r + 1 == num_runs) {
+                // odd one out
+                memcpy(dst + start, src + start, (run_starts[r + 1] - start) * sizeof(FsearchSortItem));
+                run_starts[num_merged_runs++] = start;
+                continue;
+            }
+            const uint32_t mid = run_starts[r + 1];
+            const uint32_t end = run_starts[r + 2];
+            const uint32_t len = end - start;
+            for (uint32_t i = 0; i < num_threads; i++) {
+                tasks[i] = (FsearchSortTask){
+                    .ctx = ctx,
+                    .a = src + start,
+                    .len_a = mid - start,
+                    .b = src + mid,
+                    .len_b = end - mid,
+                    .out = dst + start,
+                    .out_start = (uint64_t)len * i / num_threads,
+                    .out_end = (uint64_t)len * (i + 1) / num_threads,
+                };
+            }
+            fsearch_thread_pool_parallel_for(pool, num_threads, 1, fsearch_sort_merge_tasks, tasks);
+            run_starts[num_merged_runs++] = start;
+        }
+        run_starts[num_merged_runs] = num_items;
+        num_runs = num_merged_runs;
+
+        FsearchSortItem *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if (src != items) {
+        memcpy(items, src, num_items * sizeof(FsearchSortItem));
+    }
+}
+
+void
+fsearch_sort(FsearchSortItem *items,
+             uint32_t num_items,
+             FsearchSortCompareFunc compare_func,
+             void *user_data,
+             FsearchThreadPool *pool) {
+    assert(items != NULL || num_items == 0);
+    if (num_items <= 1) {
+        return;
+    }
+
+    const FsearchSortContext ctx = {.compare_func = compare_func, .user_data = user_data};
+    FsearchSortItem *tmp = malloc(num_items * sizeof(FsearchSortItem));
+    assert(tmp != NULL);
+
+    uint32_t num_threads = pool ? fsearch_thread_pool_get_num_threads(pool) : 1;
+    num_threads = MAX(1, MIN(num_threads, num_items / FSEARCH_SORT_MIN_ITEMS_PER_THREAD));
+    if (num_threads == 1) {
+        fsearch_sort_chunk(&ctx, items, tmp, num_items);
+        free(tmp);
+        return;
+    }
+
+    FsearchSortTask tasks[num_threads];
+    uint32_t run_starts[num_threads + 1];
+
+    // sort one chunk per thread
+    const uint32_t chunk_size = num_items / num_threads;
+    for (uint32_t i = 0; i < num_threads; i++) {
+        run_starts[i] = i * chunk_size;
+        tasks[i] = (FsearchSortTask){
+            .ctx = &ctx,
+            .items = items + run_starts[i],
+            .tmp = tmp + run_starts[i],
+            .num_items = i == num_threads - 1 ? num_items - run_starts[i] : chunk_size,
+        };
+    }
+    run_starts[num_threads] = num_items;
+    fsearch_thread_pool_parallel_for(pool, num_threads, 1, fsearch_sort_chunk_tasks, tasks);
+
+    fsearch_sort_merge_runs_with_tmp(&ctx, items, tmp, num_items, run_starts, num_threads, num_threads, pool);
+    free(tmp);
+}
+
+void
+fsearch_sort_merge_runs(FsearchSortItem *items,
+                        uint32_t num_items,
+                        const uint32_t *run_starts,
+                        uint32_t num_runs,
+                        FsearchSortCompareFunc compare_func,
+                        void *user_data,
+                        FsearchThreadPool *pool) {
+    assert(items != NULL || num_items == 0);
+    if (num_runs <= 1 || num_items <= 1) {
+        return;
+    }
+
+    const FsearchSortContext ctx = {.compare_func = compare_func, .user_data = user_data};
+    FsearchSortItem *tmp = malloc(num_items * sizeof(FsearchSortItem));
+    assert(tmp != NULL);
+    uint32_t *starts = malloc((num_runs + 1) * sizeof(uint32_t));
+    assert(starts != NULL);
+    memcpy(starts, run_starts, num_runs * sizeof(uint32_t));
+    starts[num_runs] = num_items;
+
+    uint32_t num_threads = pool ? fsearch_thread_pool_get_num_threads(pool) : 1;
+    num_threads = MAX(1, MIN(num_threads, num_items / FSEARCH_SORT_MIN_ITEMS_PER_THREAD));
+    fsearch_sort_merge_runs_with_tmp(&ctx, items, tmp, num_items, starts, num_runs, num_threads, pool);
+    free(starts);
+    free(tmp);
+}
+
+void
+fsearch_sort_by_rank(FsearchSortItem *items, uint32_t num_items) {
+    assert(items != NULL || num_items == 0);
+    if (num_items <= 1) {
+        return;
+    }
+
+    // LSD radix sort, two passes over 16 bits each
+    FsearchSortItem *tmp = malloc(num_items * sizeof(FsearchSortItem));
+    assert(tmp != NULL);
+    uint32_t *counts = malloc((1 << 16) * sizeof(uint32_t));
+    assert(counts != NULL);
+
+    FsearchSortItem *src = items;
+    FsearchSortItem *dst = tmp;
+    for (uint32_t shift = 0; shift < 32; shift += 16) {
+        memset(counts, 0, (1 << 16) * sizeof(uint32_t));
+        for (uint32_t i = 0; i < num_items; i++) {
+            counts[(src[i].key >> shift) & 0xffff]++;
+        }
+        uint32_t offset = 0;
+        for (uint32_t i = 0; i < (1 << 16); i++) {
+            const uint32_t count = counts[i];
+            counts[i] = offset;
+            offset += count;
+        }
+        for (uint32_t i = 0; i < num_items; i++) {
+            dst[counts[(src[i].key >> shift) & 0xffff]++] = src[i];
+        }
+        FsearchSortItem *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    // an even number of passes leaves the result in items
+
+    free(counts);
+    free(tmp);
+}
+
+uint64_t
+fsearch_sort_get_name_key(const char *name, bool is_dir) {
+    assert(name != NULL);
+
+    // The first bytes of the name up to the first digit, in big endian order. strverscmp compares
+    // names by their bytes until digits are involved, so those bytes decide unless they're equal.
+    // A digit ends the prefix as '0': it compares like any other digit against non-digits, and two
+    // names differing in a digit first get equal keys, they need strverscmp for their numbers.
+    uint64_t prefix = 0;
+    for (uint32_t i = 0; i < 8; i++) {
+        const unsigned char c = name[i];
+        if (c == '\0') {
+            break;
+        }
+        const bool is_digit = c >= '0' && c <= '9';
+        prefix |= (uint64_t)(is_digit ? '0' : c) << (56 - 8 * i);
+        if (is_digit) {
+            break;
+        }
+    }
+    // folders first, the prefix loses its lowest bit for that which is fine for a non-strict order
+    return (uint64_t)!is_dir << 63 | prefix >> 1;
+}
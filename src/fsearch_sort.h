@@ -0,0 +1,61 @@
+/*
+   FSearch - A fast file search utility
+   Copyright © 2020 Christian Boxdörfer
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+   */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "fsearch_thread_pool.h"
+
+// An item to be sorted together with a precomputed key. Items are ordered by their keys,
+// the compare function is only needed for items with equal keys.
+typedef struct _FsearchSortItem {
+    uint64_t key;
+    void *data;
+} FsearchSortItem;
+
+typedef int (*FsearchSortCompareFunc)(void *a, void *b, void *user_data);
+
+// Stable merge sort. With a pool, chunks are sorted and merged on all of its threads.
+// compare_func may be NULL if items with equal keys are considered equal.
+void
+fsearch_sort(FsearchSortItem *items,
+             uint32_t num_items,
+             FsearchSortCompareFunc compare_func,
+             void *user_data,
+             FsearchThreadPool *pool);
+
+// Merges the sorted runs which start at run_starts into one, items of earlier runs come first on ties.
+// With a pool, every merge is split up between its threads.
+void
+fsearch_sort_merge_runs(FsearchSortItem *items,
+                        uint32_t num_items,
+                        const uint32_t *run_starts,
+                        uint32_t num_runs,
+                        FsearchSortCompareFunc compare_func,
+                        void *user_data,
+                        FsearchThreadPool *pool);
+
+// Stable radix sort by the lower 32 bits of the keys, e.g. precomputed ranks
+void
+fsearch_sort_by_rank(FsearchSortItem *items, uint32_t num_items);
+
+// Key which orders names like strverscmp with folders first. Names with equal keys need a full comparison.
+uint64_t
+fsearch_sort_get_name_key(const char *name, bool is_dir);
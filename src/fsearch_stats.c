@@ -0,0 +1,253 @@
+/*
+   FSearch - A fast file search utility
+   Copyright © 2020 Christian Boxdörfer
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+   */
+
+#include "fsearch_stats.h"
+
+#include <math.h>
+
+// Durations in µs: the first buckets hold 0 to 7 µs, after that every power of two is split into
+// four buckets, so the upper bound of a bucket is at most 25% off the durations it holds
+#define FSEARCH_STATS_NUM_BUCKETS 128
+
+typedef struct {
+    volatile gsize count;
+    volatile gsize sum_us;
+    volatile gsize last_us;
+    volatile gsize buckets[FSEARCH_STATS_NUM_BUCKETS];
+} FsearchStatsHistogram;
+
+volatile gint fsearch_stats_enabled = 0;
+
+static volatile gsize stats_counters[NUM_FSEARCH_STATS_COUNTERS];
+static volatile gsize stats_gauges[NUM_FSEARCH_STATS_GAUGES];
+static FsearchStatsHistogram stats_timers[NUM_FSEARCH_STATS_TIMERS];
+static volatile gsize stats_thread_busy_us[FSEARCH_STATS_MAX_THREADS];
+
+static const char *counter_names[NUM_FSEARCH_STATS_COUNTERS] = {
+    "scan entries",
+    "scan folders opened",
+    "scan stat calls",
+    "search entries checked",
+    "search matches",
+    "search cache hits",
+    "search index hits",
+    "search joined",
+};
+
+static const char *timer_names[NUM_FSEARCH_STATS_TIMERS] = {
+    "scan",
+    "load",
+    "search",
+    "search prepare",
+    "search match",
+    "search merge",
+    "list sort",
+};
+
+static gsize
+stats_get(volatile gsize *value) {
+    return GPOINTER_TO_SIZE(g_atomic_pointer_get(value));
+}
+
+void
+fsearch_stats_set_enabled(bool enabled) {
+    g_atomic_int_set(&fsearch_stats_enabled, enabled);
+}
+
+void
+fsearch_stats_reset(void) {
+    for (uint32_t i = 0; i < NUM_FSEARCH_STATS_COUNTERS; i++) {
+        g_atomic_pointer_set(&stats_counters[i], NULL);
+    }
+    for (uint32_t i = 0; i < NUM_FSEARCH_STATS_TIMERS; i++) {
+        FsearchStatsHistogram *hist = &stats_timers[i];
+        g_atomic_pointer_set(&hist->count, NULL);
+        g_atomic_pointer_set(&hist->sum_us, NULL);
+        g_atomic_pointer_set(&hist->last_us, NULL);
+        for (uint32_t j = 0; j < FSEARCH_STATS_NUM_BUCKETS; j++) {
+            g_atomic_pointer_set(&hist->buckets[j], NULL);
+        }
+    }
+    for (uint32_t i = 0; i < FSEARCH_STATS_MAX_THREADS; i++) {
+        g_atomic_pointer_set(&stats_thread_busy_us[i], NULL);
+    }
+    // the gauges describe the current database, they stay valid
+}
+
+void
+fsearch_stats_add(FsearchStatsCounter counter, uint64_t value) {
+    if (!fsearch_stats_is_enabled()) {
+        return;
+    }
+    g_atomic_pointer_add(&stats_counters[counter], value);
+}
+
+void
+fsearch_stats_set(FsearchStatsGauge gauge, uint64_t value) {
+    if (!fsearch_stats_is_enabled()) {
+        return;
+    }
+    g_atomic_pointer_set(&stats_gauges[gauge], GSIZE_TO_POINTER(value));
+}
+
+gint64
+fsearch_stats_now(void) {
+    return fsearch_stats_is_enabled() ? g_get_monotonic_time() : 0;
+}
+
+static uint32_t
+histogram_get_bucket(gsize duration) {
+    if (duration < 8) {
+        return duration;
+    }
+    const uint32_t exp = g_bit_storage(duration) - 1;
+    const uint32_t sub = (duration >> (exp - 2)) & 3;
+    return MIN(8 + (exp - 3) * 4 + sub, FSEARCH_STATS_NUM_BUCKETS - 1);
+}
+
+// first duration in µs which doesn't fall into the bucket anymore
+static double
+histogram_get_bucket_end(uint32_t bucket) {
+    if (bucket < 8) {
+        return bucket + 1;
+    }
+    const uint32_t exp = (bucket - 8) / 4 + 3;
+    const uint32_t sub = (bucket - 8) % 4;
+    return ldexp(4 + sub + 1, exp - 2);
+}
+
+gint64
+fsearch_stats_record(FsearchStatsTimer timer, gint64 start) {
+    // sections which started while statistics were disabled aren't recorded
+    if (!fsearch_stats_is_enabled() || start == 0) {
+        return 0;
+    }
+    const gint64 now = g_get_monotonic_time();
+    const gsize duration = now > start ? now - start : 0;
+    const uint32_t bucket = histogram_get_bucket(duration);
+
+    FsearchStatsHistogram *hist = &stats_timers[timer];
+    g_atomic_pointer_add(&hist->count, 1);
+    g_atomic_pointer_add(&hist->sum_us, duration);
+    g_atomic_pointer_set(&hist->last_us, GSIZE_TO_POINTER(duration));
+    g_atomic_pointer_add(&hist->buckets[bucket], 1);
+    return now;
+}
+
+void
+fsearch_stats_record_thread_busy(uint32_t thread_index, gint64 start) {
+    if (!fsearch_stats_is_enabled() || start == 0) {
+        return;
+    }
+    const gint64 now = g_get_monotonic_time();
+    g_atomic_pointer_add(&stats_thread_busy_us[MIN(thread_index, FSEARCH_STATS_MAX_THREADS - 1)],
+                         now > start ? now - start : 0);
+}
+
+double
+fsearch_stats_get_last_ms(FsearchStatsTimer timer) {
+    FsearchStatsHistogram *hist = &stats_timers[timer];
+    if (!g_atomic_pointer_get(&hist->count)) {
+        return -1;
+    }
+    return stats_get(&hist->last_us) / 1000.0;
+}
+
+// upper bound of the bucket which holds the given fraction of the samples, in ms
+static double
+histogram_get_percentile(FsearchStatsHistogram *hist, gsize count, double fraction) {
+    const gsize rank = MAX((gsize)(fraction * count + 0.5), 1);
+    gsize seen = 0;
+    for (uint32_t i = 0; i < FSEARCH_STATS_NUM_BUCKETS; i++) {
+        seen += stats_get(&hist->buckets[i]);
+        if (seen >= rank) {
+            return histogram_get_bucket_end(i) / 1000.0;
+        }
+    }
+    return histogram_get_bucket_end(FSEARCH_STATS_NUM_BUCKETS - 1) / 1000.0;
+}
+
+static gsize
+counter_get(FsearchStatsCounter counter) {
+    return stats_get(&stats_counters[counter]);
+}
+
+char *
+fsearch_stats_dump(void) {
+    GString *out = g_string_new(NULL);
+    if (!fsearch_stats_is_enabled()) {
+        g_string_append(out, "Statistics are disabled.\n\n");
+    }
+
+    g_string_append_printf(out, "%-24s %10s\n", "Counter", "Value");
+    for (uint32_t i = 0; i < NUM_FSEARCH_STATS_COUNTERS; i++) {
+        g_string_append_printf(out, "%-24s %10" G_GSIZE_FORMAT "\n", counter_names[i], counter_get(i));
+    }
+
+    g_string_append_printf(out,
+                           "\n%-24s %8s %10s %10s %10s %10s %10s\n",
+                           "Timer (ms)",
+                           "count",
+                           "last",
+                           "mean",
+                           "p50 <=",
+                           "p90 <=",
+                           "p99 <=");
+    for (uint32_t i = 0; i < NUM_FSEARCH_STATS_TIMERS; i++) {
+        FsearchStatsHistogram *hist = &stats_timers[i];
+        const gsize count = stats_get(&hist->count);
+        const gsize sum_us = stats_get(&hist->sum_us);
+        g_string_append_printf(out,
+                               "%-24s %8" G_GSIZE_FORMAT " %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+                               timer_names[i],
+                               count,
+                               stats_get(&hist->last_us) / 1000.0,
+                               count ? sum_us / 1000.0 / count : 0,
+                               count ? histogram_get_percentile(hist, count, 0.5) : 0,
+                               count ? histogram_get_percentile(hist, count, 0.9) : 0,
+                               count ? histogram_get_percentile(hist, count, 0.99) : 0);
+    }
+
+    // a folder costs an open, at least one getdents and a close, and entries might need a stat on top
+    const gsize num_scans = stats_get(&stats_timers[FSEARCH_STATS_TIME_SCAN].count);
+    const gsize scan_us = stats_get(&stats_timers[FSEARCH_STATS_TIME_SCAN].sum_us);
+    if (num_scans > 0) {
+        g_string_append_printf(out,
+                               "\nscan: %.0f entries/s, about %" G_GSIZE_FORMAT " syscalls per scan\n",
+                               scan_us ? counter_get(FSEARCH_STATS_SCAN_ENTRIES) / (scan_us / 1e6) : 0,
+                               (3 * counter_get(FSEARCH_STATS_SCAN_FOLDERS) + counter_get(FSEARCH_STATS_SCAN_STAT_CALLS))
+                                   / num_scans);
+    }
+
+    const gsize num_entries = stats_get(&stats_gauges[FSEARCH_STATS_DB_ENTRIES]);
+    const gsize node_bytes = stats_get(&stats_gauges[FSEARCH_STATS_DB_NODE_BYTES]);
+    g_string_append_printf(out,
+                           "database: %" G_GSIZE_FORMAT " entries, %.1f MB of nodes and names, %.1f bytes per entry\n",
+                           num_entries,
+                           node_bytes / 1e6,
+                           num_entries ? (double)node_bytes / num_entries : 0);
+
+    g_string_append(out, "\nThread busy time (ms)\n");
+    for (uint32_t i = 0; i < FSEARCH_STATS_MAX_THREADS; i++) {
+        const gsize busy_us = stats_get(&stats_thread_busy_us[i]);
+        if (busy_us > 0) {
+            g_string_append_printf(out, "thread %-17u %10.2f\n", i, busy_us / 1000.0);
+        }
+    }
+    return g_string_free(out, FALSE);
+}
@@ -0,0 +1,100 @@
+/*
+   FSearch - A fast file search utility
+   Copyright © 2020 Christian Boxdörfer
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+   */
+
+#pragma once
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Counters and latency histograms of the hot paths. Recording costs a single
+// check of a global flag while statistics are disabled, so calls can stay in
+// the scan and search loops.
+
+typedef enum {
+    FSEARCH_STATS_SCAN_ENTRIES,
+    FSEARCH_STATS_SCAN_FOLDERS,
+    FSEARCH_STATS_SCAN_STAT_CALLS,
+    FSEARCH_STATS_SEARCH_ENTRIES,
+    FSEARCH_STATS_SEARCH_MATCHES,
+    FSEARCH_STATS_SEARCH_CACHE_HITS,
+    FSEARCH_STATS_SEARCH_INDEX_HITS,
+    FSEARCH_STATS_SEARCH_JOINED,
+    NUM_FSEARCH_STATS_COUNTERS,
+} FsearchStatsCounter;
+
+// values which are replaced rather than accumulated
+typedef enum {
+    FSEARCH_STATS_DB_ENTRIES,
+    FSEARCH_STATS_DB_NODE_BYTES,
+    NUM_FSEARCH_STATS_GAUGES,
+} FsearchStatsGauge;
+
+typedef enum {
+    FSEARCH_STATS_TIME_SCAN,
+    FSEARCH_STATS_TIME_LOAD,
+    FSEARCH_STATS_TIME_SEARCH,
+    FSEARCH_STATS_TIME_SEARCH_PREPARE,
+    FSEARCH_STATS_TIME_SEARCH_MATCH,
+    FSEARCH_STATS_TIME_SEARCH_MERGE,
+    FSEARCH_STATS_TIME_LIST_SORT,
+    NUM_FSEARCH_STATS_TIMERS,
+} FsearchStatsTimer;
+
+// busy time is kept for this many pool threads, the rest share the last slot
+#define FSEARCH_STATS_MAX_THREADS 64
+
+extern volatile gint fsearch_stats_enabled;
+
+static inline bool
+fsearch_stats_is_enabled(void) {
+    return fsearch_stats_enabled;
+}
+
+void
+fsearch_stats_set_enabled(bool enabled);
+
+void
+fsearch_stats_reset(void);
+
+void
+fsearch_stats_add(FsearchStatsCounter counter, uint64_t value);
+
+void
+fsearch_stats_set(FsearchStatsGauge gauge, uint64_t value);
+
+// Start of a timed section, 0 while statistics are disabled
+gint64
+fsearch_stats_now(void);
+
+// Records the time since start, which came from fsearch_stats_now. Returns the current time,
+// so consecutive phases can be timed with one call each.
+gint64
+fsearch_stats_record(FsearchStatsTimer timer, gint64 start);
+
+// Adds to the busy time of a pool thread, start came from fsearch_stats_now
+void
+fsearch_stats_record_thread_busy(uint32_t thread_index, gint64 start);
+
+// Duration of the last section in ms, or a negative value if none was timed
+double
+fsearch_stats_get_last_ms(FsearchStatsTimer timer);
+
+// Everything recorded so far as human readable text, free with g_free
+char *
+fsearch_stats_dump(void);
@@ -16,229 +16,381 @@
    along with this program; if not, see <http://www.gnu.org/licenses/>.
    */
 
+#include <assert.h>
 #include <stdio.h>
 
 #include "debug.h"
+#include "fsearch_stats.h"
 #include "fsearch_thread_pool.h"
 
-struct _FsearchThreadPool {
-    GList *threads;
-    uint32_t num_threads;
-};
+#define FSEARCH_THREAD_POOL_INITIAL_DEQUE_SIZE 64
+
+typedef struct {
+    FsearchTaskFunc func;
+    gpointer data;
+    FsearchTaskGroup *group;
+} FsearchTask;
 
-typedef struct thread_context_s {
+typedef struct {
+    FsearchThreadPool *pool;
     GThread *thread;
-    gpointer (*thread_func)(gpointer thread_data);
+    uint32_t index;
 
-    gpointer *thread_data;
+    // ring buffer, the worker pushes and pops at the back, thieves take from the front
+    GMutex mutex;
+    FsearchTask *tasks;
+    uint32_t capacity;
+    uint32_t head;
+    uint32_t len;
+} FsearchWorker;
 
+struct _FsearchThreadPool {
+    FsearchWorker *workers;
+    uint32_t num_threads;
+
+    // where the next task from outside the pool goes
+    volatile gint next_worker;
+
+    // idle workers sleep on cond until something gets queued
     GMutex mutex;
-    GCond start_cond;
-    GCond finished_cond;
-    FsearchThreadStatus status;
+    GCond cond;
+    volatile gint num_queued;
     bool terminate;
-} thread_context_t;
+};
 
-static bool
-thread_pool_has_thread(FsearchThreadPool *pool, GList *thread) {
-    GList *temp = pool->threads;
-    while (temp) {
-        if (temp == thread) {
-            return true;
+struct _FsearchTaskGroup {
+    FsearchThreadPool *pool;
+    volatile gint num_pending;
+    GMutex mutex;
+    GCond cond;
+};
+
+static GPrivate current_worker;
+static gsize default_pool = 0;
+
+static FsearchWorker *
+thread_pool_get_current_worker(FsearchThreadPool *pool) {
+    FsearchWorker *worker = g_private_get(&current_worker);
+    return worker && worker->pool == pool ? worker : NULL;
+}
+
+static void
+worker_push_back(FsearchWorker *worker, const FsearchTask *task) {
+    g_mutex_lock(&worker->mutex);
+    if (worker->len == worker->capacity) {
+        const uint32_t capacity = worker->capacity * 2;
+        FsearchTask *tasks = g_new(FsearchTask, capacity);
+        for (uint32_t i = 0; i < worker->len; i++) {
+            tasks[i] = worker->tasks[(worker->head + i) % worker->capacity];
         }
-        temp = temp->next;
+        g_free(worker->tasks);
+        worker->tasks = tasks;
+        worker->capacity = capacity;
+        worker->head = 0;
     }
-    return false;
+    worker->tasks[(worker->head + worker->len) % worker->capacity] = *task;
+    worker->len++;
+    g_mutex_unlock(&worker->mutex);
 }
 
-static gpointer
-fsearch_thread_pool_thread(gpointer user_data) {
-    thread_context_t *ctx = user_data;
-
-    g_mutex_lock(&ctx->mutex);
-    while (!ctx->terminate) {
-        g_cond_wait(&ctx->start_cond, &ctx->mutex);
-        ctx->status = THREAD_BUSY;
-        if (ctx->thread_data) {
-            ctx->thread_func(ctx->thread_data);
-            ctx->status = THREAD_FINISHED;
-            ctx->thread_data = NULL;
-            g_cond_signal(&ctx->finished_cond);
+static bool
+worker_pop_back(FsearchWorker *worker, FsearchTask *task) {
+    bool res = false;
+    g_mutex_lock(&worker->mutex);
+    if (worker->len > 0) {
+        worker->len--;
+        *task = worker->tasks[(worker->head + worker->len) % worker->capacity];
+        res = true;
+    }
+    g_mutex_unlock(&worker->mutex);
+    return res;
+}
+
+static bool
+worker_pop_front(FsearchWorker *worker, FsearchTask *task) {
+    bool res = false;
+    g_mutex_lock(&worker->mutex);
+    if (worker->len > 0) {
+        *task = worker->tasks[worker->head];
+        worker->head = (worker->head + 1) % worker->capacity;
+        worker->len--;
+        res = true;
+    }
+    g_mutex_unlock(&worker->mutex);
+    return res;
+}
+
+static bool
+thread_pool_take_task(FsearchThreadPool *pool, FsearchWorker *self, FsearchTask *task) {
+    bool res = false;
+    uint32_t first_victim = 0;
+    if (self) {
+        res = worker_pop_back(self, task);
+        first_victim = self->index + 1;
+    }
+    // the oldest tasks of the others are usually the largest ones
+    for (uint32_t i = 0; !res && i < pool->num_threads; i++) {
+        FsearchWorker *victim = &pool->workers[(first_victim + i) % pool->num_threads];
+        if (victim != self) {
+            res = worker_pop_front(victim, task);
         }
-        ctx->status = THREAD_IDLE;
     }
-    g_mutex_unlock(&ctx->mutex);
-    return NULL;
+    if (res) {
+        g_atomic_int_add(&pool->num_queued, -1);
+    }
+    return res;
 }
 
 static void
-thread_context_free(thread_context_t *ctx) {
-    if (!ctx) {
-        return;
+task_group_task_finished(FsearchTaskGroup *group) {
+    // the group may be freed as soon as its mutex is released
+    FsearchThreadPool *pool = group->pool;
+
+    // decremented under the lock, a waiter which sees no pending tasks may free the group right away
+    g_mutex_lock(&group->mutex);
+    const bool finished = g_atomic_int_dec_and_test(&group->num_pending);
+    if (finished) {
+        g_cond_broadcast(&group->cond);
     }
+    g_mutex_unlock(&group->mutex);
 
-    g_mutex_lock(&ctx->mutex);
-    if (ctx->thread_data) {
-        trace("[thread_pool] search data still there\n");
+    if (finished) {
+        // workers wait for their groups on the pool's condition, see fsearch_task_group_wait
+        g_mutex_lock(&pool->mutex);
+        g_cond_broadcast(&pool->cond);
+        g_mutex_unlock(&pool->mutex);
     }
+}
 
-    // terminate thread
-    ctx->terminate = true;
-    g_cond_signal(&ctx->start_cond);
-    g_mutex_unlock(&ctx->mutex);
-    g_thread_join(ctx->thread);
-
-    g_mutex_clear(&ctx->mutex);
-    g_cond_clear(&ctx->start_cond);
-    g_cond_clear(&ctx->finished_cond);
-    g_free(ctx);
-    ctx = NULL;
+static void
+thread_pool_run(FsearchTask *task) {
+    task->func(task->data);
+    task_group_task_finished(task->group);
 }
 
-static thread_context_t *
-thread_context_new(void) {
-    thread_context_t *ctx = g_new0(thread_context_t, 1);
-    if (!ctx) {
-        return NULL;
+static void
+thread_pool_push(FsearchThreadPool *pool, const FsearchTask *task) {
+    FsearchWorker *worker = thread_pool_get_current_worker(pool);
+    if (!worker) {
+        const guint next = (guint)g_atomic_int_add(&pool->next_worker, 1);
+        worker = &pool->workers[next % pool->num_threads];
     }
-    ctx->thread_data = NULL;
-    ctx->thread_func = NULL;
-    ctx->terminate = false;
-    ctx->status = THREAD_IDLE;
-    g_mutex_init(&ctx->mutex);
-    g_cond_init(&ctx->start_cond);
-    g_cond_init(&ctx->finished_cond);
+    worker_push_back(worker, task);
 
-    ctx->thread = g_thread_new("thread pool", fsearch_thread_pool_thread, ctx);
-    return ctx;
+    g_mutex_lock(&pool->mutex);
+    g_atomic_int_inc(&pool->num_queued);
+    g_cond_signal(&pool->cond);
+    g_mutex_unlock(&pool->mutex);
+}
+
+static gpointer
+fsearch_thread_pool_thread(gpointer user_data) {
+    FsearchWorker *self = user_data;
+    FsearchThreadPool *pool = self->pool;
+    g_private_set(&current_worker, self);
+
+    while (true) {
+        // tasks which run while another one waits for its group count towards that one
+        FsearchTask task = {0};
+        if (thread_pool_take_task(pool, self, &task)) {
+            const gint64 stats_start = fsearch_stats_now();
+            thread_pool_run(&task);
+            fsearch_stats_record_thread_busy(self->index, stats_start);
+            continue;
+        }
+        g_mutex_lock(&pool->mutex);
+        while (!pool->terminate && g_atomic_int_get(&pool->num_queued) == 0) {
+            g_cond_wait(&pool->cond, &pool->mutex);
+        }
+        const bool terminate = pool->terminate && g_atomic_int_get(&pool->num_queued) == 0;
+        g_mutex_unlock(&pool->mutex);
+        if (terminate) {
+            break;
+        }
+    }
+    return NULL;
 }
 
 FsearchThreadPool *
 fsearch_thread_pool_init(void) {
     FsearchThreadPool *pool = g_new0(FsearchThreadPool, 1);
-    pool->threads = NULL;
-    pool->num_threads = 0;
-
-    uint32_t num_cpus = g_get_num_processors();
-    for (uint32_t i = 0; i < num_cpus; i++) {
-        thread_context_t *ctx = thread_context_new();
-        if (ctx) {
-            pool->threads = g_list_prepend(pool->threads, ctx);
-            pool->num_threads++;
-        }
+    g_mutex_init(&pool->mutex);
+    g_cond_init(&pool->cond);
+
+    pool->num_threads = MAX(1, g_get_num_processors());
+    pool->workers = g_new0(FsearchWorker, pool->num_threads);
+    for (uint32_t i = 0; i < pool->num_threads; i++) {
+        FsearchWorker *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->index = i;
+        worker->capacity = FSEARCH_THREAD_POOL_INITIAL_DEQUE_SIZE;
+        worker->tasks = g_new(FsearchTask, worker->capacity);
+        g_mutex_init(&worker->mutex);
+    }
+    // all deques have to exist before the first worker starts stealing
+    for (uint32_t i = 0; i < pool->num_threads; i++) {
+        pool->workers[i].thread = g_thread_new("thread pool", fsearch_thread_pool_thread, &pool->workers[i]);
     }
 
     return pool;
 }
 
+FsearchThreadPool *
+fsearch_thread_pool_get_default(void) {
+    if (g_once_init_enter(&default_pool)) {
+        g_once_init_leave(&default_pool, (gsize)fsearch_thread_pool_init());
+    }
+    return (FsearchThreadPool *)default_pool;
+}
+
 void
 fsearch_thread_pool_free(FsearchThreadPool *pool) {
     if (!pool) {
         return;
     }
-    GList *thread = pool->threads;
-    for (uint32_t i = 0; thread && i < pool->num_threads; i++) {
-        thread_context_t *ctx = thread->data;
-        thread_context_free(ctx);
-        thread = thread->next;
+    assert((gsize)pool != default_pool);
+
+    g_mutex_lock(&pool->mutex);
+    if (g_atomic_int_get(&pool->num_queued) > 0) {
+        trace("[thread_pool] tasks still queued\n");
+    }
+    pool->terminate = true;
+    g_cond_broadcast(&pool->cond);
+    g_mutex_unlock(&pool->mutex);
+
+    for (uint32_t i = 0; i < pool->num_threads; i++) {
+        FsearchWorker *worker = &pool->workers[i];
+        g_thread_join(worker->thread);
+        g_mutex_clear(&worker->mutex);
+        g_free(worker->tasks);
     }
-    pool->num_threads = 0;
+    g_free(pool->workers);
+    g_mutex_clear(&pool->mutex);
+    g_cond_clear(&pool->cond);
     g_free(pool);
     pool = NULL;
 }
 
-GList *
-fsearch_thread_pool_get_threads(FsearchThreadPool *pool) {
+uint32_t
+fsearch_thread_pool_get_num_threads(FsearchThreadPool *pool) {
     if (!pool) {
-        return NULL;
+        return 0;
     }
-    return pool->threads;
+    return pool->num_threads;
 }
 
-gpointer
-fsearch_thread_pool_get_data(FsearchThreadPool *pool, GList *thread) {
-    if (!pool || !thread) {
-        return NULL;
-    }
-    if (!thread_pool_has_thread(pool, thread)) {
-        return NULL;
-    }
-    thread_context_t *ctx = thread->data;
-    if (!ctx) {
-        return NULL;
-    }
-    return ctx->thread_data;
+uint32_t
+fsearch_thread_pool_get_thread_index(FsearchThreadPool *pool) {
+    assert(pool != NULL);
+    FsearchWorker *worker = thread_pool_get_current_worker(pool);
+    return worker ? worker->index : pool->num_threads;
 }
 
-bool
-fsearch_thread_pool_task_is_idle(FsearchThreadPool *pool, GList *thread) {
-    bool res = false;
-    if (!thread_pool_has_thread(pool, thread)) {
-        return res;
-    }
-    thread_context_t *ctx = thread->data;
-    if (!ctx) {
-        return res;
-    }
+FsearchTaskGroup *
+fsearch_task_group_new(FsearchThreadPool *pool) {
+    assert(pool != NULL);
+    FsearchTaskGroup *group = g_new0(FsearchTaskGroup, 1);
+    group->pool = pool;
+    g_mutex_init(&group->mutex);
+    g_cond_init(&group->cond);
+    return group;
+}
 
-    res = ctx->status == THREAD_IDLE ? true : false;
+void
+fsearch_task_group_free(FsearchTaskGroup *group) {
+    if (!group) {
+        return;
+    }
+    fsearch_task_group_wait(group);
+    g_mutex_clear(&group->mutex);
+    g_cond_clear(&group->cond);
+    g_free(group);
+    group = NULL;
+}
 
-    return res;
+void
+fsearch_task_group_push(FsearchTaskGroup *group, FsearchTaskFunc func, gpointer data) {
+    assert(group != NULL);
+    assert(func != NULL);
+    g_atomic_int_inc(&group->num_pending);
+    const FsearchTask task = {.func = func, .data = data, .group = group};
+    thread_pool_push(group->pool, &task);
 }
 
-bool
-fsearch_thread_pool_task_is_busy(FsearchThreadPool *pool, GList *thread) {
-    bool res = false;
-    if (!thread_pool_has_thread(pool, thread)) {
-        return res;
+void
+fsearch_task_group_wait(FsearchTaskGroup *group) {
+    assert(group != NULL);
+    FsearchThreadPool *pool = group->pool;
+    FsearchWorker *self = thread_pool_get_current_worker(pool);
+    if (self) {
+        // blocking here could leave no worker to run the tasks this one waits for, so this helps with
+        // whatever is queued. Once nothing is, the remaining tasks of group are running elsewhere and
+        // it sleeps until they're done or new tasks show up.
+        while (g_atomic_int_get(&group->num_pending) > 0) {
+            FsearchTask task = {0};
+            if (thread_pool_take_task(pool, self, &task)) {
+                thread_pool_run(&task);
+                continue;
+            }
+            g_mutex_lock(&pool->mutex);
+            while (g_atomic_int_get(&group->num_pending) > 0 && g_atomic_int_get(&pool->num_queued) == 0) {
+                g_cond_wait(&pool->cond, &pool->mutex);
+            }
+            g_mutex_unlock(&pool->mutex);
+        }
     }
-    thread_context_t *ctx = thread->data;
-    if (!ctx) {
-        return res;
+    // also waits for the last task to let go of the group's mutex
+    g_mutex_lock(&group->mutex);
+    while (g_atomic_int_get(&group->num_pending) > 0) {
+        g_cond_wait(&group->cond, &group->mutex);
     }
+    g_mutex_unlock(&group->mutex);
+}
 
-    res = ctx->status == THREAD_BUSY ? true : false;
+typedef struct {
+    FsearchParallelForFunc func;
+    gpointer data;
+    uint32_t start;
+    uint32_t end;
+} FsearchParallelForChunk;
 
-    return res;
+static void
+thread_pool_parallel_for_chunk(gpointer data) {
+    FsearchParallelForChunk *chunk = data;
+    chunk->func(chunk->start, chunk->end, chunk->data);
 }
 
-bool
-fsearch_thread_pool_wait_for_thread(FsearchThreadPool *pool, GList *thread) {
-    thread_context_t *ctx = thread->data;
-    g_mutex_lock(&ctx->mutex);
-    while (fsearch_thread_pool_task_is_busy(pool, thread)) {
-        trace("[thread_pool] busy, waiting...\n");
-        g_cond_wait(&ctx->finished_cond, &ctx->mutex);
-        trace("[thread_pool] continue...\n");
+void
+fsearch_thread_pool_parallel_for(FsearchThreadPool *pool,
+                                 uint32_t num_items,
+                                 uint32_t min_chunk_size,
+                                 FsearchParallelForFunc func,
+                                 gpointer data) {
+    assert(func != NULL);
+    if (num_items == 0) {
+        return;
     }
-    g_mutex_unlock(&ctx->mutex);
-    return true;
-}
-
-uint32_t
-fsearch_thread_pool_get_num_threads(FsearchThreadPool *pool) {
-    if (!pool) {
-        return 0;
+    const uint32_t max_chunks = num_items / MAX(1, min_chunk_size);
+    const uint32_t num_chunks = MAX(1, MIN(fsearch_thread_pool_get_num_threads(pool), max_chunks));
+    if (num_chunks == 1) {
+        func(0, num_items, data);
+        return;
     }
-    return pool->num_threads;
-}
 
-bool
-fsearch_thread_pool_push_data(FsearchThreadPool *pool, GList *thread, ThreadFunc thread_func, gpointer thread_data) {
-    if (!pool || !thread || !thread_func || !thread_data) {
-        return false;
+    FsearchParallelForChunk *chunks = g_new(FsearchParallelForChunk, num_chunks);
+    for (uint32_t i = 0; i < num_chunks; i++) {
+        chunks[i] = (FsearchParallelForChunk){
+            .func = func,
+            .data = data,
+            .start = (uint64_t)num_items * i / num_chunks,
+            .end = (uint64_t)num_items * (i + 1) / num_chunks,
+        };
     }
-    if (!thread_pool_has_thread(pool, thread)) {
-        return false;
+    FsearchTaskGroup *group = fsearch_task_group_new(pool);
+    for (uint32_t i = 1; i < num_chunks; i++) {
+        fsearch_task_group_push(group, thread_pool_parallel_for_chunk, &chunks[i]);
     }
-    thread_context_t *ctx = thread->data;
-    g_mutex_lock(&ctx->mutex);
-    ctx->thread_func = thread_func;
-    ctx->thread_data = thread_data;
-    ctx->status = THREAD_BUSY;
-
-    g_cond_signal(&ctx->start_cond);
-    g_mutex_unlock(&ctx->mutex);
-    return true;
+    thread_pool_parallel_for_chunk(&chunks[0]);
+    fsearch_task_group_free(group);
+    g_free(chunks);
 }
-
@@ -22,37 +22,62 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+// A work-stealing task scheduler. Every worker thread has its own deque of
+// tasks: it runs the newest task it pushed itself first and, once its deque
+// is empty, steals the oldest task of another worker. Tasks pushed from
+// outside the pool are spread over the workers.
 typedef struct _FsearchThreadPool FsearchThreadPool;
-typedef GThreadFunc ThreadFunc;
 
-typedef enum _FsearchThreadStatus { THREAD_IDLE, THREAD_BUSY, THREAD_FINISHED } FsearchThreadStatus;
+// A set of tasks which can be waited for as a whole, it's the future of the
+// work that has been pushed to it.
+typedef struct _FsearchTaskGroup FsearchTaskGroup;
+
+typedef void (*FsearchTaskFunc)(gpointer data);
+
+// Handles the items [start, end) of a parallel for.
+typedef void (*FsearchParallelForFunc)(uint32_t start, uint32_t end, gpointer data);
 
 FsearchThreadPool *
 fsearch_thread_pool_init(void);
 
+// The pool shared by everything in this process, with one worker per CPU.
+// It's never freed.
+FsearchThreadPool *
+fsearch_thread_pool_get_default(void);
+
 void
 fsearch_thread_pool_free(FsearchThreadPool *pool);
 
-GList *
-fsearch_thread_pool_get_threads(FsearchThreadPool *pool);
-
 uint32_t
 fsearch_thread_pool_get_num_threads(FsearchThreadPool *pool);
 
-bool
-fsearch_thread_pool_push_data(FsearchThreadPool *pool, GList *thread, ThreadFunc thread_func, gpointer thread_data);
+// Index of the worker of pool which calls this, in [0, num_threads), or
+// num_threads for any other thread.
+uint32_t
+fsearch_thread_pool_get_thread_index(FsearchThreadPool *pool);
 
-bool
-fsearch_thread_pool_wait_for_thread(FsearchThreadPool *pool, GList *thread);
+// Splits [0, num_items) into at most one chunk per worker with no less than
+// min_chunk_size items each and returns once all of them are handled.
+// The calling thread takes the first chunk, without a pool it handles all of them.
+void
+fsearch_thread_pool_parallel_for(FsearchThreadPool *pool,
+                                 uint32_t num_items,
+                                 uint32_t min_chunk_size,
+                                 FsearchParallelForFunc func,
+                                 gpointer data);
 
-bool
-fsearch_thread_pool_task_is_busy(FsearchThreadPool *pool, GList *thread);
+FsearchTaskGroup *
+fsearch_task_group_new(FsearchThreadPool *pool);
 
-bool
-fsearch_thread_pool_task_is_idle(FsearchThreadPool *pool, GList *thread);
+// Waits for the tasks which are still pending.
+void
+fsearch_task_group_free(FsearchTaskGroup *group);
 
-gpointer
-fsearch_thread_pool_get_data(FsearchThreadPool *pool, GList *thread);
+void
+fsearch_task_group_push(FsearchTaskGroup *group, FsearchTaskFunc func, gpointer data);
 
-bool
-fsearch_thread_pool_set_task_finished(FsearchThreadPool *pool, GList *thread);
+// Returns once every task pushed so far has finished. Tasks may push more
+// tasks to their own group and wait for other groups, a worker runs queued
+// tasks while it waits.
+void
+fsearch_task_group_wait(FsearchTaskGroup *group);
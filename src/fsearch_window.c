@@ -26,6 +26,7 @@
 #include "debug.h"
 #include "fsearch_config.h"
 #include "fsearch_limits.h"
+#include "fsearch_stats.h"
 #include "fsearch_window.h"
 #include "fsearch_window_actions.h"
 #include "list_model.h"
@@ -36,6 +37,13 @@
 #include "utils.h"
 #include <glib/gi18n.h>
 
+// Search as you type: a search which takes longer than that on average only starts once
+// typing paused for about as long as it takes, but never waits longer than max
+#define FSEARCH_WINDOW_SEARCH_DEBOUNCE_MIN_MS 15
+#define FSEARCH_WINDOW_SEARCH_DEBOUNCE_MAX_MS 250
+// how much the latest search time counts for the average, in percent
+#define FSEARCH_WINDOW_SEARCH_LATENCY_WEIGHT 30
+
 struct _FsearchApplicationWindow {
     GtkApplicationWindow parent_instance;
     DatabaseSearch *search;
@@ -96,12 +104,23 @@ struct _FsearchApplicationWindow {
 
     guint statusbar_timeout_id;
 
+    // the search for what is typed in, once typing paused for long enough
+    guint search_timeout_id;
+    // a search which will be done soon is let finish, the text typed meanwhile is searched right after
+    bool search_deferred;
+    // when the last search was queued, and what the searches took on average until their results were in
+    gint64 search_start_time;
+    double search_latency_ms;
+
     GMutex mutex;
 };
 
 static gboolean
 perform_search(FsearchApplicationWindow *win);
 
+static void
+search_remove_delayed_cb(FsearchApplicationWindow *win);
+
 static void
 init_statusbar(FsearchApplicationWindow *self) {
     g_assert(FSEARCH_WINDOW_IS_WINDOW(self));
@@ -317,7 +336,7 @@ fsearch_application_window_constructed(GObject *object) {
 
     self->num_searches_active = 0;
     self->search = NULL;
-    self->search = db_search_new(fsearch_application_get_thread_pool(FSEARCH_APPLICATION_DEFAULT));
+    self->search = db_search_new(fsearch_application_get_search_service(FSEARCH_APPLICATION_DEFAULT));
     g_mutex_init(&self->mutex);
     fsearch_window_apply_config(self);
 
@@ -331,6 +350,7 @@ fsearch_application_window_finalize(GObject *object) {
     FsearchApplicationWindow *self = (FsearchApplicationWindow *)object;
     g_assert(FSEARCH_WINDOW_IS_WINDOW(self));
 
+    search_remove_delayed_cb(self);
     if (self->search) {
         db_search_free(self->search);
         self->search = NULL;
@@ -409,6 +429,22 @@ statusbar_update_delayed(FsearchApplicationWindow *win, const char *text) {
     win->statusbar_timeout_id = g_timeout_add(200, statusbar_set_query_status, win);
 }
 
+static void
+perform_deferred_search(FsearchApplicationWindow *win) {
+    if (win->num_searches_active == 0 && win->search_deferred) {
+        win->search_deferred = false;
+        perform_search(win);
+    }
+}
+
+static void
+search_remove_delayed_cb(FsearchApplicationWindow *win) {
+    if (win->search_timeout_id) {
+        g_source_remove(win->search_timeout_id);
+        win->search_timeout_id = 0;
+    }
+}
+
 static gboolean
 search_cancelled_cb(gpointer user_data) {
     FsearchApplicationWindow *win = user_data;
@@ -416,6 +452,89 @@ search_cancelled_cb(gpointer user_data) {
         return FALSE;
     }
     win->num_searches_active--;
+    perform_deferred_search(win);
+    return FALSE;
+}
+
+static void
+update_query_highlight(FsearchApplicationWindow *win, FsearchConfig *config, const char *text) {
+    if (win->query_highlight) {
+        fsearch_query_highlight_free(win->query_highlight);
+        win->query_highlight = NULL;
+    }
+    FsearchQueryFlags flags = {.enable_regex = config->enable_regex,
+                               .enable_fuzzy = config->enable_fuzzy,
+                               .enable_ranking = config->enable_ranking,
+                               .match_case = config->match_case,
+                               .auto_match_case = config->auto_match_case,
+                               .search_in_path = config->search_in_path,
+                               .auto_search_in_path = config->auto_search_in_path};
+    win->query_highlight = fsearch_query_highlight_new(text, flags);
+}
+
+// the first rows of a streamed result are already shown, so the rest is just appended
+static bool
+append_streamed_results(FsearchApplicationWindow *win, DatabaseSearchResult *result) {
+    GArray *shown = win->search->results;
+    if (!shown || win->list_model->results != shown) {
+        return false;
+    }
+    if (result->results) {
+        list_model_append_results(win->list_model, result->results);
+        g_array_free(result->results, TRUE);
+        result->results = NULL;
+    }
+    win->search->num_folders = result->num_folders;
+    win->search->num_files = result->num_files;
+    return true;
+}
+
+static gboolean
+update_model_partial_cb(gpointer user_data) {
+    DatabaseSearchResult *result = user_data;
+    FsearchApplicationWindow *win = result->cb_data;
+    FsearchApplication *app = FSEARCH_APPLICATION_DEFAULT;
+    FsearchConfig *config = fsearch_application_get_config(app);
+    FsearchDatabase *db = fsearch_application_get_db(app);
+
+    bool shown = false;
+    if (db == result->db) {
+        if (result->num_streamed == 0) {
+            // the first matches of a new search replace the old results
+            remove_model_from_list(win);
+            db_search_results_clear(win->search);
+            list_model_set_results(win->list_model, result->db, result->results);
+            win->search->results = result->results;
+            win->search->num_folders = result->num_folders;
+            win->search->num_files = result->num_files;
+            result->results = NULL;
+            update_query_highlight(win, config, gtk_entry_get_text(GTK_ENTRY(win->search_entry)));
+            apply_model_to_list(win);
+            hide_overlays(win);
+            shown = true;
+        }
+        else {
+            shown = append_streamed_results(win, result);
+        }
+    }
+    if (shown) {
+        gchar sb_text[100] = "";
+        snprintf(sb_text, sizeof(sb_text), _("%'d Items"), win->search->results->len);
+        statusbar_update(win, sb_text);
+    }
+
+    if (result->results) {
+        g_array_free(result->results, TRUE);
+        result->results = NULL;
+    }
+    if (db) {
+        db_unref(db);
+    }
+    if (result->db) {
+        db_unref(result->db);
+    }
+    free(result);
+    result = NULL;
     return FALSE;
 }
 
@@ -428,43 +547,67 @@ update_model_cb(gpointer user_data) {
     FsearchDatabase *db = fsearch_application_get_db(app);
 
     win->num_searches_active--;
-    remove_model_from_list(win);
-    db_search_results_clear(win->search);
+    if (win->num_searches_active == 0) {
+        // the result of the last search, the others were cancelled or answered along with it
+        const double latency_ms = (double)(g_get_monotonic_time() - win->search_start_time) / G_TIME_SPAN_MILLISECOND;
+        win->search_latency_ms = (win->search_latency_ms * (100 - FSEARCH_WINDOW_SEARCH_LATENCY_WEIGHT)
+                                  + latency_ms * FSEARCH_WINDOW_SEARCH_LATENCY_WEIGHT)
+                               / 100;
+    }
 
     const gchar *text = gtk_entry_get_text(GTK_ENTRY(win->search_entry));
     uint32_t num_results = 0;
-    if (db == result->db) {
-        GPtrArray *results = result->results;
-        if (results && results->len > 0) {
-            list_model_set_results(win->list_model, results);
-            win->search->results = results;
-            win->search->num_folders = result->num_folders;
-            win->search->num_files = result->num_files;
-            num_results = results->len;
+    if (db == result->db && result->num_streamed > 0 && append_streamed_results(win, result)) {
+        num_results = win->search->results->len;
+        if (list_model_needs_sort(win->list_model)) {
+            // the rows were streamed in database order
+            remove_model_from_list(win);
             list_model_update_sort(win->list_model);
-            if (win->query_highlight) {
-                fsearch_query_highlight_free(win->query_highlight);
-                win->query_highlight = NULL;
+            apply_model_to_list(win);
+        }
+    }
+    else {
+        remove_model_from_list(win);
+        db_search_results_clear(win->search);
+
+        if (db == result->db) {
+            // if rows were streamed they are gone, the rest is shown on its own
+            GArray *results = result->results;
+            if (results && results->len > 0) {
+                list_model_set_results(win->list_model, result->db, results);
+                win->search->results = results;
+                win->search->num_folders = result->num_folders;
+                win->search->num_files = result->num_files;
+                num_results = results->len;
+                if (!result->is_ranked) {
+                    // the best matches stay on top, until another column is picked to sort by
+                    list_model_update_sort(win->list_model);
+                }
+                update_query_highlight(win, config, text);
+            }
+            else {
+                list_model_set_results(win->list_model, NULL, NULL);
+                win->search->results = NULL;
+                win->search->num_folders = 0;
+                win->search->num_files = 0;
+                num_results = 0;
             }
-            FsearchQueryFlags flags = {.enable_regex = config->enable_regex,
-                                       .match_case = config->match_case,
-                                       .auto_match_case = config->auto_match_case,
-                                       .search_in_path = config->search_in_path,
-                                       .auto_search_in_path = config->auto_search_in_path};
-            win->query_highlight = fsearch_query_highlight_new(text, flags);
         }
-        else {
-            list_model_set_results(win->list_model, NULL);
-            win->search->results = NULL;
-            win->search->num_folders = 0;
-            win->search->num_files = 0;
-            num_results = 0;
+        else if (result->results) {
+            g_array_free(result->results, TRUE);
+            result->results = NULL;
         }
-    }
 
-    apply_model_to_list(win);
+        apply_model_to_list(win);
+    }
     gchar sb_text[100] = "";
-    snprintf(sb_text, sizeof(sb_text), _("%'d Items"), num_results);
+    const double search_ms = fsearch_stats_get_last_ms(FSEARCH_STATS_TIME_SEARCH);
+    if (fsearch_stats_is_enabled() && search_ms >= 0) {
+        snprintf(sb_text, sizeof(sb_text), _("%'d Items (%.1f ms)"), num_results, search_ms);
+    }
+    else {
+        snprintf(sb_text, sizeof(sb_text), _("%'d Items"), num_results);
+    }
     statusbar_update(win, sb_text);
 
     if (text[0] == '\0' && config->hide_results_on_empty_search) {
@@ -485,6 +628,8 @@ update_model_cb(gpointer user_data) {
     }
     free(result);
     result = NULL;
+
+    perform_deferred_search(win);
     return FALSE;
 }
 
@@ -498,6 +643,11 @@ fsearch_application_window_update_results(void *data) {
     g_idle_add(update_model_cb, data);
 }
 
+void
+fsearch_application_window_update_results_partial(void *data) {
+    g_idle_add(update_model_partial_cb, data);
+}
+
 static gboolean
 perform_search(FsearchApplicationWindow *win) {
     g_assert(FSEARCH_WINDOW_IS_WINDOW(win));
@@ -520,20 +670,22 @@ perform_search(FsearchApplicationWindow *win) {
         fsearch_application_state_unlock(app);
         return FALSE;
     }
-    if (!db_try_lock(db)) {
-        trace("[search] database locked\n");
-        db_unref(db);
-        fsearch_application_state_unlock(app);
-        return FALSE;
-    }
-
+    // searches don't have to wait for a rescan or a monitor update: both build a new database,
+    // the monitor's copies the changed locations (see db_new_with_changed_folders), so the entries
+    // of this one stay as they are. What it loads later on (metadata of nodes without any) is
+    // kept next to them. The reference keeps it alive until the query is done.
     win->num_searches_active++;
+    win->search_start_time = g_get_monotonic_time();
+    win->search_deferred = false;
+    search_remove_delayed_cb(win);
 
     const gchar *text = gtk_entry_get_text(GTK_ENTRY(win->search_entry));
     trace("[search] %s\n", text);
     uint32_t max_results = config->limit_results ? config->num_results : 0;
 
     FsearchQueryFlags flags = {.enable_regex = config->enable_regex,
+                               .enable_fuzzy = config->enable_fuzzy,
+                               .enable_ranking = config->enable_ranking,
                                .match_case = config->match_case,
                                .auto_match_case = config->auto_match_case,
                                .search_in_path = config->search_in_path,
@@ -547,13 +699,13 @@ perform_search(FsearchApplicationWindow *win) {
                                         filter,
                                         fsearch_application_window_update_results,
                                         win,
+                                        fsearch_application_window_update_results_partial,
                                         fsearch_application_window_search_cancelled,
                                         win,
                                         max_results,
                                         flags,
                                         !config->hide_results_on_empty_search);
 
-    db_unlock(db);
     statusbar_update_delayed(win, _("Querying…"));
     db_search_queue(win->search, q);
 
@@ -581,9 +733,8 @@ typedef struct _count_results_ctx {
 static void
 count_results_cb(GtkTreeModel *model, GtkTreePath *path, GtkTreeIter *iter, gpointer data) {
     count_results_ctx *ctx = (count_results_ctx *)data;
-    DatabaseSearchEntry *entry = (DatabaseSearchEntry *)iter->user_data;
-    if (entry) {
-        BTreeNode *node = db_search_entry_get_node(entry);
+    BTreeNode *node = (BTreeNode *)iter->user_data;
+    if (node) {
         if (node->is_dir) {
             ctx->num_folders++;
         }
@@ -709,8 +860,8 @@ on_listview_row_activated(GtkTreeView *tree_view, GtkTreePath *path, GtkTreeView
     if (!gtk_tree_model_get_iter(model, &iter, path)) {
         return;
     }
-    DatabaseSearchEntry *entry = (DatabaseSearchEntry *)iter.user_data;
-    if (!entry) {
+    BTreeNode *node = (BTreeNode *)iter.user_data;
+    if (!node) {
         return;
     }
 
@@ -720,8 +871,6 @@ on_listview_row_activated(GtkTreeView *tree_view, GtkTreePath *path, GtkTreeView
         launch_folder = true;
     }
 
-    BTreeNode *node = db_search_entry_get_node(entry);
-
     if (!launch_folder ? launch_node(node) : launch_node_path(node, config->folder_open_cmd)) {
         // open succeeded
         fsearch_window_action_after_file_open(true);
@@ -776,6 +925,25 @@ on_listview_selection_changed(GtkTreeSelection *sel, gpointer user_data) {
     }
 }
 
+static void
+on_listview_scrolled(GtkAdjustment *adjustment, gpointer user_data) {
+    FsearchApplicationWindow *self = (FsearchApplicationWindow *)user_data;
+    g_assert(FSEARCH_WINDOW_IS_WINDOW(self));
+
+    // icons and types of rows which were scrolled past aren't looked up anymore
+    GtkTreePath *start_path = NULL;
+    GtkTreePath *end_path = NULL;
+    if (!gtk_tree_view_get_visible_range(GTK_TREE_VIEW(self->listview), &start_path, &end_path)) {
+        list_model_set_visible_rows(self->list_model, -1, -1);
+        return;
+    }
+    list_model_set_visible_rows(self->list_model,
+                                gtk_tree_path_get_indices(start_path)[0],
+                                gtk_tree_path_get_indices(end_path)[0]);
+    gtk_tree_path_free(start_path);
+    gtk_tree_path_free(end_path);
+}
+
 static gboolean
 toggle_action_on_2button_press(GdkEvent *event, const char *action, gpointer user_data) {
     guint button;
@@ -822,6 +990,37 @@ on_match_case_label_button_press_event(GtkWidget *widget, GdkEvent *event, gpoin
     return toggle_action_on_2button_press(event, "match_case", user_data);
 }
 
+static gboolean
+search_delayed_cb(gpointer user_data) {
+    FsearchApplicationWindow *win = user_data;
+    win->search_timeout_id = 0;
+
+    if (win->num_searches_active > 0 && win->search_latency_ms <= FSEARCH_WINDOW_SEARCH_DEBOUNCE_MAX_MS) {
+        const double elapsed_ms = (double)(g_get_monotonic_time() - win->search_start_time) / G_TIME_SPAN_MILLISECOND;
+        if (elapsed_ms < 2 * win->search_latency_ms) {
+            // cancelling it could mean that fast typing never shows any results
+            win->search_deferred = true;
+            return FALSE;
+        }
+    }
+    perform_search(win);
+    return FALSE;
+}
+
+// Cheap searches run right away, slower ones wait for a pause in typing, which is
+// as long as they took recently, so bursts of keystrokes only search for the last text
+static void
+search_as_you_type(FsearchApplicationWindow *win) {
+    search_remove_delayed_cb(win);
+    win->search_deferred = false;
+    if (win->search_latency_ms < FSEARCH_WINDOW_SEARCH_DEBOUNCE_MIN_MS && win->num_searches_active == 0) {
+        perform_search(win);
+        return;
+    }
+    const guint delay_ms = (guint)MIN(win->search_latency_ms, FSEARCH_WINDOW_SEARCH_DEBOUNCE_MAX_MS);
+    win->search_timeout_id = g_timeout_add(delay_ms, search_delayed_cb, win);
+}
+
 static void
 on_search_entry_changed(GtkEntry *entry, gpointer user_data) {
     FsearchApplicationWindow *win = user_data;
@@ -830,7 +1029,7 @@ on_search_entry_changed(GtkEntry *entry, gpointer user_data) {
     FsearchConfig *config = fsearch_application_get_config(FSEARCH_APPLICATION_DEFAULT);
 
     if (config->search_as_you_type) {
-        perform_search(win);
+        search_as_you_type(win);
     }
 }
 
@@ -890,6 +1089,9 @@ create_view_and_model(FsearchApplicationWindow *app) {
 
     gtk_tree_view_set_model(list, GTK_TREE_MODEL(app->list_model));
     g_object_unref(app->list_model); /* destroy store automatically with view */
+
+    GtkAdjustment *vadjustment = gtk_scrolled_window_get_vadjustment(GTK_SCROLLED_WINDOW(app->listview_scrolled_window));
+    g_signal_connect_object(vadjustment, "value-changed", G_CALLBACK(on_listview_scrolled), app, 0);
 }
 
 static void
@@ -1093,20 +1295,17 @@ on_listview_query_tooltip(GtkWidget *widget,
         return ret_val;
     }
 
-    DatabaseSearchEntry *entry = (DatabaseSearchEntry *)iter.user_data;
-    if (entry) {
-        BTreeNode *node = db_search_entry_get_node(entry);
-        if (node) {
-            char path_name[PATH_MAX] = "";
-            btree_node_get_path_full(node, path_name, sizeof(path_name));
-            char *display_name = g_filename_display_name(path_name);
-            if (display_name) {
-                gtk_tree_view_set_tooltip_row(GTK_TREE_VIEW(widget), tooltip, path);
-                gtk_tooltip_set_text(tooltip, display_name);
-                g_free(display_name);
-                display_name = NULL;
-                ret_val = TRUE;
-            }
+    BTreeNode *node = (BTreeNode *)iter.user_data;
+    if (node) {
+        char path_name[PATH_MAX] = "";
+        btree_node_get_path_full(node, path_name, sizeof(path_name));
+        char *display_name = g_filename_display_name(path_name);
+        if (display_name) {
+            gtk_tree_view_set_tooltip_row(GTK_TREE_VIEW(widget), tooltip, path);
+            gtk_tooltip_set_text(tooltip, display_name);
+            g_free(display_name);
+            display_name = NULL;
+            ret_val = TRUE;
         }
     }
     gtk_tree_path_free(path);
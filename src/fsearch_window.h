@@ -78,6 +78,9 @@ fsearch_application_window_get_query_highlight(FsearchApplicationWindow *self);
 void
 fsearch_application_window_update_results(void *data);
 
+void
+fsearch_application_window_update_results_partial(void *data);
+
 void
 fsearch_window_apply_search_revealer_config(FsearchApplicationWindow *win);
 G_END_DECLS
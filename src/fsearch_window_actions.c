@@ -91,36 +91,38 @@ build_entry_list(GList *selection, GtkTreeModel *model) {
         GtkTreePath *path = temp->data;
         GtkTreeIter iter = {0};
         if (gtk_tree_model_get_iter(model, &iter, path)) {
-            entry_list = g_list_append(entry_list, iter.user_data);
+            entry_list = g_list_prepend(entry_list, iter.user_data);
         }
         temp = temp->next;
     }
-    return entry_list;
+    return g_list_reverse(entry_list);
 }
 
 static void
-copy_file(GtkTreeModel *model, GtkTreePath *path, GtkTreeIter *iter, gpointer userdata) {
-    DatabaseSearchEntry *entry = (DatabaseSearchEntry *)iter->user_data;
-    GList **file_list = (GList **)userdata;
-    if (!entry) {
-        return;
+add_selected_node(GtkTreeModel *model, GtkTreePath *path, GtkTreeIter *iter, gpointer userdata) {
+    BTreeNode *node = (BTreeNode *)iter->user_data;
+    GPtrArray *nodes = userdata;
+    if (node) {
+        g_ptr_array_add(nodes, node);
     }
+}
+
+// The paths of all selected entries in the order of the list, NULL if nothing is selected
+static BTreeNodePaths *
+build_selection_paths(GtkTreeSelection *selection) {
+    GPtrArray *nodes = g_ptr_array_sized_new(gtk_tree_selection_count_selected_rows(selection));
+    gtk_tree_selection_selected_foreach(selection, add_selected_node, nodes);
 
-    BTreeNode *node = db_search_entry_get_node(entry);
-    char path_str[PATH_MAX] = "";
-    bool res = btree_node_get_path_full(node, path_str, sizeof(path_str));
-    if (res) {
-        *file_list = g_list_prepend(*file_list, g_strdup(path_str));
+    BTreeNodePaths *paths = NULL;
+    if (nodes->len > 0) {
+        paths = btree_node_paths_new((BTreeNode **)nodes->pdata, nodes->len, fsearch_thread_pool_get_default());
     }
+    g_ptr_array_free(nodes, TRUE);
+    return paths;
 }
 
 static bool
-delete_file(DatabaseSearchEntry *entry, bool delete) {
-    if (!entry) {
-        return false;
-    }
-
-    BTreeNode *node = db_search_entry_get_node(entry);
+delete_file(BTreeNode *node, bool delete) {
     if (!node) {
         return false;
     }
@@ -251,10 +253,10 @@ fsearch_window_action_cut_or_copy(GSimpleAction *action, GVariant *variant, bool
     if (!selection) {
         return;
     }
-    GList *file_list = NULL;
-    gtk_tree_selection_selected_foreach(selection, copy_file, &file_list);
-    file_list = g_list_reverse(file_list);
-    clipboard_copy_file_list(file_list, copy);
+    BTreeNodePaths *paths = build_selection_paths(selection);
+    if (paths) {
+        clipboard_copy_file_list(paths, copy);
+    }
 }
 
 static void
@@ -274,19 +276,15 @@ fsearch_window_action_copy_filepath(GSimpleAction *action, GVariant *variant, gp
     if (!selection) {
         return;
     }
-    GList *file_list = NULL;
-    gtk_tree_selection_selected_foreach(selection, copy_file, &file_list);
-    file_list = g_list_reverse(file_list);
-    clipboard_copy_filepath_list(file_list);
+    BTreeNodePaths *paths = build_selection_paths(selection);
+    if (paths) {
+        clipboard_copy_filepath_list(paths);
+    }
 }
 
 static void
 open_cb(GtkTreeModel *model, GtkTreePath *path, GtkTreeIter *iter, gpointer data) {
-    DatabaseSearchEntry *entry = (DatabaseSearchEntry *)iter->user_data;
-    if (!entry) {
-        return;
-    }
-    BTreeNode *node = db_search_entry_get_node(entry);
+    BTreeNode *node = (BTreeNode *)iter->user_data;
     if (!node) {
         return;
     }
@@ -296,22 +294,6 @@ open_cb(GtkTreeModel *model, GtkTreePath *path, GtkTreeIter *iter, gpointer data
     }
 }
 
-static void
-open_with_cb(GtkTreeModel *model, GtkTreePath *path, GtkTreeIter *iter, gpointer data) {
-    DatabaseSearchEntry *entry = (DatabaseSearchEntry *)iter->user_data;
-    if (!entry) {
-        return;
-    }
-    BTreeNode *node = db_search_entry_get_node(entry);
-    if (!node) {
-        return;
-    }
-    char path_name[PATH_MAX] = "";
-    btree_node_get_path_full(node, path_name, sizeof(path_name));
-    GList **list = data;
-    *list = g_list_append(*list, g_file_new_for_path(path_name));
-}
-
 void
 fsearch_window_action_after_file_open(bool action_mouse) {
     FsearchConfig *config = fsearch_application_get_config(FSEARCH_APPLICATION_DEFAULT);
@@ -349,7 +331,13 @@ launch_selection_for_app_info(FsearchApplicationWindow *win, GAppInfo *app_info)
     }
 
     GList *file_list = NULL;
-    gtk_tree_selection_selected_foreach(selection, open_with_cb, &file_list);
+    BTreeNodePaths *paths = build_selection_paths(selection);
+    if (paths) {
+        for (uint32_t i = paths->num_paths; i > 0; i--) {
+            file_list = g_list_prepend(file_list, g_file_new_for_path(btree_node_paths_get(paths, i - 1)));
+        }
+        btree_node_paths_free(paths);
+    }
     g_app_info_launch(app_info, file_list, G_APP_LAUNCH_CONTEXT(launch_context), NULL);
 
     g_object_unref(launch_context);
@@ -420,11 +408,7 @@ fsearch_window_action_open(GSimpleAction *action, GVariant *variant, gpointer us
 
 static void
 open_folder_cb(GtkTreeModel *model, GtkTreePath *path, GtkTreeIter *iter, gpointer data) {
-    DatabaseSearchEntry *entry = (DatabaseSearchEntry *)iter->user_data;
-    if (!entry) {
-        return;
-    }
-    BTreeNode *node = db_search_entry_get_node(entry);
+    BTreeNode *node = (BTreeNode *)iter->user_data;
     if (!node) {
         return;
     }
@@ -553,6 +537,30 @@ fsearch_window_action_search_mode(GSimpleAction *action, GVariant *variant, gpoi
     }
 }
 
+static void
+fsearch_window_action_fuzzy_search(GSimpleAction *action, GVariant *variant, gpointer user_data) {
+    FsearchApplicationWindow *self = user_data;
+    g_simple_action_set_state(action, variant);
+    FsearchConfig *config = fsearch_application_get_config(FSEARCH_APPLICATION_DEFAULT);
+    bool enable_fuzzy_old = config->enable_fuzzy;
+    config->enable_fuzzy = g_variant_get_boolean(variant);
+    if (enable_fuzzy_old != config->enable_fuzzy) {
+        g_idle_add((GSourceFunc)fsearch_application_window_update_search, self);
+    }
+}
+
+static void
+fsearch_window_action_rank_results(GSimpleAction *action, GVariant *variant, gpointer user_data) {
+    FsearchApplicationWindow *self = user_data;
+    g_simple_action_set_state(action, variant);
+    FsearchConfig *config = fsearch_application_get_config(FSEARCH_APPLICATION_DEFAULT);
+    bool enable_ranking_old = config->enable_ranking;
+    config->enable_ranking = g_variant_get_boolean(variant);
+    if (enable_ranking_old != config->enable_ranking) {
+        g_idle_add((GSourceFunc)fsearch_application_window_update_search, self);
+    }
+}
+
 static void
 fsearch_window_action_match_case(GSimpleAction *action, GVariant *variant, gpointer user_data) {
     FsearchApplicationWindow *self = user_data;
@@ -687,6 +695,8 @@ static GActionEntry FsearchWindowActions[] = {
     // Search
     {"search_in_path", action_toggle_state_cb, NULL, "true", fsearch_window_action_search_in_path},
     {"search_mode", action_toggle_state_cb, NULL, "true", fsearch_window_action_search_mode},
+    {"fuzzy_search", action_toggle_state_cb, NULL, "true", fsearch_window_action_fuzzy_search},
+    {"rank_results", action_toggle_state_cb, NULL, "true", fsearch_window_action_rank_results},
     {"match_case", action_toggle_state_cb, NULL, "true", fsearch_window_action_match_case},
 };
 
@@ -737,6 +747,8 @@ fsearch_window_actions_update(FsearchApplicationWindow *self) {
     action_set_active_bool(group, "show_search_button", config->show_search_button);
     action_set_active_bool(group, "search_in_path", config->search_in_path);
     action_set_active_bool(group, "search_mode", config->enable_regex);
+    action_set_active_bool(group, "fuzzy_search", config->enable_fuzzy);
+    action_set_active_bool(group, "rank_results", config->enable_ranking);
     action_set_active_bool(group, "match_case", config->match_case);
     action_set_active_bool(group, "show_name_column", true);
     action_set_active_bool(group, "show_path_column", config->show_path_column);
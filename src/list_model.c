@@ -29,8 +29,39 @@
 #include "debug.h"
 #include "fsearch.h"
 #include "fsearch_config.h"
+#include "fsearch_file_type.h"
+#include "fsearch_sort.h"
+#include "fsearch_stats.h"
 #include "fsearch_timer.h"
 
+// rows whose values are kept, far more than fit on a screen
+#define LIST_MODEL_CACHED_VALUES_MAX 1024
+// rows around the visible ones whose icon and type are still looked up
+#define LIST_MODEL_VISIBLE_ROWS_MARGIN 32
+#define LIST_MODEL_VALUE_POOL_THREADS 2
+
+// icon and type of an entry, looked up on the value pool
+typedef struct {
+    ListModel *list_model;
+    uint32_t idx;
+    uint32_t row;
+    uint32_t generation;
+    uint32_t serial;
+    bool is_dir;
+    bool skipped;
+    gchar *name;
+
+    gchar *type;
+    GIcon *icon;
+} ListModelValueLookup;
+
+// the metadata of the results, read on the metadata pool
+typedef struct {
+    ListModel *list_model;
+    FsearchDatabase *db;
+    GArray *indices;
+} ListModelMetadataFetch;
+
 /* boring declarations of local functions */
 
 static void
@@ -109,49 +140,230 @@ list_model_sortable_has_default_sort_func(GtkTreeSortable *sortable);
 static GObjectClass *parent_class = NULL; /* GObject stuff - nothing to worry about */
 
 static gchar *
-get_mimetype(const gchar *path) {
-    if (!path) {
-        return NULL;
-    }
-    gchar *content_type = g_content_type_guess(path, NULL, 1, NULL);
-    if (content_type) {
-        gchar *mimetype = g_content_type_get_description(content_type);
-        g_free(content_type);
-        content_type = NULL;
-        return mimetype;
+get_file_type(bool is_dir, const gchar *name) {
+    gchar *type = NULL;
+    fsearch_file_type_get(name, is_dir, &type, NULL);
+    if (type == NULL) {
+        type = g_strdup("Unknown Type");
     }
-    return NULL;
+    return type;
 }
 
-static gchar *
-get_file_type(DatabaseSearchEntry *entry, const gchar *path) {
-    gchar *type = NULL;
-    BTreeNode *node = db_search_entry_get_node(entry);
-    if (node->is_dir) {
-        type = strdup("Folder");
+// false if cached_only and the type of the file wasn't looked up before
+static bool
+get_file_type_and_icon(const gchar *name, bool is_dir, bool cached_only, gchar **type, GIcon **icon) {
+    if (cached_only) {
+        if (!fsearch_file_type_peek(name, is_dir, type, icon)) {
+            return false;
+        }
     }
     else {
-        type = get_mimetype(path);
+        fsearch_file_type_get(name, is_dir, type, icon);
     }
-    if (type == NULL) {
-        type = strdup("Unknown Type");
+    if (!*type) {
+        *type = g_strdup("Unknown Type");
     }
-    return type;
+    if (!*icon) {
+        *icon = g_icon_new_for_string("image-missing", NULL);
+    }
+    return true;
+}
+
+static inline BTreeNode *
+list_model_get_node(ListModel *list_model, uint32_t row) {
+    const uint32_t idx = g_array_index(list_model->results, uint32_t, row);
+    return darray_get_item(db_get_entries(list_model->db), idx);
+}
+
+// iters point to the node of a row and know the row they're in
+static inline void
+list_model_iter_set_row(ListModel *list_model, GtkTreeIter *iter, uint32_t row) {
+    iter->stamp = list_model->stamp;
+    iter->user_data = list_model_get_node(list_model, row);
+    iter->user_data2 = GUINT_TO_POINTER(row);
+    iter->user_data3 = NULL; /* unused */
+}
+
+static void
+list_model_cached_value_free(ListModelCachedValue *cached) {
+    if (!cached) {
+        return;
+    }
+    g_free(cached->path);
+    cached->path = NULL;
+    g_free(cached->type);
+    cached->type = NULL;
+    if (cached->icon) {
+        g_object_unref(cached->icon);
+        cached->icon = NULL;
+    }
+    g_free(cached);
+}
+
+static void
+list_model_clear_cached_values(ListModel *list_model) {
+    g_hash_table_remove_all(list_model->cached_values);
+    g_queue_clear(list_model->cached_values_lru);
+    // lookups which are still running belong to the old values
+    list_model->value_generation++;
+}
+
+static bool
+list_model_row_is_near_visible(ListModel *list_model, uint32_t row) {
+    const gint first = g_atomic_int_get(&list_model->first_visible_row);
+    const gint last = g_atomic_int_get(&list_model->last_visible_row);
+    if (first < 0 || last < 0) {
+        return true;
+    }
+    return (gint64)row + LIST_MODEL_VISIBLE_ROWS_MARGIN >= first && (gint64)row <= (gint64)last + LIST_MODEL_VISIBLE_ROWS_MARGIN;
+}
+
+static void
+list_model_value_lookup_free(ListModelValueLookup *lookup) {
+    g_free(lookup->name);
+    lookup->name = NULL;
+    g_free(lookup->type);
+    lookup->type = NULL;
+    if (lookup->icon) {
+        g_object_unref(lookup->icon);
+        lookup->icon = NULL;
+    }
+    g_object_unref(lookup->list_model);
+    lookup->list_model = NULL;
+    g_free(lookup);
+}
+
+// runs on the main thread once a lookup is finished
+static gboolean
+list_model_value_lookup_done(gpointer user_data) {
+    ListModelValueLookup *lookup = user_data;
+    ListModel *list_model = lookup->list_model;
+
+    ListModelCachedValue *cached = NULL;
+    if (lookup->generation == list_model->value_generation) {
+        cached = g_hash_table_lookup(list_model->cached_values, GUINT_TO_POINTER(lookup->idx));
+    }
+    if (cached) {
+        cached->lookup_pending = false;
+        if (!lookup->skipped) {
+            cached->icon = lookup->icon;
+            lookup->icon = NULL;
+            cached->type = lookup->type;
+            lookup->type = NULL;
+            cached->lookup_done = true;
+
+            // redraw the row if it's still where it was shown
+            const uint32_t row = cached->row;
+            GArray *results = list_model->results;
+            if (results && row < results->len && g_array_index(results, uint32_t, row) == cached->idx) {
+                GtkTreeIter iter = {0};
+                list_model_iter_set_row(list_model, &iter, row);
+                GtkTreePath *path = gtk_tree_path_new();
+                gtk_tree_path_append_index(path, row);
+                gtk_tree_model_row_changed(GTK_TREE_MODEL(list_model), path, &iter);
+                gtk_tree_path_free(path);
+            }
+        }
+    }
+    list_model_value_lookup_free(lookup);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+list_model_value_lookup_worker(gpointer data, gpointer user_data) {
+    ListModelValueLookup *lookup = data;
+    lookup->skipped = !list_model_row_is_near_visible(lookup->list_model, lookup->row);
+    if (!lookup->skipped) {
+        get_file_type_and_icon(lookup->name, lookup->is_dir, false, &lookup->type, &lookup->icon);
+    }
+    g_idle_add(list_model_value_lookup_done, lookup);
+}
+
+// the most recently requested rows are looked up first, those are the ones on screen
+static gint
+list_model_value_lookup_compare(gconstpointer a, gconstpointer b, gpointer user_data) {
+    const ListModelValueLookup *lookup_a = a;
+    const ListModelValueLookup *lookup_b = b;
+    return (lookup_b->serial > lookup_a->serial) - (lookup_b->serial < lookup_a->serial);
+}
+
+// Fills in the icon and type right away if the type of node is known already,
+// looks them up on the value pool otherwise.
+static void
+list_model_lookup_values(ListModel *list_model, ListModelCachedValue *cached, BTreeNode *node) {
+    if (cached->lookup_done || cached->lookup_pending) {
+        return;
+    }
+    if (get_file_type_and_icon(node->name, node->is_dir, true, &cached->type, &cached->icon)) {
+        cached->lookup_done = true;
+        return;
+    }
+    if (!list_model->value_pool) {
+        list_model->value_pool = g_thread_pool_new(list_model_value_lookup_worker,
+                                                   NULL,
+                                                   LIST_MODEL_VALUE_POOL_THREADS,
+                                                   FALSE,
+                                                   NULL);
+        g_thread_pool_set_sort_function(list_model->value_pool, list_model_value_lookup_compare, NULL);
+    }
+
+    ListModelValueLookup *lookup = g_new0(ListModelValueLookup, 1);
+    // keeps the model around until the lookup is done
+    lookup->list_model = g_object_ref(list_model);
+    lookup->idx = cached->idx;
+    lookup->row = cached->row;
+    lookup->generation = list_model->value_generation;
+    lookup->serial = ++list_model->value_lookup_serial;
+    lookup->is_dir = node->is_dir;
+    lookup->name = g_strdup(node->name);
+
+    cached->lookup_pending = true;
+    g_thread_pool_push(list_model->value_pool, lookup, NULL);
+}
+
+static ListModelCachedValue *
+list_model_get_cached_value(ListModel *list_model, BTreeNode *node, uint32_t row) {
+    const uint32_t idx = g_array_index(list_model->results, uint32_t, row);
+    GQueue *lru = list_model->cached_values_lru;
+
+    ListModelCachedValue *cached = g_hash_table_lookup(list_model->cached_values, GUINT_TO_POINTER(idx));
+    if (cached) {
+        g_queue_unlink(lru, cached->lru_link);
+        g_queue_push_head_link(lru, cached->lru_link);
+    }
+    else {
+        while (g_queue_get_length(lru) >= LIST_MODEL_CACHED_VALUES_MAX) {
+            ListModelCachedValue *oldest = g_queue_pop_tail(lru);
+            g_hash_table_remove(list_model->cached_values, GUINT_TO_POINTER(oldest->idx));
+        }
+
+        cached = g_new0(ListModelCachedValue, 1);
+        cached->idx = idx;
+        char path[PATH_MAX] = "";
+        btree_node_get_path(node, path, sizeof(path));
+        cached->path = g_filename_display_name(path);
+
+        g_queue_push_head(lru, cached);
+        cached->lru_link = g_queue_peek_head_link(lru);
+        g_hash_table_insert(list_model->cached_values, GUINT_TO_POINTER(idx), cached);
+    }
+    cached->row = row;
+    return cached;
 }
 
 static void
 list_model_clear(ListModel *list_model) {
     if (list_model->results) {
-        g_ptr_array_free(list_model->results, TRUE);
+        g_array_free(list_model->results, TRUE);
         list_model->results = NULL;
     }
-    if (list_model->node_path) {
-        g_string_free(list_model->node_path, TRUE);
-        list_model->node_path = NULL;
+    if (list_model->cached_values) {
+        g_hash_table_destroy(list_model->cached_values);
+        list_model->cached_values = NULL;
     }
-    if (list_model->parent_path) {
-        g_string_free(list_model->parent_path, TRUE);
-        list_model->parent_path = NULL;
+    if (list_model->cached_values_lru) {
+        g_queue_free(list_model->cached_values_lru);
+        list_model->cached_values_lru = NULL;
     }
 }
 
@@ -271,8 +483,13 @@ list_model_init(ListModel *list_model) {
     g_assert(LIST_MODEL_N_COLUMNS == 7);
 
     list_model->results = NULL;
-    list_model->node_path = g_string_new(NULL);
-    list_model->parent_path = g_string_new(NULL);
+    list_model->cached_values = g_hash_table_new_full(g_direct_hash,
+                                                      g_direct_equal,
+                                                      NULL,
+                                                      (GDestroyNotify)list_model_cached_value_free);
+    list_model->cached_values_lru = g_queue_new();
+    list_model->first_visible_row = -1;
+    list_model->last_visible_row = -1;
 
     list_model->sort_id = SORT_ID_NONE;
     list_model->sort_order = GTK_SORT_ASCENDING;
@@ -291,7 +508,20 @@ list_model_init(ListModel *list_model) {
 static void
 list_model_finalize(GObject *object) {
     ListModel *list_model = LIST_MODEL(object);
+    if (list_model->value_pool) {
+        // nothing is queued anymore, every lookup holds a reference
+        g_thread_pool_free(list_model->value_pool, FALSE, TRUE);
+        list_model->value_pool = NULL;
+    }
+    if (list_model->metadata_pool) {
+        g_thread_pool_free(list_model->metadata_pool, FALSE, TRUE);
+        list_model->metadata_pool = NULL;
+    }
     list_model_clear(list_model);
+    if (list_model->db) {
+        db_unref(list_model->db);
+        list_model->db = NULL;
+    }
 
     /* must chain up - finalize parent */
     (*parent_class->finalize)(object);
@@ -301,9 +531,7 @@ list_model_finalize(GObject *object) {
  *
  *  list_model_get_flags: tells the rest of the world whether our tree model
  *                         has any special characteristics. In our case,
- *                         we have a list model (instead of a tree), and each
- *                         tree iter is valid as long as the row in question
- *                         exists, as it only contains a pointer to our struct.
+ *                         we have a list model (instead of a tree).
  *
  *****************************************************************************/
 
@@ -311,7 +539,8 @@ static GtkTreeModelFlags
 list_model_get_flags(GtkTreeModel *tree_model) {
     g_return_val_if_fail(IS_LIST_MODEL(tree_model), (GtkTreeModelFlags)0);
 
-    return (GTK_TREE_MODEL_LIST_ONLY | GTK_TREE_MODEL_ITERS_PERSIST);
+    // iters know their row, so they don't persist when rows are added, removed or reordered
+    return GTK_TREE_MODEL_LIST_ONLY;
 }
 
 /*****************************************************************************
@@ -372,16 +601,8 @@ list_model_get_iter(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreePath *pa
     if (!list_model->results || n >= list_model->results->len || n < 0)
         return FALSE;
 
-    DatabaseSearchEntry *entry = g_ptr_array_index(list_model->results, n);
-
-    g_assert(entry != NULL);
-    g_assert(db_search_entry_get_pos(entry) == n);
-
-    /* We simply store a pointer to our custom entry in the iter */
-    iter->stamp = list_model->stamp;
-    iter->user_data = entry;
-    iter->user_data2 = NULL; /* unused */
-    iter->user_data3 = NULL; /* unused */
+    list_model_iter_set_row(list_model, iter, n);
+    g_assert(iter->user_data != NULL);
 
     return TRUE;
 }
@@ -400,8 +621,7 @@ list_model_get_path(GtkTreeModel *tree_model, GtkTreeIter *iter) {
     g_return_val_if_fail(iter->user_data != NULL, NULL);
 
     GtkTreePath *path = gtk_tree_path_new();
-    DatabaseSearchEntry *entry = (DatabaseSearchEntry *)iter->user_data;
-    gtk_tree_path_append_index(path, db_search_entry_get_pos(entry));
+    gtk_tree_path_append_index(path, GPOINTER_TO_UINT(iter->user_data2));
     return path;
 }
 
@@ -412,87 +632,106 @@ list_model_get_path(GtkTreeModel *tree_model, GtkTreeIter *iter) {
  *
  *****************************************************************************/
 
+// The stats of the folder in row from the entry tables of the database, false if they're not known
+// there. With false only num_children is set, by walking the children.
+static bool
+list_model_get_folder_stats(ListModel *list_model, uint32_t row, FsearchDatabaseFolderStats *stats) {
+    const uint32_t idx = g_array_index(list_model->results, uint32_t, row);
+    if (db_get_folder_stats(list_model->db, idx, stats)) {
+        return true;
+    }
+    BTreeNode *node = list_model_get_node(list_model, row);
+    *stats = (FsearchDatabaseFolderStats){.num_children = btree_node_n_children(node)};
+    return false;
+}
+
+// Entries indexed without metadata get it once they're asked for, the database keeps it
+static void
+list_model_get_metadata(ListModel *list_model, uint32_t row, off_t *size, time_t *mtime) {
+    const uint32_t idx = g_array_index(list_model->results, uint32_t, row);
+    db_get_entry_metadata(list_model->db, idx, size, mtime);
+}
+
+// folders are sorted by the size of their contents rather than their number of children
+static bool
+list_model_show_folder_sizes(ListModel *list_model) {
+    FsearchConfig *config = fsearch_application_get_config(FSEARCH_APPLICATION_DEFAULT);
+    return config->show_folder_sizes && list_model->db && !db_get_flags(list_model->db).names_only;
+}
+
+static char *
+list_model_format_size(int64_t size) {
+    FsearchConfig *config = fsearch_application_get_config(FSEARCH_APPLICATION_DEFAULT);
+    return g_format_size_full(size, config->show_base_2_units ? G_FORMAT_SIZE_IEC_UNITS : G_FORMAT_SIZE_DEFAULT);
+}
+
 static void
 list_model_get_value(GtkTreeModel *tree_model, GtkTreeIter *iter, gint column, GValue *value) {
     g_return_if_fail(IS_LIST_MODEL(tree_model));
     g_return_if_fail(iter != NULL);
     g_return_if_fail(column < LIST_MODEL(tree_model)->n_columns);
 
-    DatabaseSearchEntry *record = (DatabaseSearchEntry *)iter->user_data;
-    g_return_if_fail(record != NULL);
+    BTreeNode *node = (BTreeNode *)iter->user_data;
+    g_return_if_fail(node != NULL);
 
     ListModel *list_model = LIST_MODEL(tree_model);
 
-    if (db_search_entry_get_pos(record) >= list_model->results->len)
+    const uint32_t row = GPOINTER_TO_UINT(iter->user_data2);
+    if (row >= list_model->results->len)
         g_return_if_reached();
 
     char output[100] = "";
 
-    BTreeNode *node = db_search_entry_get_node(record);
-
-    GString *node_path = list_model->node_path;
-    GString *parent_path = list_model->parent_path;
-    if (!list_model->node_cached || node->parent != list_model->node_cached->parent) {
-        g_string_erase(parent_path, 0, -1);
-        char path[PATH_MAX] = "";
-        btree_node_get_path(node, path, sizeof(path));
-        g_string_append(parent_path, path);
+    // only rows which are drawn ask for these, so only their values are ever computed
+    ListModelCachedValue *cached = NULL;
+    if (column == LIST_MODEL_COL_ICON || column == LIST_MODEL_COL_PATH || column == LIST_MODEL_COL_TYPE) {
+        cached = list_model_get_cached_value(list_model, node, row);
     }
-    if (node != list_model->node_cached) {
-        g_string_erase(node_path, 0, -1);
-        g_string_append(node_path, parent_path->str);
-        g_string_append_c(node_path, '/');
-        g_string_append(node_path, node->name);
-    }
-
-    list_model->node_cached = node;
 
+    off_t size = node->size;
     time_t mtime = node->mtime;
+    if (column == LIST_MODEL_COL_SIZE || column == LIST_MODEL_COL_CHANGED) {
+        // entries indexed without metadata get it once they're shown
+        list_model_get_metadata(list_model, row, &size, &mtime);
+    }
 
     g_value_init(value, list_model->column_types[column]);
     switch (column) {
     case LIST_MODEL_COL_RECORD:
-        g_value_set_pointer(value, record);
+        g_value_set_pointer(value, node);
         break;
 
-    case LIST_MODEL_COL_ICON: {
-        GIcon *icon = NULL;
-        GFile *g_file = g_file_new_for_path(node_path->str);
-        if (g_file) {
-            GFileInfo *file_info = g_file_query_info(g_file, "standard::icon", 0, NULL, NULL);
-            if (file_info) {
-                icon = g_file_info_get_icon(file_info);
-                if (icon) {
-                    g_value_set_object(value, icon);
-                }
-                g_object_unref(file_info);
-                file_info = NULL;
-            }
-            g_object_unref(g_file);
-            g_file = NULL;
-        }
-
-        if (!icon) {
-            icon = g_icon_new_for_string("image-missing", NULL);
-            if (icon) {
-                g_value_take_object(value, icon);
-                icon = NULL;
-            }
+    case LIST_MODEL_COL_ICON:
+        // if it has to be looked up, the row is updated once it's known
+        list_model_lookup_values(list_model, cached, node);
+        if (cached->icon) {
+            g_value_set_object(value, cached->icon);
         }
-    } break;
+        break;
 
     case LIST_MODEL_COL_NAME:
         g_value_take_string(value, g_filename_display_name(node->name));
         break;
 
     case LIST_MODEL_COL_PATH:
-        g_value_take_string(value, g_filename_display_name(parent_path->str));
+        g_value_set_string(value, cached->path);
         break;
 
     case LIST_MODEL_COL_SIZE:
         if (node->is_dir) {
-            uint32_t num_children = btree_node_n_children(node);
-            if (num_children == 1) {
+            FsearchDatabaseFolderStats stats = {0};
+            const bool has_stats = list_model_get_folder_stats(list_model, row, &stats);
+            const uint32_t num_children = stats.num_children;
+            if (has_stats && list_model_show_folder_sizes(list_model)) {
+                char *formatted_size = list_model_format_size(stats.total_size);
+                snprintf(output,
+                         sizeof(output),
+                         num_children == 1 ? "%s (%d Item)" : "%s (%d Items)",
+                         formatted_size,
+                         num_children);
+                g_free(formatted_size);
+            }
+            else if (num_children == 1) {
                 snprintf(output, sizeof(output), "%d Item", num_children);
             }
             else {
@@ -501,22 +740,19 @@ list_model_get_value(GtkTreeModel *tree_model, GtkTreeIter *iter, gint column, G
             g_value_set_static_string(value, output);
         }
         else {
-            FsearchConfig *config = fsearch_application_get_config(FSEARCH_APPLICATION_DEFAULT);
-            char *formatted_size = NULL;
-            if (config->show_base_2_units) {
-                formatted_size = g_format_size_full(node->size, G_FORMAT_SIZE_IEC_UNITS);
-            }
-            else {
-                formatted_size = g_format_size_full(node->size, G_FORMAT_SIZE_DEFAULT);
-            }
-            g_value_take_string(value, formatted_size);
+            g_value_take_string(value, list_model_format_size(size));
         }
         break;
 
-    case LIST_MODEL_COL_TYPE: {
-        char *mime_type = get_file_type(record, node_path->str);
-        g_value_take_string(value, mime_type);
-    } break;
+    case LIST_MODEL_COL_TYPE:
+        list_model_lookup_values(list_model, cached, node);
+        if (cached->type) {
+            g_value_set_string(value, cached->type);
+        }
+        else {
+            g_value_set_static_string(value, "");
+        }
+        break;
 
     case LIST_MODEL_COL_CHANGED:
         strftime(output,
@@ -543,20 +779,14 @@ list_model_iter_next(GtkTreeModel *tree_model, GtkTreeIter *iter) {
         return FALSE;
 
     ListModel *list_model = LIST_MODEL(tree_model);
-    DatabaseSearchEntry *record = (DatabaseSearchEntry *)iter->user_data;
 
-    const uint32_t new_results_pos = db_search_entry_get_pos(record) + 1;
+    const uint32_t new_results_pos = GPOINTER_TO_UINT(iter->user_data2) + 1;
     /* Is this the last record in the list? */
     if (new_results_pos >= list_model->results->len)
         return FALSE;
 
-    DatabaseSearchEntry *nextrecord = g_ptr_array_index(list_model->results, new_results_pos);
-
-    g_assert(nextrecord != NULL);
-    g_assert(db_search_entry_get_pos(nextrecord) == new_results_pos);
-
-    iter->stamp = list_model->stamp;
-    iter->user_data = nextrecord;
+    list_model_iter_set_row(list_model, iter, new_results_pos);
+    g_assert(iter->user_data != NULL);
 
     return TRUE;
 }
@@ -588,12 +818,11 @@ list_model_iter_children(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreeIte
     ListModel *list_model = LIST_MODEL(tree_model);
 
     /* No rows => no first row */
-    if (list_model->results->len == 0)
+    if (!list_model->results || list_model->results->len == 0)
         return FALSE;
 
     /* Set iter to first item in list */
-    iter->stamp = list_model->stamp;
-    iter->user_data = g_ptr_array_index(list_model->results, 0);
+    list_model_iter_set_row(list_model, iter, 0);
 
     return TRUE;
 }
@@ -659,16 +888,11 @@ list_model_iter_nth_child(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreeIt
     /* special case: if parent == NULL, set iter to n-th top-level row */
 
     ListModel *list_model = LIST_MODEL(tree_model);
-    if (n >= list_model->results->len)
+    if (!list_model->results || n < 0 || n >= list_model->results->len)
         return FALSE;
 
-    DatabaseSearchEntry *record = g_ptr_array_index(list_model->results, n);
-
-    g_assert(record != NULL);
-    g_assert(db_search_entry_get_pos(record) == n);
-
-    iter->stamp = list_model->stamp;
-    iter->user_data = record;
+    list_model_iter_set_row(list_model, iter, n);
+    g_assert(iter->user_data != NULL);
 
     return TRUE;
 }
@@ -687,9 +911,8 @@ list_model_iter_parent(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreeIter
 }
 
 void
-list_model_remove_entry(ListModel *list, DatabaseSearch *search, DatabaseSearchEntry *entry) {
-    guint row = db_search_entry_get_pos(entry);
-    db_search_remove_entry(search, entry);
+list_model_remove_entry(ListModel *list, DatabaseSearch *search, uint32_t row) {
+    db_search_remove_entry(search, row);
     GtkTreePath *path = gtk_tree_path_new();
     gtk_tree_path_append_index(path, row);
     gtk_tree_model_row_deleted(GTK_TREE_MODEL(list), path);
@@ -794,50 +1017,47 @@ list_model_sortable_has_default_sort_func(GtkTreeSortable *sortable) {
     return FALSE;
 }
 
+// Paths compare component by component. They're taken from the full paths, the roots of the parts
+// of large locations are named after the path of their folder.
 static gint
 list_model_compare_path(BTreeNode *a, BTreeNode *b) {
     if (!a || !b) {
         return 0;
     }
-    const int32_t a_depth = btree_node_depth(a);
-    const int32_t b_depth = btree_node_depth(b);
-    char *a_parents[a_depth + 1];
-    char *b_parents[b_depth + 1];
-    a_parents[a_depth] = NULL;
-    b_parents[b_depth] = NULL;
-
-    BTreeNode *temp = a;
-    for (int32_t i = a_depth - 1; i >= 0 && temp; i--) {
-        a_parents[i] = temp->name;
-        temp = temp->parent;
+    char a_path[PATH_MAX] = "";
+    char b_path[PATH_MAX] = "";
+    btree_node_get_path_full(a, a_path, sizeof(a_path));
+    btree_node_get_path_full(b, b_path, sizeof(b_path));
+    const size_t a_len = strlen(a_path);
+    const size_t b_len = strlen(b_path);
+    for (size_t i = 0; i < a_len; i++) {
+        if (a_path[i] == '/') {
+            a_path[i] = '\0';
+        }
     }
-    temp = b;
-    for (int32_t i = b_depth - 1; i >= 0 && temp; i--) {
-        b_parents[i] = temp->name;
-        temp = temp->parent;
+    for (size_t i = 0; i < b_len; i++) {
+        if (b_path[i] == '/') {
+            b_path[i] = '\0';
+        }
     }
 
-    uint32_t i = 0;
-    char *a_name = a_parents[i];
-    char *b_name = b_parents[i];
-
-    while (a_name && b_name) {
-        int res = strverscmp(a_name, b_name);
+    size_t i = 0;
+    size_t j = 0;
+    while (i < a_len && j < b_len) {
+        const int res = strverscmp(a_path + i, b_path + j);
         if (res != 0) {
             return res;
         }
-        i++;
-        a_name = a_parents[i];
-        b_name = b_parents[i];
+        i += strlen(a_path + i) + 1;
+        j += strlen(b_path + j) + 1;
     }
-    return a_depth - b_depth;
+    return (i < a_len) - (j < b_len);
 }
 
 static gint
-list_model_compare_records(gint sort_id, DatabaseSearchEntry *a, DatabaseSearchEntry *b) {
-    BTreeNode *node_a = db_search_entry_get_node(a);
-    BTreeNode *node_b = db_search_entry_get_node(b);
-
+list_model_compare_records(ListModel *list_model, gint sort_id, uint32_t row_a, uint32_t row_b) {
+    BTreeNode *node_a = list_model_get_node(list_model, row_a);
+    BTreeNode *node_b = list_model_get_node(list_model, row_b);
     const bool is_dir_a = node_a->is_dir;
     const bool is_dir_b = node_b->is_dir;
 
@@ -847,9 +1067,6 @@ list_model_compare_records(gint sort_id, DatabaseSearchEntry *a, DatabaseSearchE
     gchar *type_a = NULL;
     gchar *type_b = NULL;
 
-    gchar path_a[PATH_MAX] = "";
-    gchar path_b[PATH_MAX] = "";
-
     gint return_val = 0;
 
     switch (sort_id) {
@@ -887,10 +1104,8 @@ list_model_compare_records(gint sort_id, DatabaseSearchEntry *a, DatabaseSearchE
             return 0;
         }
 
-        btree_node_get_path_full(node_a, path_a, sizeof(path_a));
-        type_a = get_file_type(a, path_a);
-        btree_node_get_path_full(node_b, path_b, sizeof(path_b));
-        type_b = get_file_type(b, path_b);
+        type_a = get_file_type(is_dir_a, name_a);
+        type_b = get_file_type(is_dir_b, name_b);
 
         if (type_a && type_b) {
             return_val = strverscmp(type_a, type_b);
@@ -910,21 +1125,38 @@ list_model_compare_records(gint sort_id, DatabaseSearchEntry *a, DatabaseSearchE
             return is_dir_b - is_dir_a;
         }
         if (is_dir_a && is_dir_b) {
-            uint32_t n_a = btree_node_n_children(node_a);
-            uint32_t n_b = btree_node_n_children(node_b);
-            return n_a - n_b;
+            FsearchDatabaseFolderStats stats_a = {0};
+            FsearchDatabaseFolderStats stats_b = {0};
+            const bool has_stats_a = list_model_get_folder_stats(list_model, row_a, &stats_a);
+            const bool has_stats_b = list_model_get_folder_stats(list_model, row_b, &stats_b);
+            if (has_stats_a && has_stats_b && list_model_show_folder_sizes(list_model)) {
+                if (stats_a.total_size == stats_b.total_size)
+                    return 0;
+                return (stats_a.total_size > stats_b.total_size) ? 1 : -1;
+            }
+            return stats_a.num_children - stats_b.num_children;
         }
 
-        if (node_a->size == node_b->size)
+        off_t size_a = 0;
+        off_t size_b = 0;
+        time_t mtime = 0;
+        list_model_get_metadata(list_model, row_a, &size_a, &mtime);
+        list_model_get_metadata(list_model, row_b, &size_b, &mtime);
+        if (size_a == size_b)
             return 0;
 
-        return (node_a->size > node_b->size) ? 1 : -1;
+        return (size_a > size_b) ? 1 : -1;
     }
     case SORT_ID_CHANGED: {
-        if (node_a->mtime == node_b->mtime)
+        off_t size = 0;
+        time_t mtime_a = 0;
+        time_t mtime_b = 0;
+        list_model_get_metadata(list_model, row_a, &size, &mtime_a);
+        list_model_get_metadata(list_model, row_b, &size, &mtime_b);
+        if (mtime_a == mtime_b)
             return 0;
 
-        return (node_a->mtime > node_b->mtime) ? 1 : -1;
+        return (mtime_a > mtime_b) ? 1 : -1;
     }
     default:
         return 0;
@@ -933,17 +1165,164 @@ list_model_compare_records(gint sort_id, DatabaseSearchEntry *a, DatabaseSearchE
     g_return_val_if_reached(0);
 }
 
-static gint
-list_model_qsort_compare_func(DatabaseSearchEntry **a, DatabaseSearchEntry **b, ListModel *list_model) {
-    g_assert((a) && (b) && (list_model));
+static int
+list_model_sort_compare_entries(void *a, void *b, void *user_data) {
+    // the items hold the rows of the entries
+    ListModel *list_model = user_data;
+    return list_model_compare_records(list_model, list_model->sort_id, GPOINTER_TO_UINT(a), GPOINTER_TO_UINT(b));
+}
 
-    gint ret = list_model_compare_records(list_model->sort_id, *a, *b);
+static int
+list_model_sort_compare_parents(void *a, void *b, void *user_data) {
+    return list_model_compare_path(a, b);
+}
+
+static int
+list_model_sort_compare_types(void *a, void *b, void *user_data) {
+    return strverscmp(a, b);
+}
+
+static GHashTable *
+list_model_sort_rank_keys(GHashTable *keys, FsearchSortCompareFunc compare_func, FsearchThreadPool *pool) {
+    // sort the distinct keys once and replace them by their rank, so entries are only compared by rank
+    const uint32_t num_keys = g_hash_table_size(keys);
+    FsearchSortItem *items = g_new(FsearchSortItem, MAX(num_keys, 1));
+
+    GHashTableIter iter;
+    gpointer key = NULL;
+    uint32_t i = 0;
+    g_hash_table_iter_init(&iter, keys);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        items[i].key = 0;
+        items[i].data = key;
+        i++;
+    }
+    fsearch_sort(items, num_keys, compare_func, NULL, pool);
+    for (i = 0; i < num_keys; i++) {
+        g_hash_table_insert(keys, items[i].data, GUINT_TO_POINTER(i));
+    }
+    g_free(items);
+    return keys;
+}
+
+static const uint32_t *
+list_model_get_sort_ranks(ListModel *list_model) {
+    if (!list_model->db) {
+        return NULL;
+    }
+    switch (list_model->sort_id) {
+    case SORT_ID_PATH:
+        return db_get_sort_ranks(list_model->db, DATABASE_SORT_PATH);
+    case SORT_ID_TYPE:
+        return db_get_sort_ranks(list_model->db, DATABASE_SORT_TYPE);
+    case SORT_ID_SIZE:
+        return db_get_sort_ranks(list_model->db,
+                                 list_model_show_folder_sizes(list_model) ? DATABASE_SORT_TOTAL_SIZE : DATABASE_SORT_SIZE);
+    case SORT_ID_CHANGED:
+        return db_get_sort_ranks(list_model->db, DATABASE_SORT_MODIFICATION_TIME);
+    default:
+        return NULL;
+    }
+}
+
+static FsearchSortItem *
+list_model_get_sort_items(ListModel *list_model, FsearchThreadPool *pool) {
+    GArray *results = list_model->results;
+    FsearchSortItem *items = g_new(FsearchSortItem, results->len);
+
+    GHashTable *ranks = NULL;
+    GPtrArray *known_types = NULL;
+    gchar **types = NULL;
+    if (list_model->sort_id == SORT_ID_PATH) {
+        ranks = g_hash_table_new(g_direct_hash, g_direct_equal);
+        for (uint32_t i = 0; i < results->len; i++) {
+            BTreeNode *node = list_model_get_node(list_model, i);
+            if (node->parent) {
+                g_hash_table_insert(ranks, node->parent, NULL);
+            }
+        }
+        list_model_sort_rank_keys(ranks, list_model_sort_compare_parents, pool);
+    }
+    else if (list_model->sort_id == SORT_ID_TYPE) {
+        // look up every type only once, instead of twice per comparison
+        ranks = g_hash_table_new(g_str_hash, g_str_equal);
+        known_types = g_ptr_array_new_with_free_func(g_free);
+        types = g_new0(gchar *, results->len);
+        for (uint32_t i = 0; i < results->len; i++) {
+            BTreeNode *node = list_model_get_node(list_model, i);
+            if (node->is_dir) {
+                continue;
+            }
+            gchar *type = get_file_type(node->is_dir, node->name);
+            gchar *known_type = NULL;
+            if (g_hash_table_lookup_extended(ranks, type, (gpointer *)&known_type, NULL)) {
+                g_free(type);
+                type = known_type;
+            }
+            else {
+                g_hash_table_insert(ranks, type, NULL);
+                g_ptr_array_add(known_types, type);
+            }
+            types[i] = type;
+        }
+        list_model_sort_rank_keys(ranks, list_model_sort_compare_types, pool);
+    }
 
-    /* Swap -1 and 1 if sort order is reverse */
-    if (ret != 0 && list_model->sort_order == GTK_SORT_DESCENDING)
-        ret = (ret < 0) ? 1 : -1;
+    const bool show_folder_sizes = list_model_show_folder_sizes(list_model);
+    for (uint32_t i = 0; i < results->len; i++) {
+        BTreeNode *node = list_model_get_node(list_model, i);
+        // folders first, except for the modification date
+        const uint64_t is_file = (uint64_t)!node->is_dir << 63;
+        uint64_t key = 0;
+        off_t size = 0;
+        time_t mtime = 0;
+
+        switch (list_model->sort_id) {
+        case SORT_ID_NAME:
+            key = fsearch_sort_get_name_key(node->name, node->is_dir);
+            break;
+        case SORT_ID_PATH:
+            key = is_file | (node->parent ? GPOINTER_TO_UINT(g_hash_table_lookup(ranks, node->parent)) : 0);
+            break;
+        case SORT_ID_TYPE:
+            key = is_file | (types[i] ? GPOINTER_TO_UINT(g_hash_table_lookup(ranks, types[i])) : 0);
+            break;
+        case SORT_ID_SIZE:
+            if (node->is_dir) {
+                FsearchDatabaseFolderStats stats = {0};
+                const bool has_stats = list_model_get_folder_stats(list_model, i, &stats);
+                key = has_stats && show_folder_sizes ? MIN((uint64_t)stats.total_size, INT64_MAX) : stats.num_children;
+            }
+            else {
+                list_model_get_metadata(list_model, i, &size, &mtime);
+                key = is_file | MIN((uint64_t)MAX(size, 0), INT64_MAX);
+            }
+            break;
+        case SORT_ID_CHANGED:
+            list_model_get_metadata(list_model, i, &size, &mtime);
+            // order signed times as unsigned keys
+            key = (uint64_t)mtime ^ ((uint64_t)1 << 63);
+            break;
+        default:
+            break;
+        }
+        items[i].key = key;
+        items[i].data = GUINT_TO_POINTER(i);
+    }
 
-    return ret;
+    if (types) {
+        g_free(types);
+        types = NULL;
+    }
+    if (ranks) {
+        g_hash_table_destroy(ranks);
+        ranks = NULL;
+    }
+    if (known_types) {
+        g_ptr_array_free(known_types, TRUE);
+        known_types = NULL;
+    }
+    return items;
 }
 
 void
@@ -977,21 +1356,29 @@ list_model_sort_init(ListModel *list_model, char *sort_by, bool sort_ascending)
     }
 }
 
+// items hold the old rows in their new order
 static void
-list_model_apply_sort(ListModel *list_model) {
+list_model_apply_sort(ListModel *list_model, FsearchSortItem *items, bool reverse) {
+    GArray *results = list_model->results;
+    const uint32_t num_results = results->len;
+    uint32_t *old_results = g_new(uint32_t, num_results);
+    memcpy(old_results, results->data, num_results * sizeof(uint32_t));
+
     /* let other objects know about the new order */
-    gint *neworder = g_new0(gint, list_model->results->len);
+    gint *neworder = g_new0(gint, num_results);
 
-    for (uint32_t i = 0; i < list_model->results->len; ++i) {
+    for (uint32_t i = 0; i < num_results; ++i) {
         /* Note that the API reference might be wrong about
          * this, see bug number 124790 on bugs.gnome.org.
          * Both will work, but one will give you 'jumpy'
          * selections after row reordering. */
         /* neworder[(list_model->rows[i])->pos] = i; */
-        DatabaseSearchEntry *entry = g_ptr_array_index(list_model->results, i);
-        neworder[i] = db_search_entry_get_pos(entry);
-        db_search_entry_set_pos(entry, i);
+        const uint32_t old_row = GPOINTER_TO_UINT(items[reverse ? num_results - 1 - i : i].data);
+        neworder[i] = old_row;
+        g_array_index(results, uint32_t, i) = old_results[old_row];
     }
+    g_free(old_results);
+    old_results = NULL;
 
     GtkTreePath *path = gtk_tree_path_new();
     gtk_tree_model_rows_reordered(GTK_TREE_MODEL(list_model), path, NULL, neworder);
@@ -1003,6 +1390,76 @@ list_model_apply_sort(ListModel *list_model) {
     neworder = NULL;
 }
 
+// names only databases have no ranks for sizes and dates, those of the results are read first
+static bool
+list_model_sort_needs_metadata(ListModel *list_model) {
+    return list_model->db && db_get_flags(list_model->db).names_only
+        && (list_model->sort_id == SORT_ID_SIZE || list_model->sort_id == SORT_ID_CHANGED);
+}
+
+static void
+list_model_metadata_fetch_free(ListModelMetadataFetch *fetch) {
+    g_array_free(fetch->indices, TRUE);
+    fetch->indices = NULL;
+    db_unref(fetch->db);
+    fetch->db = NULL;
+    g_object_unref(fetch->list_model);
+    fetch->list_model = NULL;
+    g_free(fetch);
+}
+
+// runs on the main thread once the metadata is read, the results are sorted by it now
+static gboolean
+list_model_metadata_fetch_done(gpointer user_data) {
+    ListModelMetadataFetch *fetch = user_data;
+    ListModel *list_model = fetch->list_model;
+    list_model->metadata_fetch_pending = false;
+    // the results might have changed in the meantime, then the new ones are fetched
+    if (list_model->results && list_model_sort_needs_metadata(list_model)) {
+        list_model_sort(list_model);
+    }
+    list_model_metadata_fetch_free(fetch);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+list_model_metadata_fetch_worker(gpointer data, gpointer user_data) {
+    ListModelMetadataFetch *fetch = data;
+    db_fetch_entry_metadata(fetch->db,
+                            (const uint32_t *)fetch->indices->data,
+                            fetch->indices->len,
+                            fsearch_thread_pool_get_default());
+    g_idle_add(list_model_metadata_fetch_done, fetch);
+}
+
+// True if the metadata of all results is known, otherwise it's read on the metadata pool
+// and the results are sorted once that's done. Reading it here would block the main thread.
+static bool
+list_model_fetch_metadata(ListModel *list_model) {
+    GArray *results = list_model->results;
+    if (db_has_entry_metadata(list_model->db, (const uint32_t *)results->data, results->len)) {
+        return true;
+    }
+    if (list_model->metadata_fetch_pending) {
+        return false;
+    }
+    if (!list_model->metadata_pool) {
+        list_model->metadata_pool = g_thread_pool_new(list_model_metadata_fetch_worker, NULL, 1, FALSE, NULL);
+    }
+
+    ListModelMetadataFetch *fetch = g_new0(ListModelMetadataFetch, 1);
+    // keeps the model around until the fetch is done
+    fetch->list_model = g_object_ref(list_model);
+    db_ref(list_model->db);
+    fetch->db = list_model->db;
+    fetch->indices = g_array_sized_new(FALSE, FALSE, sizeof(uint32_t), results->len);
+    g_array_append_vals(fetch->indices, results->data, results->len);
+
+    list_model->metadata_fetch_pending = true;
+    g_thread_pool_push(list_model->metadata_pool, fetch, NULL);
+    return false;
+}
+
 void
 list_model_sort(ListModel *list_model) {
     g_return_if_fail(list_model);
@@ -1018,27 +1475,100 @@ list_model_sort(ListModel *list_model) {
     }
 
     trace("[list_model] sort started\n");
+    const gint64 stats_start = fsearch_stats_now();
     GTimer *timer = fsearch_timer_start();
-    /* resort */
-    g_ptr_array_sort_with_data(list_model->results, (GCompareDataFunc)list_model_qsort_compare_func, list_model);
+    // sort tasks are queued next to those of running searches and scans
+    FsearchThreadPool *pool = fsearch_thread_pool_get_default();
 
-    list_model_apply_sort(list_model);
+    /* resort */
+    GArray *results = list_model->results;
+    FsearchSortItem *items = NULL;
+    const uint32_t *ranks = list_model_get_sort_ranks(list_model);
+    if (!ranks && list_model_sort_needs_metadata(list_model) && !list_model_fetch_metadata(list_model)) {
+        // sorted again once the metadata is there
+        fsearch_timer_stop(timer, "[list_model] sort waits for the metadata after %.2f ms\n");
+        return;
+    }
+    if (ranks || (list_model->db && list_model->sort_id == SORT_ID_NAME)) {
+        // the database knows the rank of every entry, entries in name order are ranked by their position
+        items = g_new(FsearchSortItem, results->len);
+        for (uint32_t i = 0; i < results->len; i++) {
+            const uint32_t idx = g_array_index(results, uint32_t, i);
+            items[i].key = ranks ? ranks[idx] : idx;
+            items[i].data = GUINT_TO_POINTER(i);
+        }
+        fsearch_sort_by_rank(items, results->len);
+    }
+    else {
+        items = list_model_get_sort_items(list_model, pool);
+        // only names need a full comparison for equal keys, the other keys are exact
+        fsearch_sort(items,
+                     results->len,
+                     list_model->sort_id == SORT_ID_NAME ? list_model_sort_compare_entries : NULL,
+                     list_model,
+                     pool);
+    }
+    list_model_apply_sort(list_model, items, list_model->sort_order == GTK_SORT_DESCENDING);
+    g_free(items);
+    items = NULL;
 
     fsearch_timer_stop(timer, "[list_model] sort finished in %.2f ms\n");
     timer = NULL;
+    fsearch_stats_record(FSEARCH_STATS_TIME_LIST_SORT, stats_start);
+}
+
+bool
+list_model_needs_sort(ListModel *list_model) {
+    if (list_model->sort_id == SORT_ID_NONE) {
+        return false;
+    }
+    // results are in database order, which is ascending by name
+    return list_model->sort_id != SORT_ID_NAME || list_model->sort_order != GTK_SORT_ASCENDING;
 }
 
 void
 list_model_update_sort(ListModel *list_model) {
-    if (list_model->sort_id == SORT_ID_NAME && list_model->sort_order == GTK_SORT_ASCENDING) {
+    if (!list_model_needs_sort(list_model)) {
         return;
     }
     list_model_sort(list_model);
 }
 
 void
-list_model_set_results(ListModel *list, GPtrArray *results) {
-    list->node_cached = NULL;
+list_model_append_results(ListModel *list, GArray *results) {
+    g_return_if_fail(list->results);
+
+    const uint32_t first_row = list->results->len;
+    g_array_append_vals(list->results, results->data, results->len);
+    for (uint32_t row = first_row; row < list->results->len; row++) {
+        GtkTreeIter iter = {0};
+        list_model_iter_set_row(list, &iter, row);
+        GtkTreePath *path = gtk_tree_path_new();
+        gtk_tree_path_append_index(path, row);
+        gtk_tree_model_row_inserted(GTK_TREE_MODEL(list), path, &iter);
+        gtk_tree_path_free(path);
+    }
+}
+
+void
+list_model_set_results(ListModel *list, FsearchDatabase *db, GArray *results) {
+    if (db != list->db) {
+        // the values are kept by entry index, which only holds within one database
+        list_model_clear_cached_values(list);
+    }
+    list_model_set_visible_rows(list, -1, -1);
     list->results = results;
+    if (db) {
+        db_ref(db);
+    }
+    if (list->db) {
+        db_unref(list->db);
+    }
+    list->db = db;
 }
 
+void
+list_model_set_visible_rows(ListModel *list, gint first_row, gint last_row) {
+    g_atomic_int_set(&list->first_visible_row, first_row);
+    g_atomic_int_set(&list->last_visible_row, last_row);
+}
@@ -65,13 +65,29 @@ typedef struct _ListModelClass ListModelClass;
  *             crucial that 'parent' is the first member of the
  *             structure.                                          */
 
+// Values of a row which are expensive to compute: the path is built once,
+// the icon and type are looked up on value_pool. Kept per entry index for the
+// most recently shown rows.
 typedef struct ListModelCachedValue {
+    uint32_t idx;
+    // the row it was last shown in
+    uint32_t row;
+    GList *lru_link;
+
+    gchar *path;
+    gchar *type;
+    GIcon *icon;
+    bool lookup_pending;
+    bool lookup_done;
 } ListModelCachedValue;
 
 struct _ListModel {
     GObject parent; /* this MUST be the first member */
 
-    GPtrArray *results;
+    // indices into the entries of db, one per row
+    GArray *results;
+    // the database the results belong to
+    FsearchDatabase *db;
 
     /* These two fields are not absolutely necessary, but they    */
     /*   speed things up a bit in our get_value implementation    */
@@ -79,9 +95,18 @@ struct _ListModel {
     GType column_types[LIST_MODEL_N_COLUMNS];
 
     // Cached values for more efficient get_value calls
-    BTreeNode *node_cached;
-    GString *node_path;
-    GString *parent_path;
+    GHashTable *cached_values;
+    GQueue *cached_values_lru;
+    GThreadPool *value_pool;
+    // lookups of an older generation are dropped, it changes with the database
+    uint32_t value_generation;
+    uint32_t value_lookup_serial;
+    // reads the sizes and dates of the results of names only databases before they're sorted by them
+    GThreadPool *metadata_pool;
+    bool metadata_fetch_pending;
+    // rows the view shows, lookups far away from them are skipped; -1 if unknown
+    volatile gint first_visible_row;
+    volatile gint last_visible_row;
 
     gint sort_id;
     GtkSortType sort_order;
@@ -105,6 +130,10 @@ list_model_new(void);
 void
 list_model_sort(ListModel *list_model);
 
+// true if results in database order have to be sorted for the current sort column
+bool
+list_model_needs_sort(ListModel *list_model);
+
 void
 list_model_update_sort(ListModel *list_model);
 
@@ -112,8 +141,16 @@ void
 list_model_sort_init(ListModel *list_model, char *sort_by, bool sort_ascending);
 
 void
-list_model_set_results(ListModel *list, GPtrArray *results);
+list_model_set_results(ListModel *list, FsearchDatabase *db, GArray *results);
+
+// Appends the entry indices of results as new rows, results stays with the caller
+void
+list_model_append_results(ListModel *list, GArray *results);
+
+void
+list_model_remove_entry(ListModel *list, DatabaseSearch *search, uint32_t row);
 
+// Tells the model which rows are on screen, -1 if that's not known
 void
-list_model_remove_entry(ListModel *list, DatabaseSearch *search, DatabaseSearchEntry *entry);
+list_model_set_visible_rows(ListModel *list, gint first_row, gint last_row);
 
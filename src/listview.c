@@ -109,24 +109,25 @@ listview_path_cell_data_func(GtkTreeViewColumn *col,
         return;
     }
 
-    DatabaseSearchEntry *entry = iter->user_data;
-    BTreeNode *node = db_search_entry_get_node(entry);
+    BTreeNode *node = iter->user_data;
     if (!node) {
         return;
     }
 
-    char path[PATH_MAX] = "";
-    if ((q->has_separator && q->flags.auto_search_in_path) || q->flags.search_in_path) {
-        btree_node_get_path(node, path, sizeof(path));
-    }
-    else {
+    if (!(q->has_separator && q->flags.auto_search_in_path) && !q->flags.search_in_path) {
         g_object_set(G_OBJECT(cell), "attributes", NULL, NULL);
         return;
     }
 
-    PangoAttrList *attr = fsearch_query_highlight_match(q, path);
+    PangoAttrList *attr = fsearch_query_highlight_lookup(q, node, LIST_MODEL_COL_PATH);
     if (!attr) {
-        return;
+        char path[PATH_MAX] = "";
+        btree_node_get_path(node, path, sizeof(path));
+        attr = fsearch_query_highlight_match(q, path);
+        if (!attr) {
+            return;
+        }
+        fsearch_query_highlight_store(q, node, LIST_MODEL_COL_PATH, attr);
     }
 
     g_object_set(G_OBJECT(cell), "attributes", attr, NULL);
@@ -145,15 +146,18 @@ listview_name_cell_data_func(GtkTreeViewColumn *col,
         return;
     }
 
-    DatabaseSearchEntry *entry = iter->user_data;
-    BTreeNode *node = db_search_entry_get_node(entry);
+    BTreeNode *node = iter->user_data;
     if (!node) {
         return;
     }
 
-    PangoAttrList *attr = fsearch_query_highlight_match(q, node->name);
+    PangoAttrList *attr = fsearch_query_highlight_lookup(q, node, LIST_MODEL_COL_NAME);
     if (!attr) {
-        return;
+        attr = fsearch_query_highlight_match(q, node->name);
+        if (!attr) {
+            return;
+        }
+        fsearch_query_highlight_store(q, node, LIST_MODEL_COL_NAME, attr);
     }
 
     g_object_set(G_OBJECT(cell), "attributes", attr, NULL);
@@ -27,13 +27,11 @@
 
 static void
 fill_open_with_menu(GtkTreeView *view, GtkBuilder *builder, GtkTreeIter *iter) {
-    DatabaseSearchEntry *entry = (DatabaseSearchEntry *)iter->user_data;
-    if (!entry) {
+    BTreeNode *node = (BTreeNode *)iter->user_data;
+    if (!node) {
         return;
     }
 
-    BTreeNode *node = db_search_entry_get_node(entry);
-
     GList *app_list = NULL;
     char *content_type = NULL;
 
@@ -242,6 +242,9 @@ preferences_ui_launch(FsearchConfig *config,
     GtkToggleButton *show_base_2_units =
         toggle_button_get(builder, "show_base_2_units", "help_units", pref.config->show_base_2_units);
 
+    GtkToggleButton *show_folder_sizes =
+        toggle_button_get(builder, "show_folder_sizes", "help_folder_sizes", pref.config->show_folder_sizes);
+
     GtkBox *action_after_file_open_box =
         GTK_BOX(builder_init_widget(builder, "action_after_file_open_box", "help_action_after_open"));
     GtkComboBox *action_after_file_open =
@@ -372,6 +375,7 @@ preferences_ui_launch(FsearchConfig *config,
         pref.config->restore_window_size = gtk_toggle_button_get_active(restore_win_size_button);
         pref.config->update_database_on_launch = gtk_toggle_button_get_active(update_db_at_start_button);
         pref.config->show_base_2_units = gtk_toggle_button_get_active(show_base_2_units);
+        pref.config->show_folder_sizes = gtk_toggle_button_get_active(show_folder_sizes);
         pref.config->action_after_file_open = gtk_combo_box_get_active(action_after_file_open);
         pref.config->action_after_file_open_keyboard = gtk_toggle_button_get_active(action_after_file_open_keyboard);
         pref.config->action_after_file_open_mouse = gtk_toggle_button_get_active(action_after_file_open_mouse);
@@ -30,6 +30,7 @@ fsearch_query_new(const char *text,
                   FsearchFilter *filter,
                   void (*callback)(void *),
                   void *callback_data,
+                  void (*callback_partial)(void *),
                   void (*callback_cancelled)(void *),
                   void *callback_cancelled_data,
                   uint32_t max_results,
@@ -41,24 +42,26 @@ fsearch_query_new(const char *text,
         q->text = strdup(text);
     }
 
-    q->token = fsearch_tokens_new(text, flags.match_case, flags.enable_regex, flags.auto_match_case);
+    q->token = fsearch_tokens_new(text, flags.match_case, flags.enable_regex, flags.enable_fuzzy, flags.auto_match_case);
     q->num_token = 0;
     for (uint32_t i = 0; q->token[i] != NULL; i++) {
         q->num_token++;
     }
 
     if (filter && filter->query) {
-        q->filter_token = fsearch_tokens_new(filter->query, filter->match_case, filter->enable_regex, false);
+        q->filter_token = fsearch_tokens_new(filter->query, filter->match_case, filter->enable_regex, false, false);
         q->num_filter_token = 0;
         for (uint32_t i = 0; q->filter_token[i] != NULL; i++) {
             q->num_filter_token++;
         }
+        q->filter_extensions = fsearch_filter_get_extensions(filter);
     }
 
     q->db = db;
     q->filter = filter;
     q->callback = callback;
     q->callback_data = callback_data;
+    q->callback_partial = callback_partial;
     q->callback_cancelled = callback_cancelled;
     q->callback_cancelled_data = callback_cancelled_data;
     q->max_results = max_results;
@@ -78,6 +81,12 @@ fsearch_query_free(FsearchQuery *query) {
         fsearch_tokens_free(query->token);
         query->token = NULL;
     }
+    if (query->filter_token) {
+        fsearch_tokens_free(query->filter_token);
+        query->filter_token = NULL;
+    }
+    g_strfreev(query->filter_extensions);
+    query->filter_extensions = NULL;
     free(query);
     query = NULL;
 }
@@ -105,6 +114,18 @@ fsearch_query_highlight_match_glob(FsearchQueryHighlightToken *token, const char
     return true;
 }
 
+static void
+fsearch_query_highlight_match_literal(FsearchQueryHighlightToken *token, const char *text, PangoAttrList *attr) {
+    const char *match = text;
+    while ((match = token->match_case ? strstr(match, token->text) : strcasestr(match, token->text))) {
+        PangoAttribute *pa = pango_attr_weight_new(PANGO_WEIGHT_BOLD);
+        pa->start_index = match - text;
+        pa->end_index = pa->start_index + token->query_len;
+        pango_attr_list_insert(attr, pa);
+        match += token->query_len;
+    }
+}
+
 PangoAttrList *
 fsearch_query_highlight_match(FsearchQueryHighlight *q, const char *input) {
     PangoAttrList *attr = pango_attr_list_new();
@@ -113,11 +134,16 @@ fsearch_query_highlight_match(FsearchQueryHighlight *q, const char *input) {
     GList *l = q->token;
     while (l) {
         FsearchQueryHighlightToken *token = l->data;
-        if (!token || !token->regex) {
+        if (!token || (!token->regex && !token->is_literal)) {
             break;
         }
         l = l->next;
 
+        if (token->is_literal) {
+            fsearch_query_highlight_match_literal(token, input, attr);
+            continue;
+        }
+
         if (token->is_supported_glob && fsearch_query_highlight_match_glob(token, input, q->flags.match_case)) {
             PangoAttribute *pa = pango_attr_weight_new(PANGO_WEIGHT_BOLD);
             pa->start_index = token->hl_start;
@@ -145,6 +171,33 @@ fsearch_query_highlight_match(FsearchQueryHighlight *q, const char *input) {
     return attr;
 }
 
+static uint32_t
+fsearch_query_highlight_cache_slot(const void *row, uint32_t column) {
+    // the rows are pointers to entries, whose lowest bits are always the same
+    const uint64_t key = ((uintptr_t)row >> 3) * 2 + column;
+    return (uint32_t)((key * 0x9e3779b97f4a7c15ull) >> 32) % FSEARCH_QUERY_HIGHLIGHT_CACHE_SIZE;
+}
+
+PangoAttrList *
+fsearch_query_highlight_lookup(FsearchQueryHighlight *q, const void *row, uint32_t column) {
+    FsearchQueryHighlightCacheEntry *entry = &q->cache[fsearch_query_highlight_cache_slot(row, column)];
+    if (!entry->attr || entry->row != row || entry->column != column) {
+        return NULL;
+    }
+    return pango_attr_list_ref(entry->attr);
+}
+
+void
+fsearch_query_highlight_store(FsearchQueryHighlight *q, const void *row, uint32_t column, PangoAttrList *attr) {
+    FsearchQueryHighlightCacheEntry *entry = &q->cache[fsearch_query_highlight_cache_slot(row, column)];
+    if (entry->attr) {
+        pango_attr_list_unref(entry->attr);
+    }
+    entry->row = row;
+    entry->column = column;
+    entry->attr = pango_attr_list_ref(attr);
+}
+
 static void
 fsearch_query_highlight_token_glob_init(FsearchQueryHighlightToken *token, char *text) {
     if (!token) {
@@ -224,19 +277,27 @@ fsearch_query_highlight_new(const char *text, FsearchQueryFlags flags) {
             FsearchQueryHighlightToken *token = fsearch_query_highlight_token_new();
             assert(token != NULL);
 
-            gchar *query_escaped = g_regex_escape_string(queries[i], -1);
-
-            bool has_uppercase = fs_str_utf8_has_upper(query_escaped);
+            bool has_uppercase = fs_str_utf8_has_upper(queries[i]);
             bool query_match_case = false;
             if (!flags.match_case && flags.auto_match_case) {
                 query_match_case = has_uppercase ? true : false;
             }
-            token->regex = g_regex_new(query_escaped, !query_match_case ? G_REGEX_CASELESS : 0, 0, NULL);
-            g_free(query_escaped);
-            query_escaped = NULL;
 
             fsearch_query_highlight_token_glob_init(token, queries[i]);
 
+            // strcasestr only knows the case of ASCII letters, other text takes the regex
+            if (token->query_len > 0 && !strpbrk(queries[i], "*?")
+                && (query_match_case || !fs_str_is_utf8(queries[i]))) {
+                token->is_literal = true;
+                token->match_case = query_match_case;
+            }
+            else {
+                gchar *query_escaped = g_regex_escape_string(queries[i], -1);
+                token->regex = g_regex_new(query_escaped, !query_match_case ? G_REGEX_CASELESS : 0, 0, NULL);
+                g_free(query_escaped);
+                query_escaped = NULL;
+            }
+
             q->token = g_list_append(q->token, token);
         }
 
@@ -266,6 +327,11 @@ fsearch_query_highlight_token_free(FsearchQueryHighlightToken *token) {
 
 void
 fsearch_query_highlight_free(FsearchQueryHighlight *q) {
+    for (uint32_t i = 0; i < FSEARCH_QUERY_HIGHLIGHT_CACHE_SIZE; i++) {
+        if (q->cache[i].attr) {
+            pango_attr_list_unref(q->cache[i].attr);
+        }
+    }
     if (q->token) {
         g_list_free_full(q->token, (GDestroyNotify)fsearch_query_highlight_token_free);
     }
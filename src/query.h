@@ -30,12 +30,20 @@ typedef struct FsearchQueryFlags {
     bool match_case;
     bool auto_match_case;
     bool enable_regex;
+    // words match with a few typos or as a subsequence, the best matches come first
+    bool enable_fuzzy;
+    // the best matches come first: exact names, then those which start with a word, then the
+    // ones with a word at a word boundary and then anywhere, shallow and recent entries first
+    bool enable_ranking;
     bool search_in_path;
     bool auto_search_in_path;
 } FsearchQueryFlags;
 
 typedef struct FsearchQueryHighlightToken {
     GRegex *regex;
+    // plain text, found with strstr/strcasestr instead of the regex
+    bool is_literal;
+    bool match_case;
 
     bool is_supported_glob;
     bool start_with_asterisk;
@@ -48,11 +56,22 @@ typedef struct FsearchQueryHighlightToken {
     size_t query_len;
 } FsearchQueryHighlightToken;
 
+// the attributes of the rows drawn last, GTK asks for every visible cell's again and again
+#define FSEARCH_QUERY_HIGHLIGHT_CACHE_SIZE 512
+
+typedef struct FsearchQueryHighlightCacheEntry {
+    const void *row;
+    uint32_t column;
+    PangoAttrList *attr;
+} FsearchQueryHighlightCacheEntry;
+
 typedef struct FsearchQueryHighlight {
     GList *token;
 
     FsearchQueryFlags flags;
     bool has_separator;
+
+    FsearchQueryHighlightCacheEntry cache[FSEARCH_QUERY_HIGHLIGHT_CACHE_SIZE];
 } FsearchQueryHighlight;
 
 typedef struct FsearchQuery {
@@ -65,6 +84,8 @@ typedef struct FsearchQuery {
 
     FsearchToken **filter_token;
     uint32_t num_filter_token;
+    // if the filter's query only checks the extension, the ones it accepts
+    char **filter_extensions;
 
     uint32_t max_results;
 
@@ -73,6 +94,9 @@ typedef struct FsearchQuery {
 
     void (*callback)(void *);
     void *callback_data;
+    // if set, gets the matches found so far while a slow search is still
+    // running, with the same callback_data
+    void (*callback_partial)(void *);
     void (*callback_cancelled)(void *);
     void *callback_cancelled_data;
 } FsearchQuery;
@@ -83,6 +107,7 @@ fsearch_query_new(const char *text,
                   FsearchFilter *filter,
                   void (*callback)(void *),
                   void *callback_data,
+                  void (*callback_partial)(void *),
                   void (*callback_cancelled)(void *),
                   void *callback_cancelled_data,
                   uint32_t max_results,
@@ -95,6 +120,14 @@ fsearch_query_free(FsearchQuery *query);
 PangoAttrList *
 fsearch_query_highlight_match(FsearchQueryHighlight *q, const char *input);
 
+// A new reference to the attributes stored for the column of row, NULL if they aren't kept anymore
+PangoAttrList *
+fsearch_query_highlight_lookup(FsearchQueryHighlight *q, const void *row, uint32_t column);
+
+// Keeps attr for the column of row, until the slot is needed for another one
+void
+fsearch_query_highlight_store(FsearchQueryHighlight *q, const void *row, uint32_t column, PangoAttrList *attr);
+
 FsearchQueryHighlight *
 fsearch_query_highlight_new(const char *text, FsearchQueryFlags flags);
 
@@ -16,14 +16,259 @@
    along with this program; if not, see <http://www.gnu.org/licenses/>.
    */
 
+#define _GNU_SOURCE
 #include "string_utils.h"
 #include <assert.h>
 #include <ctype.h>
 #include <glib.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#define FS_STR_HAVE_SSE2 1
+#define FS_STR_HAVE_AVX2 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define FS_STR_HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+// the vector kernels handle needles up to this length, longer ones are rare
+// enough to be left to strcasestr
+#define FS_STR_CASE_CONTAINS_MAX_NEEDLE 32
+// a block plus the needle length, the bytes a kernel reads per step
+#define FS_STR_CASE_WINDOW 64
+#define FS_STR_PAGE_SIZE 4096
+
+typedef bool (*FsStrCaseScanFunc)(const char *haystack, const char *needle, size_t needle_len);
+
+static inline char
+fs_str_ascii_tolower(char c) {
+    return (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+}
+
+static inline char
+fs_str_ascii_case_bit(char c) {
+    // or-ing this bit into a haystack byte maps it to c if it's c in either case
+    return (c >= 'a' && c <= 'z') ? 0x20 : 0;
+}
+
+static inline bool
+fs_str_case_equal(const char *s, const char *needle, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (fs_str_ascii_tolower(s[i]) != needle[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static inline const char *
+fs_str_case_window(const char *p, char window[FS_STR_CASE_WINDOW]) {
+    // the kernels don't know the haystack length and read past its end, which is fine
+    // as long as they stay on the same page. Close to a page end a zero padded copy is used,
+    // needle bytes are never zero, so the padding can't produce a match
+    if (((uintptr_t)p & (FS_STR_PAGE_SIZE - 1)) <= FS_STR_PAGE_SIZE - FS_STR_CASE_WINDOW) {
+        return p;
+    }
+    const size_t len = strnlen(p, FS_STR_CASE_WINDOW);
+    memcpy(window, p, len);
+    memset(window + len, 0, FS_STR_CASE_WINDOW - len);
+    return window;
+}
+
+// In every block the first and last needle byte are compared at all positions at once,
+// only positions where both match are compared in full. Matches after the terminating
+// zero of the haystack are masked out.
+
+#ifdef FS_STR_HAVE_AVX2
+__attribute__((target("avx2"), no_sanitize_address)) static bool
+fs_str_case_scan_avx2(const char *haystack, const char *needle, size_t needle_len) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
+    const __m256i first_bit = _mm256_set1_epi8(fs_str_ascii_case_bit(needle[0]));
+    const __m256i last_bit = _mm256_set1_epi8(fs_str_ascii_case_bit(needle[needle_len - 1]));
+    const size_t middle_len = needle_len > 2 ? needle_len - 2 : 0;
+
+    char window[FS_STR_CASE_WINDOW];
+    for (size_t i = 0;; i += 32) {
+        const char *p = fs_str_case_window(haystack + i, window);
+        const __m256i block_first = _mm256_loadu_si256((const __m256i *)p);
+        const __m256i block_last = _mm256_loadu_si256((const __m256i *)(p + needle_len - 1));
+        const __m256i eq_first = _mm256_cmpeq_epi8(first, _mm256_or_si256(block_first, first_bit));
+        const __m256i eq_last = _mm256_cmpeq_epi8(last, _mm256_or_si256(block_last, last_bit));
+        const uint32_t zero_mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block_first, zero));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(eq_first, eq_last));
+        if (zero_mask) {
+            mask &= (zero_mask & -zero_mask) - 1;
+        }
+        while (mask) {
+            const uint32_t pos = __builtin_ctz(mask);
+            if (fs_str_case_equal(p + pos + 1, needle + 1, middle_len)) {
+                return true;
+            }
+            mask &= mask - 1;
+        }
+        if (zero_mask) {
+            return false;
+        }
+    }
+}
+#endif
+
+#ifdef FS_STR_HAVE_SSE2
+__attribute__((no_sanitize_address)) static bool
+fs_str_case_scan_sse2(const char *haystack, const char *needle, size_t needle_len) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+    const __m128i first_bit = _mm_set1_epi8(fs_str_ascii_case_bit(needle[0]));
+    const __m128i last_bit = _mm_set1_epi8(fs_str_ascii_case_bit(needle[needle_len - 1]));
+    const size_t middle_len = needle_len > 2 ? needle_len - 2 : 0;
+
+    char window[FS_STR_CASE_WINDOW];
+    for (size_t i = 0;; i += 16) {
+        const char *p = fs_str_case_window(haystack + i, window);
+        const __m128i block_first = _mm_loadu_si128((const __m128i *)p);
+        const __m128i block_last = _mm_loadu_si128((const __m128i *)(p + needle_len - 1));
+        const __m128i eq_first = _mm_cmpeq_epi8(first, _mm_or_si128(block_first, first_bit));
+        const __m128i eq_last = _mm_cmpeq_epi8(last, _mm_or_si128(block_last, last_bit));
+        const uint32_t zero_mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block_first, zero));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(eq_first, eq_last));
+        if (zero_mask) {
+            mask &= (zero_mask & -zero_mask) - 1;
+        }
+        while (mask) {
+            const uint32_t pos = __builtin_ctz(mask);
+            if (fs_str_case_equal(p + pos + 1, needle + 1, middle_len)) {
+                return true;
+            }
+            mask &= mask - 1;
+        }
+        if (zero_mask) {
+            return false;
+        }
+    }
+}
+#endif
+
+#ifdef FS_STR_HAVE_NEON
+static inline uint64_t
+fs_str_neon_mask(uint8x16_t v) {
+    // narrow the byte mask to one nibble per byte
+    const uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(v), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+}
+
+__attribute__((no_sanitize_address)) static bool
+fs_str_case_scan_neon(const char *haystack, const char *needle, size_t needle_len) {
+    const uint8x16_t zero = vdupq_n_u8(0);
+    const uint8x16_t first = vdupq_n_u8(needle[0]);
+    const uint8x16_t last = vdupq_n_u8(needle[needle_len - 1]);
+    const uint8x16_t first_bit = vdupq_n_u8(fs_str_ascii_case_bit(needle[0]));
+    const uint8x16_t last_bit = vdupq_n_u8(fs_str_ascii_case_bit(needle[needle_len - 1]));
+    const size_t middle_len = needle_len > 2 ? needle_len - 2 : 0;
+
+    char window[FS_STR_CASE_WINDOW];
+    for (size_t i = 0;; i += 16) {
+        const char *p = fs_str_case_window(haystack + i, window);
+        const uint8x16_t block_first = vld1q_u8((const uint8_t *)p);
+        const uint8x16_t block_last = vld1q_u8((const uint8_t *)(p + needle_len - 1));
+        const uint8x16_t eq_first = vceqq_u8(first, vorrq_u8(block_first, first_bit));
+        const uint8x16_t eq_last = vceqq_u8(last, vorrq_u8(block_last, last_bit));
+        const uint64_t zero_mask = fs_str_neon_mask(vceqq_u8(block_first, zero));
+        uint64_t mask = fs_str_neon_mask(vandq_u8(eq_first, eq_last));
+        if (zero_mask) {
+            mask &= (zero_mask & -zero_mask) - 1;
+        }
+        while (mask) {
+            const uint32_t pos = __builtin_ctzll(mask) >> 2;
+            if (fs_str_case_equal(p + pos + 1, needle + 1, middle_len)) {
+                return true;
+            }
+            mask &= ~(0xfull << (pos * 4));
+        }
+        if (zero_mask) {
+            return false;
+        }
+    }
+}
+#endif
+
+static FsStrCaseScanFunc fs_str_case_scan_func = NULL;
+static gsize fs_str_case_scan_initialized = 0;
+
+static void
+fs_str_case_scan_init(void) {
+    if (!g_once_init_enter(&fs_str_case_scan_initialized)) {
+        return;
+    }
+#if defined(FS_STR_HAVE_AVX2)
+    fs_str_case_scan_func = __builtin_cpu_supports("avx2") ? fs_str_case_scan_avx2 : fs_str_case_scan_sse2;
+#elif defined(FS_STR_HAVE_NEON)
+    fs_str_case_scan_func = fs_str_case_scan_neon;
+#endif
+    g_once_init_leave(&fs_str_case_scan_initialized, 1);
+}
+
+bool
+fs_str_case_contains(const char *haystack, const char *needle, size_t needle_len) {
+    assert(haystack != NULL);
+    assert(needle != NULL);
+
+    if (needle_len == 0) {
+        return true;
+    }
+    if (G_UNLIKELY(!fs_str_case_scan_initialized)) {
+        fs_str_case_scan_init();
+    }
+    const FsStrCaseScanFunc scan_func = fs_str_case_scan_func;
+    if (!scan_func || needle_len > FS_STR_CASE_CONTAINS_MAX_NEEDLE) {
+        return strcasestr(haystack, needle) ? true : false;
+    }
+    return scan_func(haystack, needle, needle_len);
+}
+
+char *
+fs_str_fold(const char *str) {
+    assert(str != NULL);
+
+    bool is_ascii = true;
+    bool has_upper = false;
+    for (const char *c = str; *c; c++) {
+        if (*c & 0x80) {
+            is_ascii = false;
+            break;
+        }
+        if (*c >= 'A' && *c <= 'Z') {
+            has_upper = true;
+        }
+    }
+    if (is_ascii && !has_upper) {
+        return NULL;
+    }
+
+    char *folded = NULL;
+    char *normalized = is_ascii ? NULL : g_utf8_normalize(str, -1, G_NORMALIZE_DEFAULT);
+    if (normalized) {
+        folded = g_utf8_strdown(normalized, -1);
+        g_free(normalized);
+        normalized = NULL;
+    }
+    else {
+        // ASCII or invalid encoding, which the search matches with strcasestr
+        folded = g_ascii_strdown(str, -1);
+    }
+    if (!strcmp(folded, str)) {
+        g_free(folded);
+        return NULL;
+    }
+    return folded;
+}
+
 bool
 fs_str_is_empty(const char *str) {
     // query is considered empty if:
@@ -41,3 +41,12 @@ fs_str_split(const char *str);
 bool
 fs_str_is_utf8(const char *str);
 
+// the normalized, lower case version of str which case insensitive UTF-8
+// searches compare against, NULL if that's str itself
+char *
+fs_str_fold(const char *str);
+
+// case insensitive substring search for ASCII, needle has to be lower case
+bool
+fs_str_case_contains(const char *haystack, const char *needle, size_t needle_len);
+
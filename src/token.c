@@ -8,11 +8,297 @@
 #include <glib.h>
 #include <string.h>
 
+#define FSEARCH_REGEX_JIT_STACK_START (32 * 1024)
+#define FSEARCH_REGEX_JIT_STACK_MAX (512 * 1024)
+// fuzzy patterns are matched with one bit per byte in a 64 bit word, longer ones aren't fuzzy
+#define FSEARCH_FUZZY_MAX_LEN 64
+#define FSEARCH_FUZZY_MAX_EDITS 2
+// names matched at once by fsearch_token_fuzzy_match_names, four fill an AVX2 register
+#define FSEARCH_FUZZY_LANES 4
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define FSEARCH_FUZZY_HAVE_AVX2 1
+#endif
+
+// Everything pcre2 writes to while matching. The search threads all share the
+// same tokens, so every thread gets its own set, which is reused for all tokens.
+typedef struct {
+    pcre2_match_data *match_data;
+    pcre2_match_context *match_context;
+    pcre2_jit_stack *jit_stack;
+} FsearchRegexThreadData;
+
+static void
+fsearch_regex_thread_data_free(gpointer data) {
+    FsearchRegexThreadData *thread_data = data;
+    if (!thread_data) {
+        return;
+    }
+    pcre2_match_data_free(thread_data->match_data);
+    pcre2_match_context_free(thread_data->match_context);
+    pcre2_jit_stack_free(thread_data->jit_stack);
+    g_free(thread_data);
+    thread_data = NULL;
+}
+
+static GPrivate fsearch_regex_thread_data = G_PRIVATE_INIT(fsearch_regex_thread_data_free);
+
+static FsearchRegexThreadData *
+fsearch_regex_thread_data_get(void) {
+    FsearchRegexThreadData *thread_data = g_private_get(&fsearch_regex_thread_data);
+    if (thread_data) {
+        return thread_data;
+    }
+    thread_data = g_new0(FsearchRegexThreadData, 1);
+    // only whether it matches is of interest, so a single pair is enough for every pattern
+    thread_data->match_data = pcre2_match_data_create(1, NULL);
+    assert(thread_data->match_data != NULL);
+    thread_data->match_context = pcre2_match_context_create(NULL);
+    assert(thread_data->match_context != NULL);
+    thread_data->jit_stack = pcre2_jit_stack_create(FSEARCH_REGEX_JIT_STACK_START, FSEARCH_REGEX_JIT_STACK_MAX, NULL);
+    if (thread_data->jit_stack) {
+        pcre2_jit_stack_assign(thread_data->match_context, NULL, thread_data->jit_stack);
+    }
+    g_private_set(&fsearch_regex_thread_data, thread_data);
+    return thread_data;
+}
+
+static uint32_t
+fsearch_search_func_regex_len(const char *haystack, size_t haystack_len, void *data) {
+    FsearchToken *t = data;
+    if (!t->regex) {
+        // invalid pattern
+        return 0;
+    }
+    FsearchRegexThreadData *thread_data = fsearch_regex_thread_data_get();
+    int res = 0;
+    if (t->regex_jit) {
+        res = pcre2_jit_match(t->regex,
+                              (PCRE2_SPTR)haystack,
+                              haystack_len,
+                              0,
+                              0,
+                              thread_data->match_data,
+                              thread_data->match_context);
+    }
+    else {
+        res = pcre2_match(t->regex,
+                          (PCRE2_SPTR)haystack,
+                          haystack_len,
+                          0,
+                          0,
+                          thread_data->match_data,
+                          thread_data->match_context);
+    }
+    return res >= 0 ? 1 : 0;
+}
+
 static uint32_t
 fsearch_search_func_regex(const char *haystack, const char *needle, void *data) {
+    return fsearch_search_func_regex_len(haystack, strlen(haystack), data);
+}
+
+// A wildcard pattern made of ASCII characters, '*' and '?', split at the stars
+// into segments which are matched from left to right.
+typedef struct {
+    char *text;
+    size_t len;
+    // the segment contains '?', otherwise it's literal text
+    bool has_any_char;
+} FsearchGlobSegment;
+
+struct FsearchGlob {
+    FsearchGlobSegment *segments;
+    uint32_t num_segments;
+    // the pattern doesn't start/end with a star
+    bool anchored_start;
+    bool anchored_end;
+    bool match_case;
+};
+
+static inline size_t
+fsearch_glob_char_len(const char *s, size_t len) {
+    // '?' matches one character, which is a whole UTF-8 sequence
+    const uint8_t c = (uint8_t)s[0];
+    const size_t char_len = c < 0xc0 ? 1 : c < 0xe0 ? 2 : c < 0xf0 ? 3 : 4;
+    return MIN(char_len, len);
+}
+
+static inline bool
+fsearch_glob_segment_match_at(FsearchGlob *glob,
+                              FsearchGlobSegment *segment,
+                              const char *haystack,
+                              size_t haystack_len,
+                              size_t start,
+                              size_t *end) {
+    if (!segment->has_any_char) {
+        if (haystack_len - start < segment->len) {
+            return false;
+        }
+        if (glob->match_case) {
+            if (memcmp(haystack + start, segment->text, segment->len)) {
+                return false;
+            }
+        }
+        else if (g_ascii_strncasecmp(haystack + start, segment->text, segment->len)) {
+            return false;
+        }
+        *end = start + segment->len;
+        return true;
+    }
+
+    size_t pos = start;
+    for (size_t i = 0; i < segment->len; i++) {
+        if (pos >= haystack_len) {
+            return false;
+        }
+        const char c = segment->text[i];
+        if (c == '?') {
+            pos += fsearch_glob_char_len(haystack + pos, haystack_len - pos);
+            continue;
+        }
+        const char h = glob->match_case ? haystack[pos] : g_ascii_tolower(haystack[pos]);
+        if (h != c) {
+            return false;
+        }
+        pos++;
+    }
+    *end = pos;
+    return true;
+}
+
+static inline bool
+fsearch_glob_is_char_start(char c) {
+    return ((uint8_t)c & 0xc0) != 0x80;
+}
+
+static bool
+fsearch_glob_match(FsearchGlob *glob, const char *haystack, size_t haystack_len) {
+    const uint32_t num_segments = glob->num_segments;
+    if (num_segments == 0) {
+        // only stars
+        return true;
+    }
+
+    size_t pos = 0;
+    uint32_t first = 0;
+    uint32_t last = num_segments;
+    if (glob->anchored_start) {
+        if (!fsearch_glob_segment_match_at(glob, &glob->segments[0], haystack, haystack_len, 0, &pos)) {
+            return false;
+        }
+        if (num_segments == 1) {
+            return glob->anchored_end ? pos == haystack_len : true;
+        }
+        first = 1;
+    }
+    if (glob->anchored_end) {
+        last = num_segments - 1;
+    }
+
+    // the leftmost match of every segment leaves the most room for the following ones
+    for (uint32_t i = first; i < last; i++) {
+        FsearchGlobSegment *segment = &glob->segments[i];
+        if (glob->match_case && !segment->has_any_char) {
+            const char *match = memmem(haystack + pos, haystack_len - pos, segment->text, segment->len);
+            if (!match) {
+                return false;
+            }
+            pos = match - haystack + segment->len;
+            continue;
+        }
+        const char first_char = segment->text[0];
+        bool found = false;
+        for (size_t start = pos; start < haystack_len; start++) {
+            const char h = glob->match_case ? haystack[start] : g_ascii_tolower(haystack[start]);
+            if (first_char != '?' ? h != first_char : !fsearch_glob_is_char_start(h)) {
+                continue;
+            }
+            if (fsearch_glob_segment_match_at(glob, segment, haystack, haystack_len, start, &pos)) {
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            return false;
+        }
+    }
+    if (!glob->anchored_end) {
+        return true;
+    }
+
+    FsearchGlobSegment *segment = &glob->segments[num_segments - 1];
+    size_t end = 0;
+    if (!segment->has_any_char) {
+        // a literal suffix, like the extension in *.jpg
+        return haystack_len - pos >= segment->len
+            && fsearch_glob_segment_match_at(glob, segment, haystack, haystack_len, haystack_len - segment->len, &end);
+    }
+    for (size_t start = pos; start < haystack_len; start++) {
+        if (fsearch_glob_is_char_start(haystack[start])
+            && fsearch_glob_segment_match_at(glob, segment, haystack, haystack_len, start, &end)
+            && end == haystack_len) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static FsearchGlob *
+fsearch_glob_new(const char *pattern, bool match_case) {
+    for (const char *c = pattern; *c; c++) {
+        if ((*c & 0x80) || *c == '[' || *c == '\\') {
+            // bracket expressions, escapes and multibyte characters are left to fnmatch
+            return NULL;
+        }
+    }
+
+    FsearchGlob *glob = calloc(1, sizeof(FsearchGlob));
+    assert(glob != NULL);
+
+    const size_t pattern_len = strlen(pattern);
+    glob->match_case = match_case;
+    glob->anchored_start = pattern_len > 0 && pattern[0] != '*';
+    glob->anchored_end = pattern_len > 0 && pattern[pattern_len - 1] != '*';
+
+    char **parts = g_strsplit(pattern, "*", -1);
+    glob->segments = calloc(g_strv_length(parts) + 1, sizeof(FsearchGlobSegment));
+    assert(glob->segments != NULL);
+    for (uint32_t i = 0; parts[i]; i++) {
+        if (parts[i][0] == '\0') {
+            continue;
+        }
+        FsearchGlobSegment *segment = &glob->segments[glob->num_segments++];
+        segment->text = g_strdup(parts[i]);
+        segment->len = strlen(parts[i]);
+        segment->has_any_char = strchr(parts[i], '?') ? true : false;
+    }
+    g_strfreev(parts);
+    return glob;
+}
+
+static void
+fsearch_glob_free(FsearchGlob *glob) {
+    if (!glob) {
+        return;
+    }
+    for (uint32_t i = 0; i < glob->num_segments; i++) {
+        g_free(glob->segments[i].text);
+    }
+    free(glob->segments);
+    free(glob);
+    glob = NULL;
+}
+
+static uint32_t
+fsearch_search_func_glob_len(const char *haystack, size_t haystack_len, void *data) {
     FsearchToken *t = data;
-    size_t haystack_len = strlen(haystack);
-    return pcre_exec(t->regex, t->regex_study, haystack, haystack_len, 0, 0, t->ovector, OVECCOUNT) >= 0 ? 1 : 0;
+    return fsearch_glob_match(t->glob, haystack, haystack_len) ? 1 : 0;
+}
+
+static uint32_t
+fsearch_search_func_glob(const char *haystack, const char *needle, void *data) {
+    return fsearch_search_func_glob_len(haystack, strlen(haystack), data);
 }
 
 static uint32_t
@@ -27,7 +313,8 @@ fsearch_search_func_wildcard(const char *haystack, const char *needle, void *dat
 
 static uint32_t
 fsearch_search_func_normal_icase_u8(const char *haystack, const char *needle, void *data) {
-    // TODO: make this faster
+    // searches of names use the folded copies from the entry table instead,
+    // this is left for paths and databases without a table
     char *haystack_normalized = g_utf8_normalize(haystack, -1, G_NORMALIZE_DEFAULT);
     if (haystack_normalized == NULL) {
         trace("[search] file has invalid encoding: %s\n", haystack);
@@ -42,7 +329,8 @@ fsearch_search_func_normal_icase_u8(const char *haystack, const char *needle, vo
 
 static uint32_t
 fsearch_search_func_normal_icase(const char *haystack, const char *needle, void *data) {
-    return strcasestr(haystack, needle) ? 1 : 0;
+    FsearchToken *t = data;
+    return fs_str_case_contains(haystack, needle, t->text_len) ? 1 : 0;
 }
 
 static uint32_t
@@ -50,6 +338,206 @@ fsearch_search_func_normal(const char *haystack, const char *needle, void *data)
     return strstr(haystack, needle) ? 1 : 0;
 }
 
+// Where text is in haystack, the whole of it, its start, the start of a word or anywhere
+static uint32_t
+fsearch_token_get_position_score(FsearchToken *t, const char *haystack) {
+    const size_t len = strlen(t->text);
+    uint32_t score = FSEARCH_TOKEN_SCORE_NONE;
+    const char *match = haystack;
+    while ((match = t->match_case ? strstr(match, t->text) : strcasestr(match, t->text))) {
+        if (match == haystack) {
+            if (match[len] == '\0') {
+                return FSEARCH_TOKEN_SCORE_EXACT;
+            }
+            score = FSEARCH_TOKEN_SCORE_PREFIX;
+        }
+        else if ((uint8_t)match[-1] < 0x80 && !g_ascii_isalnum(match[-1])) {
+            // nothing later beats that, only a match at the start would
+            return MAX(score, FSEARCH_TOKEN_SCORE_WORD);
+        }
+        else {
+            score = MAX(score, FSEARCH_TOKEN_SCORE_SUBSTRING);
+        }
+        match++;
+    }
+    return score;
+}
+
+// Myers' bit-parallel edit distance, the fewest edits which turn text into any part of the haystack.
+// Column by column every bit of pv/mv tells whether the distance goes up/down by one from the row
+// above, so each byte of the haystack takes a few word operations instead of a row of cells.
+// Whether text is a subsequence of the haystack is found in the same pass.
+static uint32_t
+fsearch_search_func_fuzzy(const char *haystack, const char *needle, void *data) {
+    FsearchToken *t = data;
+    const uint64_t *peq = t->fuzzy_peq;
+    const uint32_t len = (uint32_t)t->text_len;
+    const uint64_t last = (uint64_t)1 << (len - 1);
+    uint64_t pv = UINT64_MAX;
+    uint64_t mv = 0;
+    uint32_t dist = len;
+    uint32_t min_dist = len;
+    uint32_t num_in_sequence = 0;
+    for (const uint8_t *c = (const uint8_t *)haystack; *c != '\0'; c++) {
+        const uint64_t eq = peq[*c];
+        if (num_in_sequence < len && (eq >> num_in_sequence) & 1) {
+            num_in_sequence++;
+        }
+        const uint64_t xv = eq | mv;
+        const uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+        uint64_t ph = mv | ~(xh | pv);
+        uint64_t mh = pv & xh;
+        if (ph & last) {
+            dist++;
+        }
+        else if (mh & last) {
+            dist--;
+        }
+        // a match may start anywhere, so the row above the text stays 0 and nothing is shifted in
+        ph <<= 1;
+        mh <<= 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+        min_dist = MIN(min_dist, dist);
+    }
+
+    if (min_dist == 0) {
+        // the text itself is there
+        return MAX(fsearch_token_get_position_score(t, haystack), FSEARCH_TOKEN_SCORE_SUBSTRING);
+    }
+    if (min_dist <= t->fuzzy_max_edits) {
+        return min_dist == 1 ? FSEARCH_TOKEN_SCORE_ONE_EDIT : FSEARCH_TOKEN_SCORE_TWO_EDITS;
+    }
+    return num_in_sequence == len ? FSEARCH_TOKEN_SCORE_SUBSEQUENCE : FSEARCH_TOKEN_SCORE_NONE;
+}
+
+#ifdef FSEARCH_FUZZY_HAVE_AVX2
+// The fuzzy matcher above for four names at once, one name per lane of a vector. Names which
+// end early are fed zero bytes, which match nothing and can't lower their smallest distance.
+typedef uint64_t FsearchFuzzyLanes __attribute__((vector_size(FSEARCH_FUZZY_LANES * sizeof(uint64_t))));
+
+static inline __attribute__((always_inline)) uint32_t
+fsearch_token_fuzzy_match_lanes(FsearchToken *t, const char *const *names, uint32_t num_names) {
+    const uint64_t *peq = t->fuzzy_peq;
+    const uint64_t len = t->text_len;
+    const uint64_t last = (uint64_t)1 << (len - 1);
+    const uint8_t *c[FSEARCH_FUZZY_LANES];
+    for (uint32_t l = 0; l < FSEARCH_FUZZY_LANES; l++) {
+        c[l] = (const uint8_t *)(l < num_names ? names[l] : "");
+    }
+    const FsearchFuzzyLanes zero = {0};
+    FsearchFuzzyLanes pv = ~zero;
+    FsearchFuzzyLanes mv = zero;
+    FsearchFuzzyLanes dist = zero + len;
+    FsearchFuzzyLanes min_dist = dist;
+    FsearchFuzzyLanes num_in_sequence = zero;
+    for (;;) {
+        const uint8_t b0 = *c[0];
+        const uint8_t b1 = *c[1];
+        const uint8_t b2 = *c[2];
+        const uint8_t b3 = *c[3];
+        if ((b0 | b1 | b2 | b3) == 0) {
+            break;
+        }
+        c[0] += b0 != '\0';
+        c[1] += b1 != '\0';
+        c[2] += b2 != '\0';
+        c[3] += b3 != '\0';
+        const FsearchFuzzyLanes eq = {peq[b0], peq[b1], peq[b2], peq[b3]};
+        // comparisons give all ones for true
+        num_in_sequence += (eq >> (num_in_sequence & 63)) & 1 & (FsearchFuzzyLanes)(num_in_sequence < len);
+        const FsearchFuzzyLanes xv = eq | mv;
+        const FsearchFuzzyLanes xh = (((eq & pv) + pv) ^ pv) | eq;
+        FsearchFuzzyLanes ph = mv | ~(xh | pv);
+        FsearchFuzzyLanes mh = pv & xh;
+        dist += (FsearchFuzzyLanes)((mh & last) != 0) - (FsearchFuzzyLanes)((ph & last) != 0);
+        ph <<= 1;
+        mh <<= 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+        const FsearchFuzzyLanes lower = (FsearchFuzzyLanes)(dist < min_dist);
+        min_dist = (dist & lower) | (min_dist & ~lower);
+    }
+
+    uint32_t matches = 0;
+    for (uint32_t l = 0; l < num_names; l++) {
+        if (min_dist[l] <= t->fuzzy_max_edits || num_in_sequence[l] == len) {
+            matches |= 1u << l;
+        }
+    }
+    return matches;
+}
+
+__attribute__((target("avx2"))) static uint32_t
+fsearch_token_fuzzy_match_lanes_avx2(FsearchToken *t, const char *const *names, uint32_t num_names) {
+    return fsearch_token_fuzzy_match_lanes(t, names, num_names);
+}
+#endif
+
+typedef uint32_t (*FsearchFuzzyLanesFunc)(FsearchToken *t, const char *const *names, uint32_t num_names);
+
+// without AVX2 the per lane shifts are emulated, which is slower than one name after another
+static uint32_t
+fsearch_token_fuzzy_match_lanes_default(FsearchToken *t, const char *const *names, uint32_t num_names) {
+    uint32_t matches = 0;
+    for (uint32_t l = 0; l < num_names; l++) {
+        if (fsearch_search_func_fuzzy(names[l], t->text, t) != FSEARCH_TOKEN_SCORE_NONE) {
+            matches |= 1u << l;
+        }
+    }
+    return matches;
+}
+
+static FsearchFuzzyLanesFunc fsearch_fuzzy_lanes_func = NULL;
+static gsize fsearch_fuzzy_lanes_initialized = 0;
+
+static FsearchFuzzyLanesFunc
+fsearch_token_get_fuzzy_lanes_func(void) {
+    if (!g_once_init_enter(&fsearch_fuzzy_lanes_initialized)) {
+        return fsearch_fuzzy_lanes_func;
+    }
+#ifdef FSEARCH_FUZZY_HAVE_AVX2
+    fsearch_fuzzy_lanes_func = __builtin_cpu_supports("avx2") ? fsearch_token_fuzzy_match_lanes_avx2
+                                                              : fsearch_token_fuzzy_match_lanes_default;
+#else
+    fsearch_fuzzy_lanes_func = fsearch_token_fuzzy_match_lanes_default;
+#endif
+    g_once_init_leave(&fsearch_fuzzy_lanes_initialized, 1);
+    return fsearch_fuzzy_lanes_func;
+}
+
+uint64_t
+fsearch_token_fuzzy_match_names(FsearchToken *token, const char *const *names, uint32_t num_names) {
+    assert(token->fuzzy_peq != NULL);
+    assert(num_names <= 64);
+    FsearchFuzzyLanesFunc func = fsearch_token_get_fuzzy_lanes_func();
+    uint64_t matches = 0;
+    for (uint32_t i = 0; i < num_names; i += FSEARCH_FUZZY_LANES) {
+        matches |= (uint64_t)func(token, names + i, MIN(num_names - i, FSEARCH_FUZZY_LANES)) << i;
+    }
+    return matches;
+}
+
+static void
+fsearch_token_init_fuzzy(FsearchToken *token, bool match_case) {
+    token->text_len = strlen(token->text);
+    token->fuzzy_max_edits = token->text_len <= 2 ? 0 : token->text_len <= 5 ? 1 : FSEARCH_FUZZY_MAX_EDITS;
+    token->fuzzy_peq = g_new0(uint64_t, 256);
+    for (uint32_t i = 0; i < token->text_len; i++) {
+        const uint8_t c = (uint8_t)token->text[i];
+        token->fuzzy_peq[c] |= (uint64_t)1 << i;
+        if (!match_case) {
+            // the text is lower case already
+            token->fuzzy_peq[(uint8_t)g_ascii_toupper(c)] |= (uint64_t)1 << i;
+        }
+    }
+    token->search_func = fsearch_search_func_fuzzy;
+    if (!match_case) {
+        token->search_func_folded = fsearch_search_func_fuzzy;
+    }
+}
+
+
 static void
 fsearch_token_free(void *data) {
     FsearchToken *token = data;
@@ -59,14 +547,26 @@ fsearch_token_free(void *data) {
         g_free(token->text);
         token->text = NULL;
     }
-    if (token->regex_study != NULL) {
-        pcre_free_study(token->regex_study);
-        token->regex_study = NULL;
-    }
     if (token->regex != NULL) {
-        pcre_free(token->regex);
+        pcre2_code_free(token->regex);
         token->regex = NULL;
     }
+    if (token->glob != NULL) {
+        fsearch_glob_free(token->glob);
+        token->glob = NULL;
+    }
+    if (token->fuzzy_peq != NULL) {
+        g_free(token->fuzzy_peq);
+        token->fuzzy_peq = NULL;
+    }
+    if (token->extensions != NULL) {
+        g_strfreev(token->extensions);
+        token->extensions = NULL;
+    }
+    if (token->children != NULL) {
+        fsearch_tokens_free(token->children);
+        token->children = NULL;
+    }
     g_free(token);
     token = NULL;
 }
@@ -80,12 +580,12 @@ fsearch_tokens_free(FsearchToken **tokens) {
         fsearch_token_free(tokens[i]);
         tokens[i] = NULL;
     }
-    free(tokens);
+    g_free(tokens);
     tokens = NULL;
 }
 
 static FsearchToken *
-fsearch_token_new(const char *text, bool match_case, bool auto_match_case, bool is_regex) {
+fsearch_token_new(const char *text, bool match_case, bool auto_match_case, bool is_regex, bool is_fuzzy) {
     FsearchToken *new = calloc(1, sizeof(FsearchToken));
     assert(new != NULL);
 
@@ -95,6 +595,7 @@ fsearch_token_new(const char *text, bool match_case, bool auto_match_case, bool
     if (auto_match_case && fs_str_utf8_has_upper(text)) {
         match_case = true;
     }
+    new->match_case = match_case;
 
     char *normalized = g_utf8_normalize(text, -1, G_NORMALIZE_DEFAULT);
     new->text = match_case ? g_strdup(text) : g_utf8_strdown(normalized, -1);
@@ -102,34 +603,556 @@ fsearch_token_new(const char *text, bool match_case, bool auto_match_case, bool
     normalized = NULL;
 
     if (is_regex) {
-        const char *error;
-        int erroffset;
-        new->regex = pcre_compile(text, match_case ? 0 : PCRE_CASELESS, &error, &erroffset, NULL);
-        new->regex_study = pcre_study(new->regex, PCRE_STUDY_JIT_COMPILE, &error);
+        int error_code;
+        PCRE2_SIZE error_offset;
+        new->regex = pcre2_compile((PCRE2_SPTR)text,
+                                   PCRE2_ZERO_TERMINATED,
+                                   match_case ? 0 : PCRE2_CASELESS,
+                                   &error_code,
+                                   &error_offset,
+                                   NULL);
+        if (new->regex) {
+            new->regex_jit = pcre2_jit_compile(new->regex, PCRE2_JIT_COMPLETE) == 0;
+        }
+        else {
+            trace("[token] invalid regex at offset %zu: %s\n", (size_t)error_offset, text);
+        }
         new->search_func = fsearch_search_func_regex;
+        new->search_func_len = fsearch_search_func_regex_len;
     }
     else if (strchr(text, '*') || strchr(text, '?')) {
-        new->search_func = match_case ? fsearch_search_func_wildcard : fsearch_search_func_wildcard_icase;
+        new->glob = fsearch_glob_new(new->text, match_case);
+        if (new->glob) {
+            new->search_func = fsearch_search_func_glob;
+            new->search_func_len = fsearch_search_func_glob_len;
+        }
+        else {
+            new->search_func = match_case ? fsearch_search_func_wildcard : fsearch_search_func_wildcard_icase;
+        }
+    }
+    else if (is_fuzzy && strlen(new->text) <= FSEARCH_FUZZY_MAX_LEN) {
+        fsearch_token_init_fuzzy(new, match_case);
     }
     else {
+        new->is_literal = true;
         if (match_case) {
             new->search_func = fsearch_search_func_normal;
         }
         else {
-            new->search_func =
-                fs_str_is_utf8(text) ? fsearch_search_func_normal_icase_u8 : fsearch_search_func_normal_icase;
+            if (fs_str_is_utf8(text)) {
+                new->search_func = fsearch_search_func_normal_icase_u8;
+                new->search_func_folded = fsearch_search_func_normal;
+            }
+            else {
+                new->search_func = fsearch_search_func_normal_icase;
+            }
+        }
+    }
+    return new;
+}
+
+// Parses a number with an optional unit, like 10k or 1.5GB, the units are powers of 1024
+static bool
+fsearch_token_parse_size(const char *text, int64_t *lo, int64_t *hi) {
+    if (!g_ascii_isdigit(text[0])) {
+        return false;
+    }
+    char *end = NULL;
+    const double value = g_ascii_strtod(text, &end);
+    const char *units = "kmgt";
+    const char *unit = *end ? strchr(units, g_ascii_tolower(*end)) : NULL;
+    double factor = 1;
+    if (unit) {
+        for (const char *u = units; u <= unit; u++) {
+            factor *= 1024;
+        }
+        end++;
+        if (g_ascii_tolower(end[0]) == 'i' && g_ascii_tolower(end[1]) == 'b') {
+            end += 2;
+        }
+        else if (g_ascii_tolower(end[0]) == 'b') {
+            end++;
+        }
+    }
+    else if (g_ascii_tolower(end[0]) == 'b') {
+        end++;
+    }
+    if (*end != '\0') {
+        return false;
+    }
+    const double size = value * factor;
+    *lo = *hi = size >= (double)INT64_MAX ? INT64_MAX : (int64_t)size;
+    return true;
+}
+
+// Parses a day, month or year (2026-10-14, 2026-10, 2026), today or yesterday into the seconds it spans
+static bool
+fsearch_token_parse_date(const char *text, int64_t *lo, int64_t *hi) {
+    GDateTime *start = NULL;
+    GDateTime *end = NULL;
+    const bool is_today = !g_ascii_strcasecmp(text, "today");
+    if (is_today || !g_ascii_strcasecmp(text, "yesterday")) {
+        GDateTime *now = g_date_time_new_now_local();
+        GDateTime *today = g_date_time_new_local(g_date_time_get_year(now),
+                                                 g_date_time_get_month(now),
+                                                 g_date_time_get_day_of_month(now),
+                                                 0,
+                                                 0,
+                                                 0);
+        g_date_time_unref(now);
+        start = is_today ? g_date_time_ref(today) : g_date_time_add_days(today, -1);
+        end = g_date_time_add_days(start, 1);
+        g_date_time_unref(today);
+    }
+    else {
+        int fields[3] = {0, 1, 1};
+        uint32_t num_fields = 0;
+        const char *c = text;
+        while (num_fields < 3 && g_ascii_isdigit(*c)) {
+            // a year has four digits, months and days one or two
+            const uint32_t max_digits = num_fields == 0 ? 4 : 2;
+            int value = 0;
+            uint32_t num_digits = 0;
+            for (; g_ascii_isdigit(*c) && num_digits < max_digits; c++, num_digits++) {
+                value = value * 10 + *c - '0';
+            }
+            if (num_fields == 0 && num_digits != 4) {
+                return false;
+            }
+            fields[num_fields++] = value;
+            if (*c != '-' || num_fields == 3 || !g_ascii_isdigit(c[1])) {
+                // anything left over, including a trailing '-', is rejected below
+                break;
+            }
+            c++;
+        }
+        if (num_fields == 0 || *c != '\0') {
+            return false;
+        }
+        start = g_date_time_new_local(fields[0], fields[1], fields[2], 0, 0, 0);
+        if (!start) {
+            return false;
+        }
+        end = num_fields == 1   ? g_date_time_add_years(start, 1)
+            : num_fields == 2 ? g_date_time_add_months(start, 1)
+                              : g_date_time_add_days(start, 1);
+    }
+    *lo = g_date_time_to_unix(start);
+    *hi = g_date_time_to_unix(end) - 1;
+    g_date_time_unref(start);
+    g_date_time_unref(end);
+    return true;
+}
+
+// Parses value, =value, >value, >=value, <value, <=value and value..value,
+// where parse_value gives the range a single value stands for
+static bool
+fsearch_token_parse_range(const char *text,
+                          bool (*parse_value)(const char *, int64_t *, int64_t *),
+                          int64_t *min,
+                          int64_t *max) {
+    int64_t lo = 0;
+    int64_t hi = 0;
+    const char *range_separator = strstr(text, "..");
+    if (range_separator) {
+        char *first = g_strndup(text, range_separator - text);
+        int64_t last_lo = 0;
+        int64_t last_hi = 0;
+        const bool res = parse_value(first, &lo, &hi) && parse_value(range_separator + 2, &last_lo, &last_hi);
+        g_free(first);
+        first = NULL;
+        if (!res) {
+            return false;
+        }
+        *min = MIN(lo, last_lo);
+        *max = MAX(hi, last_hi);
+        return true;
+    }
+
+    const bool is_greater = text[0] == '>';
+    const bool is_less = text[0] == '<';
+    const bool or_equal = (is_greater || is_less) && text[1] == '=';
+    const char *value = text + (is_greater || is_less || text[0] == '=' ? 1 : 0) + (or_equal ? 1 : 0);
+    if (!parse_value(value, &lo, &hi)) {
+        return false;
+    }
+    *min = is_less ? INT64_MIN : is_greater && !or_equal ? (hi < INT64_MAX ? hi + 1 : INT64_MAX) : lo;
+    *max = is_greater ? INT64_MAX : is_less && !or_equal ? (lo > INT64_MIN ? lo - 1 : INT64_MIN) : hi;
+    return true;
+}
+
+// The value of a word like field:value, NULL if it's about another field or has no value
+static const char *
+fsearch_token_get_field_value(const char *text, const char *field) {
+    const size_t field_len = strlen(field);
+    if (g_ascii_strncasecmp(text, field, field_len) || text[field_len] != ':' || text[field_len + 1] == '\0') {
+        return NULL;
+    }
+    return text + field_len + 1;
+}
+
+// A token for a word like size:>1G, NULL if it isn't a predicate or its value can't be parsed
+static FsearchToken *
+fsearch_token_new_predicate(const char *text, bool match_case, bool auto_match_case) {
+    FsearchToken *new = calloc(1, sizeof(FsearchToken));
+    assert(new != NULL);
+
+    const char *value = NULL;
+    bool res = false;
+    if ((value = fsearch_token_get_field_value(text, "size"))) {
+        new->type = FSEARCH_TOKEN_SIZE;
+        res = fsearch_token_parse_range(value, fsearch_token_parse_size, &new->min, &new->max);
+    }
+    else if ((value = fsearch_token_get_field_value(text, "dm"))
+             || (value = fsearch_token_get_field_value(text, "datemodified"))) {
+        new->type = FSEARCH_TOKEN_DATE_MODIFIED;
+        res = fsearch_token_parse_range(value, fsearch_token_parse_date, &new->min, &new->max);
+    }
+    else if ((value = fsearch_token_get_field_value(text, "ext"))) {
+        new->type = FSEARCH_TOKEN_EXTENSION;
+        new->match_case = match_case || (auto_match_case && fs_str_utf8_has_upper(value));
+        GPtrArray *extensions = g_ptr_array_new();
+        char **split = g_strsplit(value, ";", -1);
+        for (uint32_t i = 0; split[i]; i++) {
+            char *ext = split[i][0] == '.' ? split[i] + 1 : split[i];
+            if (*ext) {
+                g_ptr_array_add(extensions, new->match_case ? g_strdup(ext) : g_ascii_strdown(ext, -1));
+            }
+        }
+        g_strfreev(split);
+        split = NULL;
+        res = extensions->len > 0;
+        g_ptr_array_add(extensions, NULL);
+        new->extensions = (char **)g_ptr_array_free(extensions, FALSE);
+    }
+    else if ((value = fsearch_token_get_field_value(text, "parent"))) {
+        new->type = FSEARCH_TOKEN_PARENT;
+        new->match_case = match_case || (auto_match_case && fs_str_utf8_has_upper(value));
+        new->text = g_strdup(value);
+        // the root folder's path is empty, like in the entries' paths
+        for (size_t len = strlen(new->text); len > 0 && new->text[len - 1] == '/'; len--) {
+            new->text[len - 1] = '\0';
         }
+        new->text_len = strlen(new->text);
+        res = true;
+    }
+
+    if (!res) {
+        fsearch_token_free(new);
+        return NULL;
+    }
+    return new;
+}
+
+static FsearchToken *
+fsearch_token_new_operator(FsearchTokenType type, GPtrArray *children) {
+    FsearchToken *new = calloc(1, sizeof(FsearchToken));
+    assert(new != NULL);
+
+    new->type = type;
+    for (uint32_t i = 0; i < children->len; i++) {
+        FsearchToken *child = g_ptr_array_index(children, i);
+        new->has_separator |= child->has_separator;
     }
+    g_ptr_array_add(children, NULL);
+    new->children = (FsearchToken **)g_ptr_array_free(children, FALSE);
     return new;
 }
 
+typedef enum {
+    FSEARCH_QUERY_LEXEME_TERM,
+    FSEARCH_QUERY_LEXEME_OR,
+    FSEARCH_QUERY_LEXEME_NOT,
+    FSEARCH_QUERY_LEXEME_OPEN,
+    FSEARCH_QUERY_LEXEME_CLOSE,
+} FsearchQueryLexemeType;
+
+typedef struct {
+    FsearchQueryLexemeType type;
+    char *text;
+} FsearchQueryLexeme;
+
+typedef struct {
+    GArray *lexemes;
+    uint32_t pos;
+    bool match_case;
+    bool auto_match_case;
+    bool enable_fuzzy;
+} FsearchQueryParser;
+
+static void
+fsearch_query_lexeme_clear(gpointer data) {
+    FsearchQueryLexeme *lexeme = data;
+    g_free(lexeme->text);
+    lexeme->text = NULL;
+}
+
+static void
+fsearch_query_lexemes_add(GArray *lexemes, FsearchQueryLexemeType type, char *text) {
+    FsearchQueryLexeme lexeme = {.type = type, .text = text};
+    g_array_append_val(lexemes, lexeme);
+}
+
+// Splits a word at | and takes the leading ! and < and the trailing > of every part apart,
+// depth is the number of groups opened before. Everything else is left to the term.
+static void
+fsearch_query_lex_word(GArray *lexemes, const char *word, uint32_t *depth) {
+    char **parts = g_strsplit(word, "|", -1);
+    for (uint32_t i = 0; parts[i]; i++) {
+        if (i > 0) {
+            fsearch_query_lexemes_add(lexemes, FSEARCH_QUERY_LEXEME_OR, NULL);
+        }
+        const char *p = parts[i];
+        // a lone ! is searched for
+        for (; *p == '<' || (*p == '!' && p[1] != '\0'); p++) {
+            fsearch_query_lexemes_add(lexemes, *p == '<' ? FSEARCH_QUERY_LEXEME_OPEN : FSEARCH_QUERY_LEXEME_NOT, NULL);
+            *depth += *p == '<' ? 1 : 0;
+        }
+        size_t len = strlen(p);
+        uint32_t num_closed = 0;
+        for (; len > 0 && p[len - 1] == '>' && num_closed < *depth; len--) {
+            num_closed++;
+        }
+        if (len > 0) {
+            fsearch_query_lexemes_add(lexemes, FSEARCH_QUERY_LEXEME_TERM, g_strndup(p, len));
+        }
+        for (uint32_t j = 0; j < num_closed; j++) {
+            fsearch_query_lexemes_add(lexemes, FSEARCH_QUERY_LEXEME_CLOSE, NULL);
+        }
+        *depth -= num_closed;
+    }
+    g_strfreev(parts);
+}
+
+static FsearchQueryLexeme *
+fsearch_query_parser_peek(FsearchQueryParser *parser) {
+    if (parser->pos >= parser->lexemes->len) {
+        return NULL;
+    }
+    return &g_array_index(parser->lexemes, FsearchQueryLexeme, parser->pos);
+}
+
+static void
+fsearch_query_parse_and(FsearchQueryParser *parser, GPtrArray *operands);
+
+// unary := !unary | <and> | term
+static FsearchToken *
+fsearch_query_parse_unary(FsearchQueryParser *parser) {
+    FsearchQueryLexeme *lexeme = fsearch_query_parser_peek(parser);
+    if (!lexeme || lexeme->type == FSEARCH_QUERY_LEXEME_OR || lexeme->type == FSEARCH_QUERY_LEXEME_CLOSE) {
+        // nothing to apply an operator to, those are skipped
+        return NULL;
+    }
+    parser->pos++;
+    const FsearchQueryLexemeType type = lexeme->type;
+    if (type == FSEARCH_QUERY_LEXEME_TERM) {
+        trace("[search] token: %s\n", lexeme->text);
+        FsearchToken *predicate = fsearch_token_new_predicate(lexeme->text, parser->match_case, parser->auto_match_case);
+        if (predicate) {
+            return predicate;
+        }
+        return fsearch_token_new(lexeme->text, parser->match_case, parser->auto_match_case, false, parser->enable_fuzzy);
+    }
+    GPtrArray *operands = g_ptr_array_new();
+    if (type == FSEARCH_QUERY_LEXEME_NOT) {
+        // what's excluded is meant literally, not everything a few typos off
+        const bool enable_fuzzy = parser->enable_fuzzy;
+        parser->enable_fuzzy = false;
+        FsearchToken *operand = fsearch_query_parse_unary(parser);
+        parser->enable_fuzzy = enable_fuzzy;
+        if (operand) {
+            g_ptr_array_add(operands, operand);
+        }
+    }
+    else {
+        fsearch_query_parse_and(parser, operands);
+        lexeme = fsearch_query_parser_peek(parser);
+        if (lexeme && lexeme->type == FSEARCH_QUERY_LEXEME_CLOSE) {
+            parser->pos++;
+        }
+    }
+    if (operands->len == 0) {
+        g_ptr_array_free(operands, TRUE);
+        return NULL;
+    }
+    if (operands->len == 1 && type != FSEARCH_QUERY_LEXEME_NOT) {
+        FsearchToken *operand = g_ptr_array_index(operands, 0);
+        g_ptr_array_free(operands, TRUE);
+        return operand;
+    }
+    return fsearch_token_new_operator(type == FSEARCH_QUERY_LEXEME_NOT ? FSEARCH_TOKEN_NOT : FSEARCH_TOKEN_AND, operands);
+}
+
+// or := unary (| unary)*, OR takes precedence over AND
+static FsearchToken *
+fsearch_query_parse_or(FsearchQueryParser *parser) {
+    GPtrArray *operands = g_ptr_array_new();
+    FsearchToken *operand = fsearch_query_parse_unary(parser);
+    if (operand) {
+        g_ptr_array_add(operands, operand);
+    }
+    FsearchQueryLexeme *lexeme = NULL;
+    while ((lexeme = fsearch_query_parser_peek(parser)) && lexeme->type == FSEARCH_QUERY_LEXEME_OR) {
+        parser->pos++;
+        if ((operand = fsearch_query_parse_unary(parser))) {
+            g_ptr_array_add(operands, operand);
+        }
+    }
+    if (operands->len <= 1) {
+        operand = operands->len ? g_ptr_array_index(operands, 0) : NULL;
+        g_ptr_array_free(operands, TRUE);
+        return operand;
+    }
+    return fsearch_token_new_operator(FSEARCH_TOKEN_OR, operands);
+}
+
+// and := or+, up to the end of the group
+static void
+fsearch_query_parse_and(FsearchQueryParser *parser, GPtrArray *operands) {
+    FsearchQueryLexeme *lexeme = NULL;
+    while ((lexeme = fsearch_query_parser_peek(parser)) && lexeme->type != FSEARCH_QUERY_LEXEME_CLOSE) {
+        FsearchToken *operand = fsearch_query_parse_or(parser);
+        if (!operand) {
+            continue;
+        }
+        if (operand->type == FSEARCH_TOKEN_AND) {
+            // groups which are just part of another AND are flattened
+            for (uint32_t i = 0; operand->children[i]; i++) {
+                g_ptr_array_add(operands, operand->children[i]);
+                operand->children[i] = NULL;
+            }
+            fsearch_token_free(operand);
+            continue;
+        }
+        g_ptr_array_add(operands, operand);
+    }
+}
+
+bool
+fsearch_token_is_refined_by(FsearchToken *token, FsearchToken *refinement) {
+    assert(token != NULL);
+    assert(refinement != NULL);
+
+    if (token->type != refinement->type) {
+        return false;
+    }
+    switch (token->type) {
+    case FSEARCH_TOKEN_SIZE:
+    case FSEARCH_TOKEN_DATE_MODIFIED:
+        return refinement->min >= token->min && refinement->max <= token->max;
+    case FSEARCH_TOKEN_EXTENSION:
+        if (token->match_case && !refinement->match_case) {
+            return false;
+        }
+        for (uint32_t i = 0; refinement->extensions[i]; i++) {
+            bool found = false;
+            for (uint32_t j = 0; !found && token->extensions[j]; j++) {
+                found = token->match_case ? !strcmp(token->extensions[j], refinement->extensions[i])
+                                          : !g_ascii_strcasecmp(token->extensions[j], refinement->extensions[i]);
+            }
+            if (!found) {
+                return false;
+            }
+        }
+        return true;
+    case FSEARCH_TOKEN_PARENT:
+        return token->match_case == refinement->match_case && !strcmp(token->text, refinement->text);
+    case FSEARCH_TOKEN_AND:
+    case FSEARCH_TOKEN_OR:
+    case FSEARCH_TOKEN_NOT:
+        return false;
+    default:
+        break;
+    }
+
+    if (token->has_separator != refinement->has_separator) {
+        // they don't search the same haystack (name vs. path)
+        return false;
+    }
+    // only plain substring searches can be reasoned about,
+    // a regex or wildcard pattern might match without its text being present
+    if (token->search_func == fsearch_search_func_normal) {
+        return refinement->search_func == fsearch_search_func_normal && strstr(refinement->text, token->text);
+    }
+    if (token->search_func == fsearch_search_func_normal_icase) {
+        if (refinement->search_func == fsearch_search_func_normal) {
+            return strcasestr(refinement->text, token->text) ? true : false;
+        }
+        return refinement->search_func == fsearch_search_func_normal_icase && strstr(refinement->text, token->text);
+    }
+    if (token->search_func == fsearch_search_func_normal_icase_u8) {
+        // both texts went through the same normalization
+        return refinement->search_func == fsearch_search_func_normal_icase_u8 && strstr(refinement->text, token->text);
+    }
+    return false;
+}
+
+void
+fsearch_token_add_folded_literals(FsearchToken *token, GPtrArray *literals) {
+    assert(token != NULL);
+    assert(literals != NULL);
+
+    if (token->type != FSEARCH_TOKEN_TEXT || token->search_func == fsearch_search_func_regex || token->fuzzy_peq) {
+        // a fuzzy match doesn't have to contain any part of the text
+        return;
+    }
+    if (token->search_func == fsearch_search_func_normal_icase_u8) {
+        // the text went through the same folding as the haystack
+        g_ptr_array_add(literals, g_strdup(token->text));
+        return;
+    }
+    const bool is_wildcard = token->search_func == fsearch_search_func_glob
+                          || token->search_func == fsearch_search_func_wildcard
+                          || token->search_func == fsearch_search_func_wildcard_icase;
+    if (is_wildcard && strpbrk(token->text, "[\\")) {
+        // bracket expressions and escapes aren't literal text
+        return;
+    }
+
+    // Folding leaves runs of ASCII characters intact apart from their case,
+    // anything else might look different in the folded haystack
+    const char *run_start = token->text;
+    for (const char *c = token->text;; c++) {
+        const bool ends_run = *c == '\0' || (*c & 0x80) || (is_wildcard && (*c == '*' || *c == '?'));
+        if (!ends_run) {
+            continue;
+        }
+        if (c > run_start) {
+            g_ptr_array_add(literals, g_ascii_strdown(run_start, c - run_start));
+        }
+        if (*c == '\0') {
+            break;
+        }
+        run_start = c + 1;
+    }
+}
+
+uint32_t
+fsearch_token_get_score(FsearchToken *token, const char *haystack) {
+    assert(token != NULL);
+    assert(haystack != NULL);
+
+    if (token->type != FSEARCH_TOKEN_TEXT) {
+        return FSEARCH_TOKEN_SCORE_NONE;
+    }
+    if (token->fuzzy_peq) {
+        return fsearch_search_func_fuzzy(haystack, token->text, token);
+    }
+    if (token->search_func == fsearch_search_func_normal || token->search_func == fsearch_search_func_normal_icase
+        || token->search_func == fsearch_search_func_normal_icase_u8) {
+        return fsearch_token_get_position_score(token, haystack);
+    }
+    // where a regex or wildcard pattern matches isn't known
+    return token->search_func(haystack, token->text, token) ? FSEARCH_TOKEN_SCORE_SUBSTRING : FSEARCH_TOKEN_SCORE_NONE;
+}
+
 FsearchToken **
-fsearch_tokens_new(const char *query, bool match_case, bool enable_regex, bool auto_match_case) {
+fsearch_tokens_new(const char *query, bool match_case, bool enable_regex, bool enable_fuzzy, bool auto_match_case) {
     // check if regex characters are present
     const bool is_reg = fs_str_is_regex(query);
     if (is_reg && enable_regex) {
-        FsearchToken **token = calloc(2, sizeof(FsearchToken *));
-        token[0] = fsearch_token_new(query, match_case, auto_match_case, true);
+        FsearchToken **token = g_new0(FsearchToken *, 2);
+        token[0] = fsearch_token_new(query, match_case, auto_match_case, true, false);
         token[1] = NULL;
         return token;
     }
@@ -138,16 +1161,27 @@ fsearch_tokens_new(const char *query, bool match_case, bool enable_regex, bool a
     char **query_split = fs_str_split(query);
     assert(query_split != NULL);
 
-    uint32_t tmp_token_len = g_strv_length(query_split);
-    FsearchToken **token = calloc(tmp_token_len + 1, sizeof(FsearchToken *));
-    for (uint32_t i = 0; i < tmp_token_len; i++) {
-        trace("[search] token %d: %s\n", i, query_split[i]);
-        token[i] = fsearch_token_new(query_split[i], match_case, auto_match_case, false);
+    GArray *lexemes = g_array_new(FALSE, FALSE, sizeof(FsearchQueryLexeme));
+    g_array_set_clear_func(lexemes, fsearch_query_lexeme_clear);
+    uint32_t depth = 0;
+    for (uint32_t i = 0; query_split[i]; i++) {
+        fsearch_query_lex_word(lexemes, query_split[i], &depth);
     }
-
     g_strfreev(query_split);
     query_split = NULL;
 
-    return token;
-}
+    FsearchQueryParser parser = {
+        .lexemes = lexemes,
+        .pos = 0,
+        .match_case = match_case,
+        .auto_match_case = auto_match_case,
+        .enable_fuzzy = enable_fuzzy,
+    };
+    GPtrArray *token = g_ptr_array_new();
+    fsearch_query_parse_and(&parser, token);
+    g_array_free(lexemes, TRUE);
+    lexemes = NULL;
 
+    g_ptr_array_add(token, NULL);
+    return (FsearchToken **)g_ptr_array_free(token, FALSE);
+}
@@ -1,28 +1,109 @@
 
 #pragma once
 
-#include <pcre.h>
+#define PCRE2_CODE_UNIT_WIDTH 8
+
+#include <glib.h>
+#include <pcre2.h>
 #include <stdbool.h>
 #include <stdint.h>
 
-#define OVECCOUNT 3
+typedef struct FsearchGlob FsearchGlob;
+
+typedef enum {
+    // matched against the name or path with search_func
+    FSEARCH_TOKEN_TEXT,
+    // the entry's size or modification time lies in [min, max]
+    FSEARCH_TOKEN_SIZE,
+    FSEARCH_TOKEN_DATE_MODIFIED,
+    // the text behind the last dot of the name is one of extensions
+    FSEARCH_TOKEN_EXTENSION,
+    // the path of the entry's parent folder is text
+    FSEARCH_TOKEN_PARENT,
+    // combine their children
+    FSEARCH_TOKEN_AND,
+    FSEARCH_TOKEN_OR,
+    FSEARCH_TOKEN_NOT,
+} FsearchTokenType;
 
 typedef struct FsearchToken {
+    FsearchTokenType type;
 
     char *text;
     size_t text_len;
 
     uint32_t has_separator;
     uint32_t (*search_func)(const char *, const char *, void *data);
+    // if set, matching the folded haystack (see fs_str_fold) with this
+    // gives the same result as search_func, but much cheaper
+    uint32_t (*search_func_folded)(const char *, const char *, void *data);
+    // if set, does the same as search_func for a haystack whose length is already known
+    uint32_t (*search_func_len)(const char *, size_t haystack_len, void *data);
+    // search_func only looks for text as a substring: with match_case in the haystack, otherwise
+    // in the folded haystack if search_func_folded is set, or else ignoring the case of ASCII letters
+    bool is_literal;
+
+    // the match data and JIT stack are per thread, so the compiled pattern
+    // is only read while searching
+    pcre2_code *regex;
+    bool regex_jit;
+
+    // compiled wildcard pattern, for patterns which don't need fnmatch
+    FsearchGlob *glob;
+
+    // set for fuzzy token: the positions in text which a byte matches, one bit each,
+    // and how many edits a match may take until it only counts as a subsequence
+    uint64_t *fuzzy_peq;
+    uint32_t fuzzy_max_edits;
+
+    // both inclusive, the time in seconds since the epoch for dates
+    int64_t min;
+    int64_t max;
+    char **extensions;
+    bool match_case;
 
-    pcre *regex;
-    pcre_extra *regex_study;
-    int ovector[OVECCOUNT];
+    // the operands of AND, OR and NOT token, NULL terminated
+    struct FsearchToken **children;
 } FsearchToken;
 
+// Splits the query into the token which all have to match. Unless the query is a regex, words can be
+// predicates (size:>1G, dm:2026-10, ext:jpg;png, parent:/var/log), combined with | (OR), ! (NOT)
+// and grouped with < and >. With enable_fuzzy plain words also match names which are a few
+// typos off or contain them as a subsequence.
 FsearchToken **
-fsearch_tokens_new(const char *query, bool match_case, bool enable_regex, bool auto_match_case);
+fsearch_tokens_new(const char *query, bool match_case, bool enable_regex, bool enable_fuzzy, bool auto_match_case);
 
 void
 fsearch_tokens_free(FsearchToken **tokens);
 
+// Which of the names a fuzzy token matches, bit i for names[i]. The same as its search_func, but a few
+// names are matched at once. At most 64 names.
+uint64_t
+fsearch_token_fuzzy_match_names(FsearchToken *token, const char *const *names, uint32_t num_names);
+
+// true if everything matched by refinement is also matched by token
+bool
+fsearch_token_is_refined_by(FsearchToken *token, FsearchToken *refinement);
+
+// Adds the strings which the folded version (see fs_str_fold) of every haystack
+// matched by token has to contain to literals
+void
+fsearch_token_add_folded_literals(FsearchToken *token, GPtrArray *literals);
+
+// How well a text token matches haystack, to rank the matches of a search
+enum {
+    FSEARCH_TOKEN_SCORE_NONE = 0,
+    // only with fuzzy token
+    FSEARCH_TOKEN_SCORE_SUBSEQUENCE,
+    FSEARCH_TOKEN_SCORE_TWO_EDITS,
+    FSEARCH_TOKEN_SCORE_ONE_EDIT,
+    // the text is somewhere in haystack, at the start of a word, at its start or all of it
+    FSEARCH_TOKEN_SCORE_SUBSTRING,
+    FSEARCH_TOKEN_SCORE_WORD,
+    FSEARCH_TOKEN_SCORE_PREFIX,
+    FSEARCH_TOKEN_SCORE_EXACT,
+};
+
+// One of the scores above, FSEARCH_TOKEN_SCORE_NONE if haystack doesn't match or token isn't a text token
+uint32_t
+fsearch_token_get_score(FsearchToken *token, const char *haystack);